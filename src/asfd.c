@@ -12,6 +12,16 @@
 #include "ncurses.h"
 #endif
 
+#ifdef HAVE_LINUX_OS
+#include <sys/sendfile.h>
+#endif
+
+// Kernel TLS lets openssl hand file data straight to the socket.
+#if defined(HAVE_LINUX_OS) \
+  && OPENSSL_VERSION_NUMBER>=0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS_SENDFILE
+#endif
+
 #include "protocol2/blist.h"
 
 static size_t bufmaxsize=(ASYNC_BUF_LEN*2)+32;
@@ -230,7 +240,7 @@ static int check_ratelimit(struct asfd *asfd)
 	if(!diff) return 0; // Need to get started somehow.
 	f=(asfd->rlbytes)/diff; // Bytes per second.
 
-	if(f>=asfd->ratelimit)
+	if(f>=throttle_ratelimit(asfd->ratelimit))
 	{
 #ifdef HAVE_WIN32
 		// Windows Sleep is milliseconds, usleep is microseconds.
@@ -248,9 +258,15 @@ static int check_ratelimit(struct asfd *asfd)
 	return 0;
 }
 
+static int asfd_do_send_from_fd(struct asfd *asfd);
+
 static int asfd_do_write(struct asfd *asfd)
 {
 	ssize_t w;
+#ifdef HAVE_LINUX_OS
+	if(!asfd->writebuflen && asfd->sendlen)
+		return asfd_do_send_from_fd(asfd);
+#endif
 	if(asfd->ratelimit && check_ratelimit(asfd)) return 0;
 
 	w=write(asfd->fd, asfd->writebuf, asfd->writebuflen);
@@ -288,6 +304,10 @@ static int asfd_do_write_ssl(struct asfd *asfd)
 
 	asfd->write_blocked_on_read=0;
 
+#ifdef HAVE_LINUX_OS
+	if(!asfd->writebuflen && asfd->sendlen)
+		return asfd_do_send_from_fd(asfd);
+#endif
 	if(asfd->ratelimit && check_ratelimit(asfd)) return 0;
 	ERR_clear_error();
 	w=SSL_write(asfd->ssl, asfd->writebuf, asfd->writebuflen);
@@ -430,6 +450,102 @@ static int asfd_write(struct asfd *asfd, struct iobuf *wbuf)
 	return 0;
 }
 
+#ifdef HAVE_LINUX_OS
+static ssize_t send_from_fd(struct asfd *asfd, int fd, off_t offset, size_t len)
+{
+	ssize_t w;
+#ifdef HAVE_KTLS_SENDFILE
+	if(asfd->ssl)
+	{
+		ERR_clear_error();
+		if((w=SSL_sendfile(asfd->ssl, fd, offset, len, 0))>0)
+			return w;
+		switch(SSL_get_error(asfd->ssl, w))
+		{
+			case SSL_ERROR_WANT_WRITE:
+				return 0;
+			case SSL_ERROR_SYSCALL:
+				if(errno==EAGAIN || errno==EINTR)
+					return 0;
+				// Fall through.
+			default:
+				logp_ssl_err("%s: SSL_sendfile problem: %s\n",
+					asfd->desc, strerror(errno));
+				return -1;
+		}
+	}
+#endif
+	if((w=sendfile(asfd->fd, fd, &offset, len))>0)
+		return w;
+	if(w<0 && (errno==EAGAIN || errno==EINTR))
+		return 0;
+	logp("%s: sendfile problem: %s\n", asfd->desc, strerror(errno));
+	return -1;
+}
+
+// Called by async when the socket is writable, once the write buffer is
+// empty.
+static int asfd_do_send_from_fd(struct asfd *asfd)
+{
+	ssize_t w;
+	if((w=send_from_fd(asfd, asfd->sendfd, asfd->sendoff, asfd->sendlen))<0)
+		return -1;
+	asfd->sendoff+=w;
+	asfd->sendlen-=w;
+	return 0;
+}
+
+static int can_send_from_fd(struct asfd *asfd)
+{
+	if(asfd->streamtype!=ASFD_STREAM_STANDARD
+	  || asfd->ratelimit)
+		return 0;
+	if(!asfd->ssl) return 1;
+#ifdef HAVE_KTLS_SENDFILE
+	return BIO_get_ktls_send(SSL_get_wbio(asfd->ssl));
+#else
+	return 0;
+#endif
+}
+#endif
+
+// Send len bytes at offset of a file as a single frame, without reading them
+// into user space, when the connection allows it. That means a plain socket,
+// or kernel TLS. Returns 1 if it is not possible, so that the caller can fall
+// back to asfd->write().
+// The payload goes out through async like everything else, so waiting for
+// the socket is bounded by the network timeout.
+static int asfd_write_from_fd(struct asfd *asfd,
+	enum cmd wcmd, int fd, off_t offset, size_t len)
+{
+#ifdef HAVE_LINUX_OS
+	char sbuf[10]="";
+	if(!can_send_from_fd(asfd)) return 1;
+	if(asfd->as->doing_estimate) return 0;
+
+	// Everything already queued has to go first, then the frame header.
+	snprintf(sbuf, sizeof(sbuf), "%c%04X", wcmd, (unsigned int)len);
+	while(asfd->writebuflen+5>=bufmaxsize-1)
+		if(asfd->as->write(asfd->as)) return -1;
+	append_to_write_buffer(asfd, sbuf, 5);
+
+	asfd->sendfd=fd;
+	asfd->sendoff=offset;
+	asfd->sendlen=len;
+	while(asfd->writebuflen || asfd->sendlen)
+	{
+		if(asfd->as->write(asfd->as))
+		{
+			asfd->sendlen=0;
+			return -1;
+		}
+	}
+	return 0;
+#else
+	return 1;
+#endif
+}
+
 static int asfd_write_strn(struct asfd *asfd,
 	enum cmd wcmd, const char *wsrc, size_t len)
 {
@@ -530,6 +646,7 @@ static int asfd_init(struct asfd *asfd, const char *desc,
 	asfd->read_expect=asfd_read_expect;
 	asfd->simple_loop=asfd_simple_loop;
 	asfd->write=asfd_write;
+	asfd->write_from_fd=asfd_write_from_fd;
 	asfd->write_str=asfd_write_str;
 	asfd->write_strn=asfd_write_strn;
 
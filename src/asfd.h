@@ -73,6 +73,11 @@ struct asfd
 	char *writebuf;
 	size_t writebuflen;
 	int write_blocked_on_read;
+	// The payload of a frame that goes straight from a file, once the
+	// write buffer is empty.
+	int sendfd;
+	off_t sendoff;
+	size_t sendlen;
 
 	struct asfd *next;
 
@@ -108,6 +113,7 @@ struct asfd
 		const char *, enum asl_ret callback(struct asfd *,
 			struct conf **, void *));
 	int (*write)(struct asfd *, struct iobuf *);
+	int (*write_from_fd)(struct asfd *, enum cmd, int, off_t, size_t);
 	int (*write_str)(struct asfd *, enum cmd, const char *);
 	int (*write_strn)(struct asfd *, enum cmd, const char *, size_t);
 };
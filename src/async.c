@@ -63,7 +63,8 @@ static int async_io(struct async *as, int doread)
 				asfd->doread=0;
 		}
 
-		if(asfd->writebuflen && !asfd->write_blocked_on_read)
+		if((asfd->writebuflen || asfd->sendlen)
+		  && !asfd->write_blocked_on_read)
 			asfd->dowrite++; // The write buffer is not yet empty.
 
 		if(!asfd->doread && !asfd->dowrite) continue;
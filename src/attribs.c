@@ -255,6 +255,7 @@ void attribs_decode(struct sbuf *sb)
 	}
 }
 
+#ifdef HAVE_WIN32
 static int set_file_times(struct asfd *asfd,
 	const char *path, struct utimbuf *ut,
 	struct stat *statp, struct conf **confs)
@@ -262,12 +263,8 @@ static int set_file_times(struct asfd *asfd,
 	int e;
 // The mingw64 utime() appears not to work on read-only files.
 // Use the utime() from bacula instead.
-#ifdef HAVE_WIN32
 	//e=utime(path, ut);
 	e=win32_utime(path, ut);
-#else
-	e=utime(path, ut);
-#endif
 	if(e<0)
 	{
 		berrno be;
@@ -278,6 +275,7 @@ static int set_file_times(struct asfd *asfd,
 	}
 	return 0;
 }
+#endif
 
 uint64_t decode_file_no(struct iobuf *iobuf)
 {
@@ -307,26 +305,18 @@ static int do_lutimes(const char *path, struct stat *statp)
 }
 #endif
 
-int attribs_set(struct asfd *asfd, const char *path,
-	struct stat *statp, uint64_t winattr, struct conf **confs)
+#ifndef HAVE_WIN32
+int attribs_set_quiet(const char *path, struct stat *statp,
+	const char **failed)
 {
 	struct utimbuf ut;
 
 	ut.actime=statp->st_atime;
 	ut.modtime=statp->st_mtime;
 
-#ifdef HAVE_WIN32
-	win32_chmod(path, statp->st_mode, winattr);
-	set_file_times(asfd, path, &ut, statp, confs);
-	return 0;
-#endif
-
 	if(lchown(path, statp->st_uid, statp->st_gid)<0)
 	{
-		berrno be;
-		berrno_init(&be);
-		logw(asfd, confs, "Unable to set file owner %s: ERR=%s",
-			path, berrno_bstrerror(&be, errno));
+		*failed="set file owner";
 		return -1;
 	}
 
@@ -336,11 +326,9 @@ int attribs_set(struct asfd *asfd, const char *path,
 	if(S_ISLNK(statp->st_mode))
 	{
 #ifdef HAVE_LUTIMES
-		if(do_lutimes(path, statp)) {
-			berrno be;
-			berrno_init(&be);
-			logw(asfd, confs, "Unable to set lutimes %s: ERR=%s",
-				path, berrno_bstrerror(&be, errno));
+		if(do_lutimes(path, statp))
+		{
+			*failed="set lutimes";
 			return -1;
 		}
 #endif
@@ -349,15 +337,15 @@ int attribs_set(struct asfd *asfd, const char *path,
 	{
 		if(chmod(path, statp->st_mode) < 0)
 		{
-			berrno be;
-			berrno_init(&be);
-			logw(asfd, confs, "Unable to set file modes %s: ERR=%s",
-				path, berrno_bstrerror(&be, errno));
+			*failed="set file modes";
 			return -1;
 		}
 
-		if(set_file_times(asfd, path, &ut, statp, confs))
+		if(utime(path, &ut)<0)
+		{
+			*failed="set file times";
 			return -1;
+		}
 #ifdef HAVE_CHFLAGS
 		/*
 		 * FreeBSD user flags
@@ -368,10 +356,7 @@ int attribs_set(struct asfd *asfd, const char *path,
 		 */
 		if(chflags(path, statp->st_flags)<0)
 		{
-			berrno be;
-			berrno_init(&be);
-			logw(asfd, confs, "Unable to set file flags %s: ERR=%s",
-				path, berrno_bstrerror(&be, errno));
+			*failed="set file flags";
 			return -1;
 		}
 #endif
@@ -379,3 +364,31 @@ int attribs_set(struct asfd *asfd, const char *path,
 
 	return 0;
 }
+#endif
+
+int attribs_set(struct asfd *asfd, const char *path,
+	struct stat *statp, uint64_t winattr, struct conf **confs)
+{
+#ifdef HAVE_WIN32
+	struct utimbuf ut;
+
+	ut.actime=statp->st_atime;
+	ut.modtime=statp->st_mtime;
+
+	win32_chmod(path, statp->st_mode, winattr);
+	set_file_times(asfd, path, &ut, statp, confs);
+	return 0;
+#else
+	const char *failed=NULL;
+
+	if(attribs_set_quiet(path, statp, &failed))
+	{
+		berrno be;
+		berrno_init(&be);
+		logw(asfd, confs, "Unable to %s %s: ERR=%s",
+			failed, path, berrno_bstrerror(&be, errno));
+		return -1;
+	}
+	return 0;
+#endif
+}
@@ -7,6 +7,13 @@ extern void attribs_decode(struct sbuf *sb);
 
 extern int attribs_set(struct asfd *asfd, const char *path, struct stat *statp,
 	uint64_t winattr, struct conf **confs);
+#ifndef HAVE_WIN32
+// Like attribs_set(), but logs nothing, so that it can be used from a worker
+// thread. On failure, returns -1 with errno set and 'failed' saying what
+// could not be done.
+extern int attribs_set_quiet(const char *path, struct stat *statp,
+	const char **failed);
+#endif
 
 extern uint64_t decode_file_no(struct iobuf *iobuf);
 extern uint64_t decode_file_no_and_save_path(struct iobuf *iobuf,
@@ -422,6 +422,14 @@ static int bfile_close(BFILE *bfd, struct asfd *asfd)
 {
 	if(!bfd || bfd->mode==BF_CLOSED) return 0;
 
+	if(bfd->mem)
+	{
+		free_w(&bfd->mem);
+		bfd->mode=BF_CLOSED;
+		free_w(&bfd->path);
+		return 0;
+	}
+
 	if(!close(bfd->fd))
 	{
 		if(bfd->mode==BF_WRITE)
@@ -436,25 +444,117 @@ static int bfile_close(BFILE *bfd, struct asfd *asfd)
 	return -1;
 }
 
+#ifdef SEEK_DATA
+// Ask the filesystem, rather than guessing from st_blocks, which is also
+// smaller than the size on filesystems that compress.
+static int has_holes(int fd)
+{
+	off_t hole;
+	struct stat statp;
+	if(fstat(fd, &statp) || !S_ISREG(statp.st_mode))
+		return 0;
+	hole=lseek(fd, 0, SEEK_HOLE);
+	if(lseek(fd, 0, SEEK_SET)<0)
+		return 0;
+	return hole>=0 && hole<statp.st_size;
+}
+#endif
+
 static int bfile_open(BFILE *bfd,
 	struct asfd *asfd, const char *fname, int flags, mode_t mode)
 {
 	if(!bfd) return 0;
 	if(bfd->mode!=BF_CLOSED && bfd->close(bfd, asfd))
 		return -1;
-	if(!(bfd->fd=open(fname, flags, mode))<0)
+	if((bfd->fd=open(fname, flags, mode))<0)
 		return -1;
 	if(flags & O_CREAT || flags & O_WRONLY)
 		bfd->mode=BF_WRITE;
 	else
+	{
 		bfd->mode=BF_READ;
+#ifdef SEEK_DATA
+		bfd->sparse=has_holes(bfd->fd);
+#endif
+	}
+	bfd->pos=0;
+	bfd->hole_end=0;
+	bfd->data_end=0;
 	if(!(bfd->path=strdup_w(fname, __func__)))
 		return -1;
 	return 0;
 }
 
+#ifdef SEEK_DATA
+// Find where the next hole and data are. Returns 0 at the end of the file,
+// -1 if the filesystem cannot say.
+static int find_data(BFILE *bfd)
+{
+	off_t data;
+	struct stat statp;
+	if((data=lseek(bfd->fd, bfd->pos, SEEK_DATA))<0)
+	{
+		if(errno!=ENXIO || fstat(bfd->fd, &statp))
+			return -1;
+		// Nothing but a hole up to the end of the file.
+		if(statp.st_size<=bfd->pos) return 0;
+		bfd->hole_end=statp.st_size;
+		bfd->data_end=statp.st_size;
+		return 1;
+	}
+	bfd->hole_end=data;
+	if((bfd->data_end=lseek(bfd->fd, data, SEEK_HOLE))<0
+	  || lseek(bfd->fd, data, SEEK_SET)<0)
+		return -1;
+	return 1;
+}
+
+// Hand back zeros for holes, rather than reading them from the disk.
+static ssize_t bfile_read_sparse(BFILE *bfd, void *buf, size_t count)
+{
+	ssize_t got;
+	if(bfd->pos>=bfd->data_end)
+	{
+		switch(find_data(bfd))
+		{
+			case 1: break;
+			case 0: return 0;
+			default:
+				// Just read it all, then.
+				bfd->sparse=0;
+				if(lseek(bfd->fd, bfd->pos, SEEK_SET)<0)
+					return -1;
+				return read(bfd->fd, buf, count);
+		}
+	}
+	if(bfd->pos<bfd->hole_end)
+	{
+		count=min(count, (size_t)(bfd->hole_end-bfd->pos));
+		memset(buf, 0, count);
+		bfd->pos+=count;
+		return count;
+	}
+	count=min(count, (size_t)(bfd->data_end-bfd->pos));
+	if((got=read(bfd->fd, buf, count))>0)
+		bfd->pos+=got;
+	return got;
+}
+#endif
+
+static ssize_t bfile_read_mem(BFILE *bfd, void *buf, size_t count)
+{
+	count=min(count, bfd->memlen-bfd->mempos);
+	memcpy(buf, bfd->mem+bfd->mempos, count);
+	bfd->mempos+=count;
+	return count;
+}
+
 static ssize_t bfile_read(BFILE *bfd, void *buf, size_t count)
 {
+	if(bfd->mem) return bfile_read_mem(bfd, buf, count);
+#ifdef SEEK_DATA
+	if(bfd->sparse) return bfile_read_sparse(bfd, buf, count);
+#endif
 	return read(bfd->fd, buf, count);
 }
 
@@ -505,6 +605,25 @@ static int bfile_open_for_send(BFILE *bfd, struct asfd *asfd,
 	return 0;
 }
 
+#ifndef HAVE_WIN32
+int bfile_open_mem(BFILE *bfd, struct asfd *asfd, const char *fname,
+	char *mem, size_t memlen, struct conf **confs)
+{
+	if(bfd->mode!=BF_CLOSED)
+		bfd->close(bfd, asfd);
+	bfile_init(bfd, 0, confs);
+	if(!(bfd->path=strdup_w(fname, __func__)))
+	{
+		free_w(&mem);
+		return -1;
+	}
+	bfd->mem=mem;
+	bfd->memlen=memlen;
+	bfd->mode=BF_READ;
+	return 0;
+}
+#endif
+
 void bfile_setup_funcs(BFILE *bfd)
 {
 	bfd->open=bfile_open;
@@ -29,6 +29,19 @@ struct BFILE
 	int berrno;          /* errno */
 #else
 	int fd;
+	// Sparse files are read without reading their holes.
+	uint8_t sparse;
+	off_t pos;
+	off_t hole_end;
+	off_t data_end;
+	// Set when the file is being written by a restore_writer.
+	struct restore_writer *rw;
+	struct rw_job *rw_job;
+	// Set when the contents were read into memory ahead of time, so
+	// reads come from here instead of fd.
+	char *mem;
+	size_t memlen;
+	size_t mempos;
 #endif
 
 	// Let us try using function pointers.
@@ -54,6 +67,11 @@ extern void bfile_setup_funcs(BFILE *bfd);
 
 #ifdef HAVE_WIN32
 extern int have_win32_api(void);
+#else
+// Like open_for_send, but for a file whose contents have already been read
+// into 'mem'. Takes over 'mem', which gets freed on close.
+extern int bfile_open_mem(BFILE *bfd, struct asfd *asfd, const char *fname,
+	char *mem, size_t memlen, struct conf **confs);
 #endif
 
 #endif
@@ -142,62 +142,68 @@ int get_acl(struct asfd *asfd, struct sbuf *sb,
 	return 0;
 }
 
-static int do_set_acl(struct asfd *asfd, const char *path,
-	const char *acltext, size_t alen,
-	int acltype, struct conf **confs)
+static int do_set_acl(const char *path, const char *acltext, int acltype,
+	const char **failed)
 {
 	acl_t acl;
 	int ret=-1;
+	int err=0;
 	if(!(acl=acl_from_text(acltext)))
 	{
-		logp("acl_from_text error on %s (%s): %s\n",
-			path, acltext, strerror(errno));
-		logw(asfd, confs, "acl_from_text error on %s (%s): %s\n",
-			path, acltext, strerror(errno));
-		goto end;
+		*failed="convert ACL text";
+		return -1;
 	}
 //#ifndef HAVE_FREEBSD_OS // Bacula says that acl_valid fails on valid input
 			// on freebsd. It works OK for me on FreeBSD 8.2.
 	if(acl_valid(acl))
 	{
-		logp("acl_valid error on %s: %s", path, strerror(errno));
-		logw(asfd, confs,
-			"acl_valid error on %s: %s", path, strerror(errno));
+		*failed="validate ACL";
 		goto end;
 	}
 //#endif
 	if(acl_set_file(path, acltype, acl))
 	{
-		logp("acl set error on %s: %s", path, strerror(errno));
-		logw(asfd,
-			confs, "acl set error on %s: %s", path, strerror(errno));
+		*failed="set ACL";
 		goto end;
 	}
 	ret=0;
 end:
-	if(acl) acl_free(acl);
+	err=errno;
+	acl_free(acl);
+	errno=err;
 	return ret; 
 }
 
-int set_acl(struct asfd *asfd, const char *path, struct sbuf *sb,
-	const char *acltext, size_t alen, char metacmd, struct conf **confs)
+int set_acl_quiet(const char *path, const char *acltext, char metacmd,
+	const char **failed)
 {
 	switch(metacmd)
 	{
 		case META_ACCESS_ACL:
-			return do_set_acl(asfd, path,
-				acltext, alen, ACL_TYPE_ACCESS, confs);
+			return do_set_acl(path,
+				acltext, ACL_TYPE_ACCESS, failed);
 		case META_DEFAULT_ACL:
-			return do_set_acl(asfd, path,
-				acltext, alen, ACL_TYPE_DEFAULT, confs);
+			return do_set_acl(path,
+				acltext, ACL_TYPE_DEFAULT, failed);
 		default:
-			logp("unknown acl type: %c\n", metacmd);
-			logw(asfd, confs,
-				"unknown acl type: %c\n", metacmd);
+			*failed="set unknown ACL type";
+			errno=EINVAL;
 			break;
 	}
 	return -1;
 }
 
+int set_acl(struct asfd *asfd, const char *path, struct sbuf *sb,
+	const char *acltext, size_t alen, char metacmd, struct conf **confs)
+{
+	const char *failed=NULL;
+	if(!set_acl_quiet(path, acltext, metacmd, &failed))
+		return 0;
+	logp("Could not %s on %s: %s\n", failed, path, strerror(errno));
+	logw(asfd, confs,
+		"Could not %s on %s: %s\n", failed, path, strerror(errno));
+	return -1;
+}
+
 #endif // LINUX | BSD
 #endif // HAVE_ACL
@@ -11,6 +11,10 @@ extern int get_acl(struct asfd *asfd, struct sbuf *sb,
 	char **acltext, size_t *alen, struct conf **confs);
 extern int set_acl(struct asfd *asfd, const char *path, struct sbuf *sb,
 	const char *acltext, size_t alen, char metacmd, struct conf **confs);
+// Logs nothing. On failure, returns -1 with errno set and 'failed' saying
+// what could not be done.
+extern int set_acl_quiet(const char *path, const char *acltext, char metacmd,
+	const char **failed);
 #endif
 #endif
 
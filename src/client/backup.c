@@ -51,6 +51,11 @@ int do_backup_client(struct asfd *asfd, struct conf **confs, enum action action,
 	if(action==ACTION_BACKUP_TIMED) set_low_priority();
 #endif
 
+	if(action!=ACTION_ESTIMATE
+	  && throttle_init(get_cntr(confs[OPT_CNTR]),
+		get_int(confs[OPT_PRESSURE_LIMIT]), PRESSURE_DIR))
+			goto end;
+
 	// Scan the file system and send the results to the server.
 	// Skip phase1 if the server wanted to resume.
 	if(!resume)
@@ -93,6 +98,7 @@ int do_backup_client(struct asfd *asfd, struct conf **confs, enum action action,
 
 	ret=0;
 end:
+	throttle_free();
 #if defined(HAVE_WIN32)
 	if(action==ACTION_BACKUP_TIMED) unset_low_priority();
 #if defined(WIN32_VSS)
@@ -123,6 +123,7 @@ int send_file(struct asfd *asfd, FF_PKT *ff, bool top_level, struct conf **confs
 	static struct sbuf *sb=NULL;
 
 	if(!sb && !(sb=sbuf_alloc(confs))) return -1;
+	throttle_wait();
 
 #ifdef HAVE_WIN32
 	if(ff->winattr & FILE_ATTRIBUTE_ENCRYPTED)
@@ -141,8 +142,8 @@ int send_file(struct asfd *asfd, FF_PKT *ff, bool top_level, struct conf **confs
 		case FT_RAW:
 		case FT_FIFO:
 			return do_to_server(asfd, confs, ff, sb, filesymbol,
-				in_exclude_comp(get_strlist(confs[OPT_EXCOM]),
-				  ff->fname, get_int(confs[OPT_COMPRESSION])));
+				file_compression(ff->fname,
+				  get_int(confs[OPT_COMPRESSION])));
 		case FT_DIR:
 		case FT_REPARSE:
 		case FT_JUNCTION:
@@ -194,9 +195,10 @@ int backup_phase1_client(struct asfd *asfd, struct conf **confs, int estimate)
 	dirsymbol=filesymbol;
 #endif
 
-	if(!(ff=find_files_init())) goto end;
+	if(!(ff=find_files_init(confs))) goto end;
 	for(l=get_strlist(confs[OPT_STARTDIR]); l; l=l->next) if(l->flag)
 		if(find_files_begin(asfd, ff, confs, l->path)) goto end;
+	if(find_files_end(ff)) goto end;
 	ret=0;
 end:
 	cntr_print_end_phase1(get_cntr(confs[OPT_CNTR]));
@@ -125,6 +125,47 @@ int extra_comms(struct async *as, struct conf **confs,
 		set_int(confs[OPT_SEND_CLIENT_CNTR], 1);
 	}
 
+	// :metaref: is for the client sending a reference to extra meta
+	// data that it has already sent in this backup, instead of sending
+	// the same thing again.
+	if((*action==ACTION_BACKUP
+	  || *action==ACTION_BACKUP_TIMED
+	  || *action==ACTION_TIMER_CHECK)
+	  && server_supports(feat, ":metaref:"))
+	{
+		if(asfd->write_str(asfd, CMD_GEN, "metarefok"))
+			goto end;
+		set_int(confs[OPT_META_REF], 1);
+	}
+
+	// :appendfrom: is for the protocol2 client sending only the end of
+	// a file that has grown since the last backup. Both ends have to
+	// want it.
+	if((*action==ACTION_BACKUP
+	  || *action==ACTION_BACKUP_TIMED
+	  || *action==ACTION_TIMER_CHECK)
+	  && get_int(confs[OPT_APPEND_FROM])
+	  && server_supports(feat, ":appendfrom:"))
+	{
+		if(asfd->write_str(asfd, CMD_GEN, "appendfromok"))
+			goto end;
+	}
+	else
+		set_int(confs[OPT_APPEND_FROM], 0);
+
+	// :sigfilter: is for the protocol2 client being sent a filter of the
+	// blocks that the server already has, so that it can refer to them
+	// rather than send all their sigs.
+	if((*action==ACTION_BACKUP
+	  || *action==ACTION_BACKUP_TIMED
+	  || *action==ACTION_TIMER_CHECK)
+	  && server_supports(feat, ":sigfilter:"))
+	{
+		if(asfd->write_str(asfd, CMD_GEN, "sigfilterok"))
+			goto end;
+		set_int(confs[OPT_SIG_FILTER], 1);
+	}
+
 	// :incexc: is for the client sending the server the
 	// incexc conf so that it better knows what to do on
 	// resume.
@@ -150,3 +150,89 @@ int set_extrameta(struct asfd *asfd,
 
 	return errors;
 }
+
+#ifndef HAVE_WIN32
+int set_extrameta_quiet(const char *path,
+	const char *extrameta, size_t metalen, const char **failed)
+{
+	size_t l=metalen;
+	char cmdtmp='\0';
+	unsigned int s=0;
+	const char *metadata=extrameta;
+	const char *f=NULL;
+	int ret=0;
+	int err=0;
+
+	while(l>0)
+	{
+		char *m=NULL;
+		int r=-1;
+		if(l<9
+		  || (sscanf(metadata, "%c%08X", &cmdtmp, &s))!=2
+		  || s>l-9)
+		{
+			*failed="read metadata";
+			errno=EINVAL;
+			return -1;
+		}
+		metadata+=9;
+		l-=9;
+		// Plain malloc(), as this can be used from a worker thread.
+		if(!(m=(char *)malloc(s+1)))
+		{
+			*failed="allocate metadata";
+			return -1;
+		}
+		memcpy(m, metadata, s);
+		m[s]='\0';
+
+		metadata+=s;
+		l-=s;
+
+		switch(cmdtmp)
+		{
+#if defined(HAVE_LINUX_OS) || \
+    defined(HAVE_FREEBSD_OS) || \
+    defined(HAVE_OPENBSD_OS) || \
+    defined(HAVE_NETBSD_OS)
+#ifdef HAVE_ACL
+			case META_ACCESS_ACL:
+			case META_DEFAULT_ACL:
+				r=set_acl_quiet(path, m, cmdtmp, &f);
+				break;
+#endif
+#endif
+#if defined(HAVE_LINUX_OS)
+#ifdef HAVE_XATTR
+			case META_XATTR:
+				r=set_xattr_quiet(path, m, s, cmdtmp, &f);
+				break;
+#endif
+#endif
+#if defined(HAVE_FREEBSD_OS) || \
+    defined(HAVE_OPENBSD_OS) || \
+    defined(HAVE_NETBSD_OS)
+#ifdef HAVE_XATTR
+			case META_XATTR_BSD:
+				r=set_xattr_quiet(path, m, s, cmdtmp, &f);
+				break;
+#endif
+#endif
+			default:
+				f="set unknown metadata";
+				errno=EINVAL;
+				break;
+		}
+		free(m);
+		// Carry on with the rest, but say what went wrong first.
+		if(r && !ret)
+		{
+			*failed=f;
+			err=errno;
+			ret=-1;
+		}
+	}
+	if(ret) errno=err;
+	return ret;
+}
+#endif
@@ -24,4 +24,12 @@ extern int set_extrameta(struct asfd *asfd,
 	size_t metalen,
 	struct conf **confs);
 
+#ifndef HAVE_WIN32
+// Like set_extrameta(), but logs nothing, so that it can be used from a
+// worker thread. It carries on past anything that cannot be set, and then
+// returns -1 with errno set and 'failed' saying what the first one was.
+extern int set_extrameta_quiet(const char *path,
+	const char *extrameta, size_t metalen, const char **failed);
+#endif
+
 #endif
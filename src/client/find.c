@@ -52,8 +52,12 @@
 #include <sys/statfs.h>
 #endif
 
+// The include/exclude settings, compiled for the scan. The walk threads
+// look at it too.
+static struct matcher *matcher=NULL;
+
 // Initialize the find files "global" variables
-FF_PKT *find_files_init(void)
+FF_PKT *find_files_init(struct conf **confs)
 {
 	FF_PKT *ff;
 
@@ -66,64 +70,41 @@ FF_PKT *find_files_init(void)
 	// crossed?
 	init_fs_max(NULL);
 
-	return ff;
-}
-
-void find_files_free(FF_PKT *ff)
-{
-	linkhash_free();
-	free_v((void **)&ff);
-}
-
-static int myalphasort(const struct dirent **a, const struct dirent **b)
-{
-	return pathcmp((*a)->d_name, (*b)->d_name);
-}
+	if(!(matcher=matcher_alloc(confs)))
+	{
+		find_files_free(ff);
+		return NULL;
+	}
 
-// Return 1 to include the file, 0 to exclude it.
-static int in_include_ext(struct strlist *incext, const char *fname)
-{
-	int i=0;
-	struct strlist *l;
-	const char *cp=NULL;
-	// If not doing include_ext, let the file get backed up. 
-	if(!incext) return 1;
+	// Not being able to use the journal just means reading everything.
+	ff->journal=journal_open(confs);
 
-	// The flag of the first item contains the maximum number of characters
-	// that need to be checked.
-	// FIX THIS: The next two functions do things very similar to this.
-	for(cp=fname+strlen(fname)-1; i<incext->flag && cp>=fname; cp--, i++)
+	if(!(ff->walk=walk_alloc(get_int(confs[OPT_SCAN_THREADS]), confs,
+		ff->journal)))
 	{
-		if(*cp!='.') continue;
-		for(l=incext; l; l=l->next)
-			if(!strcasecmp(l->path, cp+1))
-				return 1;
-		// If file has no extension, it cannot be included.
-		return 0;
+		find_files_free(ff);
+		return NULL;
 	}
-	return 0;
+
+	return ff;
 }
 
-static int in_exclude_ext(struct strlist *excext, const char *fname)
+// Call when the scan has finished without errors.
+int find_files_end(FF_PKT *ff)
 {
-	int i=0;
-	struct strlist *l;
-	const char *cp=NULL;
-	// If not doing exclude_ext, let the file get backed up.
-	if(!excext) return 0;
+	return journal_close(ff->journal);
+}
 
-	// The flag of the first item contains the maximum number of characters
-	// that need to be checked.
-	for(cp=fname+strlen(fname)-1; i<excext->flag && cp>=fname; cp--, i++)
+void find_files_free(FF_PKT *ff)
+{
+	linkhash_free();
+	if(ff)
 	{
-		if(*cp!='.') continue;
-		for(l=excext; l; l=l->next)
-			if(!strcasecmp(l->path, cp+1))
-				return 1;
-		// If file has no extension, it is included.
-		return 0;
+		walk_free(&ff->walk);
+		journal_free(&ff->journal);
 	}
-	return 0;
+	matcher_free(&matcher);
+	free_v((void **)&ff);
 }
 
 // Returns the level of compression.
@@ -149,61 +130,18 @@ int in_exclude_comp(struct strlist *excom, const char *fname, int compression)
 	return compression;
 }
 
-/* Return 1 to include the file, 0 to exclude it. */
-/* Currently not used - it needs more thinking about. */
-int in_include_regex(struct strlist *increg, const char *fname)
+int file_compression(const char *fname, int compression)
 {
-	// If not doing include_regex, let the file get backed up.
-	if(!increg) return 1;
-	for(; increg; increg=increg->next)
-		if(check_regex(increg->re, fname))
-			return 1;
-	return 0;
-}
-
-int in_exclude_regex(struct strlist *excreg, const char *fname)
-{
-	// If not doing exclude_regex, let the file get backed up.
-	for(; excreg; excreg=excreg->next)
-		if(check_regex(excreg->re, fname))
-			return 1;
-	return 0;
+	return matcher_exclude_comp(matcher, fname, compression);
 }
 
 // When recursing into directories, do not want to check the include_ext list.
-static int file_is_included_no_incext(struct conf **confs, const char *fname)
+int file_is_included_no_incext(const char *fname)
 {
-	int ret=0;
-	int longest=0;
-	int matching=0;
-	struct strlist *l=NULL;
-	struct strlist *best=NULL;
-
-	if(in_exclude_ext(get_strlist(confs[OPT_EXCEXT]), fname)
-	  || in_exclude_regex(get_strlist(confs[OPT_EXCREG]), fname))
-		return 0;
-
-	// Check include/exclude directories.
-	for(l=get_strlist(confs[OPT_INCEXCDIR]); l; l=l->next)
-	{
-		//logp("try: %d %s\n", i, l->path);
-		matching=is_subdir(l->path, fname);
-		if(matching>longest)
-		{
-			longest=matching;
-			best=l;
-		}
-	}
-	//logp("best: %d\n", best);
-	if(!best) ret=0;
-	else ret=best->flag;
-
-	//logp("return: %d\n", ret);
-	return ret;
+	return matcher_is_included(matcher, fname);
 }
 
-static int file_is_included(struct conf **confs,
-	const char *fname, bool top_level)
+static int file_is_included(const char *fname, bool top_level)
 {
 	// Always save the top level directory.
 	// This will help in the simulation of browsing backups because it
@@ -214,9 +152,9 @@ static int file_is_included(struct conf **confs,
 	// in this example) as the stats of the parent directories (/home,
 	// for example). Trust me on this.
 	if(!top_level
-	  && !in_include_ext(get_strlist(confs[OPT_INCEXT]), fname)) return 0;
+	  && !matcher_include_ext(matcher, fname)) return 0;
 
-	return file_is_included_no_incext(confs, fname);
+	return file_is_included_no_incext(fname);
 }
 
 static int fs_change_is_allowed(struct conf **confs, const char *fname)
@@ -281,12 +219,12 @@ static int file_size_match(FF_PKT *ff_pkt, struct conf **confs)
 // Last checks before actually processing the file system entry.
 int send_file_w(struct asfd *asfd, FF_PKT *ff, bool top_level, struct conf **confs)
 {
-	if(!file_is_included(confs, ff->fname, top_level)) return 0;
+	if(!file_is_included(ff->fname, top_level)) return 0;
 
 	// Doing the file size match here also catches hard links.
 	if(S_ISREG(ff->statp.st_mode))
 	{
-		if(!file_is_included(confs, ff->fname, top_level)) return 0;
+		if(!file_is_included(ff->fname, top_level)) return 0;
 		if(!file_size_match(ff, confs)) return 0;
 	}
 
@@ -304,9 +242,8 @@ int send_file_w(struct asfd *asfd, FF_PKT *ff, bool top_level, struct conf **con
 		|| S_ISSOCK(ff->statp.st_mode)))
 	{
 		struct f_link *lp;
-		struct f_link **bucket=NULL;
 
-		if((lp=linkhash_search(&ff->statp, &bucket)))
+		if((lp=linkhash_search(&ff->statp)))
 		{
 			if(!strcmp(lp->name, ff->fname)) return 0;
 			ff->link=lp->name;
@@ -315,8 +252,7 @@ int send_file_w(struct asfd *asfd, FF_PKT *ff, bool top_level, struct conf **con
 		}
 		else
 		{
-			if(linkhash_add(ff->fname,
-				&ff->statp, bucket)) return -1;
+			if(linkhash_add(ff->fname, &ff->statp)) return -1;
 		}
 	}
 
@@ -405,94 +341,44 @@ static void windows_reparse_point_fiddling(FF_PKT *ff_pkt)
 }
 #endif
 
-static int get_files_in_directory(DIR *directory, struct dirent ***nl, int *count)
-{
-	int status;
-	int allocated=0;
-	struct dirent **ntmp=NULL;
-	struct dirent *entry=NULL;
-	struct dirent *result=NULL;
-
-	/* Graham says: this here is doing a funky kind of scandir/alphasort
-	   that can also run on Windows.
-	*/
-	while(1)
-	{
-		char *p;
-		if(!(entry=(struct dirent *)malloc_w(
-			sizeof(struct dirent)+fs_name_max+100, __func__)))
-				return -1;
-		status=readdir_r(directory, entry, &result);
-		if(status || !result)
-		{
-			free_v((void **)&entry);
-			break;
-		}
-
-		p=entry->d_name;
-		ASSERT(fs_name_max+1 > (int)sizeof(struct dirent)+strlen(p));
-
-		/* Skip `.', `..', and excluded file names.  */
-		if(!p || !strcmp(p, ".") || !strcmp(p, ".."))
-		{
-			free_v((void **)&entry);
-			continue;
-		}
-
-		if(*count==allocated)
-		{
-			if(!allocated) allocated=10;
-			else allocated*=2;
-
-			if(!(ntmp=(struct dirent **)
-			  realloc_w(*nl, allocated*sizeof(**nl), __func__)))
-			{
-				free_v((void **)&entry);
-				return -1;
-			}
-			*nl=ntmp;
-		}
-		(*nl)[(*count)++]=entry;
-	}
-	if(*nl) qsort(*nl, *count, sizeof(**nl),
-		(int (*)(const void *, const void *))myalphasort);
-	return 0;
-}
-
 // Prototype because process_files_in_directory() recurses using find_files().
 static int find_files(struct asfd *asfd, FF_PKT *ff_pkt, struct conf **confs,
-	char *fname, dev_t parent_device, bool top_level);
+	char *fname, dev_t parent_device, bool top_level, struct walk_ent *ent);
 
-static int process_files_in_directory(struct asfd *asfd, struct dirent **nl,
-	int count, int *rtn_stat, char **link, size_t len, size_t *link_len,
-	struct conf **confs, FF_PKT *ff_pkt, dev_t our_device)
+static int process_files_in_directory(struct asfd *asfd,
+	struct walk_list *list, int *rtn_stat, char **link, size_t len,
+	size_t *link_len, struct conf **confs, FF_PKT *ff_pkt,
+	dev_t our_device)
 {
 	int m=0;
-	for(m=0; m<count; m++)
+	for(m=0; m<list->count; m++)
 	{
 		size_t i;
 		char *p=NULL;
 		char *q=NULL;
+		size_t plen;
 
-		p=nl[m]->d_name;
+		p=list->ents[m].name;
+		plen=strlen(p);
 
-		if(strlen(p)+len>=*link_len)
+		if(plen+len>=*link_len)
 		{
-			*link_len=len+strlen(p)+1;
+			*link_len=len+plen+1;
 			if(!(*link=(char *)
 			  realloc_w(*link, (*link_len)+1, __func__)))
 				return -1;
 		}
 		q=(*link)+len;
-		for(i=0; i<strlen(nl[m]->d_name); i++)
+		for(i=0; i<plen; i++)
 			*q++=*p++;
 		*q=0;
 		ff_pkt->flen=i;
 
-		if(file_is_included_no_incext(confs, *link))
+		if(file_is_included_no_incext(*link))
 		{
 			*rtn_stat=find_files(asfd, ff_pkt,
-				confs, *link, our_device, false);
+				confs, *link, our_device, false,
+				&list->ents[m]);
 		}
 		else
 		{
@@ -507,7 +393,7 @@ static int process_files_in_directory(struct asfd *asfd, struct dirent **nl,
 					struct strlist *y;
 					if((*rtn_stat=find_files(asfd, ff_pkt,
 						confs, x->path,
-						our_device, false)))
+						our_device, false, NULL)))
 							break;
 					// Now need to skip subdirectories of
 					// the thing that we just stuck in
@@ -520,7 +406,6 @@ static int process_files_in_directory(struct asfd *asfd, struct dirent **nl,
 				}
 			}
 		}
-		free_v((void **)&(nl[m]));
 		if(*rtn_stat) break;
 	}
 	return 0;
@@ -530,15 +415,13 @@ static int found_directory(struct asfd *asfd, FF_PKT *ff_pkt, struct conf **conf
 	char *fname, dev_t parent_device, bool top_level)
 {
 	int rtn_stat;
-	DIR *directory;
 	char *link=NULL;
 	size_t link_len;
 	size_t len;
 	int nbret=0;
-	int count=0;
 	bool recurse;
 	dev_t our_device;
-	struct dirent **nl=NULL;
+	struct walk_list *list=NULL;
 
 	recurse=true;
 	our_device=ff_pkt->statp.st_dev;
@@ -620,56 +503,37 @@ static int found_directory(struct asfd *asfd, FF_PKT *ff_pkt, struct conf **conf
 
 	/*
 	* Descend into or "recurse" into the directory to read
-	*   all the files in it.
+	*   all the files in it. The listing may well have been read ahead
+	*   already.
 	*/
-	errno = 0;
-#if defined(O_DIRECTORY) && defined(O_NOATIME)
-	int dfd=-1;
-	if((dfd=open(fname,
-		O_RDONLY|O_DIRECTORY|get_int(confs[OPT_ATIME])?0:O_NOATIME))<0
-	  || !(directory=fdopendir(dfd)))
-#else
-// Mac OS X appears to have no O_NOATIME and no fdopendir(), so it should
-// end up using opendir() here.
-	if(!(directory=opendir(fname)))
-#endif
+	if(walk_get(ff_pkt->walk, fname, our_device, &list))
+	{
+		free_w(&link);
+		return -1;
+	}
+	if(list->noopen)
 	{
-#if defined(O_DIRECTORY) && defined(O_NOATIME)
-		if(dfd>=0) close(dfd);
-#endif
 		ff_pkt->type=FT_NOOPEN;
 		rtn_stat=send_file_w(asfd, ff_pkt, top_level, confs);
+		walk_list_free(&list);
 		free_w(&link);
 		return rtn_stat;
 	}
 
 	/*
 	* Process all files in this directory entry (recursing).
-	*    This would possibly run faster if we chdir to the directory
-	*    before traversing it.
 	*/
-	if(get_files_in_directory(directory, &nl, &count))
+	rtn_stat=0;
+	if(process_files_in_directory(asfd, list,
+		&rtn_stat, &link, len, &link_len, confs,
+		ff_pkt, our_device))
 	{
-		closedir(directory);
+		walk_list_free(&list);
 		free_w(&link);
 		return -1;
 	}
-	closedir(directory);
-
-	rtn_stat=0;
-	if(nl)
-	{
-		if(process_files_in_directory(asfd, nl, count,
-			&rtn_stat, &link, len, &link_len, confs,
-			ff_pkt, our_device))
-		{
-			free_w(&link);
-			free(nl);
-			return -1;
-		}
-	}
+	walk_list_free(&list);
 	free_w(&link);
-	if(nl) free(nl);
 
 	return rtn_stat;
 }
@@ -708,24 +572,36 @@ static int found_other(struct asfd *asfd, FF_PKT *ff_pkt, struct conf **confs,
 	return send_file_w(asfd, ff_pkt, top_level, confs);
 }
 
+static int get_stat(FF_PKT *ff_pkt, const char *fname, struct walk_ent *ent)
+{
+#ifdef HAVE_WIN32
+	return win32_lstat(fname, &ff_pkt->statp, &ff_pkt->winattr);
+#else
+	// Use the stat from when the directory was read, if there was one.
+	if(ent && ent->stat_done)
+	{
+		ff_pkt->statp=ent->statp;
+		return ent->stat_ret;
+	}
+	return lstat(fname, &ff_pkt->statp);
+#endif
+}
+
 /*
  * Find a single file.
  * p is the filename
  * parent_device is the device we are currently on
  * top_level is 1 when not recursing or 0 when
  *  descending into a directory.
+ * ent is the directory entry of the file, if it came from one.
  */
 static int find_files(struct asfd *asfd, FF_PKT *ff_pkt, struct conf **confs,
-	char *fname, dev_t parent_device, bool top_level)
+	char *fname, dev_t parent_device, bool top_level, struct walk_ent *ent)
 {
 	ff_pkt->fname=fname;
 	ff_pkt->link=fname;
 
-#ifdef HAVE_WIN32
-	if(win32_lstat(fname, &ff_pkt->statp, &ff_pkt->winattr))
-#else
-	if(lstat(fname, &ff_pkt->statp))
-#endif
+	if(get_stat(ff_pkt, fname, ent))
 	{
 		ff_pkt->type=FT_NOSTAT;
 		return send_file_w(asfd, ff_pkt, top_level, confs);
@@ -765,5 +641,5 @@ int find_files_begin(struct asfd *asfd,
 	FF_PKT *ff_pkt, struct conf **confs, char *fname)
 {
 	return find_files(asfd, ff_pkt,
-		confs, fname, (dev_t)-1, 1 /* top_level */);
+		confs, fname, (dev_t)-1, 1 /* top_level */, NULL);
 }
@@ -92,14 +92,20 @@ struct FF_PKT
 	struct stat statp;	/* stat packet */
 	uint64_t winattr;	/* windows attributes */
 	int type;		/* FT_ type from above */
+	struct walk *walk;	/* reads directories ahead */
+	struct journal *journal; /* what has changed since last time */
 };
 
-extern FF_PKT *find_files_init(void);
+extern FF_PKT *find_files_init(struct conf **confs);
+extern int find_files_end(FF_PKT *ff);
 extern void find_files_free(FF_PKT *ff);
 extern int find_files_begin(struct asfd *asfd,
 	FF_PKT *ff_pkt, struct conf **confs, char *fname);
+extern int file_is_included_no_incext(const char *fname);
 // Returns the level of compression.
 extern int in_exclude_comp(struct strlist *excom, const char *fname,
 	int compression);
+// The same, for use during the scan.
+extern int file_compression(const char *fname, int compression);
 
 #endif
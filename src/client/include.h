@@ -16,10 +16,14 @@
 #include "extrameta.h"
 #include "find.h"
 #include "glob_windows.h"
+#include "journal.h"
 #include "list.h"
 #include "main.h"
+#include "matcher.h"
 #include "monitor.h"
 #include "restore.h"
+#include "restore_writer.h"
+#include "walk.h"
 #include "xattr.h"
 
 #endif
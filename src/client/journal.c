@@ -0,0 +1,1339 @@
+#include "include.h"
+#include "../lock.h"
+#include "../pathcmp.h"
+#include "../prepend.h"
+
+#if defined(HAVE_LINUX_OS) && defined(HAVE_SYS_INOTIFY_H)
+#define USE_JOURNAL
+#endif
+
+#ifdef USE_JOURNAL
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <uthash.h>
+
+#define JOURNAL_FILE		"journal"
+#define JOURNAL_TMP		"journal.tmp"
+#define JOURNAL_LOCK		"journal.lock"
+#define JOURNAL_SYNC		"sync"
+#define JOURNAL_SYNC_TMP	"sync.tmp"
+#define JOURNAL_SCAN		"scan"
+#define JOURNAL_SCAN_TMP	"scan.tmp"
+
+#define SCAN_MAGIC		"burpscan1\n"
+#define SCAN_MAGIC_LEN		10
+
+// Once the journal gets this big, the watcher starts a new one. The scan
+// after that reads everything.
+#define JOURNAL_MAX		(256*1024*1024)
+
+// How long the scan waits for the watcher to catch up.
+#define JOURNAL_SYNC_WAIT	30
+
+// The lines of the journal, each of which is a letter, then a space and a
+// path or a token if there is one.
+#define J_SESSION	's'	// First line. A new one for each journal.
+#define J_ROOT		'r'	// A directory being watched, with everything
+				// under it.
+#define J_READY		'R'	// Everything is being watched.
+#define J_DIR		'd'	// Something changed in this directory.
+#define J_TREE		't'	// Anything under this path may have changed.
+#define J_INODE		'i'	// A file with more than one hard link
+				// changed. Its device and inode numbers.
+#define J_UNLINK	'u'	// A name went from a directory, and it might
+				// have been a hard link to something else.
+#define J_SYNC		'S'	// Everything before this has been written.
+#define J_RESET		'X'	// Something may have been missed.
+
+// When the watcher reads a directory, it is reported as an access to the
+// directory. That does not change anything that the scan keeps, so it is
+// ignored, along with the same thing done by the scan itself.
+#define WATCH_MASK	(IN_ACCESS|IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE \
+	|IN_DELETE|IN_DELETE_SELF|IN_MODIFY|IN_MOVE_SELF|IN_MOVED_FROM \
+	|IN_MOVED_TO|IN_DONT_FOLLOW|IN_EXCL_UNLINK|IN_ONLYDIR)
+
+// The new path is 'dir' and 'name' with a slash between, with any slashes
+// at the end of 'dir' taken off first, as the scan does.
+static char *join(const char *dir, const char *name)
+{
+	char *path;
+	size_t dlen=strlen(dir);
+	size_t nlen=strlen(name);
+	while(dlen>=1 && dir[dlen-1]=='/') dlen--;
+	if(!(path=(char *)malloc_w(dlen+nlen+2, __func__)))
+		return NULL;
+	memcpy(path, dir, dlen);
+	path[dlen]='/';
+	memcpy(path+dlen+1, name, nlen+1);
+	return path;
+}
+
+/* The watcher. */
+
+struct seen
+{
+	char *line;
+	UT_hash_handle hh;
+};
+
+struct watcher
+{
+	const char *dir;
+	struct strlist *roots;
+	int fd;
+	int jfd;
+	char *jpath;
+	char *jtmp;
+	int mfd;
+	int sync_wd;
+	char *syncpath;
+	// The path of each watch descriptor.
+	char **paths;
+	int paths_alloc;
+	// Directories that could not be watched.
+	char **unwatched;
+	int unwatched_count;
+	// The lines written since the last sync, so that a busy directory
+	// goes in once, rather than over and over.
+	struct seen *seen;
+	char *out;
+	size_t outlen;
+	size_t outalloc;
+	unsigned int sessions;
+};
+
+static void seen_free(struct watcher *w)
+{
+	struct seen *s;
+	struct seen *tmp;
+	HASH_ITER(hh, w->seen, s, tmp)
+	{
+		HASH_DEL(w->seen, s);
+		free_w(&s->line);
+		free_v((void **)&s);
+	}
+}
+
+// The lines that only need to go in once between syncs.
+static int once(char type)
+{
+	return type==J_DIR || type==J_TREE || type==J_INODE || type==J_UNLINK;
+}
+
+static int out_add(struct watcher *w, char type, const char *str)
+{
+	size_t len;
+	char *line;
+	struct seen *s=NULL;
+
+	// The journal has a line for each path, so a path with a newline in
+	// it cannot go in. Let the scan read everything instead.
+	if(str && strchr(str, '\n'))
+	{
+		type=J_RESET;
+		str=NULL;
+	}
+	len=2+(str?strlen(str)+1:0);
+	if(!(line=(char *)malloc_w(len+1, __func__)))
+		return -1;
+	if(str) snprintf(line, len+1, "%c %s\n", type, str);
+	else snprintf(line, len+1, "%c\n", type);
+	len=strlen(line);
+
+	if(once(type))
+	{
+		HASH_FIND_STR(w->seen, line, s);
+		if(s)
+		{
+			free_w(&line);
+			return 0;
+		}
+	}
+
+	if(w->outlen+len>w->outalloc)
+	{
+		char *tmp;
+		size_t a=w->outalloc?w->outalloc:4096;
+		while(a<w->outlen+len) a*=2;
+		if(!(tmp=(char *)realloc_w(w->out, a, __func__)))
+		{
+			free_w(&line);
+			return -1;
+		}
+		w->out=tmp;
+		w->outalloc=a;
+	}
+	memcpy(w->out+w->outlen, line, len);
+	w->outlen+=len;
+
+	if(once(type))
+	{
+		if(!(s=(struct seen *)calloc_w(1, sizeof(struct seen),
+			__func__)))
+		{
+			free_w(&line);
+			return -1;
+		}
+		s->line=line;
+		HASH_ADD_KEYPTR(hh, w->seen, s->line, strlen(s->line), s);
+		return 0;
+	}
+	free_w(&line);
+	return 0;
+}
+
+// The scan trusts whatever is in the journal, so it has to be on disk before
+// anything after it is.
+static int out_flush(struct watcher *w)
+{
+	size_t done=0;
+	ssize_t r;
+	if(!w->outlen) return 0;
+	while(done<w->outlen)
+	{
+		if((r=write(w->jfd, w->out+done, w->outlen-done))<0)
+		{
+			if(errno==EINTR) continue;
+			logp("Could not write to journal: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		done+=r;
+	}
+	if(fdatasync(w->jfd))
+	{
+		logp("Could not sync journal: %s\n", strerror(errno));
+		return -1;
+	}
+	w->outlen=0;
+	return 0;
+}
+
+// A change to a directory changes its own times, and those are kept in the
+// entries of its parent.
+static int out_dir(struct watcher *w, const char *path)
+{
+	int ret;
+	char *cp;
+	char *parent;
+	if(out_add(w, J_DIR, path)) return -1;
+	if(!(parent=strdup_w(path, __func__))) return -1;
+	if((cp=strrchr(parent, '/')))
+	{
+		if(cp==parent) cp++;
+		*cp='\0';
+	}
+	ret=out_add(w, J_DIR, parent);
+	free_w(&parent);
+	return ret;
+}
+
+// A file with more than one hard link can be changed through any of them,
+// and the directories that the others are in hear nothing about it.
+static int out_links(struct watcher *w, const char *path, uint32_t mask)
+{
+	char ino[64];
+	struct stat statp;
+	if(mask & (IN_DELETE|IN_MOVED_FROM))
+		return out_add(w, J_UNLINK, NULL);
+	if(lstat(path, &statp) || statp.st_nlink<2)
+		return 0;
+	snprintf(ino, sizeof(ino), "%llx:%llx",
+		(unsigned long long)statp.st_dev,
+		(unsigned long long)statp.st_ino);
+	return out_add(w, J_INODE, ino);
+}
+
+static int set_path(struct watcher *w, int wd, const char *path)
+{
+	if(wd>=w->paths_alloc)
+	{
+		char **tmp;
+		int a=w->paths_alloc?w->paths_alloc:1024;
+		while(a<=wd) a*=2;
+		if(!(tmp=(char **)realloc_w(w->paths, a*sizeof(char *),
+			__func__)))
+				return -1;
+		memset(tmp+w->paths_alloc, 0,
+			(a-w->paths_alloc)*sizeof(char *));
+		w->paths=tmp;
+		w->paths_alloc=a;
+	}
+	free_w(&w->paths[wd]);
+	if(!(w->paths[wd]=strdup_w(path, __func__)))
+		return -1;
+	return 0;
+}
+
+static int add_unwatched(struct watcher *w, const char *path)
+{
+	char **tmp;
+	if(!(tmp=(char **)realloc_w(w->unwatched,
+		(w->unwatched_count+1)*sizeof(char *), __func__)))
+			return -1;
+	w->unwatched=tmp;
+	if(!(w->unwatched[w->unwatched_count]=strdup_w(path, __func__)))
+		return -1;
+	w->unwatched_count++;
+	return 0;
+}
+
+static int watch_tree(struct watcher *w, const char *path)
+{
+	int wd;
+	int ret=-1;
+	DIR *dirp=NULL;
+	struct dirent *d;
+
+	// The journal and the cache change all the time, so do not watch them.
+	if(is_subdir(w->dir, path)) return 0;
+
+	if((wd=inotify_add_watch(w->fd, path, WATCH_MASK))<0)
+	{
+		switch(errno)
+		{
+			case ENOENT:
+			case ENOTDIR:
+			case ELOOP:
+				// It has gone already, which the
+				// journal knows from its parent.
+				return 0;
+			case ENOSPC:
+				logp("Could not watch %s: %s\n",
+					path, strerror(errno));
+				logp("Try raising fs.inotify.max_user_watches\n");
+				return -1;
+			default:
+				// The scan will always read this one.
+				logp("Could not watch %s: %s\n",
+					path, strerror(errno));
+				return add_unwatched(w, path);
+		}
+	}
+	if(set_path(w, wd, path)) return -1;
+
+	if(!(dirp=opendir(path)))
+	{
+		if(errno==ENOENT || errno==ENOTDIR) return 0;
+		logp("Could not open %s: %s\n", path, strerror(errno));
+		return add_unwatched(w, path);
+	}
+	while((d=readdir(dirp)))
+	{
+		char *child;
+		struct stat statp;
+		if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if(d->d_type!=DT_DIR && d->d_type!=DT_UNKNOWN)
+			continue;
+		if(!(child=join(path, d->d_name)))
+			goto end;
+		if(d->d_type==DT_UNKNOWN
+		  && (lstat(child, &statp) || !S_ISDIR(statp.st_mode)))
+		{
+			free_w(&child);
+			continue;
+		}
+		if(watch_tree(w, child))
+		{
+			free_w(&child);
+			goto end;
+		}
+		free_w(&child);
+	}
+	ret=0;
+end:
+	closedir(dirp);
+	return ret;
+}
+
+static void unwatch_tree(struct watcher *w, const char *path)
+{
+	int wd;
+	for(wd=0; wd<w->paths_alloc; wd++)
+	{
+		if(!w->paths[wd] || !is_subdir(path, w->paths[wd]))
+			continue;
+		inotify_rm_watch(w->fd, wd);
+		free_w(&w->paths[wd]);
+	}
+}
+
+// The new journal replaces the old one in one go, so that a crash cannot
+// leave one that is cut short.
+static int start_session(struct watcher *w, int ready)
+{
+	char session[64];
+	struct strlist *l;
+
+	seen_free(w);
+	w->outlen=0;
+	if(w->jfd>=0) close(w->jfd);
+	if((w->jfd=open(w->jtmp, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600))<0)
+	{
+		logp("Could not open %s: %s\n", w->jtmp, strerror(errno));
+		return -1;
+	}
+	snprintf(session, sizeof(session), "%ld.%d.%u",
+		(long)time(NULL), (int)getpid(), w->sessions++);
+	if(out_add(w, J_SESSION, session)) return -1;
+	for(l=w->roots; l; l=l->next)
+		if(l->flag && out_add(w, J_ROOT, l->path))
+			return -1;
+	if(ready && out_add(w, J_READY, NULL)) return -1;
+	if(out_flush(w)) return -1;
+	if(rename(w->jtmp, w->jpath))
+	{
+		logp("Could not rename %s to %s: %s\n",
+			w->jtmp, w->jpath, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int do_sync(struct watcher *w)
+{
+	int i;
+	int fd;
+	ssize_t r;
+	char token[64]="";
+
+	if((fd=open(w->syncpath, O_RDONLY))<0)
+		return 0;
+	r=read(fd, token, sizeof(token)-1);
+	close(fd);
+	if(r<=0) return 0;
+	token[r]='\0';
+	token[strcspn(token, "\n")]='\0';
+
+	for(i=0; i<w->unwatched_count; i++)
+		if(out_add(w, J_TREE, w->unwatched[i]))
+			return -1;
+	if(out_add(w, J_SYNC, token)
+	  || out_flush(w))
+		return -1;
+	// Whatever happens from now on needs to go in again, for the next
+	// scan to see it.
+	seen_free(w);
+	return 0;
+}
+
+// Events have been lost, and they may have been for new directories, which
+// would then never be watched. Start again from the top, and let the next
+// scan read everything.
+static int rewatch(struct watcher *w)
+{
+	int i;
+	struct strlist *l;
+	if(out_add(w, J_RESET, NULL)) return -1;
+	for(i=0; i<w->unwatched_count; i++)
+		free_w(&w->unwatched[i]);
+	w->unwatched_count=0;
+	for(l=w->roots; l; l=l->next)
+		if(l->flag && watch_tree(w, l->path))
+			return -1;
+	return 0;
+}
+
+static int is_root(struct watcher *w, const char *path)
+{
+	struct strlist *l;
+	for(l=w->roots; l; l=l->next)
+		if(l->flag && !strcmp(l->path, path))
+			return 1;
+	return 0;
+}
+
+static int do_event(struct watcher *w, struct inotify_event *ev)
+{
+	int ret=-1;
+	char *child=NULL;
+	const char *path;
+
+	if(ev->mask & IN_Q_OVERFLOW)
+	{
+		logp("inotify queue overflowed\n");
+		// A scan asking to sync may have been lost as well.
+		if(rewatch(w)) return -1;
+		return do_sync(w);
+	}
+	if(ev->wd==w->sync_wd)
+	{
+		if(ev->len
+		  && (ev->mask & IN_MOVED_TO)
+		  && !strcmp(ev->name, JOURNAL_SYNC))
+			return do_sync(w);
+		return 0;
+	}
+	if(ev->wd<0
+	  || ev->wd>=w->paths_alloc
+	  || !(path=w->paths[ev->wd]))
+		return 0;
+	if(ev->mask & IN_IGNORED)
+	{
+		free_w(&w->paths[ev->wd]);
+		return 0;
+	}
+	if((ev->mask & IN_ACCESS)
+	  && ((ev->mask & IN_ISDIR) || !ev->len))
+		return 0;
+	if((ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF))
+	  && is_root(w, path))
+	{
+		logp("%s has gone\n", path);
+		return out_add(w, J_RESET, NULL);
+	}
+
+	if(out_dir(w, path)) return -1;
+	if(!ev->len) return 0;
+
+	if(!(child=join(path, ev->name))) return -1;
+	if(!(ev->mask & IN_ISDIR))
+	{
+		ret=out_links(w, child, ev->mask);
+		goto end;
+	}
+	if(ev->mask & IN_MOVED_FROM)
+	{
+		// Its watches still have the old paths on them.
+		unwatch_tree(w, child);
+		if(out_add(w, J_TREE, child)) goto end;
+	}
+	if(ev->mask & (IN_CREATE|IN_MOVED_TO))
+	{
+		// Things may have been put in it before the watch was added,
+		// so it needs reading in full.
+		if(out_add(w, J_TREE, child)
+		  || watch_tree(w, child))
+			goto end;
+	}
+	ret=0;
+end:
+	free_w(&child);
+	return ret;
+}
+
+static int read_events(struct watcher *w)
+{
+	ssize_t r;
+	char *p;
+	char buf[64*1024]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	if((r=read(w->fd, buf, sizeof(buf)))<0)
+	{
+		if(errno==EINTR || errno==EAGAIN) return 0;
+		logp("Could not read inotify events: %s\n", strerror(errno));
+		return -1;
+	}
+	for(p=buf; p<buf+r; )
+	{
+		struct inotify_event *ev=(struct inotify_event *)p;
+		if(do_event(w, ev)) return -1;
+		p+=sizeof(struct inotify_event)+ev->len;
+	}
+	return 0;
+}
+
+// The file has to be read again for poll() to notice the next change.
+static void read_mounts(struct watcher *w)
+{
+	char buf[4096];
+	lseek(w->mfd, 0, SEEK_SET);
+	while(read(w->mfd, buf, sizeof(buf))>0) { }
+}
+
+int journal_watch(struct conf **confs)
+{
+	int i;
+	int ret=-1;
+	char *path=NULL;
+	struct lock *lock=NULL;
+	struct pollfd pfd[2];
+	struct strlist *l;
+	struct watcher w;
+
+	memset(&w, 0, sizeof(w));
+	w.fd=-1;
+	w.jfd=-1;
+	w.mfd=-1;
+	w.roots=get_strlist(confs[OPT_STARTDIR]);
+	if(!(w.dir=get_string(confs[OPT_JOURNAL_DIR])))
+	{
+		logp("journal_dir is not set\n");
+		return -1;
+	}
+
+	if(!(path=prepend_s(w.dir, JOURNAL_LOCK))
+	  || !(lock=lock_alloc_and_init(path)))
+		goto end;
+	lock_get(lock);
+	if(lock->status!=GET_LOCK_GOT)
+	{
+		logp("Could not get %s - is another watcher running?\n", path);
+		goto end;
+	}
+	free_w(&path);
+
+	if(!(w.jpath=prepend_s(w.dir, JOURNAL_FILE))
+	  || !(w.jtmp=prepend_s(w.dir, JOURNAL_TMP))
+	  || !(w.syncpath=prepend_s(w.dir, JOURNAL_SYNC)))
+		goto end;
+	if((w.fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC))<0)
+	{
+		logp("Could not start inotify: %s\n", strerror(errno));
+		goto end;
+	}
+	if((w.sync_wd=inotify_add_watch(w.fd, w.dir, IN_MOVED_TO))<0)
+	{
+		logp("Could not watch %s: %s\n", w.dir, strerror(errno));
+		goto end;
+	}
+	if((w.mfd=open("/proc/self/mountinfo", O_RDONLY))>=0)
+		read_mounts(&w);
+
+	// The scan cannot use the journal until it says that everything is
+	// being watched.
+	if(start_session(&w, 0)) goto end;
+	for(l=w.roots; l; l=l->next)
+	{
+		if(!l->flag) continue;
+		logp("Watching %s\n", l->path);
+		if(watch_tree(&w, l->path)) goto end;
+	}
+	if(out_add(&w, J_READY, NULL)
+	  || out_flush(&w))
+		goto end;
+	logp("Journal ready\n");
+
+	pfd[0].fd=w.fd;
+	pfd[0].events=POLLIN;
+	pfd[1].fd=w.mfd;
+	pfd[1].events=POLLPRI;
+	while(1)
+	{
+		pfd[0].revents=0;
+		pfd[1].revents=0;
+		if(poll(pfd, w.mfd>=0?2:1, -1)<0)
+		{
+			if(errno==EINTR) continue;
+			logp("poll failed in %s: %s\n",
+				__func__, strerror(errno));
+			goto end;
+		}
+		if(pfd[1].revents & (POLLPRI|POLLERR))
+		{
+			// Something has been mounted or unmounted, which
+			// does not make any inotify events.
+			read_mounts(&w);
+			if(rewatch(&w)) goto end;
+		}
+		if((pfd[0].revents & POLLIN)
+		  && read_events(&w))
+			goto end;
+		if(out_flush(&w)) goto end;
+		if(lseek(w.jfd, 0, SEEK_END)>JOURNAL_MAX
+		  && start_session(&w, 1))
+			goto end;
+	}
+
+end:
+	free_w(&path);
+	seen_free(&w);
+	free_w(&w.out);
+	free_w(&w.syncpath);
+	free_w(&w.jpath);
+	free_w(&w.jtmp);
+	for(i=0; i<w.paths_alloc; i++)
+		free_w(&w.paths[i]);
+	free_v((void **)&w.paths);
+	for(i=0; i<w.unwatched_count; i++)
+		free_w(&w.unwatched[i]);
+	free_v((void **)&w.unwatched);
+	if(w.mfd>=0) close(w.mfd);
+	if(w.jfd>=0) close(w.jfd);
+	if(w.fd>=0) close(w.fd);
+	lock_release(lock);
+	lock_free(&lock);
+	return ret;
+}
+
+/* The scan. */
+
+struct inode
+{
+	uint64_t dev;
+	uint64_t ino;
+};
+
+struct journal
+{
+	const char *dir;
+	char *session;
+	// Set if the cache from the previous scan can be used.
+	uint8_t use_old;
+	char **roots;
+	int nroots;
+	// Sorted with strcmp().
+	char **dirs;
+	int ndirs;
+	char **trees;
+	int ntrees;
+	// Sorted with inode_cmp().
+	struct inode *inodes;
+	int ninodes;
+	// Set if any hard link might have gone.
+	uint8_t unlinked;
+
+	// The cache from the previous scan, and the record that it is on.
+	FILE *oldfp;
+	char *oldpath;
+	uint64_t oldlen;
+
+	// The cache for this scan.
+	FILE *newfp;
+	char *newpath;
+	char *newtmp;
+};
+
+static int add_str(char ***list, int *count, const char *str)
+{
+	char **tmp;
+	if(!(tmp=(char **)realloc_w(*list, (*count+1)*sizeof(char *),
+		__func__)))
+			return -1;
+	*list=tmp;
+	if(!((*list)[*count]=strdup_w(str, __func__)))
+		return -1;
+	(*count)++;
+	return 0;
+}
+
+static void free_strs(char ***list, int *count)
+{
+	int i;
+	for(i=0; i<*count; i++)
+		free_w(&(*list)[i]);
+	free_v((void **)list);
+	*count=0;
+}
+
+static int str_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+static int add_inode(struct journal *j, const char *str)
+{
+	struct inode *tmp;
+	unsigned long long dev;
+	unsigned long long ino;
+	if(sscanf(str, "%llx:%llx", &dev, &ino)!=2)
+	{
+		logp("Bad inode line in journal: %s\n", str);
+		return -1;
+	}
+	if(!(tmp=(struct inode *)realloc_w(j->inodes,
+		(j->ninodes+1)*sizeof(struct inode), __func__)))
+			return -1;
+	j->inodes=tmp;
+	j->inodes[j->ninodes].dev=dev;
+	j->inodes[j->ninodes].ino=ino;
+	j->ninodes++;
+	return 0;
+}
+
+static int inode_cmp(const void *a, const void *b)
+{
+	const struct inode *x=(const struct inode *)a;
+	const struct inode *y=(const struct inode *)b;
+	if(x->dev!=y->dev) return x->dev<y->dev?-1:1;
+	if(x->ino!=y->ino) return x->ino<y->ino?-1:1;
+	return 0;
+}
+
+static int write_all(FILE *fp, const void *buf, size_t len)
+{
+	return fwrite(buf, 1, len, fp)!=len;
+}
+
+static int read_all(FILE *fp, void *buf, size_t len)
+{
+	return fread(buf, 1, len, fp)!=len;
+}
+
+static char *read_str(FILE *fp)
+{
+	uint32_t len;
+	char *str;
+	if(read_all(fp, &len, sizeof(len))
+	  || len>65536
+	  || !(str=(char *)malloc_w(len+1, __func__)))
+		return NULL;
+	if(read_all(fp, str, len))
+	{
+		free_w(&str);
+		return NULL;
+	}
+	str[len]='\0';
+	return str;
+}
+
+static int write_str(FILE *fp, const char *str)
+{
+	uint32_t len=strlen(str);
+	return write_all(fp, &len, sizeof(len))
+	  || write_all(fp, str, len);
+}
+
+static void old_close(struct journal *j)
+{
+	close_fp(&j->oldfp);
+	free_w(&j->oldpath);
+}
+
+// Reads the start of the next record in the old cache.
+static void old_next(struct journal *j)
+{
+	free_w(&j->oldpath);
+	if(!(j->oldpath=read_str(j->oldfp))
+	  || !*j->oldpath
+	  || read_all(j->oldfp, &j->oldlen, sizeof(j->oldlen)))
+		old_close(j);
+}
+
+// Returns the offset of the journal that the old cache goes up to, or -1
+// if there is no old cache that can be used.
+static long old_open(struct journal *j)
+{
+	uint32_t stlen;
+	uint64_t offset;
+	char *path=NULL;
+	char *session=NULL;
+	char magic[SCAN_MAGIC_LEN];
+
+	if(!(path=prepend_s(j->dir, JOURNAL_SCAN)))
+		return -1;
+	j->oldfp=fopen(path, "rb");
+	free_w(&path);
+	if(!j->oldfp) return -1;
+
+	if(read_all(j->oldfp, magic, sizeof(magic))
+	  || memcmp(magic, SCAN_MAGIC, SCAN_MAGIC_LEN)
+	  || read_all(j->oldfp, &stlen, sizeof(stlen))
+	  || stlen!=sizeof(struct stat)
+	  || !(session=read_str(j->oldfp))
+	  || read_all(j->oldfp, &offset, sizeof(offset)))
+	{
+		free_w(&session);
+		old_close(j);
+		return -1;
+	}
+	if(strcmp(session, j->session))
+	{
+		free_w(&session);
+		old_close(j);
+		return -1;
+	}
+	free_w(&session);
+	old_next(j);
+	return (long)offset;
+}
+
+static int new_open(struct journal *j, long offset)
+{
+	uint32_t stlen=sizeof(struct stat);
+	uint64_t off=offset;
+	if(!(j->newpath=prepend_s(j->dir, JOURNAL_SCAN))
+	  || !(j->newtmp=prepend_s(j->dir, JOURNAL_SCAN_TMP)))
+		return -1;
+	if(!(j->newfp=fopen(j->newtmp, "wb")))
+	{
+		logp("Could not open %s: %s\n", j->newtmp, strerror(errno));
+		return -1;
+	}
+	if(write_all(j->newfp, SCAN_MAGIC, SCAN_MAGIC_LEN)
+	  || write_all(j->newfp, &stlen, sizeof(stlen))
+	  || write_str(j->newfp, j->session)
+	  || write_all(j->newfp, &off, sizeof(off)))
+	{
+		logp("Could not write to %s\n", j->newtmp);
+		return -1;
+	}
+	return 0;
+}
+
+// Asks the watcher to put a line in the journal, so that the scan knows that
+// everything that happened before now is in there.
+static int send_sync(struct journal *j, char *token, size_t len)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	char *tmp=NULL;
+	char *path=NULL;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	snprintf(token, len, "%d.%ld.%ld", (int)getpid(),
+		(long)tv.tv_sec, (long)tv.tv_usec);
+	if(!(tmp=prepend_s(j->dir, JOURNAL_SYNC_TMP))
+	  || !(path=prepend_s(j->dir, JOURNAL_SYNC)))
+		goto end;
+	if(!(fp=fopen(tmp, "w")))
+	{
+		logp("Could not open %s: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+	fprintf(fp, "%s\n", token);
+	if(close_fp(&fp)) goto end;
+	if(rename(tmp, path))
+	{
+		logp("Could not rename %s to %s: %s\n",
+			tmp, path, strerror(errno));
+		goto end;
+	}
+	ret=0;
+end:
+	free_w(&tmp);
+	free_w(&path);
+	return ret;
+}
+
+// Reads the journal up to the line for our sync. The lines from 'from'
+// onwards are what has changed since the previous scan.
+static int read_journal(struct journal *j, FILE *fp, const char *path,
+	const char *token, long *ready, long *synced)
+{
+	int ret=-1;
+	long pos;
+	long from=-1;
+	int reset=0;
+	size_t alloc=0;
+	ssize_t len;
+	char *line=NULL;
+	time_t deadline=time(NULL)+JOURNAL_SYNC_WAIT;
+
+	*ready=-1;
+	*synced=-1;
+	while(1)
+	{
+		pos=ftell(fp);
+		if((len=getline(&line, &alloc, fp))<=0
+		  || line[len-1]!='\n')
+		{
+			struct stat statp;
+			struct stat now;
+			// Wait for the watcher to write some more, unless
+			// it has started a new journal.
+			if(time(NULL)>=deadline
+			  || fstat(fileno(fp), &statp)
+			  || stat(path, &now)
+			  || now.st_ino!=statp.st_ino
+			  || now.st_dev!=statp.st_dev)
+				goto end;
+			clearerr(fp);
+			fseek(fp, pos, SEEK_SET);
+			usleep(100000);
+			continue;
+		}
+		line[len-1]='\0';
+
+		if(!pos)
+		{
+			if(line[0]!=J_SESSION || line[1]!=' ')
+				goto end;
+			if(!(j->session=strdup_w(line+2, __func__)))
+				goto end;
+			// Now the old cache can be checked.
+			from=old_open(j);
+			continue;
+		}
+		switch(line[0])
+		{
+			case J_ROOT:
+				if(add_str(&j->roots, &j->nroots, line+2))
+					goto end;
+				break;
+			case J_READY:
+				*ready=ftell(fp);
+				break;
+			case J_SYNC:
+				if(strcmp(line+2, token)) break;
+				*synced=ftell(fp);
+				ret=0;
+				goto end;
+			case J_DIR:
+				if(from<0 || pos<from) break;
+				if(add_str(&j->dirs, &j->ndirs, line+2))
+					goto end;
+				break;
+			case J_TREE:
+				if(from<0 || pos<from) break;
+				if(add_str(&j->trees, &j->ntrees, line+2))
+					goto end;
+				break;
+			case J_INODE:
+				if(from<0 || pos<from) break;
+				if(add_inode(j, line+2))
+					goto end;
+				break;
+			case J_UNLINK:
+				if(pos>=from) j->unlinked=1;
+				break;
+			case J_RESET:
+				if(pos>=from) reset=1;
+				break;
+		}
+	}
+end:
+	// The old cache is only good if the watcher was ready before the
+	// previous scan started, and has not missed anything since.
+	if(ret || reset || from<0 || *ready<0 || *ready>from)
+		old_close(j);
+	free(line);
+	return ret;
+}
+
+struct journal *journal_open(struct conf **confs)
+{
+	long ready;
+	long synced;
+	FILE *fp=NULL;
+	char *path=NULL;
+	char token[64];
+	struct journal *j=NULL;
+	const char *dir=get_string(confs[OPT_JOURNAL_DIR]);
+
+	if(!dir) return NULL;
+
+	if(!(path=prepend_s(dir, JOURNAL_LOCK)))
+		goto error;
+	if(!lock_test(path))
+	{
+		logp("Journal watcher is not running\n");
+		goto error;
+	}
+	free_w(&path);
+
+	if(!(j=(struct journal *)calloc_w(1, sizeof(struct journal),
+		__func__)))
+			goto error;
+	j->dir=dir;
+
+	if(!(path=prepend_s(dir, JOURNAL_FILE)))
+		goto error;
+	if(!(fp=fopen(path, "r")))
+	{
+		logp("Could not open %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	if(send_sync(j, token, sizeof(token))
+	  || read_journal(j, fp, path, token, &ready, &synced))
+	{
+		logp("Could not sync with the journal watcher\n");
+		goto error;
+	}
+	close_fp(&fp);
+	free_w(&path);
+
+	if(j->ndirs) qsort(j->dirs, j->ndirs, sizeof(char *), str_cmp);
+	if(j->ntrees) qsort(j->trees, j->ntrees, sizeof(char *), str_cmp);
+	if(j->ninodes) qsort(j->inodes, j->ninodes, sizeof(struct inode),
+		inode_cmp);
+
+	if(ready<0)
+		logp("Journal watcher is not ready yet\n");
+	else if(new_open(j, synced))
+		goto error;
+	if((j->use_old=(j->oldfp!=NULL)))
+		logp("Using the journal: %d changed directories, %d changed trees\n", j->ndirs, j->ntrees);
+	else
+		logp("Not using the journal for this scan\n");
+	return j;
+error:
+	close_fp(&fp);
+	free_w(&path);
+	journal_free(&j);
+	return NULL;
+}
+
+int journal_close(struct journal *j)
+{
+	uint32_t end=0;
+	if(!j || !j->newfp) return 0;
+	// The next scan trusts whatever is in it.
+	if(write_all(j->newfp, &end, sizeof(end))
+	  || fflush(j->newfp)
+	  || fsync(fileno(j->newfp))
+	  || close_fp(&j->newfp))
+	{
+		logp("Could not write %s\n", j->newtmp);
+		return -1;
+	}
+	if(rename(j->newtmp, j->newpath))
+	{
+		logp("Could not rename %s to %s: %s\n",
+			j->newtmp, j->newpath, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void journal_free(struct journal **journal)
+{
+	struct journal *j;
+	if(!journal || !(j=*journal)) return;
+	old_close(j);
+	if(j->newfp)
+	{
+		close_fp(&j->newfp);
+		unlink(j->newtmp);
+	}
+	free_w(&j->newpath);
+	free_w(&j->newtmp);
+	free_w(&j->session);
+	free_strs(&j->roots, &j->nroots);
+	free_strs(&j->dirs, &j->ndirs);
+	free_strs(&j->trees, &j->ntrees);
+	free_v((void **)&j->inodes);
+	free_v((void **)journal);
+}
+
+struct prefix
+{
+	const char *str;
+	size_t len;
+};
+
+static int prefix_cmp(const void *a, const void *b)
+{
+	int r;
+	const struct prefix *p=(const struct prefix *)a;
+	const char *s=*(char **)b;
+	if((r=strncmp(p->str, s, p->len))) return r;
+	return s[p->len]?-1:0;
+}
+
+// Called from the walker threads, so it must not allocate anything.
+int journal_is_clean(struct journal *journal, const char *path)
+{
+	int i;
+	struct prefix p;
+
+	if(!journal || !journal->use_old) return 0;
+	if(is_subdir(journal->dir, path)) return 0;
+	for(i=0; i<journal->nroots; i++)
+		if(is_subdir(journal->roots[i], path)) break;
+	if(i==journal->nroots) return 0;
+
+	if(journal->ndirs && bsearch(&path, journal->dirs, journal->ndirs,
+		sizeof(char *), str_cmp))
+			return 0;
+
+	// Is it, or anything above it, a changed tree?
+	p.str=path;
+	for(p.len=1; journal->ntrees && p.str[p.len-1]; p.len++)
+	{
+		if(p.str[p.len] && p.str[p.len]!='/') continue;
+		if(bsearch(&p, journal->trees, journal->ntrees,
+			sizeof(char *), prefix_cmp))
+				return 0;
+	}
+	return 1;
+}
+
+static int load_list(struct journal *j, const char *path,
+	struct walk_list **list)
+{
+	int i;
+	uint8_t noopen;
+	uint32_t count;
+	size_t names_len=0;
+	size_t longest=0;
+	size_t plen=strlen(path);
+	char *fullpath=NULL;
+	struct walk_list *l;
+
+	// Like walk_read(), this uses plain malloc().
+	if(!(l=(struct walk_list *)calloc(1, sizeof(struct walk_list)))
+	  || read_all(j->oldfp, &noopen, sizeof(noopen))
+	  || read_all(j->oldfp, &count, sizeof(count))
+	  || !(l->ents=(struct walk_ent *)
+		calloc(count?count:1, sizeof(struct walk_ent)))
+	  || !(l->names=(char *)
+		malloc(j->oldlen-sizeof(noopen)-sizeof(count)+1)))
+			goto error;
+	l->noopen=noopen;
+
+	for(i=0; i<(int)count; i++)
+	{
+		uint16_t nlen;
+		struct walk_ent *e=&l->ents[i];
+		if(read_all(j->oldfp, &nlen, sizeof(nlen))
+		  || read_all(j->oldfp, l->names+names_len, nlen)
+		  || read_all(j->oldfp, &e->stat_done, sizeof(e->stat_done)))
+			goto error;
+		e->name=l->names+names_len;
+		e->name[nlen]='\0';
+		names_len+=nlen+1;
+		if(nlen>longest) longest=nlen;
+		if(!e->stat_done) continue;
+		if(read_all(j->oldfp, &e->stat_ret, sizeof(e->stat_ret))
+		  || read_all(j->oldfp, &e->statp, sizeof(e->statp)))
+			goto error;
+	}
+	l->count=count;
+
+	// Nothing in the directory has changed, so the entries are used as
+	// they are, apart from files with other hard links that have been
+	// changed through one of those.
+	for(i=0; i<l->count; i++)
+	{
+		struct inode ino;
+		struct walk_ent *e=&l->ents[i];
+		if(!e->stat_done
+		  || e->stat_ret
+		  || S_ISDIR(e->statp.st_mode)
+		  || e->statp.st_nlink<2)
+			continue;
+		ino.dev=e->statp.st_dev;
+		ino.ino=e->statp.st_ino;
+		if(!j->unlinked
+		  && !(j->ninodes && bsearch(&ino, j->inodes, j->ninodes,
+			sizeof(struct inode), inode_cmp)))
+				continue;
+		if(!fullpath && !(fullpath=(char *)
+			malloc(plen+longest+2)))
+				goto error;
+		snprintf(fullpath, plen+longest+2, "%s/%s",
+			path, e->name);
+		e->stat_ret=lstat(fullpath, &e->statp);
+	}
+	free(fullpath);
+	*list=l;
+	return 0;
+error:
+	free(fullpath);
+	walk_list_free(&l);
+	return -1;
+}
+
+int journal_get(struct journal *journal, const char *path,
+	struct walk_list **list)
+{
+	int cmp=1;
+
+	*list=NULL;
+	if(!journal || !journal->oldfp) return 0;
+
+	while(journal->oldfp
+	  && (cmp=pathcmp(journal->oldpath, path))<0)
+	{
+		if(fseeko(journal->oldfp, journal->oldlen, SEEK_CUR))
+			old_close(journal);
+		else
+			old_next(journal);
+	}
+	if(!journal->oldfp || cmp) return 0;
+	if(!journal_is_clean(journal, path))
+		return 0;
+
+	if(load_list(journal, path, list))
+	{
+		// Carry on without it.
+		logp("Could not read the scan cache at %s\n", path);
+		old_close(journal);
+		return 0;
+	}
+	old_next(journal);
+	return 0;
+}
+
+int journal_put(struct journal *journal, const char *path,
+	struct walk_list *list)
+{
+	int i;
+	uint64_t len;
+	uint32_t count;
+	FILE *fp;
+
+	if(!journal || !(fp=journal->newfp)) return 0;
+
+	len=sizeof(list->noopen)+sizeof(count);
+	for(i=0; i<list->count; i++)
+	{
+		struct walk_ent *e=&list->ents[i];
+		len+=sizeof(uint16_t)+strlen(e->name)+sizeof(e->stat_done);
+		if(e->stat_done)
+			len+=sizeof(e->stat_ret)+sizeof(e->statp);
+	}
+	count=list->count;
+	if(write_str(fp, path)
+	  || write_all(fp, &len, sizeof(len))
+	  || write_all(fp, &list->noopen, sizeof(list->noopen))
+	  || write_all(fp, &count, sizeof(count)))
+		goto error;
+	for(i=0; i<list->count; i++)
+	{
+		struct walk_ent *e=&list->ents[i];
+		uint16_t nlen=strlen(e->name);
+		if(write_all(fp, &nlen, sizeof(nlen))
+		  || write_all(fp, e->name, nlen)
+		  || write_all(fp, &e->stat_done, sizeof(e->stat_done)))
+			goto error;
+		if(!e->stat_done) continue;
+		if(write_all(fp, &e->stat_ret, sizeof(e->stat_ret))
+		  || write_all(fp, &e->statp, sizeof(e->statp)))
+			goto error;
+	}
+	return 0;
+error:
+	logp("Could not write to %s\n", journal->newtmp);
+	// Leave it out, rather than fail the backup.
+	close_fp(&journal->newfp);
+	unlink(journal->newtmp);
+	return 0;
+}
+
+#else
+
+int journal_watch(struct conf **confs)
+{
+	logp("The journal watcher is not supported on this platform\n");
+	return -1;
+}
+
+struct journal *journal_open(struct conf **confs)
+{
+	return NULL;
+}
+
+int journal_close(struct journal *journal)
+{
+	return 0;
+}
+
+void journal_free(struct journal **journal)
+{
+}
+
+int journal_is_clean(struct journal *journal, const char *path)
+{
+	return 0;
+}
+
+int journal_get(struct journal *journal, const char *path,
+	struct walk_list **list)
+{
+	*list=NULL;
+	return 0;
+}
+
+int journal_put(struct journal *journal, const char *path,
+	struct walk_list *list)
+{
+	return 0;
+}
+
+#endif
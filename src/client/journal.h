@@ -0,0 +1,46 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+// Lets the phase1 scan skip the directories that have not changed since the
+// previous scan.
+//
+// 'burp -a journal' stays running and watches the directories in the
+// include list with inotify. Whenever something changes in a directory, it
+// adds the directory to a journal in journal_dir. The phase1 scan keeps the
+// entries of every directory that it reads in a cache in journal_dir. The
+// next scan takes a directory from the cache instead of reading it again,
+// unless the journal says that it has changed since, and does not look at
+// the entries in it again either. The exceptions are files with other hard
+// links that the watcher has seen change. Writes through a shared mmap()
+// make no inotify events, so they are not seen until something else changes
+// in the directory.
+//
+// If the watcher is not running, has been restarted since the previous
+// scan, or might have missed something, the cache is not used and the scan
+// reads everything, as usual.
+
+struct journal;
+struct walk_list;
+
+// Runs the watcher. Only returns on error.
+extern int journal_watch(struct conf **confs);
+
+// Returns NULL if the journal cannot be used for this scan.
+extern struct journal *journal_open(struct conf **confs);
+// Keeps the new cache. Call after the scan has finished without errors.
+extern int journal_close(struct journal *journal);
+// Throws away the new cache, unless journal_close() was called first.
+extern void journal_free(struct journal **journal);
+
+// Whether the cache may be used for 'path'. Safe to call from any thread.
+extern int journal_is_clean(struct journal *journal, const char *path);
+// Gets the entries of 'path' from the previous scan, if they are still
+// good. Otherwise, 'list' is left NULL. The scan must ask for directories
+// in the order that it goes through them.
+extern int journal_get(struct journal *journal, const char *path,
+	struct walk_list **list);
+// Adds the entries of 'path' to the new cache.
+extern int journal_put(struct journal *journal, const char *path,
+	struct walk_list *list);
+
+#endif
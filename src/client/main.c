@@ -364,6 +364,13 @@ static enum cliret do_client(struct conf **confs,
 		goto end;
 	}
 
+	// The journal watcher runs by itself, without the server.
+	if(action==ACTION_JOURNAL)
+	{
+		if(journal_watch(confs)) ret=CLIENT_ERROR;
+		goto end;
+	}
+
 	if(!(cntr=cntr_alloc())
 	  || cntr_init(cntr, get_string(confs[OPT_CNAME]))) goto error;
 	set_cntr(confs[OPT_CNTR], cntr);
@@ -0,0 +1,426 @@
+#include "include.h"
+#include "../regexp.h"
+#include "matcher.h"
+
+#include <ctype.h>
+
+// A set of extensions, compared without regard to case.
+struct extset
+{
+	// How many characters from the end of the name to look through for
+	// the '.'. This is the flag of the first item of the list.
+	long limit;
+	// Open addressing. The strings belong to the config.
+	const char **slots;
+	size_t mask;
+};
+
+// One component of the include/exclude directory paths. A rule that is
+// just the path down to here is kept in 'exact', and one that is the same
+// with a '/' on the end is kept in 'slash'. The rules matter in the order
+// that they come in the config, so 'order' is where they were in the list.
+struct dir_rule
+{
+	int set;
+	int order;
+	long flag;
+};
+
+struct dir_node
+{
+	const char *name;
+	size_t len;
+	struct dir_rule exact;
+	struct dir_rule slash;
+	// In order of length, then memcmp().
+	struct dir_node **kids;
+	int nkids;
+};
+
+struct matcher
+{
+	struct extset *incext;
+	struct extset *excext;
+	struct extset *excom;
+	struct dir_node *dirs;
+	// All the exclude regexes in one. If they could not be joined,
+	// this is NULL and 'excreg' is gone through as usual.
+	regex_t *excreg_set;
+	struct strlist *excreg;
+};
+
+static uint32_t ext_hash(const char *ext)
+{
+	// FNV-1a.
+	uint32_t h=2166136261U;
+	for(; *ext; ext++)
+	{
+		h^=(uint8_t)tolower((unsigned char)*ext);
+		h*=16777619U;
+	}
+	return h;
+}
+
+static void extset_free(struct extset **extset)
+{
+	if(!extset || !*extset) return;
+	free_v((void **)&(*extset)->slots);
+	free_v((void **)extset);
+}
+
+static struct extset *extset_alloc(struct strlist *list)
+{
+	size_t n=0;
+	size_t size=8;
+	struct strlist *l;
+	struct extset *extset=NULL;
+
+	if(!list) return NULL;
+	for(l=list; l; l=l->next) n++;
+	while(size<n*2) size<<=1;
+
+	if(!(extset=(struct extset *)
+		calloc_w(1, sizeof(struct extset), __func__))
+	  || !(extset->slots=(const char **)
+		calloc_w(size, sizeof(char *), __func__)))
+	{
+		extset_free(&extset);
+		return NULL;
+	}
+	extset->limit=list->flag;
+	extset->mask=size-1;
+	for(l=list; l; l=l->next)
+	{
+		size_t i=ext_hash(l->path)&extset->mask;
+		for(; extset->slots[i]; i=(i+1)&extset->mask)
+			if(!strcasecmp(extset->slots[i], l->path)) break;
+		extset->slots[i]=l->path;
+	}
+	return extset;
+}
+
+// Gives the extension of 'fname', found the same way as it always has
+// been - after the last '.' in the last 'limit' characters. NULL if there
+// is no '.' there.
+static const char *get_ext(const char *fname, long limit)
+{
+	long i=0;
+	const char *cp=NULL;
+	for(cp=fname+strlen(fname)-1; i<limit && cp>=fname; cp--, i++)
+		if(*cp=='.') return cp+1;
+	return NULL;
+}
+
+static int extset_has(struct extset *extset, const char *ext)
+{
+	size_t i=ext_hash(ext)&extset->mask;
+	for(; extset->slots[i]; i=(i+1)&extset->mask)
+		if(!strcasecmp(extset->slots[i], ext)) return 1;
+	return 0;
+}
+
+static void dir_node_free(struct dir_node **node)
+{
+	int i;
+	if(!node || !*node) return;
+	for(i=0; i<(*node)->nkids; i++)
+		dir_node_free(&(*node)->kids[i]);
+	free_v((void **)&(*node)->kids);
+	free_v((void **)node);
+}
+
+static int kid_cmp(struct dir_node *kid, const char *name, size_t len)
+{
+	if(kid->len!=len) return kid->len<len?-1:1;
+	return memcmp(kid->name, name, len);
+}
+
+// Returns the position of the kid called 'name', or where it would go.
+static int find_kid(struct dir_node *node, const char *name, size_t len,
+	int *found)
+{
+	int lo=0;
+	int hi=node->nkids;
+	while(lo<hi)
+	{
+		int mid=lo+(hi-lo)/2;
+		int c=kid_cmp(node->kids[mid], name, len);
+		if(!c)
+		{
+			*found=1;
+			return mid;
+		}
+		if(c<0) lo=mid+1;
+		else hi=mid;
+	}
+	*found=0;
+	return lo;
+}
+
+static struct dir_node *add_kid(struct dir_node *node,
+	const char *name, size_t len)
+{
+	int i;
+	int found=0;
+	struct dir_node *kid=NULL;
+	struct dir_node **kids=NULL;
+
+	i=find_kid(node, name, len, &found);
+	if(found) return node->kids[i];
+
+	if(!(kid=(struct dir_node *)
+		calloc_w(1, sizeof(struct dir_node), __func__))
+	  || !(kids=(struct dir_node **)realloc_w(node->kids,
+		(node->nkids+1)*sizeof(struct dir_node *), __func__)))
+	{
+		free_v((void **)&kid);
+		return NULL;
+	}
+	kid->name=name;
+	kid->len=len;
+	node->kids=kids;
+	memmove(node->kids+i+1, node->kids+i,
+		(node->nkids-i)*sizeof(struct dir_node *));
+	node->kids[i]=kid;
+	node->nkids++;
+	return kid;
+}
+
+// is_subdir() treats 'dir' as a list of components split on '/', except
+// that one with a '/' on the end also takes anything that carries on after
+// that '/'.
+static int dir_add(struct dir_node *root, struct strlist *l, int order)
+{
+	size_t plen=strlen(l->path);
+	const char *cp=l->path;
+	const char *end=NULL;
+	struct dir_node *node=root;
+	struct dir_rule *rule=NULL;
+
+	if(plen && l->path[plen-1]=='/') plen--;
+	end=l->path+plen;
+	while(1)
+	{
+		const char *slash;
+		if(!(slash=(const char *)memchr(cp, '/', end-cp))) slash=end;
+		if(!(node=add_kid(node, cp, slash-cp))) return -1;
+		if(slash==end) break;
+		cp=slash+1;
+	}
+	rule=(end==l->path+strlen(l->path))?&node->exact:&node->slash;
+	// The first one in the list wins, as before.
+	if(rule->set) return 0;
+	rule->set=1;
+	rule->order=order;
+	rule->flag=l->flag;
+	return 0;
+}
+
+static struct dir_node *dirs_alloc(struct strlist *list)
+{
+	int order=0;
+	struct strlist *l;
+	struct dir_node *root=NULL;
+
+	if(!(root=(struct dir_node *)
+		calloc_w(1, sizeof(struct dir_node), __func__)))
+			return NULL;
+	for(l=list; l; l=l->next)
+	{
+		if(dir_add(root, l, order++))
+		{
+			dir_node_free(&root);
+			return NULL;
+		}
+	}
+	return root;
+}
+
+static void try_rule(struct dir_rule *rule, int count,
+	int *best_count, int *best_order, long *flag)
+{
+	if(!rule->set) return;
+	if(count<*best_count
+	  || (count==*best_count && rule->order>*best_order))
+		return;
+	*best_count=count;
+	*best_order=rule->order;
+	*flag=rule->flag;
+}
+
+// Gives the same answer as going through the list with is_subdir() and
+// taking the flag of the first one with the highest count.
+static long dirs_match(struct dir_node *root, const char *fname)
+{
+	int count=0;
+	long flag=0;
+	int found=0;
+	int best_order=0;
+	int best_count=0;
+	const char *cp=fname;
+	struct dir_node *node=root;
+
+	while(1)
+	{
+		int i;
+		const char *slash;
+		if(!(slash=strchr(cp, '/'))) slash=cp+strlen(cp);
+		i=find_kid(node, cp, slash-cp, &found);
+		if(!found) break;
+		node=node->kids[i];
+		count++;
+		try_rule(&node->exact, count,
+			&best_count, &best_order, &flag);
+		if(!*slash) break;
+		try_rule(&node->slash, count+1,
+			&best_count, &best_order, &flag);
+		cp=slash+1;
+	}
+	return flag;
+}
+
+// Whether 'str' can go inside brackets without changing what it means -
+// every ')' outside of a bracket expression has its own '(', and nothing
+// refers back to a group, as the numbers would change.
+static int regex_can_join(const char *str)
+{
+	int depth=0;
+	const char *cp;
+	for(cp=str; *cp; cp++)
+	{
+		switch(*cp)
+		{
+			case '\\':
+				if(!*(cp+1)
+				  || isdigit((unsigned char)*(cp+1)))
+					return 0;
+				cp++;
+				break;
+			case '[':
+				// A ']' straight after the '[' or '[^' is
+				// part of the list.
+				cp++;
+				if(*cp=='^') cp++;
+				if(*cp==']') cp++;
+				for(; *cp && *cp!=']'; cp++) { }
+				if(!*cp) return 0;
+				break;
+			case '(':
+				depth++;
+				break;
+			case ')':
+				if(--depth<0) return 0;
+				break;
+		}
+	}
+	return !depth;
+}
+
+// Joins the regexes into '(a)|(b)|...'. This is not done if one of them
+// was empty, which always matches, or cannot go inside brackets.
+static int excreg_join(struct matcher *matcher)
+{
+	int ret=-1;
+	size_t len=0;
+	char *str=NULL;
+	struct strlist *l;
+
+	for(l=matcher->excreg; l; l=l->next)
+	{
+		if(!l->re || !regex_can_join(l->path)) return 0;
+		len+=strlen(l->path)+3;
+	}
+	if(!len) return 0;
+	if(!(str=(char *)malloc_w(len+1, __func__)))
+		goto end;
+	*str='\0';
+	for(l=matcher->excreg; l; l=l->next)
+	{
+		if(l!=matcher->excreg) strcat(str, "|");
+		strcat(str, "(");
+		strcat(str, l->path);
+		strcat(str, ")");
+	}
+	// If it does not compile for some reason, they will be done one at
+	// a time.
+	compile_regex_nosub(&matcher->excreg_set, str);
+	ret=0;
+end:
+	free_w(&str);
+	return ret;
+}
+
+static int excreg_match(struct matcher *matcher, const char *fname)
+{
+	struct strlist *l;
+	if(matcher->excreg_set)
+		return check_regex(matcher->excreg_set, fname);
+	for(l=matcher->excreg; l; l=l->next)
+		if(check_regex(l->re, fname))
+			return 1;
+	return 0;
+}
+
+void matcher_free(struct matcher **matcher)
+{
+	if(!matcher || !*matcher) return;
+	extset_free(&(*matcher)->incext);
+	extset_free(&(*matcher)->excext);
+	extset_free(&(*matcher)->excom);
+	dir_node_free(&(*matcher)->dirs);
+	regex_free(&(*matcher)->excreg_set);
+	free_v((void **)matcher);
+}
+
+struct matcher *matcher_alloc(struct conf **confs)
+{
+	struct strlist *incext=get_strlist(confs[OPT_INCEXT]);
+	struct strlist *excext=get_strlist(confs[OPT_EXCEXT]);
+	struct strlist *excom=get_strlist(confs[OPT_EXCOM]);
+	struct matcher *matcher=NULL;
+
+	if(!(matcher=(struct matcher *)
+		calloc_w(1, sizeof(struct matcher), __func__)))
+			return NULL;
+	matcher->excreg=get_strlist(confs[OPT_EXCREG]);
+	if((incext && !(matcher->incext=extset_alloc(incext)))
+	  || (excext && !(matcher->excext=extset_alloc(excext)))
+	  || (excom && !(matcher->excom=extset_alloc(excom)))
+	  || !(matcher->dirs=dirs_alloc(get_strlist(confs[OPT_INCEXCDIR])))
+	  || excreg_join(matcher))
+		matcher_free(&matcher);
+	return matcher;
+}
+
+int matcher_is_included(struct matcher *matcher, const char *fname)
+{
+	const char *ext;
+	if(matcher->excext
+	  && (ext=get_ext(fname, matcher->excext->limit))
+	  && extset_has(matcher->excext, ext))
+		return 0;
+	if(excreg_match(matcher, fname))
+		return 0;
+	return dirs_match(matcher->dirs, fname);
+}
+
+int matcher_include_ext(struct matcher *matcher, const char *fname)
+{
+	const char *ext;
+	// If not doing include_ext, let the file get backed up.
+	if(!matcher->incext) return 1;
+	// If the file has no extension, it cannot be included.
+	if(!(ext=get_ext(fname, matcher->incext->limit))) return 0;
+	return extset_has(matcher->incext, ext);
+}
+
+int matcher_exclude_comp(struct matcher *matcher, const char *fname,
+	int compression)
+{
+	const char *ext;
+	if(!compression || !matcher->excom) return compression;
+	if((ext=get_ext(fname, matcher->excom->limit))
+	  && extset_has(matcher->excom, ext))
+		return 0;
+	return compression;
+}
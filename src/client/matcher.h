@@ -0,0 +1,29 @@
+#ifndef _MATCHER_H
+#define _MATCHER_H
+
+// The include/exclude settings that get checked for every file in the scan,
+// compiled once per backup so that each check no longer has to go through
+// all of the rules one by one:
+// - the include and exclude directories become a trie of path components,
+//   so that the closest one is found in a single pass along the path,
+// - each list of extensions becomes a hash table,
+// - the exclude regexes are joined into a single regex.
+// The answers are the same as going through the lists in the config.
+// Nothing changes after matcher_alloc(), so the checks may be made from any
+// thread.
+
+struct matcher;
+
+extern struct matcher *matcher_alloc(struct conf **confs);
+extern void matcher_free(struct matcher **matcher);
+
+// Return 1 to include the file, 0 to exclude it. Does not look at the
+// include_ext list.
+extern int matcher_is_included(struct matcher *matcher, const char *fname);
+// Return 1 to include the file, 0 to exclude it.
+extern int matcher_include_ext(struct matcher *matcher, const char *fname);
+// Returns the level of compression.
+extern int matcher_exclude_comp(struct matcher *matcher, const char *fname,
+	int compression);
+
+#endif
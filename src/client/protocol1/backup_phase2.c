@@ -1,7 +1,7 @@
 #include "include.h"
 #include "../../cmd.h"
 
-static int load_signature(struct asfd *asfd,
+static int read_signature(struct asfd *asfd,
 	rs_signature_t **sumset, struct conf **confs)
 {
 	rs_result r;
@@ -14,11 +14,17 @@ static int load_signature(struct asfd *asfd,
 		rs_free_sumset(*sumset);
 		return r;
 	}
-	if((r=rs_build_hash_table(*sumset))) return r;
 	rs_job_free(job);
 	return r;
 }
 
+static int load_signature(struct asfd *asfd,
+	rs_signature_t **sumset, struct conf **confs)
+{
+	if(read_signature(asfd, sumset, confs)) return -1;
+	return rs_build_hash_table(*sumset);
+}
+
 static int load_signature_and_send_delta(struct asfd *asfd,
 	BFILE *bfd, unsigned long long *bytes, unsigned long long *sentbytes,
 	struct conf **confs)
@@ -127,7 +133,7 @@ static int forget_file(struct asfd *asfd, struct sbuf *sb, struct conf **confs)
 		rs_signature_t *sumset=NULL;
 		// The server will be sending us a signature.
 		// Munch it up then carry on.
-		if(load_signature(asfd, &sumset, confs)) return -1;
+		if(read_signature(asfd, &sumset, confs)) return -1;
 		else rs_free_sumset(sumset);
 	}
 	return 0;
@@ -154,21 +160,118 @@ static int size_checks(struct asfd *asfd, struct sbuf *sb, struct conf **confs)
 	return 0;
 }
 
+// Anything other than a delta has to wait until the deltas before it have
+// gone.
+static int flush_deltas(struct asfd *asfd,
+	struct deltas *deltas, struct conf **confs)
+{
+#ifndef HAVE_WIN32
+	if(deltas) return deltas_send(deltas, asfd, 1, confs);
+#endif
+	return 0;
+}
+
+static int read_request(struct asfd *asfd,
+	struct deltas *deltas, struct conf **confs)
+{
+#ifndef HAVE_WIN32
+	if(deltas) return deltas_read(deltas, asfd, confs);
+#endif
+	return asfd->read(asfd);
+}
+
+static int is_meta(struct sbuf *sb)
+{
+	return sb->path.cmd==CMD_METADATA
+	  || sb->path.cmd==CMD_ENC_METADATA;
+}
+
+// Refer the server back to the same extra meta data, sent earlier on, as
+// its number and length.
+static int send_meta_ref(struct asfd *asfd, struct sbuf *sb,
+	int ref, size_t elen, struct conf **confs)
+{
+	char buf[64]="";
+	snprintf(buf, sizeof(buf), "%d:%lu", ref, (unsigned long)elen);
+	if(asfd->write(asfd, &sb->attr)
+	  || asfd->write(asfd, &sb->path)
+	  || asfd->write_str(asfd, CMD_META_REF, buf))
+		return -1;
+	cntr_add(get_cntr(confs[OPT_CNTR]), sb->path.cmd, 1);
+	cntr_add_bytes(get_cntr(confs[OPT_CNTR]), elen);
+	cntr_add_sentbytes(get_cntr(confs[OPT_CNTR]), strlen(buf));
+	return 0;
+}
+
+// Whole files that were read ahead have to be taken in order, whether or
+// not they end up getting used.
+static int take_prefetched(struct sbuf *sb, struct prefetch *prefetch,
+	char **mem, size_t *memlen, struct stat *statp)
+{
+	if(!prefetch
+	  || (sb->path.cmd!=CMD_FILE && sb->path.cmd!=CMD_ENC_FILE)
+	  || sb->protocol1->datapth.buf)
+		return 0;
+	return prefetch_take(prefetch, sb->path.buf, mem, memlen, statp);
+}
+
+#ifndef HAVE_WIN32
+// The file should not have changed since it was read ahead. 'memstat' is
+// what fstat() said before the read, so look at the file as it is now.
+static int unchanged_since_read(const char *path, struct stat *memstat)
+{
+	struct stat statp;
+	if(lstat(path, &statp)) return 0;
+	return statp.st_dev==memstat->st_dev
+	  && statp.st_ino==memstat->st_ino
+	  && statp.st_size==memstat->st_size
+	  && statp.st_mtime==memstat->st_mtime
+	  && statp.st_ctime==memstat->st_ctime
+#ifdef HAVE_LINUX_OS
+	  // A change within the same second.
+	  && statp.st_mtim.tv_nsec==memstat->st_mtim.tv_nsec
+	  && statp.st_ctim.tv_nsec==memstat->st_ctim.tv_nsec
+#endif
+	  ;
+}
+#endif
+
 static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
-	BFILE *bfd, struct conf **confs)
+	BFILE *bfd, struct deltas *deltas, struct metacache *metacache,
+	struct prefetch *prefetch, struct conf **confs)
 {
 	int ret=-1;
+	int ref=-1;
 	int forget=0;
 	size_t elen=0;
 	char *extrameta=NULL;
+	char *mem=NULL;
+	size_t memlen=0;
+	struct stat memstat;
 	unsigned long long bytes=0;
 	int conf_compression=get_int(confs[OPT_COMPRESSION]);
+	BFILE *dbfd=NULL;
 
 	sb->compression=conf_compression;
+	throttle_wait();
 
 	iobuf_copy(&sb->path, asfd->rbuf);
 	iobuf_init(asfd->rbuf);
 
+	if(take_prefetched(sb, prefetch, &mem, &memlen, &memstat)<0)
+		goto error;
+
+	if(deltas
+	  && sb->path.cmd==CMD_FILE
+	  && sb->protocol1->datapth.buf)
+	{
+		// The delta gets worked out on another thread, after this
+		// function returns, so it needs a bfd of its own.
+		if(!(dbfd=bfile_alloc())) goto error;
+		bfile_init(dbfd, 0, confs);
+		bfd=dbfd;
+	}
+
 #ifdef HAVE_WIN32
 	if(win32_lstat(sb->path.buf, &sb->statp, &sb->winattr))
 #else
@@ -176,7 +279,8 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 #endif
 	{
 		logw(asfd, confs, "Path has vanished: %s", sb->path.buf);
-		if(forget_file(asfd, sb, confs)) goto error;
+		if(flush_deltas(asfd, deltas, confs)
+		  || forget_file(asfd, sb, confs)) goto error;
 		goto end;
 	}
 
@@ -186,8 +290,18 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 		sb->path.buf, conf_compression);
 	if(attribs_encode(sb)) goto error;
 
-	if(sb->path.cmd!=CMD_METADATA
-	  && sb->path.cmd!=CMD_ENC_METADATA)
+#ifndef HAVE_WIN32
+	if(mem && unchanged_since_read(sb->path.buf, &memstat))
+	{
+		// Hands over mem, whatever happens.
+		if(bfile_open_mem(bfd, asfd, sb->path.buf,
+			mem, memlen, confs))
+				forget++;
+		mem=NULL;
+	}
+	else
+#endif
+	if(!is_meta(sb))
 	{
 		if(bfd->open_for_send(bfd, asfd,
 			sb->path.buf, sb->winattr,
@@ -197,7 +311,8 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 
 	if(forget)
 	{
-		if(forget_file(asfd, sb, confs)) goto error;
+		if(flush_deltas(asfd, deltas, confs)
+		  || forget_file(asfd, sb, confs)) goto error;
 		goto end;
 	}
 
@@ -235,6 +350,19 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 		}
 	}
 
+#ifndef HAVE_WIN32
+	if(dbfd)
+	{
+		rs_signature_t *sumset=NULL;
+		if(read_signature(asfd, &sumset, confs))
+			goto error;
+		// Hands over dbfd, whatever happens.
+		bfd=NULL;
+		if(deltas_add(deltas, asfd, sb, &dbfd, sumset, confs))
+			goto error;
+	}
+	else
+#endif
 	if(sb->path.cmd==CMD_FILE
 	  && sb->protocol1->datapth.buf)
 	{
@@ -257,13 +385,22 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 			cntr_add_sentbytes(get_cntr(confs[OPT_CNTR]), sentbytes);
 		}
 	}
+	else if(metacache && extrameta && is_meta(sb)
+	  && (ref=metacache_find(metacache, sb->path.cmd,
+		sb->compression, extrameta, elen))>=0)
+	{
+		if(flush_deltas(asfd, deltas, confs)
+		  || send_meta_ref(asfd, sb, ref, elen, confs))
+			goto end;
+	}
 	else
 	{
 		//logp("need to send whole file: %s\n", sb.path);
 		// send the whole file.
 
-		if((asfd->write(asfd, &sb->attr)
-		  || asfd->write(asfd, &sb->path))
+		if(flush_deltas(asfd, deltas, confs)
+		  || asfd->write(asfd, &sb->attr)
+		  || asfd->write(asfd, &sb->path)
 		  || send_whole_file_w(asfd, sb, NULL, 0, &bytes,
 			get_string(confs[OPT_ENCRYPTION_PASSWORD]),
 			confs, sb->compression,
@@ -274,6 +411,10 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 			cntr_add(get_cntr(confs[OPT_CNTR]), sb->path.cmd, 1);
 			cntr_add_bytes(get_cntr(confs[OPT_CNTR]), bytes);
 			cntr_add_sentbytes(get_cntr(confs[OPT_CNTR]), bytes);
+			if(metacache && extrameta && is_meta(sb)
+			  && metacache_add(metacache, sb->path.cmd,
+				sb->compression, extrameta, elen))
+					goto error;
 		}
 	}
 
@@ -287,15 +428,18 @@ error:
 	// different file path, or when this function
 	// exits.
 #else
-	bfd->close(bfd, asfd);
+	if(bfd) bfd->close(bfd, asfd);
+	if(dbfd) bfile_free(&dbfd);
 #endif
 	sbuf_free_content(sb);
 	if(extrameta) free(extrameta);
+	free_w(&mem);
 	return ret;
 }
 
 static int parse_rbuf(struct asfd *asfd, struct sbuf *sb,
-	BFILE *bfd, struct conf **confs)
+	BFILE *bfd, struct deltas *deltas, struct metacache *metacache,
+	struct prefetch *prefetch, struct conf **confs)
 {
 	static struct iobuf *rbuf;
 	rbuf=asfd->rbuf;
@@ -321,7 +465,8 @@ static int parse_rbuf(struct asfd *asfd, struct sbuf *sb,
 	  || rbuf->cmd==CMD_ENC_VSS_T
 	  || rbuf->cmd==CMD_EFS_FILE)
 	{
-		if(deal_with_data(asfd, sb, bfd, confs))
+		if(deal_with_data(asfd, sb, bfd, deltas, metacache,
+			prefetch, confs))
 			return -1;
 	}
 	else if(rbuf->cmd==CMD_WARNING)
@@ -346,12 +491,25 @@ static int do_backup_phase2_client(struct asfd *asfd,
 	// data is read.
 	BFILE *bfd=NULL;
 	struct sbuf *sb=NULL;
+	struct deltas *deltas=NULL;
+	struct metacache *metacache=NULL;
+	struct prefetch *prefetch=NULL;
 	struct iobuf *rbuf=asfd->rbuf;
 
 	if(!(bfd=bfile_alloc())
 	  || !(sb=sbuf_alloc(confs)))
 		goto end;
 	bfile_init(bfd, 0, confs);
+#ifndef HAVE_WIN32
+	if(get_int(confs[OPT_DELTA_THREADS])>0
+	  && !(deltas=deltas_alloc(get_int(confs[OPT_DELTA_THREADS]))))
+		goto end;
+#endif
+	if(get_int(confs[OPT_META_REF])
+	  && !(metacache=metacache_alloc()))
+		goto end;
+	// Carries on without it, if it is not available.
+	prefetch=prefetch_alloc(get_int(confs[OPT_ATIME]));
 
 	if(!resume)
 	{
@@ -369,22 +527,32 @@ static int do_backup_phase2_client(struct asfd *asfd,
 	while(1)
 	{
 		iobuf_free_content(rbuf);
-		if(asfd->read(asfd)) goto end;
+		if(prefetch && prefetch_peek(prefetch, asfd,
+			sb->protocol1->datapth.buf!=NULL))
+				goto end;
+		if(read_request(asfd, deltas, confs)) goto end;
 		else if(!rbuf->buf) continue;
 
 		if(rbuf->cmd==CMD_GEN && !strcmp(rbuf->buf, "backupphase2end"))
 		{
-			if(asfd->write_str(asfd, CMD_GEN, "okbackupphase2end"))
+			if(flush_deltas(asfd, deltas, confs)
+			  || asfd->write_str(asfd, CMD_GEN, "okbackupphase2end"))
 				goto end;
 			ret=0;
 			break;
 		}
 
-		if(parse_rbuf(asfd, sb, bfd, confs))
+		if(parse_rbuf(asfd, sb, bfd, deltas, metacache,
+			prefetch, confs))
 			goto end;
 	}
 
 end:
+#ifndef HAVE_WIN32
+	deltas_free(&deltas);
+#endif
+	metacache_free(&metacache);
+	prefetch_free(&prefetch);
 	// It is possible for a bfd to still be open.
 	bfd->close(bfd, asfd);
 	bfile_free(&bfd);
@@ -0,0 +1,369 @@
+#include "include.h"
+#include "../../cmd.h"
+#include "../../workq.h"
+
+#ifndef HAVE_WIN32
+
+// How much of a delta is kept in memory, waiting to be sent, before its
+// worker waits for some of it to go. About 1MB.
+#define DELTA_CHUNK		ASYNC_BUF_LEN
+#define DELTA_MAX_CHUNKS	64
+
+struct delta_chunk
+{
+	char buf[DELTA_CHUNK];
+	size_t len;
+	struct delta_chunk *next;
+};
+
+struct delta_job
+{
+	struct deltas *deltas;
+	BFILE *bfd;
+	struct iobuf datapth;
+	struct iobuf attr;
+	struct iobuf path;
+	rs_signature_t *sumset;
+	rs_job_t *rsjob;
+	rs_filebuf_t *infb;
+	unsigned long long sentbytes;
+	uint8_t header_sent;
+
+	// Protected by the lock in struct deltas.
+	struct delta_chunk *head;
+	struct delta_chunk *tail;
+	int nchunks;
+	uint8_t done;
+	int ret;
+
+	// Only touched by the worker.
+	struct delta_chunk *filling;
+
+	struct delta_job *next;
+};
+
+struct deltas
+{
+	struct workq *workq;
+	// Jobs in the order that they have to be sent.
+	struct delta_job *head;
+	struct delta_job *tail;
+	uint8_t abort;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void chunks_free(struct delta_chunk *chunk)
+{
+	struct delta_chunk *next;
+	for(; chunk; chunk=next)
+	{
+		next=chunk->next;
+		free(chunk);
+	}
+}
+
+static void delta_job_free(struct delta_job **job, struct asfd *asfd)
+{
+	if(!job || !*job) return;
+	if((*job)->bfd)
+	{
+		(*job)->bfd->close((*job)->bfd, asfd);
+		bfile_free(&(*job)->bfd);
+	}
+	iobuf_free_content(&(*job)->datapth);
+	iobuf_free_content(&(*job)->attr);
+	iobuf_free_content(&(*job)->path);
+	if((*job)->infb) rs_filebuf_free((*job)->infb);
+	if((*job)->rsjob) rs_job_free((*job)->rsjob);
+	if((*job)->sumset) rs_free_sumset((*job)->sumset);
+	chunks_free((*job)->head);
+	chunks_free((*job)->filling);
+	free_v((void **)job);
+}
+
+// Hands the chunk being filled to the sending thread, waiting for room if
+// there is too much already.
+static int push_chunk(struct delta_job *job)
+{
+	int ret=-1;
+	struct deltas *deltas=job->deltas;
+	struct delta_chunk *chunk=job->filling;
+
+	pthread_mutex_lock(&deltas->lock);
+	while(job->nchunks>=DELTA_MAX_CHUNKS && !deltas->abort)
+		pthread_cond_wait(&deltas->cond, &deltas->lock);
+	if(!deltas->abort)
+	{
+		if(job->tail) job->tail->next=chunk;
+		else job->head=chunk;
+		job->tail=chunk;
+		job->nchunks++;
+		job->filling=NULL;
+		pthread_cond_broadcast(&deltas->cond);
+		ret=0;
+	}
+	pthread_mutex_unlock(&deltas->lock);
+	return ret;
+}
+
+// Works like rs_outfilebuf_drain(), except that the output goes into chunks
+// instead of a file.
+static rs_result delta_drain(rs_job_t *rsjob, rs_buffers_t *buf, void *opaque)
+{
+	struct delta_job *job=(struct delta_job *)opaque;
+	struct delta_chunk *chunk=job->filling;
+
+	if(chunk && buf->next_out)
+	{
+		if(buf->next_out<chunk->buf
+		  || buf->next_out>chunk->buf+DELTA_CHUNK)
+		{
+			logp("delta output pointer out of range in %s\n",
+				__func__);
+			return RS_IO_ERROR;
+		}
+		if(!(chunk->len=buf->next_out-chunk->buf))
+			return RS_DONE;
+		if(push_chunk(job)) return RS_IO_ERROR;
+	}
+
+	if(!(chunk=(struct delta_chunk *)malloc(sizeof(struct delta_chunk))))
+	{
+		logp("out of memory in %s\n", __func__);
+		return RS_MEM_ERROR;
+	}
+	chunk->len=0;
+	chunk->next=NULL;
+	job->filling=chunk;
+	buf->next_out=chunk->buf;
+	buf->avail_out=DELTA_CHUNK;
+	return RS_DONE;
+}
+
+static void delta_job_run(void *data)
+{
+	rs_result r;
+	rs_buffers_t rsbuf;
+	struct delta_job *job=(struct delta_job *)data;
+	struct deltas *deltas=job->deltas;
+
+	memset(&rsbuf, 0, sizeof(rsbuf));
+	if((r=rs_build_hash_table(job->sumset)))
+		logp("could not build hash table for delta: %d\n", r);
+	else if((r=rs_job_drive(job->rsjob, &rsbuf,
+		rs_infilebuf_fill, job->infb,
+		delta_drain, job))!=RS_DONE)
+			logp("delta loop returned: %d\n", r);
+
+	pthread_mutex_lock(&deltas->lock);
+	job->ret=(r==RS_DONE)?0:-1;
+	job->done=1;
+	pthread_cond_broadcast(&deltas->cond);
+	pthread_mutex_unlock(&deltas->lock);
+}
+
+struct deltas *deltas_alloc(int threads)
+{
+	struct deltas *deltas;
+	if(!(deltas=(struct deltas *)calloc_w(1, sizeof(struct deltas),
+		__func__)))
+			return NULL;
+	pthread_mutex_init(&deltas->lock, NULL);
+	pthread_cond_init(&deltas->cond, NULL);
+	if(!(deltas->workq=workq_alloc(threads, threads*2)))
+		deltas_free(&deltas);
+	return deltas;
+}
+
+void deltas_free(struct deltas **deltas)
+{
+	struct delta_job *job;
+	if(!deltas || !*deltas) return;
+
+	// Wake up any worker that is waiting for room, so that it gives up.
+	pthread_mutex_lock(&(*deltas)->lock);
+	(*deltas)->abort=1;
+	pthread_cond_broadcast(&(*deltas)->cond);
+	pthread_mutex_unlock(&(*deltas)->lock);
+	workq_free(&(*deltas)->workq);
+
+	while((job=(*deltas)->head))
+	{
+		(*deltas)->head=job->next;
+		delta_job_free(&job, NULL);
+	}
+	pthread_mutex_destroy(&(*deltas)->lock);
+	pthread_cond_destroy(&(*deltas)->cond);
+	free_v((void **)deltas);
+}
+
+// Returns 1 when the job has been sent completely, 0 if it is still being
+// worked on, or -1 on error.
+static int send_job(struct deltas *deltas, struct delta_job *job,
+	struct asfd *asfd, int block, struct conf **confs)
+{
+	uint8_t done;
+	struct delta_chunk *c;
+	struct delta_chunk *chunks;
+	uint8_t checksum[MD5_DIGEST_LENGTH];
+	struct cntr *cntr=get_cntr(confs[OPT_CNTR]);
+
+	if(!job->header_sent)
+	{
+		if(asfd->write(asfd, &job->datapth)
+		  || asfd->write(asfd, &job->attr)
+		  || asfd->write(asfd, &job->path))
+			goto error;
+		job->header_sent=1;
+	}
+
+	while(1)
+	{
+		pthread_mutex_lock(&deltas->lock);
+		while(block && !job->head && !job->done)
+			pthread_cond_wait(&deltas->cond, &deltas->lock);
+		chunks=job->head;
+		job->head=job->tail=NULL;
+		job->nchunks=0;
+		done=job->done;
+		if(chunks) pthread_cond_broadcast(&deltas->cond);
+		pthread_mutex_unlock(&deltas->lock);
+
+		for(c=chunks; c; c=c->next)
+		{
+			if(asfd->write_strn(asfd, CMD_APPEND, c->buf, c->len))
+			{
+				chunks_free(chunks);
+				goto error;
+			}
+			job->sentbytes+=c->len;
+		}
+		chunks_free(chunks);
+
+		if(done) break;
+		if(!chunks && !block) return 0;
+	}
+
+	// The worker has finished with the job, so take it off the queue.
+	if(workq_get(deltas->workq, 1)!=job)
+	{
+		logp("delta jobs out of order in %s\n", __func__);
+		goto error;
+	}
+	if(job->ret) goto error;
+
+	if(!MD5_Final(checksum, &job->infb->md5))
+	{
+		logp("MD5_Final() failed\n");
+		goto error;
+	}
+	if(write_endfile(asfd, job->infb->bytes, checksum))
+		goto error;
+	cntr_add(cntr, CMD_FILE_CHANGED, 1);
+	cntr_add_bytes(cntr, job->infb->bytes);
+	cntr_add_sentbytes(cntr, job->sentbytes);
+	return 1;
+error:
+	logp("error in sig/delta for %s (%s)\n",
+		job->path.buf, job->datapth.buf);
+	return -1;
+}
+
+static int send_head(struct deltas *deltas, struct asfd *asfd,
+	int block, struct conf **confs)
+{
+	int r;
+	struct delta_job *job=deltas->head;
+
+	if((r=send_job(deltas, job, asfd, block, confs))<=0)
+		return r;
+	if(!(deltas->head=job->next)) deltas->tail=NULL;
+	delta_job_free(&job, asfd);
+	return 1;
+}
+
+int deltas_send(struct deltas *deltas, struct asfd *asfd,
+	int all, struct conf **confs)
+{
+	int r;
+	while(deltas->head)
+	{
+		if((r=send_head(deltas, asfd, all, confs))<0) return -1;
+		if(!r) break;
+	}
+	return 0;
+}
+
+int deltas_read(struct deltas *deltas, struct asfd *asfd,
+	struct conf **confs)
+{
+	while(!asfd->rbuf->buf)
+	{
+		if(!deltas->head) return asfd->read(asfd);
+		if(asfd->as->read_quick(asfd->as)) return -1;
+		if(asfd->rbuf->buf) break;
+		// Nothing from the server yet, so finish off the oldest delta.
+		if(send_head(deltas, asfd, 1, confs)<0) return -1;
+	}
+	return 0;
+}
+
+int deltas_add(struct deltas *deltas, struct asfd *asfd,
+	struct sbuf *sb, BFILE **bfd, rs_signature_t *sumset,
+	struct conf **confs)
+{
+	struct delta_job *job;
+
+	// Make room by sending the oldest one.
+	while(workq_full(deltas->workq))
+		if(send_head(deltas, asfd, 1, confs)<0)
+			goto error;
+
+	if(!(job=(struct delta_job *)calloc_w(1, sizeof(struct delta_job),
+		__func__)))
+			goto error;
+	job->deltas=deltas;
+	job->sumset=sumset;
+	job->bfd=*bfd;
+	*bfd=NULL;
+	iobuf_move(&job->datapth, &sb->protocol1->datapth);
+	iobuf_move(&job->attr, &sb->attr);
+	iobuf_move(&job->path, &sb->path);
+
+	if(!(job->rsjob=rs_delta_begin(job->sumset)))
+	{
+		logp("could not start delta job.\n");
+		goto error_job;
+	}
+	if(!(job->infb=rs_filebuf_new(asfd, job->bfd,
+		NULL, NULL, -1, ASYNC_BUF_LEN, job->bfd->datalen,
+		get_cntr(confs[OPT_CNTR]))))
+	{
+		logp("could not rs_filebuf_new for delta\n");
+		goto error_job;
+	}
+
+	if(deltas->tail) deltas->tail->next=job;
+	else deltas->head=job;
+	deltas->tail=job;
+	workq_set_active(deltas->workq,
+		throttle_threads(deltas->workq->threads));
+	if(workq_add(deltas->workq, delta_job_run, job))
+		return -1;
+
+	return deltas_send(deltas, asfd, 0, confs);
+error_job:
+	delta_job_free(&job, asfd);
+	return -1;
+error:
+	if(*bfd)
+	{
+		(*bfd)->close(*bfd, asfd);
+		bfile_free(bfd);
+	}
+	rs_free_sumset(sumset);
+	return -1;
+}
+
+#endif
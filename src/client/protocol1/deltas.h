@@ -0,0 +1,32 @@
+#ifndef _CLIENT_PROTOCOL1_DELTAS_H
+#define _CLIENT_PROTOCOL1_DELTAS_H
+
+struct deltas;
+
+#ifndef HAVE_WIN32
+
+// Works out the deltas for changed files on a pool of threads.
+// The signatures still arrive, and the deltas still go, over the one
+// connection, in the order that the server asked for them. A delta waits in
+// memory until it is its turn to be sent, and its worker stops when that
+// memory is full, so slow sending does not use more and more of it.
+
+extern struct deltas *deltas_alloc(int threads);
+extern void deltas_free(struct deltas **deltas);
+
+// Takes over the open bfd, the signature and the datapth, attribs and path
+// of sb.
+extern int deltas_add(struct deltas *deltas, struct asfd *asfd,
+	struct sbuf *sb, BFILE **bfd, rs_signature_t *sumset,
+	struct conf **confs);
+// Sends whatever is ready. With 'all', waits until everything has gone.
+extern int deltas_send(struct deltas *deltas, struct asfd *asfd,
+	int all, struct conf **confs);
+// Like asfd->read(), but carries on sending deltas while the server is
+// quiet.
+extern int deltas_read(struct deltas *deltas, struct asfd *asfd,
+	struct conf **confs);
+
+#endif
+
+#endif
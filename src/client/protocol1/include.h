@@ -8,7 +8,10 @@
 #include "../find.h"
 
 #include "backup_phase2.h"
+#include "deltas.h"
 #include "include.h"
+#include "metacache.h"
+#include "prefetch.h"
 #include "restore.h"
 
 #endif
@@ -0,0 +1,154 @@
+#include "include.h"
+#include "../../cmd.h"
+
+// How much of the extra meta data to keep, in total.
+#define METACACHE_BYTES	(16*1024*1024)
+
+struct meta
+{
+	uint32_t hash;
+	int num;
+	enum cmd cmd;
+	int compression;
+	size_t len;
+	char *data;
+};
+
+struct metacache
+{
+	// Open addressing.
+	struct meta *slots;
+	size_t size;
+	size_t used;
+	size_t bytes;
+	// The number that the next whole send gets.
+	int next;
+};
+
+static uint32_t meta_hash(enum cmd cmd, int compression,
+	const char *meta, size_t len)
+{
+	// FNV-1a.
+	size_t i;
+	uint32_t h=2166136261U;
+	h=(h^(uint8_t)cmd)*16777619U;
+	h=(h^(uint8_t)compression)*16777619U;
+	for(i=0; i<len; i++)
+	{
+		h^=(uint8_t)meta[i];
+		h*=16777619U;
+	}
+	return h;
+}
+
+static int meta_same(struct meta *m, uint32_t hash, enum cmd cmd,
+	int compression, const char *meta, size_t len)
+{
+	return m->hash==hash
+	  && m->cmd==cmd
+	  && m->compression==compression
+	  && m->len==len
+	  && !memcmp(m->data, meta, len);
+}
+
+struct metacache *metacache_alloc(void)
+{
+	struct metacache *metacache=NULL;
+	if(!(metacache=(struct metacache *)
+		calloc_w(1, sizeof(struct metacache), __func__)))
+			return NULL;
+	metacache->size=64;
+	if(!(metacache->slots=(struct meta *)
+		calloc_w(metacache->size, sizeof(struct meta), __func__)))
+			metacache_free(&metacache);
+	return metacache;
+}
+
+void metacache_free(struct metacache **metacache)
+{
+	size_t i;
+	if(!metacache || !*metacache) return;
+	if((*metacache)->slots)
+	{
+		for(i=0; i<(*metacache)->size; i++)
+			free_w(&(*metacache)->slots[i].data);
+		free_v((void **)&(*metacache)->slots);
+	}
+	free_v((void **)metacache);
+}
+
+static struct meta *meta_slot(struct meta *slots, size_t size,
+	uint32_t hash, enum cmd cmd, int compression,
+	const char *meta, size_t len)
+{
+	size_t i=hash&(size-1);
+	for(; slots[i].data; i=(i+1)&(size-1))
+		if(meta_same(&slots[i], hash, cmd, compression, meta, len))
+			break;
+	return &slots[i];
+}
+
+static int grow(struct metacache *metacache)
+{
+	size_t i;
+	size_t size=metacache->size*2;
+	struct meta *slots=NULL;
+	if(!(slots=(struct meta *)calloc_w(size, sizeof(struct meta), __func__)))
+		return -1;
+	for(i=0; i<metacache->size; i++)
+	{
+		struct meta *m=&metacache->slots[i];
+		if(!m->data) continue;
+		*meta_slot(slots, size, m->hash, m->cmd, m->compression,
+			m->data, m->len)=*m;
+	}
+	free_v((void **)&metacache->slots);
+	metacache->slots=slots;
+	metacache->size=size;
+	return 0;
+}
+
+int metacache_find(struct metacache *metacache, enum cmd cmd,
+	int compression, const char *meta, size_t len)
+{
+	struct meta *m;
+	if(!metacache->used) return -1;
+	m=meta_slot(metacache->slots, metacache->size,
+		meta_hash(cmd, compression, meta, len),
+		cmd, compression, meta, len);
+	return m->data?m->num:-1;
+}
+
+int metacache_add(struct metacache *metacache, enum cmd cmd,
+	int compression, const char *meta, size_t len)
+{
+	uint32_t hash;
+	struct meta *m;
+	int num=metacache->next++;
+
+	if(num>=META_REF_MAX
+	  || metacache->bytes+len>METACACHE_BYTES)
+		return 0;
+	// An empty one would look like a free slot.
+	if(!len) return 0;
+
+	if((metacache->used+1)*4>metacache->size*3
+	  && grow(metacache))
+		return -1;
+	hash=meta_hash(cmd, compression, meta, len);
+	m=meta_slot(metacache->slots, metacache->size,
+		hash, cmd, compression, meta, len);
+	// Already have one the same, which is the one to refer to.
+	if(m->data) return 0;
+	if(!(m->data=(char *)malloc_w(len, __func__)))
+		return -1;
+	memcpy(m->data, meta, len);
+	m->hash=hash;
+	m->num=num;
+	m->cmd=cmd;
+	m->compression=compression;
+	m->len=len;
+	metacache->used++;
+	metacache->bytes+=len;
+	return 0;
+}
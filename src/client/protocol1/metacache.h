@@ -0,0 +1,25 @@
+#ifndef _CLIENT_PROTOCOL1_METACACHE_H
+#define _CLIENT_PROTOCOL1_METACACHE_H
+
+// The extra meta data (ACLs and xattrs) that has been sent whole during a
+// backup. On most systems, nearly every file has one of only a few
+// different lots of it, so when one comes round again the client can send
+// CMD_META_REF with its number instead of the whole thing.
+// The numbers count every whole send, in order, the same as the server
+// counts them. Only the first META_REF_MAX of them are kept, and only while
+// they fit in the memory allowed for them.
+
+struct metacache;
+
+extern struct metacache *metacache_alloc(void);
+extern void metacache_free(struct metacache **metacache);
+
+// Returns the number of an earlier send of the same data, or -1 if there
+// was not one.
+extern int metacache_find(struct metacache *metacache, enum cmd cmd,
+	int compression, const char *meta, size_t len);
+// Call after each whole send of extra meta data.
+extern int metacache_add(struct metacache *metacache, enum cmd cmd,
+	int compression, const char *meta, size_t len);
+
+#endif
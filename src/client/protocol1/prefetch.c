@@ -0,0 +1,497 @@
+#include "include.h"
+#include "../../cmd.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && !defined(HAVE_WIN32)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Needs a kernel header that knows about IORING_OP_OPENAT and friends.
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup)
+
+// Files up to this size get read ahead, this many at a time.
+#define PREFETCH_FILE_MAX	(64*1024)
+#define PREFETCH_DEPTH		64
+
+enum pf_state
+{
+	PF_OPEN=0,
+	PF_READ,
+	PF_CLOSE,
+	PF_DONE,
+	PF_FAILED
+};
+
+struct pf_file
+{
+	char *path;
+	enum pf_state state;
+	int fd;
+	int failed;
+	struct stat statp;
+	char *buf;
+	size_t len;
+};
+
+struct ring
+{
+	int fd;
+	unsigned entries;
+	// Entries that have been filled in, but not handed to the kernel.
+	unsigned queued;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_len;
+	void *cq_map;
+	size_t cq_map_len;
+	size_t sqes_len;
+};
+
+struct prefetch
+{
+	struct ring ring;
+	int atime;
+	// A circle of the files being read, in the order that the server is
+	// going to ask for them.
+	struct pf_file files[PREFETCH_DEPTH];
+	int head;
+	int count;
+};
+
+static void ring_free(struct ring *r)
+{
+	if(r->sqes) munmap(r->sqes, r->sqes_len);
+	if(r->cq_map && r->cq_map!=r->sq_map) munmap(r->cq_map, r->cq_map_len);
+	if(r->sq_map) munmap(r->sq_map, r->sq_map_len);
+	if(r->fd>=0) close(r->fd);
+	memset(r, 0, sizeof(struct ring));
+	r->fd=-1;
+}
+
+static void *ring_map(struct ring *r, size_t len, off_t offset)
+{
+	void *p=mmap(NULL, len, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, r->fd, offset);
+	return p==MAP_FAILED?NULL:p;
+}
+
+static int ring_supports(struct ring *r)
+{
+	int ret=0;
+	size_t i;
+	size_t len;
+	struct io_uring_probe *probe=NULL;
+	uint8_t ops[]={ IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+
+	len=sizeof(struct io_uring_probe)
+		+256*sizeof(struct io_uring_probe_op);
+	if(!(probe=(struct io_uring_probe *)calloc_w(1, len, __func__)))
+		return 0;
+	if(syscall(__NR_io_uring_register, r->fd,
+		IORING_REGISTER_PROBE, probe, 256)<0)
+			goto end;
+	for(i=0; i<sizeof(ops); i++)
+		if(ops[i]>probe->last_op
+		  || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			goto end;
+	ret=1;
+end:
+	free_v((void **)&probe);
+	return ret;
+}
+
+static int ring_init(struct ring *r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	if((r->fd=syscall(__NR_io_uring_setup, entries, &p))<0)
+		return -1;
+	r->sq_map_len=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	r->cq_map_len=p.cq_off.cqes
+		+p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(r->cq_map_len>r->sq_map_len)
+			r->sq_map_len=r->cq_map_len;
+		r->cq_map_len=r->sq_map_len;
+	}
+	if(!(r->sq_map=ring_map(r, r->sq_map_len, IORING_OFF_SQ_RING)))
+		return -1;
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map=r->sq_map;
+	else if(!(r->cq_map=ring_map(r, r->cq_map_len, IORING_OFF_CQ_RING)))
+		return -1;
+	r->sqes_len=p.sq_entries*sizeof(struct io_uring_sqe);
+	if(!(r->sqes=(struct io_uring_sqe *)
+		ring_map(r, r->sqes_len, IORING_OFF_SQES)))
+			return -1;
+
+	r->sq_head=(unsigned *)((char *)r->sq_map+p.sq_off.head);
+	r->sq_tail=(unsigned *)((char *)r->sq_map+p.sq_off.tail);
+	r->sq_mask=(unsigned *)((char *)r->sq_map+p.sq_off.ring_mask);
+	r->sq_array=(unsigned *)((char *)r->sq_map+p.sq_off.array);
+	r->cq_head=(unsigned *)((char *)r->cq_map+p.cq_off.head);
+	r->cq_tail=(unsigned *)((char *)r->cq_map+p.cq_off.tail);
+	r->cq_mask=(unsigned *)((char *)r->cq_map+p.cq_off.ring_mask);
+	r->cqes=(struct io_uring_cqe *)((char *)r->cq_map+p.cq_off.cqes);
+	r->entries=p.sq_entries;
+	return 0;
+}
+
+static struct io_uring_sqe *ring_get_sqe(struct ring *r)
+{
+	unsigned tail=*r->sq_tail;
+	unsigned head=__atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+	if(tail-head>=r->entries) return NULL;
+	sqe=&r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+// Makes the entry from ring_get_sqe() visible to the kernel.
+static void ring_push(struct ring *r)
+{
+	unsigned tail=*r->sq_tail;
+	unsigned i=tail & *r->sq_mask;
+	r->sq_array[i]=i;
+	__atomic_store_n(r->sq_tail, tail+1, __ATOMIC_RELEASE);
+	r->queued++;
+}
+
+static int ring_enter(struct ring *r, int wait)
+{
+	int got;
+	while((got=syscall(__NR_io_uring_enter, r->fd, r->queued,
+		wait?1:0, wait?IORING_ENTER_GETEVENTS:0, NULL, 0))<0)
+	{
+		if(errno==EINTR || errno==EAGAIN || errno==EBUSY) continue;
+		logp("io_uring_enter failed: %s\n", strerror(errno));
+		return -1;
+	}
+	r->queued-=got;
+	return 0;
+}
+
+static void file_free_content(struct pf_file *f)
+{
+	free_w(&f->path);
+	free_w(&f->buf);
+	memset(f, 0, sizeof(struct pf_file));
+	f->fd=-1;
+}
+
+static int file_done(struct pf_file *f)
+{
+	return f->state==PF_DONE || f->state==PF_FAILED;
+}
+
+static void submit_close(struct prefetch *pf, int i)
+{
+	struct pf_file *f=&pf->files[i];
+	struct io_uring_sqe *sqe;
+	if(!(sqe=ring_get_sqe(&pf->ring)))
+	{
+		close(f->fd);
+		f->fd=-1;
+		f->state=PF_FAILED;
+		return;
+	}
+	sqe->opcode=IORING_OP_CLOSE;
+	sqe->fd=f->fd;
+	sqe->user_data=i;
+	f->state=PF_CLOSE;
+	ring_push(&pf->ring);
+}
+
+static void submit_read(struct prefetch *pf, int i)
+{
+	struct pf_file *f=&pf->files[i];
+	struct io_uring_sqe *sqe;
+	if(fstat(f->fd, &f->statp)
+	  || !S_ISREG(f->statp.st_mode)
+	  || f->statp.st_size>PREFETCH_FILE_MAX
+	  // One more than it should need, so that growing gets noticed.
+	  || !(f->buf=(char *)malloc_w(f->statp.st_size+1, __func__))
+	  || !(sqe=ring_get_sqe(&pf->ring)))
+	{
+		f->failed=1;
+		submit_close(pf, i);
+		return;
+	}
+	sqe->opcode=IORING_OP_READ;
+	sqe->fd=f->fd;
+	sqe->addr=(unsigned long)f->buf;
+	sqe->len=f->statp.st_size+1;
+	sqe->off=0;
+	sqe->user_data=i;
+	f->state=PF_READ;
+	ring_push(&pf->ring);
+}
+
+static void completed(struct prefetch *pf, struct io_uring_cqe *cqe)
+{
+	int i=(int)cqe->user_data;
+	struct pf_file *f=&pf->files[i];
+	switch(f->state)
+	{
+		case PF_OPEN:
+			if(cqe->res<0)
+			{
+				f->state=PF_FAILED;
+				break;
+			}
+			f->fd=cqe->res;
+			submit_read(pf, i);
+			break;
+		case PF_READ:
+			if(cqe->res<0 || cqe->res!=f->statp.st_size)
+				f->failed=1;
+			else
+				f->len=cqe->res;
+			submit_close(pf, i);
+			break;
+		case PF_CLOSE:
+			f->fd=-1;
+			f->state=(f->failed || cqe->res<0)?PF_FAILED:PF_DONE;
+			break;
+		default:
+			break;
+	}
+}
+
+// Hands the waiting entries to the kernel, and deals with whatever has
+// finished. If 'wait' is set, waits for at least one thing to finish.
+static int reap(struct prefetch *pf, int wait)
+{
+	struct ring *r=&pf->ring;
+	unsigned head;
+	if(ring_enter(r, wait)) return -1;
+	head=*r->cq_head;
+	while(head!=__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		completed(pf, &r->cqes[head & *r->cq_mask]);
+		head++;
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	// Finishing one step may have queued the next.
+	if(r->queued && ring_enter(r, 0)) return -1;
+	return 0;
+}
+
+// Waits for the kernel to finish with everything, and forgets it all.
+static int drain(struct prefetch *pf)
+{
+	int n;
+	int ret=0;
+	for(n=0; n<pf->count; n++)
+	{
+		struct pf_file *f=&pf->files[(pf->head+n)%PREFETCH_DEPTH];
+		while(!ret && !file_done(f))
+			ret=reap(pf, 1);
+		if(ret && !file_done(f))
+		{
+			// The kernel may still be reading into the buffer, or
+			// looking at the path, so they have to be leaked. A
+			// close that has been asked for may yet happen, and
+			// the number could belong to something else by then.
+			if(f->state==PF_READ) close(f->fd);
+			f->path=NULL;
+			f->buf=NULL;
+		}
+		file_free_content(f);
+	}
+	pf->head=0;
+	pf->count=0;
+	return ret;
+}
+
+struct prefetch *prefetch_alloc(int atime)
+{
+	int i;
+	struct prefetch *pf=NULL;
+	if(!(pf=(struct prefetch *)calloc_w(1, sizeof(struct prefetch), __func__)))
+		return NULL;
+	pf->atime=atime;
+	for(i=0; i<PREFETCH_DEPTH; i++)
+		pf->files[i].fd=-1;
+	if(ring_init(&pf->ring, PREFETCH_DEPTH)
+	  || !ring_supports(&pf->ring))
+	{
+		logp("io_uring is not available - reading files one at a time\n");
+		prefetch_free(&pf);
+		return NULL;
+	}
+	return pf;
+}
+
+void prefetch_free(struct prefetch **prefetch)
+{
+	if(!prefetch || !*prefetch) return;
+	if((*prefetch)->ring.sqes) drain(*prefetch);
+	ring_free(&(*prefetch)->ring);
+	free_v((void **)prefetch);
+}
+
+int prefetch_add(struct prefetch *prefetch, const char *path)
+{
+	int i;
+	struct pf_file *f;
+	struct io_uring_sqe *sqe;
+
+	if(prefetch->count>=PREFETCH_DEPTH
+	  || !(sqe=ring_get_sqe(&prefetch->ring)))
+		return 0;
+	i=(prefetch->head+prefetch->count)%PREFETCH_DEPTH;
+	f=&prefetch->files[i];
+	if(!(f->path=strdup_w(path, __func__)))
+		return 0;
+	sqe->opcode=IORING_OP_OPENAT;
+	sqe->fd=AT_FDCWD;
+	sqe->addr=(unsigned long)f->path;
+	sqe->open_flags=O_RDONLY|O_NOFOLLOW|O_CLOEXEC
+#ifdef O_NOATIME
+		|(prefetch->atime?0:O_NOATIME)
+#endif
+		;
+	sqe->user_data=i;
+	f->state=PF_OPEN;
+	ring_push(&prefetch->ring);
+	prefetch->count++;
+	return 1;
+}
+
+static int is_whole_file(enum cmd cmd, int *datapth)
+{
+	int ret=0;
+	switch(cmd)
+	{
+		case CMD_DATAPTH:
+			*datapth=1;
+			return 0;
+		case CMD_FILE:
+		case CMD_ENC_FILE:
+			ret=!*datapth;
+			// Fall through.
+		case CMD_METADATA:
+		case CMD_ENC_METADATA:
+		case CMD_VSS:
+		case CMD_ENC_VSS:
+		case CMD_VSS_T:
+		case CMD_ENC_VSS_T:
+		case CMD_EFS_FILE:
+			*datapth=0;
+			return ret;
+		default:
+			return 0;
+	}
+}
+
+int prefetch_peek(struct prefetch *prefetch, struct asfd *asfd, int datapth)
+{
+	int n=0;
+	size_t pos=0;
+	char path[PATH_MAX+1];
+
+	// Not worth looking through it all again for just a few.
+	if(prefetch->count>PREFETCH_DEPTH/2
+	  || asfd->streamtype!=ASFD_STREAM_STANDARD)
+		return 0;
+
+	// Standard messages are a command character and four hex digits of
+	// length, then the data.
+	while(pos+5<=asfd->readbuflen)
+	{
+		enum cmd cmd=(enum cmd)asfd->readbuf[pos];
+		unsigned int s=0;
+		char hex[5];
+		memcpy(hex, asfd->readbuf+pos+1, 4);
+		hex[4]='\0';
+		if(sscanf(hex, "%04X", &s)!=1
+		  || pos+5+s>asfd->readbuflen)
+			break;
+		// The first 'count' of them have already been started.
+		if(is_whole_file(cmd, &datapth)
+		  && n++>=prefetch->count)
+		{
+			if(s>=sizeof(path)) break;
+			memcpy(path, asfd->readbuf+pos+5, s);
+			path[s]='\0';
+			if(!prefetch_add(prefetch, path))
+				break;
+		}
+		pos+=5+s;
+	}
+	if(prefetch->ring.queued && reap(prefetch, 0))
+		return -1;
+	return 0;
+}
+
+int prefetch_take(struct prefetch *prefetch, const char *path,
+	char **buf, size_t *len, struct stat *statp)
+{
+	struct pf_file *f;
+
+	if(!prefetch->count) return 0;
+	f=&prefetch->files[prefetch->head];
+	if(strcmp(f->path, path))
+	{
+		// Lost track of what the server is asking for. Start again.
+		return drain(prefetch);
+	}
+	while(!file_done(f))
+		if(reap(prefetch, 1)) return -1;
+
+	prefetch->head=(prefetch->head+1)%PREFETCH_DEPTH;
+	prefetch->count--;
+	if(f->state!=PF_DONE)
+	{
+		file_free_content(f);
+		return 0;
+	}
+	*buf=f->buf;
+	*len=f->len;
+	*statp=f->statp;
+	f->buf=NULL;
+	file_free_content(f);
+	return 1;
+}
+
+#else
+
+struct prefetch *prefetch_alloc(int atime)
+{
+	return NULL;
+}
+
+void prefetch_free(struct prefetch **prefetch)
+{
+}
+
+int prefetch_peek(struct prefetch *prefetch, struct asfd *asfd, int datapth)
+{
+	return 0;
+}
+
+int prefetch_add(struct prefetch *prefetch, const char *path)
+{
+	return 0;
+}
+
+int prefetch_take(struct prefetch *prefetch, const char *path,
+	char **buf, size_t *len, struct stat *statp)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _CLIENT_PROTOCOL1_PREFETCH_H
+#define _CLIENT_PROTOCOL1_PREFETCH_H
+
+// Reads small files ahead of the server asking for them, with io_uring, so
+// that dozens of opens and reads are going at once instead of one after
+// another. The requests that are waiting in the read buffer say which files
+// are coming up, and in which order.
+// Only whole files are read ahead - not the ones that a delta is going to be
+// worked out for.
+// Without io_uring, prefetch_alloc() returns NULL and files get read the
+// usual way.
+
+struct prefetch;
+
+extern struct prefetch *prefetch_alloc(int atime);
+extern void prefetch_free(struct prefetch **prefetch);
+
+// Starts reading the files that are requested in the read buffer, which
+// have not been started already. Set 'datapth' if the request that is
+// being put together already has one.
+extern int prefetch_peek(struct prefetch *prefetch, struct asfd *asfd,
+	int datapth);
+// Starts reading 'path'. Returns 1 if it was started, 0 if there is no room
+// for it.
+extern int prefetch_add(struct prefetch *prefetch, const char *path);
+// Call for every whole file that the server asks for, in order. If 'path'
+// was read ahead, returns 1 and hands over its contents, and what fstat()
+// said about it before they were read. Returns 0 if it has to be read the
+// usual way, or -1 on error.
+extern int prefetch_take(struct prefetch *prefetch, const char *path,
+	char **buf, size_t *len, struct stat *statp);
+
+#endif
@@ -51,9 +51,11 @@ static int do_restore_file_or_get_meta(struct asfd *asfd, BFILE *bfd,
 			ret=-1;
 			goto end;
 		}
-#endif
+#else
+		// Elsewhere, closing the bfd sets the attributes.
 		if(!ret) attribs_set(asfd, rpath,
 			&(sb->statp), sb->winattr, confs);
+#endif
 	}
 
 	ret=0;
@@ -148,7 +150,17 @@ static int restore_metadata(struct asfd *asfd, BFILE *bfd, struct sbuf *sb,
 			goto end;
 	if(metadata)
 	{
-		
+		switch(restore_writer_took_metadata(asfd, confs,
+			fname, &metadata, metalen))
+		{
+			case 0: break;
+			case 1:
+				cntr_add(get_cntr(confs[OPT_CNTR]),
+					sb->path.cmd, 1);
+				ret=0;
+				goto end;
+			default: goto end;
+		}
 		if(!set_extrameta(asfd, bfd, fname,
 			sb, metadata, metalen, confs))
 		{
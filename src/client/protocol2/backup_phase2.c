@@ -1,6 +1,7 @@
 #include "include.h"
 #include "../../base64.h"
 #include "../../cmd.h"
+#include "../../protocol2/append.h"
 #include "../../protocol2/rabin/include.h"
 
 /* Ignore extrameta for now.
@@ -29,13 +30,22 @@ static uint64_t decode_req(const char *buf)
 }
 
 static int add_to_file_requests(struct slist *slist, struct iobuf *rbuf,
-	struct conf **confs)
+	struct iobuf *append, struct conf **confs)
 {
 	static uint64_t file_no=1;
 	struct sbuf *sb;
 
 	if(!(sb=sbuf_alloc(confs))) return -1;
 
+	if(append->buf)
+	{
+		if(append_parse(sb->protocol2, append))
+		{
+			sbuf_free(&sb);
+			return -1;
+		}
+		iobuf_free_content(append);
+	}
 	iobuf_move(&sb->path, rbuf);
 	// Give it a number to simplify tracking.
 	sb->protocol2->index=file_no++;
@@ -66,14 +76,57 @@ static int add_to_data_requests(struct blist *blist, struct iobuf *rbuf)
 	return 0;
 }
 
-static int deal_with_read(struct iobuf *rbuf, struct slist *slist, struct blist  *blist, struct conf **confs, int *backup_end, int *requests_end, int *blk_requests_end)
+// The server is going to send a filter of the blocks that it already has.
+static int sig_filter_begin(struct bloom **bloom, struct iobuf *rbuf)
+{
+	unsigned int bytes=0;
+	unsigned int hashes=0;
+	if(*bloom
+	  || sscanf(rbuf->buf, "sigfilter:%u:%u", &bytes, &hashes)!=2
+	  || bytes>BLOOM_BYTES_MAX
+	  || hashes>BLOOM_HASHES_MAX)
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		return -1;
+	}
+	if(!(*bloom=bloom_alloc(bytes, hashes))) return -1;
+	return 0;
+}
+
+static int sig_filter_add(struct bloom *bloom, struct iobuf *rbuf)
+{
+	if(!bloom
+	  || rbuf->len>bloom->bytes-bloom->pos)
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		return -1;
+	}
+	memcpy(bloom->bits+bloom->pos, rbuf->buf, rbuf->len);
+	if((bloom->pos+=rbuf->len)==bloom->bytes)
+		logp("Got filter of blocks on the server: %u bytes\n",
+			bloom->bytes);
+	return 0;
+}
+
+static int deal_with_read(struct iobuf *rbuf, struct slist *slist, struct blist  *blist, struct conf **confs, int *backup_end, int *requests_end, int *blk_requests_end, struct bloom **bloom)
 {
 	int ret=0;
+	static struct iobuf append;
 	switch(rbuf->cmd)
 	{
+		/* Incoming filter of blocks that the server has. */
+		case CMD_SIG_FILTER:
+			if(sig_filter_add(*bloom, rbuf)) goto error;
+			goto end;
+
 		/* Incoming file request. */
+		case CMD_APPEND_FROM:
+			iobuf_free_content(&append);
+			iobuf_move(&append, rbuf);
+			return 0;
 		case CMD_FILE:
-			if(add_to_file_requests(slist, rbuf, confs)) goto error;
+			if(add_to_file_requests(slist, rbuf, &append, confs))
+				goto error;
 			return 0;
 
 		/* Incoming data block request. */
@@ -124,6 +177,11 @@ static int deal_with_read(struct iobuf *rbuf, struct slist *slist, struct blist
 				*backup_end=1;
 				goto end;
 			}
+			else if(!strncmp_w(rbuf->buf, "sigfilter:"))
+			{
+				if(sig_filter_begin(bloom, rbuf)) goto error;
+				goto end;
+			}
 			break;
 		default:
 			break;
@@ -209,20 +267,71 @@ static void get_wbuf_from_data(struct conf **confs,
 	free_stuff(slist, blist);
 }
 
-static int iobuf_from_blk_data(struct iobuf *wbuf, struct blk *blk)
+static void iobuf_from_blk_data(struct iobuf *wbuf, struct blk *blk)
 {
 	static char buf[CHECKSUM_LEN];
-	if(blk_md5_update(blk)) return -1;
 
 	// FIX THIS: consider endian-ness.
 	memcpy(buf, &blk->fingerprint, FINGERPRINT_LEN);
 	memcpy(buf+FINGERPRINT_LEN, blk->md5sum, MD5_DIGEST_LENGTH);
 	iobuf_set(wbuf, CMD_SIG, buf, CHECKSUM_LEN);
+}
+
+// Returns 1 if the server probably has the block already.
+static int probably_got(struct bloom *bloom, struct blk *blk)
+{
+	// An empty file has a block with nothing in it, which the server
+	// never asks for, so it always gets a proper sig.
+	if(!bloom
+	  || bloom->pos<bloom->bytes
+	  || !blk->length)
+		return 0;
+	return bloom_test(bloom, blk->md5sum);
+}
+
+// Move on to the next block of the file.
+static void next_sig(struct slist *slist, struct sbuf *sb)
+{
+	if(sb->protocol2->bsighead==sb->protocol2->bend)
+	{
+		slist->blks_to_send=sb->next;
+		sb->protocol2->bsighead=sb->protocol2->bstart;
+	}
+	else
+	{
+		sb->protocol2->bsighead=sb->protocol2->bsighead->next;
+	}
+}
+
+// Send references to the run of blocks that the server probably has, in
+// one go, up to the end of the file or the blocks that are ready.
+// The first one has already passed the filter.
+static int iobuf_from_blk_refs(struct iobuf *wbuf,
+	struct slist *slist, struct sbuf *sb, struct bloom *bloom)
+{
+	static char buf[SIG_REF_RUN_MAX*SIG_REF_LEN];
+	size_t len=0;
+	struct blk *blk=sb->protocol2->bsighead;
+
+	while(1)
+	{
+		memcpy(buf+len, blk->md5sum, SIG_REF_LEN);
+		len+=SIG_REF_LEN;
+		next_sig(slist, sb);
+		if(len==sizeof(buf)
+		  || slist->blks_to_send!=sb
+		  || !(blk=sb->protocol2->bsighead))
+			break;
+		if(blk_md5_update(blk)) return -1;
+		if(!probably_got(bloom, blk)) break;
+	}
+	iobuf_set(wbuf, CMD_SIG_REF, buf, len);
 	return 0;
 }
 
 static int get_wbuf_from_blks(struct iobuf *wbuf,
-	struct slist *slist, int requests_end, int *sigs_end)
+	struct slist *slist, int requests_end, int *sigs_end,
+	struct bloom *bloom)
 {
 	struct sbuf *sb=slist->blks_to_send;
 
@@ -245,18 +354,24 @@ static int get_wbuf_from_blks(struct iobuf *wbuf,
 		return 0;
 	}
 
-	if(iobuf_from_blk_data(wbuf, sb->protocol2->bsighead)) return -1;
-
-	// Move on.
-	if(sb->protocol2->bsighead==sb->protocol2->bend)
+	if(sb->flags & SBUF_APPENDED)
 	{
-		slist->blks_to_send=sb->next;
-		sb->protocol2->bsighead=sb->protocol2->bstart;
-	}
-	else
-	{
-		sb->protocol2->bsighead=sb->protocol2->bsighead->next;
+		// The sigs only start from here.
+		static char offset[32];
+		snprintf(offset, sizeof(offset), "%" PRIx64,
+			sb->protocol2->append_offset);
+		iobuf_from_str(wbuf, CMD_APPEND_FROM, offset);
+		sb->flags &= ~SBUF_APPENDED;
+		return 0;
 	}
+
+	if(blk_md5_update(sb->protocol2->bsighead)) return -1;
+	if(probably_got(bloom, sb->protocol2->bsighead))
+		return iobuf_from_blk_refs(wbuf, slist, sb, bloom);
+	iobuf_from_blk_data(wbuf, sb->protocol2->bsighead);
+
+	// Move on.
+	next_sig(slist, sb);
 	return 0;
 }
 
@@ -308,6 +423,7 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 	struct blist *blist=NULL;
 	struct iobuf *rbuf=NULL;
 	struct iobuf *wbuf=NULL;
+	struct bloom *bloom=NULL;
 
 	logp("Phase 2 begin (send backup data)\n");
 
@@ -342,7 +458,8 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 			if(!wbuf->len)
 			{
 				if(get_wbuf_from_blks(wbuf, slist,
-					requests_end, &sigs_end)) goto end;
+					requests_end, &sigs_end, bloom))
+						goto end;
 			}
 		}
 
@@ -352,6 +469,7 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 				==APPEND_ERROR)
 					goto end;
 		}
+		throttle_wait();
 		if(asfd->as->read_write(asfd->as))
 		{
 			logp("error in %s\n", __func__);
@@ -359,7 +477,8 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 		}
 
 		if(rbuf->buf && deal_with_read(rbuf, slist, blist,
-			confs, &backup_end, &requests_end, &blk_requests_end))
+			confs, &backup_end, &requests_end, &blk_requests_end,
+			&bloom))
 				goto end;
 
 		if(slist->head
@@ -400,6 +519,7 @@ blk_print_alloc_stats();
 //sbuf_print_alloc_stats();
 	slist_free(&slist);
 	blist_free(&blist);
+	bloom_free(&bloom);
 	// Write buffer did not allocate 'buf'.
 	wbuf->buf=NULL;
 	iobuf_free(&wbuf);
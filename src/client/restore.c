@@ -102,6 +102,8 @@ static int make_link(struct asfd *asfd,
 	return ret;
 }
 
+static struct restore_writer *writer=NULL;
+
 // FIX THIS: Maybe should be in bfile.c.
 enum ofr_e open_for_restore(struct asfd *asfd, BFILE *bfd, const char *path,
 	struct sbuf *sb, int vss_restore, struct conf **confs)
@@ -133,6 +135,9 @@ enum ofr_e open_for_restore(struct asfd *asfd, BFILE *bfd, const char *path,
 #ifdef HAVE_WIN32
 	bfd->set_win32_api(bfd, vss_restore);
 #endif
+	if(writer && S_ISREG(sb->statp.st_mode)
+	  && (sb->path.cmd==CMD_FILE || sb->path.cmd==CMD_ENC_FILE))
+		restore_writer_setup_bfd(writer, bfd);
 	if(S_ISDIR(sb->statp.st_mode))
 	{
 		// Windows directories are treated as having file data.
@@ -159,6 +164,13 @@ enum ofr_e open_for_restore(struct asfd *asfd, BFILE *bfd, const char *path,
 	return OFR_OK;
 }
 
+int restore_writer_took_metadata(struct asfd *asfd, struct conf **confs,
+	const char *path, char **metadata, size_t metalen)
+{
+	return restore_writer_add_meta(writer,
+		asfd, confs, path, metadata, metalen);
+}
+
 static char *build_msg(const char *text, const char *param)
 {
 	static char msg[256]="";
@@ -262,7 +274,17 @@ int restore_dir(struct asfd *asfd,
 				goto end;
 			}
 		}
-		attribs_set(asfd, rpath, &(sb->statp), sb->winattr, confs);
+		if(writer && confs)
+		{
+			// Files still with the writer threads would change
+			// its times.
+			if(restore_writer_add_dir(writer, asfd, confs,
+				rpath, &(sb->statp), sb->winattr))
+					ret=-1;
+		}
+		else
+			attribs_set(asfd, rpath,
+				&(sb->statp), sb->winattr, confs);
 		if(!ret) cntr_add(get_cntr(confs[OPT_CNTR]), sb->path.cmd, 1);
 	}
 	else cntr_add(get_cntr(confs[OPT_CNTR]), sb->path.cmd, 1);
@@ -562,6 +584,13 @@ int do_restore_client(struct asfd *asfd,
 	else
 		logp("Streaming restore direct\n");
 
+#ifndef HAVE_WIN32
+	if(act==ACTION_RESTORE && get_int(confs[OPT_RESTORE_THREADS])>0
+	  && !(writer=restore_writer_alloc(get_int(confs[OPT_RESTORE_THREADS]),
+		RESTORE_WRITER_BUFMAX)))
+			goto error;
+#endif
+
 //	if(get_int(confs[OPT_SEND_CLIENT_CNTR]) && cntr_recv(confs))
 //		goto error;
 
@@ -665,6 +694,25 @@ int do_restore_client(struct asfd *asfd,
 				break;
 		}
 
+		// Files still with the writer threads need to be on disk
+		// before making hard links to them. Directories and metadata
+		// wait for them by themselves.
+		switch(sb->path.cmd)
+		{
+			case CMD_FILE:
+			case CMD_ENC_FILE:
+			case CMD_SPECIAL:
+			case CMD_SOFT_LINK:
+			case CMD_DIRECTORY:
+			case CMD_METADATA:
+			case CMD_ENC_METADATA:
+				break;
+			default:
+				if(restore_writer_flush(writer, asfd, confs))
+					goto error;
+				break;
+		}
+
 		switch(sb->path.cmd)
 		{
 			// These are the same in both protocol1 and protocol2.
@@ -705,6 +753,8 @@ error:
 	// It is possible for a fd to still be open.
 	bfd->close(bfd, asfd);
 	bfile_free(&bfd);
+	if(restore_writer_flush(writer, asfd, confs)) ret=-1;
+	restore_writer_free(&writer);
 
 	cntr_print_end(get_cntr(confs[OPT_CNTR]));
 	cntr_print(get_cntr(confs[OPT_CNTR]), act);
@@ -20,5 +20,10 @@ extern int restore_dir(struct asfd *asfd,
 	struct sbuf *sb, const char *dname, enum action act, struct conf **confs);
 extern int restore_interrupt(struct asfd *asfd,
 	struct sbuf *sb, const char *msg, struct conf **confs);
+// Returns 1 if the metadata went to the restore writer, to be set once its
+// file is written, 0 if the caller should set it, or -1 on error.
+extern int restore_writer_took_metadata(struct asfd *asfd,
+	struct conf **confs, const char *path, char **metadata,
+	size_t metalen);
 
 #endif
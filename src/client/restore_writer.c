@@ -0,0 +1,339 @@
+#include "include.h"
+#include "../workq.h"
+
+struct rw_job
+{
+	char *path;
+	int flags;
+	mode_t mode;
+	struct stat statp;
+	uint64_t winattr;
+	int fd;
+	char *buf;
+	size_t len;
+	size_t alloc;
+	// Set once the file is too big to hold in memory, and is being
+	// written as it arrives.
+	uint8_t direct;
+	char *meta;
+	size_t metalen;
+	// Set if something went wrong.
+	const char *failed;
+	int err;
+};
+
+struct rw_dir
+{
+	char *path;
+	struct stat statp;
+	uint64_t winattr;
+	struct rw_dir *next;
+};
+
+static void rw_job_free(struct rw_job **job)
+{
+	if(!job || !*job) return;
+	if((*job)->fd>=0) close((*job)->fd);
+	free_w(&(*job)->path);
+	free_w(&(*job)->buf);
+	free_w(&(*job)->meta);
+	free_v((void **)job);
+}
+
+static void rw_dir_free(struct rw_dir **dir)
+{
+	if(!dir || !*dir) return;
+	free_w(&(*dir)->path);
+	free_v((void **)dir);
+}
+
+static void set_failed(struct rw_job *job, const char *failed)
+{
+	job->failed=failed;
+	job->err=errno;
+}
+
+static int write_all(struct rw_job *job, const char *buf, size_t len)
+{
+	ssize_t w;
+	int fd=job->fd;
+	while(len)
+	{
+		if((w=write(fd, buf, len))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		buf+=w;
+		len-=w;
+	}
+	return 0;
+}
+
+#ifndef HAVE_WIN32
+// Runs in a worker thread, so it must not touch the asfd, the counters, the
+// logging, or the *_w allocation functions. Anything that goes wrong is
+// left in the job for finish_job() to report.
+static void write_job(void *data)
+{
+	const char *failed=NULL;
+	struct rw_job *job=(struct rw_job *)data;
+
+	// It could not be opened when it got too big to hold.
+	if(job->failed) return;
+
+	if(job->fd<0 && (job->fd=open(job->path, job->flags, job->mode))<0)
+	{
+		set_failed(job, "open");
+		return;
+	}
+	if(job->len && write_all(job, job->buf, job->len))
+		set_failed(job, "write");
+	if(close(job->fd) && !job->failed)
+		set_failed(job, "close");
+	job->fd=-1;
+	if(job->failed) return;
+
+	if(job->meta && set_extrameta_quiet(job->path,
+		job->meta, job->metalen, &failed))
+			set_failed(job, failed);
+	// After the metadata, since setting that can change them.
+	if(attribs_set_quiet(job->path, &job->statp, &failed)
+	  && !job->failed)
+		set_failed(job, failed);
+}
+#endif
+
+// Back on the main thread, where problems can be reported.
+static int finish_job(struct asfd *asfd, struct conf **confs,
+	struct rw_job *job)
+{
+	int ret=0;
+	if(job->failed)
+		ret=logw(asfd, confs, "Could not %s %s: %s\n",
+			job->failed, job->path, strerror(job->err));
+	rw_job_free(&job);
+	return ret;
+}
+
+static int collect(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs, int block)
+{
+	struct rw_job *job;
+	while((job=(struct rw_job *)workq_get(rw->workq, block)))
+		if(finish_job(asfd, confs, job)) return -1;
+	return 0;
+}
+
+#ifndef HAVE_WIN32
+static int add_job(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs, struct rw_job *job)
+{
+	struct rw_job *done;
+	while(workq_full(rw->workq))
+	{
+		if(!(done=(struct rw_job *)workq_get(rw->workq, 1))
+		  || finish_job(asfd, confs, done))
+		{
+			rw_job_free(&job);
+			return -1;
+		}
+	}
+	if(workq_add(rw->workq, write_job, job))
+	{
+		rw_job_free(&job);
+		return -1;
+	}
+	// Tidy up whatever has finished already.
+	return collect(rw, asfd, confs, 0);
+}
+
+static int add_pending(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs)
+{
+	struct rw_job *job;
+	if(!(job=rw->pending)) return 0;
+	rw->pending=NULL;
+	return add_job(rw, asfd, confs, job);
+}
+
+static int rw_open(BFILE *bfd, struct asfd *asfd,
+	const char *fname, int flags, mode_t mode)
+{
+	struct rw_job *job=NULL;
+	if(bfd->mode!=BF_CLOSED && bfd->close(bfd, asfd))
+		return -1;
+	if(!(job=(struct rw_job *)calloc_w(1, sizeof(struct rw_job), __func__))
+	  || !(job->path=strdup_w(fname, __func__)))
+	{
+		rw_job_free(&job);
+		return -1;
+	}
+	// A worker creates it, once all of it has arrived.
+	job->fd=-1;
+	job->flags=flags;
+	job->mode=mode;
+	bfd->rw_job=job;
+	bfd->mode=BF_WRITE;
+	return 0;
+}
+
+static int rw_close(BFILE *bfd, struct asfd *asfd)
+{
+	struct restore_writer *rw=bfd->rw;
+	struct rw_job *job=bfd->rw_job;
+	if(bfd->mode==BF_CLOSED) return 0;
+	bfd->mode=BF_CLOSED;
+	bfd->rw_job=NULL;
+	memcpy(&job->statp, &bfd->statp, sizeof(struct stat));
+	job->winattr=bfd->winattr;
+	if(add_pending(rw, asfd, bfd->confs))
+	{
+		rw_job_free(&job);
+		return -1;
+	}
+	rw->pending=job;
+	return 0;
+}
+
+static ssize_t rw_write(BFILE *bfd, void *buf, size_t count)
+{
+	struct rw_job *job=bfd->rw_job;
+	if(!job->direct && job->len+count>bfd->rw->bufmax)
+	{
+		// Too big to keep in memory, so write it from here on.
+		job->direct=1;
+		if((job->fd=open(job->path, job->flags, job->mode))<0)
+			set_failed(job, "open");
+		else if(write_all(job, job->buf, job->len))
+			return -1;
+		free_w(&job->buf);
+		job->len=0;
+		job->alloc=0;
+	}
+	if(job->direct)
+	{
+		// Reported when the job is collected.
+		if(job->failed) return count;
+		return write_all(job, (char *)buf, count)?-1:(ssize_t)count;
+	}
+	if(job->len+count>job->alloc)
+	{
+		char *tmp;
+		size_t alloc=job->alloc?job->alloc*2:ASYNC_BUF_LEN;
+		while(alloc<job->len+count) alloc*=2;
+		if(!(tmp=(char *)realloc_w(job->buf, alloc, __func__)))
+			return -1;
+		job->buf=tmp;
+		job->alloc=alloc;
+	}
+	memcpy(job->buf+job->len, buf, count);
+	job->len+=count;
+	return count;
+}
+#endif
+
+void restore_writer_setup_bfd(struct restore_writer *rw, BFILE *bfd)
+{
+#ifndef HAVE_WIN32
+	bfd->rw=rw;
+	bfd->open=rw_open;
+	bfd->close=rw_close;
+	bfd->write=rw_write;
+#endif
+}
+
+struct restore_writer *restore_writer_alloc(int threads, size_t bufmax)
+{
+	struct restore_writer *rw;
+	if(!(rw=(struct restore_writer *)
+		calloc_w(1, sizeof(struct restore_writer), __func__))
+	  || !(rw->workq=workq_alloc(threads, threads*2)))
+	{
+		restore_writer_free(&rw);
+		return NULL;
+	}
+	rw->bufmax=bufmax;
+	return rw;
+}
+
+static void dirs_free(struct restore_writer *rw)
+{
+	struct rw_dir *dir;
+	while((dir=rw->dirs))
+	{
+		rw->dirs=dir->next;
+		rw_dir_free(&dir);
+	}
+	rw->dirs_tail=NULL;
+	rw->dirs_count=0;
+}
+
+void restore_writer_free(struct restore_writer **rw)
+{
+	struct rw_job *job;
+	if(!rw || !*rw) return;
+	if((*rw)->workq)
+	{
+		while((job=(struct rw_job *)workq_get((*rw)->workq, 1)))
+			rw_job_free(&job);
+		workq_free(&(*rw)->workq);
+	}
+	rw_job_free(&(*rw)->pending);
+	dirs_free(*rw);
+	free_v((void **)rw);
+}
+
+int restore_writer_flush(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs)
+{
+	struct rw_dir *dir;
+	if(!rw) return 0;
+#ifndef HAVE_WIN32
+	if(add_pending(rw, asfd, confs)) return -1;
+#endif
+	if(collect(rw, asfd, confs, 1)) return -1;
+	// Nothing more gets written in these now.
+	for(dir=rw->dirs; dir; dir=dir->next)
+		attribs_set(asfd, dir->path, &dir->statp, dir->winattr, confs);
+	dirs_free(rw);
+	return 0;
+}
+
+int restore_writer_add_meta(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs,
+	const char *path, char **metadata, size_t metalen)
+{
+	struct rw_job *job;
+	if(!rw) return 0;
+	if((job=rw->pending) && !job->meta && !strcmp(job->path, path))
+	{
+		job->meta=*metadata;
+		job->metalen=metalen;
+		*metadata=NULL;
+		return 1;
+	}
+	// It might be for something that is still being written.
+	return restore_writer_flush(rw, asfd, confs)?-1:0;
+}
+
+int restore_writer_add_dir(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs,
+	const char *path, struct stat *statp, uint64_t winattr)
+{
+	struct rw_dir *dir;
+	if(!(dir=(struct rw_dir *)calloc_w(1, sizeof(struct rw_dir), __func__))
+	  || !(dir->path=strdup_w(path, __func__)))
+	{
+		rw_dir_free(&dir);
+		return -1;
+	}
+	memcpy(&dir->statp, statp, sizeof(struct stat));
+	dir->winattr=winattr;
+	if(rw->dirs_tail) rw->dirs_tail->next=dir;
+	else rw->dirs=dir;
+	rw->dirs_tail=dir;
+	if(++rw->dirs_count>=RESTORE_WRITER_DIRS_MAX)
+		return restore_writer_flush(rw, asfd, confs);
+	return 0;
+}
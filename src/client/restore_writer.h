@@ -0,0 +1,59 @@
+#ifndef _RESTORE_WRITER_H
+#define _RESTORE_WRITER_H
+
+// Hands the writing of restored files to a pool of threads, so that the
+// main restore loop can carry on reading the stream from the server.
+// Each file's data is gathered in memory while it arrives, then a worker
+// creates the file, writes it out, closes it, and sets its metadata and
+// attributes. Files too big to hold in memory are created and written as
+// they arrive, and only the rest is left to a worker. Anything that goes
+// wrong in a worker is reported once the file is collected.
+
+// How much of a single file to hold in memory.
+#define RESTORE_WRITER_BUFMAX	(1024*1024)
+// How many directories to keep, waiting to have their attributes set, before
+// waiting for the files in them.
+#define RESTORE_WRITER_DIRS_MAX	1024
+
+struct rw_job;
+struct rw_dir;
+
+struct restore_writer
+{
+	struct workq *workq;
+	size_t bufmax;
+	// The last file, which is kept back in case its metadata comes next.
+	struct rw_job *pending;
+	struct rw_dir *dirs;
+	struct rw_dir *dirs_tail;
+	int dirs_count;
+};
+
+extern struct restore_writer *restore_writer_alloc(int threads,
+	size_t bufmax);
+extern void restore_writer_free(struct restore_writer **rw);
+
+// Make the bfd hand its file to the restore_writer when it is closed.
+// Call after bfile_init().
+extern void restore_writer_setup_bfd(struct restore_writer *rw, BFILE *bfd);
+
+// Wait for all the queued files to be done, then set the attributes of the
+// directories that were kept. Call this before anything that needs the files
+// written so far to exist, such as making a hard link to one.
+extern int restore_writer_flush(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs);
+
+// If 'path' is the last file, takes 'metadata' for the worker to set once the
+// file is written, and returns 1. Otherwise, flushes so that the caller can
+// set it, and returns 0.
+extern int restore_writer_add_meta(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs,
+	const char *path, char **metadata, size_t metalen);
+
+// Keeps the attributes of a directory to be set at the next flush, since
+// writing the files in it would change its times.
+extern int restore_writer_add_dir(struct restore_writer *rw,
+	struct asfd *asfd, struct conf **confs,
+	const char *path, struct stat *statp, uint64_t winattr);
+
+#endif
@@ -0,0 +1,650 @@
+#include "include.h"
+#include "../pathcmp.h"
+
+// Runs in the worker threads as well as the main one, so everything here
+// uses plain malloc() and free() rather than the *_w functions.
+
+enum walk_state
+{
+	WALK_QUEUED=0,
+	WALK_RUNNING,
+	WALK_DONE
+};
+
+struct walk_node
+{
+	char *path;
+	dev_t dev;
+	enum walk_state state;
+	// Set if the scan went past the node while it was being read.
+	uint8_t abandoned;
+	struct walk_list *list;
+	struct walk_node *next;
+};
+
+struct walk
+{
+	struct conf **confs;
+	struct journal *journal;
+	int do_stat;
+	int threads;
+#ifndef HAVE_WIN32
+	pthread_t *tids;
+	// In pathcmp() order.
+	struct walk_node *nodes;
+	int count;
+	int max;
+	// Where the scan has got to.
+	char *pos;
+	uint8_t stop;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+#endif
+};
+
+void walk_list_free(struct walk_list **list)
+{
+	if(!list || !*list) return;
+	free((*list)->ents);
+	free((*list)->names);
+	free(*list);
+	*list=NULL;
+}
+
+// The length of 'path' without any trailing slashes.
+static size_t dir_len(const char *path)
+{
+	size_t len=strlen(path);
+	while(len>=1 && IsPathSeparator(path[len-1])) len--;
+	return len;
+}
+
+static int ent_cmp(const void *a, const void *b)
+{
+	return pathcmp(((struct walk_ent *)a)->name,
+		((struct walk_ent *)b)->name);
+}
+
+// Gathers the names of a directory into one buffer.
+struct names
+{
+	struct walk_list *list;
+	size_t *offs;
+	size_t ents_alloc;
+	size_t offs_alloc;
+	size_t names_len;
+	size_t names_alloc;
+	size_t longest;
+};
+
+static int grow(void **ptr, size_t *alloc, size_t need, size_t size)
+{
+	void *tmp;
+	size_t a=*alloc;
+	if(need<=a) return 0;
+	if(!a) a=16;
+	while(a<need) a*=2;
+	if(!(tmp=realloc(*ptr, a*size)))
+	{
+		logp("out of memory in %s\n", __func__);
+		return -1;
+	}
+	*ptr=tmp;
+	*alloc=a;
+	return 0;
+}
+
+static int add_name(struct names *n, const char *name)
+{
+	size_t len;
+	struct walk_list *list=n->list;
+
+	if(!strcmp(name, ".") || !strcmp(name, ".."))
+		return 0;
+
+	len=strlen(name);
+	if(grow((void **)&list->ents, &n->ents_alloc, list->count+1,
+		sizeof(struct walk_ent))
+	  || grow((void **)&n->offs, &n->offs_alloc, list->count+1,
+		sizeof(size_t))
+	  || grow((void **)&list->names, &n->names_alloc,
+		n->names_len+len+1, 1))
+		return -1;
+	// Only the offset for now, as the buffer may yet move.
+	memcpy(list->names+n->names_len, name, len+1);
+	n->offs[list->count]=n->names_len;
+	n->names_len+=len+1;
+	if(len>n->longest) n->longest=len;
+	list->count++;
+	return 0;
+}
+
+#if defined(HAVE_GETDENTS64) && defined(O_DIRECTORY) && defined(O_NOATIME)
+#define USE_GETDENTS
+#if defined(HAVE_STATX)
+#define USE_STATX
+#include <sys/sysmacros.h>
+#endif
+#endif
+
+#ifdef USE_GETDENTS
+// How much of a directory to get from the kernel at a time.
+#define GETDENTS_BUF	(64*1024)
+
+// Reads the entries in big batches, instead of one readdir() at a time.
+static int read_names(int dfd, struct names *n)
+{
+	int ret=-1;
+	ssize_t got;
+	ssize_t off;
+	char *buf;
+
+	if(!(buf=(char *)malloc(GETDENTS_BUF)))
+	{
+		logp("out of memory in %s\n", __func__);
+		return -1;
+	}
+	while((got=getdents64(dfd, buf, GETDENTS_BUF))>0)
+	{
+		for(off=0; off<got; )
+		{
+			struct dirent64 *d=(struct dirent64 *)(buf+off);
+			if(add_name(n, d->d_name)) goto end;
+			off+=d->d_reclen;
+		}
+	}
+	// An error part way through counts as the end of the directory, as
+	// it does with readdir().
+	ret=0;
+end:
+	free(buf);
+	return ret;
+}
+#else
+static int read_names(DIR *directory, struct names *n)
+{
+	int ret=-1;
+	struct dirent *entry=NULL;
+	struct dirent *result=NULL;
+
+	if(!(entry=(struct dirent *)malloc(
+		sizeof(struct dirent)+fs_name_max+100)))
+	{
+		logp("out of memory in %s\n", __func__);
+		return -1;
+	}
+	while(1)
+	{
+		if(readdir_r(directory, entry, &result) || !result)
+			break;
+		if(add_name(n, entry->d_name)) goto end;
+	}
+	ret=0;
+end:
+	free(entry);
+	return ret;
+}
+#endif
+
+#ifdef USE_STATX
+static uint8_t no_statx=0;
+
+// Asks only for what attribs_encode() keeps, so the file system need not
+// go looking for anything else, such as the birth time.
+#define WALK_STATX_MASK	(STATX_TYPE|STATX_MODE|STATX_NLINK \
+	|STATX_UID|STATX_GID|STATX_INO|STATX_SIZE|STATX_BLOCKS \
+	|STATX_ATIME|STATX_MTIME|STATX_CTIME)
+
+static int stat_at(int dfd, const char *name, struct stat *statp)
+{
+	struct statx stx;
+
+	if(!no_statx)
+	{
+		if(statx(dfd, name, AT_SYMLINK_NOFOLLOW|AT_NO_AUTOMOUNT,
+			WALK_STATX_MASK, &stx))
+		{
+			if(errno!=ENOSYS) return -1;
+			// The C library has it, but the kernel does not.
+			no_statx=1;
+		}
+		// Some file systems cannot fill in everything that was asked
+		// for, and say so in the mask. Leave those to fstatat().
+		else if((stx.stx_mask&WALK_STATX_MASK)==WALK_STATX_MASK)
+		{
+			memset(statp, 0, sizeof(struct stat));
+			statp->st_dev=makedev(stx.stx_dev_major,
+				stx.stx_dev_minor);
+			statp->st_ino=stx.stx_ino;
+			statp->st_mode=stx.stx_mode;
+			statp->st_nlink=stx.stx_nlink;
+			statp->st_uid=stx.stx_uid;
+			statp->st_gid=stx.stx_gid;
+			statp->st_rdev=makedev(stx.stx_rdev_major,
+				stx.stx_rdev_minor);
+			statp->st_size=stx.stx_size;
+			statp->st_blksize=stx.stx_blksize;
+			statp->st_blocks=stx.stx_blocks;
+			statp->st_atim.tv_sec=stx.stx_atime.tv_sec;
+			statp->st_atim.tv_nsec=stx.stx_atime.tv_nsec;
+			statp->st_mtim.tv_sec=stx.stx_mtime.tv_sec;
+			statp->st_mtim.tv_nsec=stx.stx_mtime.tv_nsec;
+			statp->st_ctim.tv_sec=stx.stx_ctime.tv_sec;
+			statp->st_ctim.tv_nsec=stx.stx_ctime.tv_nsec;
+			return 0;
+		}
+	}
+	return fstatat(dfd, name, statp, AT_SYMLINK_NOFOLLOW);
+}
+#endif
+
+#if defined(O_DIRECTORY) && defined(O_NOATIME)
+// Only the owner of a directory, or root, may open it with O_NOATIME, so try
+// again without it rather than leave the directory out.
+static int open_dir(const char *path, int atime)
+{
+	int fd;
+	if(!atime
+	  && ((fd=open(path, O_RDONLY|O_DIRECTORY|O_NOATIME))>=0
+		|| errno!=EPERM))
+			return fd;
+	return open(path, O_RDONLY|O_DIRECTORY);
+}
+#endif
+
+// Lists the directory, and stats its entries.
+static struct walk_list *walk_read(const char *path,
+	struct conf **confs, int do_stat)
+{
+	int i;
+	size_t plen;
+	char *fullpath=NULL;
+#ifndef USE_GETDENTS
+	DIR *directory=NULL;
+#endif
+	struct names n;
+	struct walk_list *list=NULL;
+
+	memset(&n, 0, sizeof(n));
+	if(!(list=(struct walk_list *)calloc(1, sizeof(struct walk_list))))
+	{
+		logp("out of memory in %s\n", __func__);
+		return NULL;
+	}
+	n.list=list;
+
+	errno=0;
+#if defined(O_DIRECTORY) && defined(O_NOATIME)
+	int dfd=-1;
+	if((dfd=open_dir(path, get_int(confs[OPT_ATIME])))<0
+#ifndef USE_GETDENTS
+	  || !(directory=fdopendir(dfd))
+#endif
+	)
+#else
+// Mac OS X appears to have no O_NOATIME and no fdopendir(), so it should
+// end up using opendir() here.
+	if(!(directory=opendir(path)))
+#endif
+	{
+#if defined(O_DIRECTORY) && defined(O_NOATIME)
+		if(dfd>=0) close(dfd);
+#endif
+		list->noopen=1;
+		return list;
+	}
+
+#ifdef USE_GETDENTS
+	if(read_names(dfd, &n))
+#else
+	if(read_names(directory, &n))
+#endif
+		goto error;
+
+	// The names have stopped moving, so they can be pointed at now.
+	for(i=0; i<list->count; i++)
+	{
+		memset(&list->ents[i], 0, sizeof(struct walk_ent));
+		list->ents[i].name=list->names+n.offs[i];
+	}
+	if(list->count) qsort(list->ents, list->count,
+		sizeof(struct walk_ent), ent_cmp);
+
+	if(do_stat && list->count)
+	{
+		plen=dir_len(path);
+		if(!(fullpath=(char *)malloc(plen+n.longest+2)))
+		{
+			logp("out of memory in %s\n", __func__);
+			goto error;
+		}
+		memcpy(fullpath, path, plen);
+		fullpath[plen++]='/';
+		for(i=0; i<list->count; i++)
+		{
+			struct walk_ent *e=&list->ents[i];
+			strcpy(fullpath+plen, e->name);
+			// Only things that the scan will look at.
+			if(!file_is_included_no_incext(fullpath))
+				continue;
+#ifdef USE_STATX
+			// Relative to the directory, so that the kernel does
+			// not have to look up the whole path every time.
+			e->stat_ret=stat_at(dfd, e->name, &e->statp);
+#else
+			e->stat_ret=lstat(fullpath, &e->statp);
+#endif
+			e->stat_done=1;
+		}
+	}
+
+#ifdef USE_GETDENTS
+	close(dfd);
+#else
+	closedir(directory);
+#endif
+	free(fullpath);
+	free(n.offs);
+	return list;
+error:
+#ifdef USE_GETDENTS
+	close(dfd);
+#else
+	closedir(directory);
+#endif
+	free(fullpath);
+	free(n.offs);
+	walk_list_free(&list);
+	return NULL;
+}
+
+#ifndef HAVE_WIN32
+
+static void node_free(struct walk_node **node)
+{
+	if(!node || !*node) return;
+	free((*node)->path);
+	walk_list_free(&(*node)->list);
+	free(*node);
+	*node=NULL;
+}
+
+static void node_unlink(struct walk *walk, struct walk_node *node)
+{
+	struct walk_node **n;
+	for(n=&walk->nodes; *n; n=&(*n)->next)
+	{
+		if(*n!=node) continue;
+		*n=node->next;
+		node->next=NULL;
+		walk->count--;
+		return;
+	}
+}
+
+// Called with the lock held. Returns 1 if there is no more room.
+static int queue_node(struct walk *walk,
+	const char *dir, size_t dlen, const char *name, dev_t dev)
+{
+	int cmp;
+	size_t len=strlen(name);
+	struct walk_node *node;
+	struct walk_node *victim=NULL;
+	struct walk_node **n;
+	char *path;
+
+	if(!(path=(char *)malloc(dlen+len+2)))
+		return 1;
+	memcpy(path, dir, dlen);
+	path[dlen]='/';
+	memcpy(path+dlen+1, name, len+1);
+
+	// The scan has already gone past it, or will not need to read it.
+	if(pathcmp(path, walk->pos)<=0
+	  || journal_is_clean(walk->journal, path))
+	{
+		free(path);
+		return 0;
+	}
+
+	if(walk->count>=walk->max)
+	{
+		// Make room by dropping whatever is furthest away, as long as
+		// that is further away than the new one.
+		for(node=walk->nodes; node; node=node->next)
+			if(node->state!=WALK_RUNNING
+			  && pathcmp(node->path, path)>0)
+				victim=node;
+		if(!victim)
+		{
+			free(path);
+			return 1;
+		}
+		node_unlink(walk, victim);
+		node_free(&victim);
+	}
+
+	for(n=&walk->nodes; *n; n=&(*n)->next)
+		if((cmp=pathcmp((*n)->path, path))>=0) break;
+	if(*n && !cmp)
+	{
+		free(path);
+		return 0;
+	}
+
+	if(!(node=(struct walk_node *)calloc(1, sizeof(struct walk_node))))
+	{
+		free(path);
+		return 1;
+	}
+	node->path=path;
+	node->dev=dev;
+	node->next=*n;
+	*n=node;
+	walk->count++;
+	return 0;
+}
+
+// Called with the lock held.
+static void queue_children(struct walk *walk, const char *path, dev_t dev,
+	struct walk_list *list)
+{
+	int i;
+	size_t dlen;
+	struct strlist *l;
+
+	if(list->noopen) return;
+
+	// The scan will not go into a directory containing one of the
+	// 'nobackup' files.
+	for(l=get_strlist(walk->confs[OPT_NOBACKUP]); l; l=l->next)
+		for(i=0; i<list->count; i++)
+			if(!strcmp(list->ents[i].name, l->path))
+				return;
+
+	dlen=dir_len(path);
+	for(i=0; i<list->count; i++)
+	{
+		struct walk_ent *e=&list->ents[i];
+		if(!e->stat_done
+		  || e->stat_ret
+		  || !S_ISDIR(e->statp.st_mode)
+		  || e->statp.st_dev!=dev)
+			continue;
+		if(queue_node(walk, path, dlen, e->name, dev))
+			break;
+	}
+	pthread_cond_broadcast(&walk->work_cond);
+}
+
+static void *walk_worker(void *arg)
+{
+	struct walk *walk=(struct walk *)arg;
+	struct walk_node *node;
+	struct walk_list *list;
+
+	pthread_mutex_lock(&walk->lock);
+	while(!walk->stop)
+	{
+		// The nearest one first.
+		for(node=walk->nodes; node; node=node->next)
+			if(node->state==WALK_QUEUED) break;
+		if(!node)
+		{
+			pthread_cond_wait(&walk->work_cond, &walk->lock);
+			continue;
+		}
+		node->state=WALK_RUNNING;
+
+		pthread_mutex_unlock(&walk->lock);
+		list=walk_read(node->path, walk->confs, walk->do_stat);
+		pthread_mutex_lock(&walk->lock);
+
+		if(node->abandoned)
+		{
+			walk_list_free(&list);
+			node_free(&node);
+			continue;
+		}
+		node->list=list;
+		node->state=WALK_DONE;
+		if(list) queue_children(walk, node->path, node->dev, list);
+		pthread_cond_broadcast(&walk->done_cond);
+	}
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+// Called with the lock held. Returns the list for 'path' if it has been
+// read ahead, and forgets about everything before it.
+static struct walk_list *take_list(struct walk *walk, const char *path)
+{
+	struct walk_node *node;
+	struct walk_list *list=NULL;
+
+	free(walk->pos);
+	walk->pos=strdup(path);
+
+	while((node=walk->nodes) && pathcmp(node->path, path)<0)
+	{
+		node_unlink(walk, node);
+		if(node->state==WALK_RUNNING) node->abandoned=1;
+		else node_free(&node);
+	}
+	if(!node || pathcmp(node->path, path))
+		return NULL;
+
+	while(node->state==WALK_RUNNING)
+		pthread_cond_wait(&walk->done_cond, &walk->lock);
+	node_unlink(walk, node);
+	if(node->state==WALK_DONE)
+	{
+		list=node->list;
+		node->list=NULL;
+	}
+	node_free(&node);
+	return list;
+}
+
+#endif
+
+struct walk *walk_alloc(int threads, struct conf **confs,
+	struct journal *journal)
+{
+	struct walk *walk;
+	if(!(walk=(struct walk *)calloc_w(1, sizeof(struct walk), __func__)))
+		return NULL;
+	walk->confs=confs;
+	walk->journal=journal;
+#ifdef HAVE_WIN32
+	// win32_lstat() gets more than lstat() does, so leave the stats to
+	// the scan.
+	walk->do_stat=0;
+	walk->threads=0;
+#else
+	walk->do_stat=1;
+	if(threads<0) threads=0;
+	walk->max=threads*8;
+	pthread_mutex_init(&walk->lock, NULL);
+	pthread_cond_init(&walk->work_cond, NULL);
+	pthread_cond_init(&walk->done_cond, NULL);
+	if(threads>0
+	  && !(walk->tids=(pthread_t *)
+		calloc_w(threads, sizeof(pthread_t), __func__)))
+			goto error;
+	for(walk->threads=0; walk->threads<threads; walk->threads++)
+	{
+		if(pthread_create(&walk->tids[walk->threads],
+			NULL, walk_worker, walk))
+		{
+			logp("Could not create scan thread: %s\n",
+				strerror(errno));
+			goto error;
+		}
+	}
+#endif
+	return walk;
+#ifndef HAVE_WIN32
+error:
+	walk_free(&walk);
+	return NULL;
+#endif
+}
+
+void walk_free(struct walk **walk)
+{
+	if(!walk || !*walk) return;
+#ifndef HAVE_WIN32
+	{
+		int i;
+		struct walk_node *node;
+		pthread_mutex_lock(&(*walk)->lock);
+		(*walk)->stop=1;
+		pthread_cond_broadcast(&(*walk)->work_cond);
+		pthread_mutex_unlock(&(*walk)->lock);
+		for(i=0; i<(*walk)->threads; i++)
+			pthread_join((*walk)->tids[i], NULL);
+		while((node=(*walk)->nodes))
+		{
+			(*walk)->nodes=node->next;
+			node_free(&node);
+		}
+		pthread_mutex_destroy(&(*walk)->lock);
+		pthread_cond_destroy(&(*walk)->work_cond);
+		pthread_cond_destroy(&(*walk)->done_cond);
+		free((*walk)->pos);
+		free_v((void **)&(*walk)->tids);
+	}
+#endif
+	free_v((void **)walk);
+}
+
+int walk_get(struct walk *walk, const char *path, dev_t dev,
+	struct walk_list **list)
+{
+	*list=NULL;
+#ifndef HAVE_WIN32
+	if(walk->threads)
+	{
+		pthread_mutex_lock(&walk->lock);
+		*list=take_list(walk, path);
+		pthread_mutex_unlock(&walk->lock);
+		if(*list) goto end;
+	}
+#endif
+	if(journal_get(walk->journal, path, list))
+		return -1;
+	if(!*list && !(*list=walk_read(path, walk->confs, walk->do_stat)))
+		return -1;
+#ifndef HAVE_WIN32
+	if(walk->threads)
+	{
+		pthread_mutex_lock(&walk->lock);
+		queue_children(walk, path, dev, *list);
+		pthread_mutex_unlock(&walk->lock);
+	}
+end:
+#endif
+	return journal_put(walk->journal, path, *list);
+}
@@ -0,0 +1,47 @@
+#ifndef _WALK_H
+#define _WALK_H
+
+// Reads the directories of the file system scan ahead of time, on a pool of
+// threads. While the scan is busy with one directory, the workers list the
+// directories that come after it, and stat their entries, so that when the
+// scan gets to them the work has already been done. The scan itself stays
+// on the one thread, so the entries still come out in exactly the same
+// order.
+// Only a limited number of directories are read ahead, and those nearest
+// to where the scan has got to are done first.
+
+struct walk_ent
+{
+	char *name;
+	// Set if the entry was looked at with lstat() when it was read.
+	uint8_t stat_done;
+	int stat_ret;
+	struct stat statp;
+};
+
+struct walk_list
+{
+	// In pathcmp() order, without '.' and '..'.
+	struct walk_ent *ents;
+	int count;
+	// Set if the directory could not be opened.
+	uint8_t noopen;
+	char *names;
+};
+
+struct walk;
+struct journal;
+
+// Directories that the journal says have not changed are taken from it,
+// and are not read ahead.
+extern struct walk *walk_alloc(int threads, struct conf **confs,
+	struct journal *journal);
+extern void walk_free(struct walk **walk);
+
+// Gets the entries of the directory 'path', which is on device 'dev'.
+// Returns -1 on error, with 'list' left NULL.
+extern int walk_get(struct walk *walk, const char *path, dev_t dev,
+	struct walk_list **list);
+extern void walk_list_free(struct walk_list **list);
+
+#endif
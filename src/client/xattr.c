@@ -6,21 +6,26 @@
  || defined(HAVE_NETBSD_OS) \
  || defined(HAVE_OPENBSD_OS)
 
-static char *get_next_str(struct asfd *asfd, char **data, size_t *l,
-	struct conf **confs, ssize_t *s, const char *path)
+static char *get_next_str(char **data, size_t *l, ssize_t *s,
+	const char **failed)
 {
 	char *ret=NULL;
 
-	if((sscanf(*data, "%08X", (unsigned int *)s))!=1)
+	if(*l<8 || (sscanf(*data, "%08X", (unsigned int *)s))!=1
+	  || *s<0 || (size_t)*s>*l-8)
 	{
-		logw(asfd, confs, "sscanf of xattr '%s' %d failed for %s\n",
-			*data, *l, path);
+		*failed="read xattr";
+		errno=EINVAL;
 		return NULL;
 	}
 	*data+=8;
 	*l-=8;
-	if(!(ret=(char *)malloc_w((*s)+1, __func__)))
+	// Plain malloc(), as this can be used from a worker thread.
+	if(!(ret=(char *)malloc((*s)+1)))
+	{
+		*failed="allocate xattr";
 		return NULL;
+	}
 	memcpy(ret, *data, *s);
 	ret[*s]='\0';
 
@@ -29,6 +34,14 @@ static char *get_next_str(struct asfd *asfd, char **data, size_t *l,
 
 	return ret;
 }
+
+static int log_set_xattr(struct asfd *asfd, struct conf **confs,
+	const char *path, const char *failed)
+{
+	logw(asfd, confs, "Could not %s on %s: %s\n",
+		failed, path, strerror(errno));
+	return -1;
+}
 #endif
 #endif
 
@@ -199,9 +212,8 @@ int get_xattr(struct asfd *asfd, struct sbuf *sb,
 	return 0;
 }
 
-static int do_set_xattr(struct asfd *asfd,
-	const char *path, struct sbuf *sb,
-	const char *xattrtext, size_t xlen, struct conf **confs)
+static int do_set_xattr(const char *path,
+	const char *xattrtext, size_t xlen, const char **failed)
 {
 	size_t l=0;
 	int ret=-1;
@@ -214,44 +226,52 @@ static int do_set_xattr(struct asfd *asfd,
 	while(l>0)
 	{
 		ssize_t s=0;
-		free_w(&name);
-		free_w(&value);
+		free(name);
+		free(value);
+		value=NULL;
 
-		if(!(name=get_next_str(asfd, &data, &l, confs, &s, path))
-		  || !(value=get_next_str(asfd, &data, &l, confs, &s, path)))
+		if(!(name=get_next_str(&data, &l, &s, failed))
+		  || !(value=get_next_str(&data, &l, &s, failed)))
 			goto end;
 
 		if(lsetxattr(path, name, value, strlen(value), 0))
 		{
-			logw(asfd, confs, "lsetxattr error on %s: %s\n",
-				path, strerror(errno));
+			*failed="lsetxattr";
 			goto end;
 		}
 	}
 
 	ret=0;
 end:
-	free_w(&name);
-	free_w(&value);
+	free(name);
+	free(value);
 	return ret;
 }
 
-int set_xattr(struct asfd *asfd, const char *path, struct sbuf *sb,
-	const char *xattrtext, size_t xlen, char metacmd, struct conf **confs)
+int set_xattr_quiet(const char *path, const char *xattrtext, size_t xlen,
+	char metacmd, const char **failed)
 {
 	switch(metacmd)
 	{
 		case META_XATTR:
-			return do_set_xattr(asfd,
-				path, sb, xattrtext, xlen, confs);
+			return do_set_xattr(path, xattrtext, xlen, failed);
 		default:
-			logp("unknown xattr type: %c\n", metacmd);
-			logw(asfd, confs, "unknown xattr type: %c\n", metacmd);
+			*failed="set unknown xattr type";
+			errno=EINVAL;
 			break;
 	}
 	return -1;
 }
 
+int set_xattr(struct asfd *asfd, const char *path, struct sbuf *sb,
+	const char *xattrtext, size_t xlen, char metacmd, struct conf **confs)
+{
+	const char *failed=NULL;
+	if(!set_xattr_quiet(path, xattrtext, xlen, metacmd, &failed))
+		return 0;
+	return log_set_xattr(asfd, confs, path, failed);
+}
+
 #endif // HAVE_LINUX_OS
 
 #if defined(HAVE_FREEBSD_OS) \
@@ -457,9 +477,8 @@ int get_xattr(struct asfd *asfd, struct sbuf *sb,
 	return 0;
 }
 
-static int do_set_xattr_bsd(struct asfd *asfd,
-	const char *path, struct sbuf *sb,
-	const char *xattrtext, size_t xlen, struct conf **confs)
+static int do_set_xattr_bsd(const char *path,
+	const char *xattrtext, size_t xlen, const char **failed)
 {
 	int ret=-1;
 	size_t l=0;
@@ -476,16 +495,15 @@ static int do_set_xattr_bsd(struct asfd *asfd,
 		int cnspace=0;
 		char *name=NULL;
 
-		if(!(nspace=get_next_str(asfd, &data, &l, confs, &vlen, path))
-		  || !(value=get_next_str(asfd, &data, &l, confs, &vlen, path)))
+		if(!(nspace=get_next_str(&data, &l, &vlen, failed))
+		  || !(value=get_next_str(&data, &l, &vlen, failed)))
 			goto end;
 
 		// Need to split the name into two parts.
 		if(!(name=strchr(nspace, '.')))
 		{
-			logw(asfd, confs,
-			  "could not split %s into namespace and name on %s\n",
-				nspace, path);
+			*failed="split xattr namespace and name";
+			errno=EINVAL;
 			goto end;
 		}
 		*name='\0';
@@ -493,9 +511,7 @@ static int do_set_xattr_bsd(struct asfd *asfd,
 
 		if(extattr_string_to_namespace(nspace, &cnspace))
 		{
-			logw(asfd, confs,
-				"could not convert %s into namespace on %s",
-				nspace, path);
+			*failed="convert xattr namespace";
 			goto end;
 		}
 
@@ -503,39 +519,47 @@ static int do_set_xattr_bsd(struct asfd *asfd,
 		if((cnt=extattr_set_link(path,
 			cnspace, name, value, vlen))!=vlen)
 		{
-			logw(asfd, confs,
-				"extattr_set_link error on %s %d!=vlen: %s\n",
-				path, strerror(errno));
+			*failed="extattr_set_link";
 			goto end;
 		}
 
-		free_w(&nspace);
-		free_w(&value);
+		free(nspace);
+		free(value);
+		nspace=NULL;
+		value=NULL;
 	}
 	ret=0;
 end:
-	free_w(&nspace);
-	free_w(&value);
+	free(nspace);
+	free(value);
 	return ret;
 }
 
-int set_xattr(struct asfd *asfd, const char *path,
-	struct sbuf *sb, const char *xattrtext,
-	size_t xlen, char metacmd, struct conf **confs)
+int set_xattr_quiet(const char *path, const char *xattrtext, size_t xlen,
+	char metacmd, const char **failed)
 {
 	switch(metacmd)
 	{
 		case META_XATTR_BSD:
-			return do_set_xattr_bsd(asfd, path, sb,
-				xattrtext, xlen, confs);
+			return do_set_xattr_bsd(path, xattrtext, xlen, failed);
 		default:
-			logp("unknown xattr type: %c\n", metacmd);
-			logw(asfd, confs, "unknown xattr type: %c\n", metacmd);
+			*failed="set unknown xattr type";
+			errno=EINVAL;
 			break;
 	}
 	return -1;
 }
 
+int set_xattr(struct asfd *asfd, const char *path,
+	struct sbuf *sb, const char *xattrtext,
+	size_t xlen, char metacmd, struct conf **confs)
+{
+	const char *failed=NULL;
+	if(!set_xattr_quiet(path, xattrtext, xlen, metacmd, &failed))
+		return 0;
+	return log_set_xattr(asfd, confs, path, failed);
+}
+
 #endif // HAVE_FREE/NET/OPENBSD_OS
 
 #endif // HAVE_XATTR
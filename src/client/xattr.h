@@ -11,6 +11,10 @@ extern int get_xattr(struct asfd *asfd, struct sbuf *sb,
 	char **xattrtext, size_t *xlen, struct conf **confs);
 extern int set_xattr(struct asfd *asfd, const char *path, struct sbuf *sb,
 	const char *xattrtext, size_t xlen, char metacmd, struct conf **confs);
+// Logs nothing. On failure, returns -1 with errno set and 'failed' saying
+// what could not be done.
+extern int set_xattr_quiet(const char *path, const char *xattrtext,
+	size_t xlen, char metacmd, const char **failed);
 #endif
 #endif
 
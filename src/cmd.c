@@ -46,6 +46,14 @@ static char *cmd_to_text(enum cmd cmd)
 			snprintf(buf, len, "Warning"); break;
 		case CMD_END_FILE:
 			snprintf(buf, len, "End of file transmission"); break;
+		case CMD_META_REF:
+			snprintf(buf, len, "Extra meta data sent earlier"); break;
+		case CMD_APPEND_FROM:
+			snprintf(buf, len, "End of a grown file"); break;
+		case CMD_SIG_FILTER:
+			snprintf(buf, len, "Filter of blocks already got"); break;
+		case CMD_SIG_REF:
+			snprintf(buf, len, "References to block signatures"); break;
 		case CMD_ENC_METADATA:
 			snprintf(buf, len, "Encrypted meta data"); break;
 		case CMD_EFS_FILE:
@@ -75,6 +83,8 @@ static char *cmd_to_text(enum cmd cmd)
 			snprintf(buf, len, "Bytes received"); break;
 		case CMD_BYTES_SENT:
 			snprintf(buf, len, "Bytes sent"); break;
+		case CMD_THROTTLED:
+			snprintf(buf, len, "Time throttled"); break;
 
 		// Legacy.
 		case CMD_DATAPTH:
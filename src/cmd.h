@@ -38,6 +38,15 @@ enum cmd
 	CMD_END_FILE	='x',	/* End of file transmission - also appears at
 				   the end of the manifest and contains
 				   size/checksum info. */
+	CMD_META_REF	='j',	/* Extra meta data the same as some that was
+				   sent earlier in the backup */
+	CMD_APPEND_FROM	='h',	/* Only the end of a file that has grown since
+				   the last backup */
+	CMD_SIG_FILTER	='g',	/* Part of a filter of the blocks that the
+				   server already has */
+	CMD_SIG_REF	='o',	/* Short references to blocks that the server
+				   probably already has, instead of their
+				   signatures */
 
 /* CMD_FILE_UNCHANGED only used in counting stats on the client, for humans */
 	CMD_FILE_CHANGED='z',
@@ -59,6 +68,7 @@ enum cmd
 	CMD_BYTES_RECV	='P',
 	CMD_BYTES_SENT	='Q',
 	CMD_TIMESTAMP_END='E',
+	CMD_THROTTLED	='T',	/* Seconds spent throttled */
 
 // Legacy stuff
 	CMD_DATAPTH	='t',	/* Path to data on the server */
@@ -69,6 +79,11 @@ enum cmd
 };
 
 
+// Both ends of a protocol1 backup keep track of the first this many lots of
+// extra meta data that get sent whole, so that CMD_META_REF can refer back
+// to them by number.
+#define META_REF_MAX	65536
+
 extern void cmd_print_all(void);
 extern int cmd_is_filedata(enum cmd cmd);
 extern int cmd_is_link(enum cmd cmd);
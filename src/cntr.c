@@ -89,6 +89,8 @@ int cntr_init(struct cntr *cntr, const char *cname)
 		CMD_TIMESTAMP_END, "time_end", "End time")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
 		CMD_TIMESTAMP, "time_start", "Start time")
+	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
+		CMD_THROTTLED, "time_throttled", "Time throttled")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
 		CMD_BYTES_SENT, "bytes_sent", "Bytes sent")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
@@ -358,6 +360,11 @@ void cntr_add_sentbytes(struct cntr *c, unsigned long long bytes)
 	incr_count_val(c, CMD_BYTES_SENT, bytes);
 }
 
+void cntr_add_throttled(struct cntr *c, unsigned long long secs)
+{
+	incr_count_val(c, CMD_THROTTLED, secs);
+}
+
 void cntr_add_recvbytes(struct cntr *c, unsigned long long bytes)
 {
 	incr_count_val(c, CMD_BYTES_RECV, bytes);
@@ -463,6 +470,11 @@ static void bottom_part(struct cntr *c, enum action act)
 		logc("           Bytes sent:   % 11llu", l);
 		logc("%s\n", bytes_to_human(l));
 	}
+	if((l=get_count(e, CMD_THROTTLED)))
+	{
+		logc("       Time throttled:   % 11llu", l);
+		logc(" (%s)\n", time_taken((time_t)l));
+	}
 }
 
 void cntr_print(struct cntr *cntr, enum action act)
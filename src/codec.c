@@ -0,0 +1,139 @@
+#include "burp.h"
+#include "codec.h"
+#include "log.h"
+
+#define ZSTD_DEFAULT_LEVEL	3
+#define ZSTD_MAX_LEVEL		19
+#define LZ4_MAX_LEVEL		12
+
+int codec_compression(enum codec codec, int level)
+{
+	if(codec==CODEC_GZIP) return level;
+	return (codec<<CODEC_SHIFT)|(level&CODEC_LEVEL_MASK);
+}
+
+enum codec codec_get(int compression)
+{
+	if(compression<=0) return CODEC_GZIP;
+	return (enum codec)(compression>>CODEC_SHIFT);
+}
+
+int codec_level(int compression)
+{
+	if(compression<=0) return 0;
+	return compression&CODEC_LEVEL_MASK;
+}
+
+const char *codec_name(enum codec codec)
+{
+	switch(codec)
+	{
+		case CODEC_GZIP: return "gzip";
+		case CODEC_ZSTD: return "zstd";
+		case CODEC_LZ4: return "lz4";
+	}
+	return "unknown";
+}
+
+const char *codec_ext(int compression)
+{
+	switch(codec_get(compression))
+	{
+		case CODEC_ZSTD: return ".zst";
+		case CODEC_LZ4: return ".lz4";
+		case CODEC_GZIP:
+		default: return ".gz";
+	}
+}
+
+int codec_available(enum codec codec)
+{
+	switch(codec)
+	{
+		case CODEC_GZIP:
+			return 1;
+		case CODEC_ZSTD:
+#if defined(HAVE_ZSTD) && defined(HAVE_FOPENCOOKIE)
+			return 1;
+#else
+			return 0;
+#endif
+		case CODEC_LZ4:
+#if defined(HAVE_LZ4) && defined(HAVE_FOPENCOOKIE)
+			return 1;
+#else
+			return 0;
+#endif
+	}
+	return 0;
+}
+
+static int get_level(const char *cp, int dflt, int max)
+{
+	int level;
+	if(!*cp) return dflt;
+	if(strspn(cp, "0123456789")!=strlen(cp) || strlen(cp)>2)
+		return -1;
+	level=atoi(cp);
+	if(level>max) return -1;
+	return level;
+}
+
+// Parses things like 'gzip9', 'zstd3' or 'lz4'. A bare number is a gzip
+// level, as before.
+// Returns the compression value, or -1 on error.
+int codec_parse(const char *v)
+{
+	int level;
+	enum codec codec;
+	const char *cp=v;
+
+	if(!strncmp(v, "zstd", strlen("zstd")))
+	{
+		codec=CODEC_ZSTD;
+		cp=v+strlen("zstd");
+		if((level=get_level(cp, ZSTD_DEFAULT_LEVEL, ZSTD_MAX_LEVEL))<0)
+			return -1;
+		// zstd has no level 0 of its own - take it as the default.
+		if(!level) level=ZSTD_DEFAULT_LEVEL;
+	}
+	else if(!strncmp(v, "lz4", strlen("lz4")))
+	{
+		codec=CODEC_LZ4;
+		cp=v+strlen("lz4");
+		// Level 0 is the fast mode, and still compresses.
+		if((level=get_level(cp, 0, LZ4_MAX_LEVEL))<0)
+			return -1;
+	}
+	else
+	{
+		if(!strncmp(v, "gzip", strlen("gzip"))
+		  || !(strncmp(v, "zlib", strlen("zlib"))))
+			cp=v+strlen("gzip"); // Or "zlib".
+		if(strlen(cp)==1 && isdigit(*cp))
+			return atoi(cp);
+		return -1;
+	}
+	if(!codec_available(codec))
+	{
+		logp("compression '%s' is not supported by this build\n", v);
+		return -1;
+	}
+	return codec_compression(codec, level);
+}
+
+// The client only knows about gzip. With the other codecs, it is told to
+// send the data as it is, and the server does the compression.
+int codec_client_level(int compression)
+{
+	if(codec_get(compression)==CODEC_GZIP) return compression;
+	return 0;
+}
+
+// Deltas and manifests stay gzipped whatever the codec. If the codec was
+// chosen for speed, do not let them slow things down.
+int codec_gzip_level(int compression)
+{
+	if(codec_get(compression)==CODEC_GZIP) return compression;
+	return 1;
+}
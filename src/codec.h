@@ -0,0 +1,29 @@
+#ifndef _CODEC_H
+#define _CODEC_H
+
+// Protocol1 data files can be stored with something other than gzip.
+// The codec and its level are packed into the compression value that goes
+// into the manifest, so a storage directory can hold a mix of them.
+// Plain gzip levels keep their old values, and 0 is still no compression.
+
+enum codec
+{
+	CODEC_GZIP=0,
+	CODEC_ZSTD,
+	CODEC_LZ4
+};
+
+#define CODEC_SHIFT		8
+#define CODEC_LEVEL_MASK	0xff
+
+extern int codec_compression(enum codec codec, int level);
+extern enum codec codec_get(int compression);
+extern int codec_level(int compression);
+extern const char *codec_name(enum codec codec);
+extern const char *codec_ext(int compression);
+extern int codec_available(enum codec codec);
+extern int codec_parse(const char *v);
+extern int codec_client_level(int compression);
+extern int codec_gzip_level(int compression);
+
+#endif
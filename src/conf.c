@@ -6,6 +6,7 @@
 #include "cntr.h"
 #include "strlist.h"
 #include "prepend.h"
+#include "protocol1/enc.h"
 #include "server/dpth.h"
 
 #include <assert.h>
@@ -370,6 +371,8 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_int(c[o], 5, 0, "ssl_compression");
 	case OPT_RATELIMIT:
 	  return sc_flt(c[o], 0, 0, "ratelimit");
+	case OPT_PRESSURE_LIMIT:
+	  return sc_int(c[o], 0, 0, "pressure_limit");
 	case OPT_NETWORK_TIMEOUT:
 	  return sc_int(c[o], 60*60*2, 0, "network_timeout");
 	case OPT_CLIENT_IS_WINDOWS:
@@ -398,6 +401,12 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_int(c[o], 10000, 0, "max_hardlinks");
 	case OPT_MAX_STORAGE_SUBDIRS:
 	  return sc_int(c[o], MAX_STORAGE_SUBDIRS, 0, "max_storage_subdirs");
+	case OPT_DATA_FILE_SYNC:
+	  return sc_int(c[o], DATA_FILE_SYNC_CLOSE, 0, "data_file_sync");
+	case OPT_RESTORE_SPOOL_THREADS:
+	  return sc_int(c[o], 2, 0, "restore_spool_threads");
+	case OPT_SHUFFLE_THREADS:
+	  return sc_int(c[o], 4, 0, "shuffle_threads");
 	case OPT_DAEMON:
 	  return sc_int(c[o], 1, 0, "daemon");
 	case OPT_CA_CONF:
@@ -420,6 +429,8 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_str(c[o], 0, 0, "server");
 	case OPT_ENCRYPTION_PASSWORD:
 	  return sc_str(c[o], 0, 0, "encryption_password");
+	case OPT_ENCRYPTION_CIPHER:
+	  return sc_int(c[o], ENC_CIPHER_AES_256_GCM, 0, "encryption_cipher");
 	case OPT_AUTOUPGRADE_OS:
 	  return sc_str(c[o], 0, 0, "autoupgrade_os");
 	case OPT_AUTOUPGRADE_DIR:
@@ -436,6 +447,8 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_str(c[o], 0, CONF_FLAG_INCEXC_RESTORE, "restoreprefix");
 	case OPT_RESTORE_SPOOL:
 	  return sc_str(c[o], 0, 0, "restore_spool");
+	case OPT_RESTORE_THREADS:
+	  return sc_int(c[o], 4, 0, "restore_threads");
 	case OPT_BROWSEFILE:
 	  return sc_str(c[o], 0, 0, "browsefile");
 	case OPT_BROWSEDIR:
@@ -474,6 +487,12 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_int(c[o], 1, 0, "restore_script_reserved_args");
 	case OPT_SEND_CLIENT_CNTR:
 	  return sc_int(c[o], 0, 0, "send_client_cntr");
+	case OPT_META_REF:
+	  return sc_int(c[o], 0, 0, "meta_ref");
+	case OPT_APPEND_FROM:
+	  return sc_int(c[o], 0, CONF_FLAG_CC_OVERRIDE, "append_from");
+	case OPT_SIG_FILTER:
+	  return sc_int(c[o], 0, 0, "sig_filter");
 	case OPT_RESTORE_CLIENT:
 	  return sc_str(c[o], 0, 0, "");
 	case OPT_RESTORE_PATH:
@@ -562,6 +581,9 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	case OPT_HARDLINKED_ARCHIVE:
 	  return sc_int(c[o], 0,
 		CONF_FLAG_CC_OVERRIDE, "hardlinked_archive");
+	case OPT_INLINE_DEDUP:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "inline_dedup");
 	case OPT_KEEP:
 	  return sc_lst(c[o], 0,
 		CONF_FLAG_CC_OVERRIDE|CONF_FLAG_STRLIST_REPLACE, "keep");
@@ -571,6 +593,9 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	case OPT_COMPRESSION:
 	  return sc_int(c[o], 9,
 		CONF_FLAG_CC_OVERRIDE, "compression");
+	case OPT_COMPRESSION_THREADS:
+	  return sc_int(c[o], 4,
+		CONF_FLAG_CC_OVERRIDE, "compression_threads");
 	case OPT_VERSION_WARN:
 	  return sc_int(c[o], 1,
 		CONF_FLAG_CC_OVERRIDE, "version_warn");
@@ -706,6 +731,12 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_int(c[o], 0, CONF_FLAG_INCEXC, "atime");
 	case OPT_SCAN_PROBLEM_RAISES_ERROR:
 	  return sc_int(c[o], 0, CONF_FLAG_INCEXC, "scan_problem_raises_error");
+	case OPT_DELTA_THREADS:
+	  return sc_int(c[o], 4, 0, "delta_threads");
+	case OPT_SCAN_THREADS:
+	  return sc_int(c[o], 4, 0, "scan_threads");
+	case OPT_JOURNAL_DIR:
+	  return sc_str(c[o], 0, 0, "journal_dir");
 	case OPT_OVERWRITE:
 	  return sc_int(c[o], 0,
 		CONF_FLAG_INCEXC|CONF_FLAG_INCEXC_RESTORE, "overwrite");
@@ -84,6 +84,7 @@ enum conf_opt
 	OPT_USER,
 	OPT_GROUP,
 	OPT_RATELIMIT,
+	OPT_PRESSURE_LIMIT,
 	OPT_NETWORK_TIMEOUT,
 	OPT_CLIENT_IS_WINDOWS,
 	OPT_PEER_VERSION,
@@ -104,6 +105,9 @@ enum conf_opt
 	OPT_UMASK,
 	OPT_MAX_HARDLINKS,
 	OPT_MAX_STORAGE_SUBDIRS,
+	OPT_DATA_FILE_SYNC,
+	OPT_RESTORE_SPOOL_THREADS,
+	OPT_SHUFFLE_THREADS,
 	OPT_FORK,
 	OPT_DAEMON,
 	OPT_DIRECTORY_TREE,
@@ -122,6 +126,7 @@ enum conf_opt
 	OPT_PASSWD, // also a clientconfdir option
 	OPT_SERVER,
 	OPT_ENCRYPTION_PASSWORD,
+	OPT_ENCRYPTION_CIPHER,
 	OPT_AUTOUPGRADE_OS,
 	OPT_AUTOUPGRADE_DIR, // also a server option
 	OPT_CA_CSR_DIR,
@@ -153,6 +158,9 @@ enum conf_opt
 	OPT_VSS_DRIVES,
 	OPT_ATIME,
 	OPT_SCAN_PROBLEM_RAISES_ERROR,
+	OPT_DELTA_THREADS,
+	OPT_SCAN_THREADS,
+	OPT_JOURNAL_DIR,
 	// These are to do with restore.
 	OPT_OVERWRITE,
 	OPT_STRIP,
@@ -161,6 +169,7 @@ enum conf_opt
 	OPT_RESTOREPREFIX,
 	OPT_REGEX,
 	OPT_RESTORE_SPOOL,
+	OPT_RESTORE_THREADS,
 	// To do with listing.
 	OPT_BROWSEFILE,
 	OPT_BROWSEDIR,
@@ -203,6 +212,7 @@ enum conf_opt
 	// Client options on the server.
 	// They can be set globally in the server config, or for each client.
 	OPT_HARDLINKED_ARCHIVE,
+	OPT_INLINE_DEDUP,
 
 	OPT_KEEP,
 
@@ -210,6 +220,7 @@ enum conf_opt
 	OPT_LIBRSYNC,
 
 	OPT_COMPRESSION,
+	OPT_COMPRESSION_THREADS,
 	OPT_VERSION_WARN,
 	OPT_PATH_LENGTH_WARN,
 	OPT_HARD_QUOTA,
@@ -243,6 +254,19 @@ enum conf_opt
 	// counters on resume/verify/restore.
 	OPT_SEND_CLIENT_CNTR,
 
+	// Set to 1 on both client and server when the client may send
+	// CMD_META_REF instead of extra meta data that it has sent before.
+	OPT_META_REF,
+
+	// Set to 1 on both client and server when a protocol2 client may
+	// send only the end of a file that has grown since the last backup.
+	OPT_APPEND_FROM,
+
+	// Set to 1 on both client and server when the server may send a
+	// protocol2 client a filter of the blocks that it already has, and the
+	// client may then refer to those blocks instead of sending their sigs.
+	OPT_SIG_FILTER,
+
 	// Set on the server to the restore client name (the one that you
 	// connected with) when the client has switched to a different set of
 	// client backups.
@@ -1,5 +1,6 @@
 #include "burp.h"
 #include "alloc.h"
+#include "codec.h"
 #include "conf.h"
 #include "fsops.h"
 #include "handy.h"
@@ -9,6 +10,8 @@
 #include "pathcmp.h"
 #include "prepend.h"
 #include "strlist.h"
+#include "protocol1/enc.h"
+#include "server/dpth.h"
 #include "server/timestamp.h"
 #include "client/glob_windows.h"
 
@@ -262,10 +265,16 @@ static int load_conf_field_and_value(struct conf **c,
 {
 	if(!strcmp(f, "compression"))
 	{
-		int compression=get_compression(v);
+		int compression=codec_parse(v);
 		if(compression<0) return -1;
 		set_int(c[OPT_COMPRESSION], compression);
 	}
+	else if(!strcmp(f, "encryption_cipher"))
+	{
+		int cipher=enc_cipher_parse(v);
+		if(cipher<0) return -1;
+		set_int(c[OPT_ENCRYPTION_CIPHER], cipher);
+	}
 	else if(!strcmp(f, "ssl_compression"))
 	{
 		int compression=get_compression(v);
@@ -468,6 +477,9 @@ static int server_conf_checks(struct conf **c, const char *path, int *r)
 		conf_problem(path, "max_status_children too low", r);
 	if(get_int(c[OPT_MAX_STORAGE_SUBDIRS])<=1000)
 		conf_problem(path, "max_storage_subdirs too low", r);
+	if(get_int(c[OPT_DATA_FILE_SYNC])<DATA_FILE_SYNC_NONE
+	  || get_int(c[OPT_DATA_FILE_SYNC])>DATA_FILE_SYNC_RANGE)
+		conf_problem(path, "data_file_sync must be 0, 1 or 2", r);
 	if(!get_string(c[OPT_TIMESTAMP_FORMAT])
 	  && set_string(c[OPT_TIMESTAMP_FORMAT], DEFAULT_TIMESTAMP_FORMAT))
 			return -1;
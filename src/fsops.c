@@ -2,6 +2,12 @@
 #include "pathcmp.h"
 
 #include <dirent.h>
+#ifndef HAVE_WIN32
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#endif
 
 uint32_t fs_name_max=0;
 uint32_t fs_path_max=0;
@@ -120,7 +126,8 @@ int mkpath(char **rpath, const char *limit)
 				logp("will not mkdir %s\n", *rpath);
 				goto end;
 			}
-			if(mkdir(*rpath, 0777))
+			// Something else may have made it in the meantime.
+			if(mkdir(*rpath, 0777) && errno!=EEXIST)
 			{
 				logp("could not mkdir %s: %s\n", *rpath, strerror(errno));
 				goto end;
@@ -355,3 +362,125 @@ gzFile gzopen_file(const char *fname, const char *mode)
 	}
 	return fp;
 }
+
+#ifndef HAVE_WIN32
+// What the filesystem that files were last cloned onto turned out not to be
+// able to do, so that it is not asked again for every file.
+#define CLONE_NO_REFLINK	0x01
+#define CLONE_NO_COPY_RANGE	0x02
+static dev_t clone_dev=0;
+static uint8_t clone_flags=0;
+
+#define CLONE_CHUNK	65536
+
+static int clone_by_copy(int ifd, int ofd)
+{
+	ssize_t r;
+	ssize_t w;
+	ssize_t done;
+	char buf[CLONE_CHUNK];
+	while((r=read(ifd, buf, sizeof(buf))))
+	{
+		if(r<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		for(done=0; done<r; done+=w)
+		{
+			if((w=write(ofd, buf+done, r-done))<0)
+			{
+				if(errno==EINTR) w=0;
+				else return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Make newpath a copy of oldpath that does not share its inode.
+// Where the filesystem can do it, such as btrfs or XFS, the copy is a
+// reflink that shares the data blocks until one of them is written to.
+// Otherwise, copy_file_range() lets the kernel do the copying, and failing
+// that, it is read and written here.
+int clone_file(const char *oldpath, const char *newpath)
+{
+	int ret=-1;
+	int ifd=-1;
+	int ofd=-1;
+	struct stat statp;
+
+	if((ifd=open(oldpath, O_RDONLY))<0)
+	{
+		logp("could not open %s: %s\n", oldpath, strerror(errno));
+		goto end;
+	}
+	if((ofd=open(newpath, O_WRONLY|O_CREAT|O_TRUNC, 0666))<0)
+	{
+		logp("could not open %s: %s\n", newpath, strerror(errno));
+		goto end;
+	}
+	if(fstat(ofd, &statp))
+	{
+		logp("could not fstat %s: %s\n", newpath, strerror(errno));
+		goto end;
+	}
+	if(statp.st_dev!=clone_dev)
+	{
+		clone_dev=statp.st_dev;
+		clone_flags=0;
+	}
+
+#ifdef FICLONE
+	if(!(clone_flags & CLONE_NO_REFLINK))
+	{
+		if(!ioctl(ofd, FICLONE, ifd))
+		{
+			ret=0;
+			goto end;
+		}
+		// EXDEV only means that this source was elsewhere.
+		if(errno!=EXDEV)
+			clone_flags|=CLONE_NO_REFLINK;
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	if(!(clone_flags & CLONE_NO_COPY_RANGE))
+	{
+		ssize_t r;
+		while((r=copy_file_range(ifd, NULL, ofd, NULL,
+			1024*1024*1024, 0))>0) { }
+		if(!r)
+		{
+			ret=0;
+			goto end;
+		}
+		if(errno==ENOSYS || errno==EOPNOTSUPP || errno==EINVAL)
+			clone_flags|=CLONE_NO_COPY_RANGE;
+		// Start again from the beginning.
+		if(lseek(ifd, 0, SEEK_SET) || lseek(ofd, 0, SEEK_SET)
+		  || ftruncate(ofd, 0))
+		{
+			logp("could not rewind %s: %s\n",
+				newpath, strerror(errno));
+			goto end;
+		}
+	}
+#endif
+	if(clone_by_copy(ifd, ofd))
+	{
+		logp("could not copy %s to %s: %s\n",
+			oldpath, newpath, strerror(errno));
+		goto end;
+	}
+	ret=0;
+end:
+	if(ofd>=0 && close(ofd))
+	{
+		logp("could not close %s: %s\n", newpath, strerror(errno));
+		ret=-1;
+	}
+	close_fd(&ifd);
+	return ret;
+}
+#endif
@@ -29,4 +29,8 @@ extern int looks_like_tmp_or_hidden_file(const char *filename);
 extern FILE *open_file(const char *fname, const char *mode);
 extern gzFile gzopen_file(const char *fname, const char *mode);
 
+#ifndef HAVE_WIN32
+extern int clone_file(const char *oldpath, const char *newpath);
+#endif
+
 #endif
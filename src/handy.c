@@ -325,7 +325,8 @@ void setup_signal(int sig, void handler(int sig))
 char *comp_level(struct conf **confs)
 {
 	static char comp[8]="";
-	snprintf(comp, sizeof(comp), "wb%d", get_int(confs[OPT_COMPRESSION]));
+	snprintf(comp, sizeof(comp), "wb%d",
+		codec_gzip_level(get_int(confs[OPT_COMPRESSION])));
 	return comp;
 }
 
@@ -10,6 +10,7 @@
 #include "burp.h"
 #include "burpconfig.h"
 #include "cntr.h"
+#include "codec.h"
 #include "conf.h"
 #include "conffile.h"
 #include "cstat.h"
@@ -28,6 +29,7 @@
 #include "sbuf.h"
 #include "ssl.h"
 #include "slist.h"
+#include "throttle.h"
 #include "version.h"
 #include "yajl_gen_w.h"
 
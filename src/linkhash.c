@@ -33,85 +33,138 @@
 */
 
 #include "burp.h"
-#include "handy.h"
+#include "alloc.h"
 #include "linkhash.h"
 
-// List of all hard linked files found.
-struct f_link **linkhash=NULL;
+// Open addressing on (dev, ino), doubling in size as it fills, so that
+// clients with millions of hard links do not end up going down long chains.
+// The names are kept in a few big blocks rather than one allocation each.
 
-#define LINK_HASHTABLE_BITS 16
-#define LINK_HASHTABLE_SIZE (1<<LINK_HASHTABLE_BITS)
-#define LINK_HASHTABLE_MASK (LINK_HASHTABLE_SIZE-1)
+#define LINKHASH_MIN_SIZE	1024
+#define LINKHASH_BLOCK_SIZE	(256*1024)
+
+struct name_block
+{
+	struct name_block *next;
+	size_t used;
+	size_t size;
+	char buf[1];
+};
+
+// Empty slots have a NULL name.
+static struct f_link *table=NULL;
+static size_t size=0;
+static size_t count=0;
+static struct name_block *blocks=NULL;
 
 int linkhash_init(void)
 {
-	if(!(linkhash=(f_link **)
-		calloc_w(1, LINK_HASHTABLE_SIZE*sizeof(f_link *), __func__)))
+	if(!(table=(struct f_link *)
+		calloc_w(LINKHASH_MIN_SIZE, sizeof(struct f_link), __func__)))
 			return -1;
+	size=LINKHASH_MIN_SIZE;
+	count=0;
 	return 0;
 }
 
 void linkhash_free(void)
 {
-	int i;
-	struct f_link *lp;
-	struct f_link *lc;
-
-	if(!linkhash) return;
-
-	for(i=0; i<LINK_HASHTABLE_SIZE; i++)
+	struct name_block *b;
+	while((b=blocks))
 	{
-		// Free up list of hard linked files.
-		lp=linkhash[i];
-		while(lp)
-		{
-			lc=lp;
-			lp=lp->next;
-			if(lc)
-			{
-				free_w(&lc->name);
-				free_v((void **)&lc);
-			}
-		}
-		linkhash[i]=NULL;
+		blocks=b->next;
+		free_v((void **)&b);
 	}
-	free_v((void **)&linkhash);
+	free_v((void **)&table);
+	size=0;
+	count=0;
 }
 
-static inline int get_hash(struct stat *statp)
+static inline size_t get_hash(dev_t dev, ino_t ino)
 {
-	int hash=statp->st_dev;
-	unsigned long long i=statp->st_ino;
-	hash ^= i;
-	i >>= 16;
-	hash ^= i;
-	i >>= 16;
-	hash ^= i;
-	i >>= 16;
-	hash ^= i;
-	return hash & LINK_HASHTABLE_MASK;
+	// The finaliser from splitmix64, which spreads the inode numbers,
+	// that tend to be close together, across the whole table.
+	uint64_t h=(uint64_t)ino^((uint64_t)dev*0x9E3779B97F4A7C15ULL);
+	h^=h>>30;
+	h*=0xBF58476D1CE4E5B9ULL;
+	h^=h>>27;
+	h*=0x94D049BB133111EBULL;
+	h^=h>>31;
+	return (size_t)h&(size-1);
 }
 
-struct f_link *linkhash_search(struct stat *statp, struct f_link ***bucket)
+static struct f_link *find_slot(dev_t dev, ino_t ino)
+{
+	size_t i=get_hash(dev, ino);
+	for(; table[i].name; i=(i+1)&(size-1))
+		if(table[i].ino==ino && table[i].dev==dev)
+			break;
+	return &table[i];
+}
+
+struct f_link *linkhash_search(struct stat *statp)
 {
 	struct f_link *lp;
-	*bucket=&linkhash[get_hash(statp)];
-	for(lp=**bucket; lp; lp=lp->next)
-		if(lp->ino==(ino_t)statp->st_ino
-		  && lp->dev==(dev_t)statp->st_dev)
-			return lp;
-	return NULL;
+	if(!table) return NULL;
+	lp=find_slot((dev_t)statp->st_dev, (ino_t)statp->st_ino);
+	return lp->name?lp:NULL;
+}
+
+static int grow(void)
+{
+	size_t i;
+	size_t old_size=size;
+	struct f_link *old_table=table;
+
+	if(!(table=(struct f_link *)
+		calloc_w(old_size*2, sizeof(struct f_link), __func__)))
+	{
+		table=old_table;
+		return -1;
+	}
+	size=old_size*2;
+	for(i=0; i<old_size; i++)
+		if(old_table[i].name)
+			*find_slot(old_table[i].dev, old_table[i].ino)
+				=old_table[i];
+	free_v((void **)&old_table);
+	return 0;
+}
+
+static char *name_add(const char *fname)
+{
+	char *name;
+	size_t len=strlen(fname)+1;
+	if(!blocks || blocks->size-blocks->used<len)
+	{
+		struct name_block *b;
+		size_t bsize=LINKHASH_BLOCK_SIZE;
+		if(len>bsize) bsize=len;
+		if(!(b=(struct name_block *)malloc_w(
+			sizeof(struct name_block)+bsize, __func__)))
+				return NULL;
+		b->used=0;
+		b->size=bsize;
+		b->next=blocks;
+		blocks=b;
+	}
+	name=blocks->buf+blocks->used;
+	memcpy(name, fname, len);
+	blocks->used+=len;
+	return name;
 }
 
-int linkhash_add(char *fname, struct stat *statp, struct f_link **bucket)
+int linkhash_add(char *fname, struct stat *statp)
 {
-	struct f_link *new_fl;
-	if(!(new_fl=(struct f_link *)malloc_w(sizeof(struct f_link), __func__))
-	  || !(new_fl->name=strdup_w(fname, __func__)))
+	struct f_link *lp;
+	// Keep it no more than three quarters full.
+	if((count+1)*4>size*3 && grow())
+		return -1;
+	lp=find_slot((dev_t)statp->st_dev, (ino_t)statp->st_ino);
+	if(!(lp->name=name_add(fname)))
 		return -1;
-	new_fl->ino=statp->st_ino;
-	new_fl->dev=statp->st_dev;
-	new_fl->next=*bucket;
-	*bucket=new_fl;
+	lp->dev=statp->st_dev;
+	lp->ino=statp->st_ino;
+	count++;
 	return 0;
 }
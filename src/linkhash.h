@@ -10,20 +10,19 @@
  */
 struct f_link
 {
-	struct f_link *next;
 	// Device plus inode is unique.
 	dev_t dev;
 	ino_t ino;
+	// Stays put until linkhash_free().
 	char *name;
 };
 
-extern struct f_link **linkhash;
-
 extern int linkhash_init(void);
 extern void linkhash_free(void);
-extern struct f_link *linkhash_search(struct stat *statp,
-	struct f_link ***bucket);
-extern int linkhash_add(char *fname,
-	struct stat *statp, struct f_link **bucket);
+// Returns NULL if it is not there. The entry itself may move on the next
+// linkhash_add(), though its name does not.
+extern struct f_link *linkhash_search(struct stat *statp);
+// Only for things that linkhash_search() did not find.
+extern int linkhash_add(char *fname, struct stat *statp);
 
 #endif
@@ -67,6 +67,9 @@ static void usage_client(void)
 	printf("                  delete: delete\n");
 	printf("                  d: diff\n");
 	printf("                  e: estimate\n");
+#ifndef HAVE_WIN32
+	printf("                  j: journal watcher, for faster scans\n");
+#endif
 	printf("                  l: list (this is the default when an action is not given)\n");
 	printf("                  L: long list\n");
 	printf("                  m: monitor interface\n");
@@ -186,6 +189,8 @@ static int parse_action(enum action *act, const char *optarg)
 		*act=ACTION_DIFF_LONG;
 	else if(!strncmp(optarg, "monitor", 1))
 		*act=ACTION_MONITOR;
+	else if(!strncmp(optarg, "journal", 1))
+		*act=ACTION_JOURNAL;
 	else
 	{
 		usage();
@@ -469,7 +474,8 @@ int main (int argc, char *argv[])
 		|| act==ACTION_DIFF_LONG
 		|| act==ACTION_STATUS
 		|| act==ACTION_STATUS_SNAPSHOT
-		|| act==ACTION_MONITOR))
+		|| act==ACTION_MONITOR
+		|| act==ACTION_JOURNAL))
 	{
 		// These client modes need to run without getting the lock.
 	}
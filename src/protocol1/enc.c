@@ -0,0 +1,447 @@
+#include "include.h"
+#include "enc.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+// The password is stretched once per process, and each file then gets its
+// own key from that and a random salt. As every file has its own key, the
+// chunk number can safely be used as the nonce.
+#define ENC_KDF_SALT		"burp protocol1 encryption"
+#define ENC_KDF_ITERATIONS	100000
+#define ENC_KEY_LEN		32
+#define ENC_IV_LEN		12
+
+struct enc
+{
+	int encrypt;
+	enum enc_cipher cipher;
+	int header_done;
+	EVP_CIPHER_CTX *ctx;
+	const char *password;
+	uint8_t key[ENC_KEY_LEN];
+	uint64_t seq;
+	// Plain text waiting to be encrypted, or encrypted data waiting to be
+	// decrypted.
+	uint8_t *pend;
+	size_t pending;
+	size_t pendsize;
+	uint8_t *out;
+	size_t outlen;
+	size_t outsize;
+};
+
+// Only a hash of the password is kept, to tell when it changes.
+static int master_set=0;
+static uint8_t master_password[SHA256_DIGEST_LENGTH];
+static uint8_t master_key[ENC_KEY_LEN];
+
+int enc_cipher_parse(const char *v)
+{
+	if(!strcmp(v, "blowfish"))
+		return ENC_CIPHER_BLOWFISH;
+	if(!strcmp(v, "aes-256-gcm"))
+		return ENC_CIPHER_AES_256_GCM;
+	logp("Unknown encryption_cipher: %s\n", v);
+	return -1;
+}
+
+const char *enc_cipher_name(enum enc_cipher cipher)
+{
+	switch(cipher)
+	{
+		case ENC_CIPHER_BLOWFISH: return "blowfish";
+		case ENC_CIPHER_AES_256_GCM: return "aes-256-gcm";
+	}
+	return "unknown";
+}
+
+static int get_master_key(const char *password)
+{
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+	SHA256((const uint8_t *)password, strlen(password), hash);
+	if(master_set && !memcmp(hash, master_password, sizeof(hash)))
+		return 0;
+	master_set=0;
+	if(!PKCS5_PBKDF2_HMAC(password, strlen(password),
+		(const uint8_t *)ENC_KDF_SALT, strlen(ENC_KDF_SALT),
+		ENC_KDF_ITERATIONS, EVP_sha256(),
+		ENC_KEY_LEN, master_key))
+	{
+		logp("Could not derive encryption key\n");
+		return -1;
+	}
+	memcpy(master_password, hash, sizeof(hash));
+	master_set=1;
+	return 0;
+}
+
+static int bf_setup(struct enc *enc)
+{
+	// Declare enc_iv with individual characters so that the weird last
+	// character can be specified as a hex number in order to prevent
+	// compilation warnings on Macs.
+	uint8_t enc_iv[]={'[', 'l', 'k', 'd', '.', '$', 'G', 0xa3, '\0'};
+
+	enc->cipher=ENC_CIPHER_BLOWFISH;
+	// Don't set key or IV because we will modify the parameters.
+	if(!(EVP_CipherInit_ex(enc->ctx, EVP_bf_cbc(),
+		NULL, NULL, NULL, enc->encrypt)))
+	{
+		logp("EVP_CipherInit_ex failed\n");
+		return -1;
+	}
+	EVP_CIPHER_CTX_set_key_length(enc->ctx, strlen(enc->password));
+	// We finished modifying parameters so now we can set key and IV
+	if(!EVP_CipherInit_ex(enc->ctx, NULL, NULL,
+		(const uint8_t *)enc->password, enc_iv, enc->encrypt))
+	{
+		logp("Second EVP_CipherInit_ex failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int aead_setup(struct enc *enc, const uint8_t *salt)
+{
+	unsigned int len=0;
+	if(get_master_key(enc->password)
+	  || !HMAC(EVP_sha256(), master_key, ENC_KEY_LEN,
+		salt, ENC_SALT_LEN, enc->key, &len)
+	  || len!=ENC_KEY_LEN)
+	{
+		logp("Could not derive file encryption key\n");
+		return -1;
+	}
+	if(!EVP_CipherInit_ex(enc->ctx, EVP_aes_256_gcm(),
+		NULL, enc->key, NULL, enc->encrypt))
+	{
+		logp("EVP_CipherInit_ex failed\n");
+		return -1;
+	}
+	enc->cipher=ENC_CIPHER_AES_256_GCM;
+	enc->pendsize=ENC_CHUNK+ENC_TAG_LEN;
+	if(!(enc->pend=(uint8_t *)malloc_w(enc->pendsize, __func__)))
+		return -1;
+	return 0;
+}
+
+struct enc *enc_alloc(int encrypt, const char *password,
+	enum enc_cipher cipher)
+{
+	struct enc *enc;
+	if(!(enc=(struct enc *)calloc_w(1, sizeof(struct enc), __func__)))
+		return NULL;
+	enc->encrypt=encrypt;
+	enc->password=password;
+	if(!(enc->ctx=EVP_CIPHER_CTX_new()))
+	{
+		logp("EVP_CIPHER_CTX_new failed\n");
+		goto error;
+	}
+	if(encrypt)
+	{
+		if(cipher==ENC_CIPHER_BLOWFISH)
+		{
+			if(bf_setup(enc)) goto error;
+			enc->header_done=1;
+		}
+		else
+		{
+			uint8_t salt[ENC_SALT_LEN];
+			if(RAND_bytes(salt, ENC_SALT_LEN)!=1)
+			{
+				logp("Could not get random salt\n");
+				goto error;
+			}
+			if(aead_setup(enc, salt)) goto error;
+			// Keep the salt for the header.
+			memcpy(enc->pend, salt, ENC_SALT_LEN);
+		}
+	}
+	else
+	{
+		// Need the start of the data to know what it is.
+		enc->pendsize=ENC_HEADER_LEN;
+		if(!(enc->pend=(uint8_t *)malloc_w(enc->pendsize, __func__)))
+			goto error;
+	}
+	return enc;
+error:
+	enc_free(&enc);
+	return NULL;
+}
+
+void enc_free(struct enc **enc)
+{
+	if(!enc || !*enc) return;
+	if((*enc)->ctx) EVP_CIPHER_CTX_free((*enc)->ctx);
+	memset((*enc)->key, 0, ENC_KEY_LEN);
+	free_v((void **)&(*enc)->pend);
+	free_v((void **)&(*enc)->out);
+	free_v((void **)enc);
+}
+
+static int out_reserve(struct enc *enc, size_t len)
+{
+	size_t need=enc->outlen+len;
+	// The callers may put a terminating nul after the data.
+	if(need+EVP_MAX_BLOCK_LENGTH<=enc->outsize) return 0;
+	enc->outsize=need+EVP_MAX_BLOCK_LENGTH;
+	if(!(enc->out=(uint8_t *)realloc_w(enc->out, enc->outsize, __func__)))
+		return -1;
+	return 0;
+}
+
+static void make_iv(struct enc *enc, uint8_t *iv)
+{
+	int i;
+	memset(iv, 0, ENC_IV_LEN);
+	for(i=0; i<8; i++)
+		iv[ENC_IV_LEN-1-i]=(uint8_t)(enc->seq>>(i*8));
+}
+
+// The final chunk is marked in the additional data, so that it is noticed
+// if the end has gone missing.
+static int aead_seal(struct enc *enc, int last)
+{
+	int len=0;
+	uint8_t aad=last;
+	uint8_t iv[ENC_IV_LEN];
+
+	make_iv(enc, iv);
+	if(out_reserve(enc, enc->pending+ENC_TAG_LEN)) return -1;
+	if(!EVP_EncryptInit_ex(enc->ctx, NULL, NULL, NULL, iv)
+	  || !EVP_EncryptUpdate(enc->ctx, NULL, &len, &aad, 1))
+		goto error;
+	if(enc->pending)
+	{
+		if(!EVP_EncryptUpdate(enc->ctx, enc->out+enc->outlen, &len,
+			enc->pend, enc->pending))
+				goto error;
+		enc->outlen+=len;
+	}
+	if(!EVP_EncryptFinal_ex(enc->ctx, enc->out+enc->outlen, &len))
+		goto error;
+	enc->outlen+=len;
+	if(!EVP_CIPHER_CTX_ctrl(enc->ctx, EVP_CTRL_GCM_GET_TAG,
+		ENC_TAG_LEN, enc->out+enc->outlen))
+			goto error;
+	enc->outlen+=ENC_TAG_LEN;
+	enc->pending=0;
+	enc->seq++;
+	return 0;
+error:
+	logp("Encryption failure.\n");
+	return -1;
+}
+
+static int aead_open(struct enc *enc, int last)
+{
+	int len=0;
+	uint8_t aad=last;
+	size_t clen;
+	uint8_t iv[ENC_IV_LEN];
+
+	if(enc->pending<ENC_TAG_LEN)
+	{
+		logp("Decryption failure: encrypted data is truncated.\n");
+		return -1;
+	}
+	clen=enc->pending-ENC_TAG_LEN;
+	make_iv(enc, iv);
+	if(out_reserve(enc, clen)) return -1;
+	if(!EVP_DecryptInit_ex(enc->ctx, NULL, NULL, NULL, iv)
+	  || !EVP_DecryptUpdate(enc->ctx, NULL, &len, &aad, 1))
+		goto error;
+	if(clen)
+	{
+		if(!EVP_DecryptUpdate(enc->ctx, enc->out+enc->outlen, &len,
+			enc->pend, clen))
+				goto error;
+		enc->outlen+=len;
+	}
+	if(!EVP_CIPHER_CTX_ctrl(enc->ctx, EVP_CTRL_GCM_SET_TAG,
+		ENC_TAG_LEN, enc->pend+clen))
+			goto error;
+	if(EVP_DecryptFinal_ex(enc->ctx, enc->out+enc->outlen, &len)<=0)
+	{
+		logp("Decryption failure: encrypted data has been changed, or the password is wrong.\n");
+		return -1;
+	}
+	enc->outlen+=len;
+	enc->pending=0;
+	enc->seq++;
+	return 0;
+error:
+	logp("Decryption failure.\n");
+	return -1;
+}
+
+static int bf_update(struct enc *enc, const uint8_t *in, size_t inlen)
+{
+	int len=0;
+	if(!inlen) return 0;
+	if(out_reserve(enc, inlen)) return -1;
+	if(!EVP_CipherUpdate(enc->ctx, enc->out+enc->outlen, &len, in, inlen))
+	{
+		logp("%s failure.\n", enc->encrypt?"Encryption":"Decryption");
+		return -1;
+	}
+	enc->outlen+=len;
+	return 0;
+}
+
+// A chunk is only sealed, or opened, once there is more data after it,
+// because the last one has to be treated differently.
+static int aead_update(struct enc *enc, const uint8_t *in, size_t inlen)
+{
+	size_t n;
+	size_t full=enc->encrypt?ENC_CHUNK:ENC_CHUNK+ENC_TAG_LEN;
+	while(inlen)
+	{
+		if(enc->pending==full)
+		{
+			if(enc->encrypt?aead_seal(enc, 0):aead_open(enc, 0))
+				return -1;
+		}
+		n=min(inlen, full-enc->pending);
+		memcpy(enc->pend+enc->pending, in, n);
+		enc->pending+=n;
+		in+=n;
+		inlen-=n;
+	}
+	return 0;
+}
+
+static int write_header(struct enc *enc)
+{
+	uint8_t *h;
+	if(out_reserve(enc, ENC_HEADER_LEN)) return -1;
+	h=enc->out+enc->outlen;
+	memcpy(h, ENC_MAGIC, ENC_MAGIC_LEN);
+	h[ENC_MAGIC_LEN]=ENC_VERSION;
+	h[ENC_MAGIC_LEN+1]=enc->cipher;
+	h[ENC_MAGIC_LEN+2]=0;
+	h[ENC_MAGIC_LEN+3]=0;
+	// The salt was left at the start of the pending buffer.
+	memcpy(h+ENC_MAGIC_LEN+4, enc->pend, ENC_SALT_LEN);
+	enc->outlen+=ENC_HEADER_LEN;
+	enc->header_done=1;
+	return 0;
+}
+
+// Returns 1 if more data is needed to tell what the cipher is.
+static int read_header(struct enc *enc, const uint8_t **in, size_t *inlen,
+	int final)
+{
+	size_t n;
+	size_t headlen;
+	uint8_t head[ENC_HEADER_LEN];
+
+	n=min(*inlen, (size_t)ENC_HEADER_LEN-enc->pending);
+	memcpy(enc->pend+enc->pending, *in, n);
+	enc->pending+=n;
+	*in+=n;
+	*inlen-=n;
+
+	if(enc->pending>=ENC_MAGIC_LEN
+	  && !memcmp(enc->pend, ENC_MAGIC, ENC_MAGIC_LEN))
+	{
+		if(enc->pending<ENC_HEADER_LEN)
+		{
+			if(!final) return 1;
+			logp("Decryption failure: encrypted data is truncated.\n");
+			return -1;
+		}
+		if(enc->pend[ENC_MAGIC_LEN]!=ENC_VERSION
+		  || enc->pend[ENC_MAGIC_LEN+1]!=ENC_CIPHER_AES_256_GCM)
+		{
+			logp("Unsupported encryption format: version %d, cipher %d\n",
+				enc->pend[ENC_MAGIC_LEN],
+				enc->pend[ENC_MAGIC_LEN+1]);
+			return -1;
+		}
+		// Anything after the header is still in 'in', for the first
+		// chunk.
+		memcpy(head, enc->pend, ENC_HEADER_LEN);
+		free_v((void **)&enc->pend);
+		enc->pending=0;
+		enc->header_done=1;
+		return aead_setup(enc, head+ENC_MAGIC_LEN+4);
+	}
+	if(enc->pending<ENC_MAGIC_LEN && !final) return 1;
+
+	// No header, so this is the original Blowfish format.
+	memcpy(head, enc->pend, enc->pending);
+	headlen=enc->pending;
+	enc->pending=0;
+	enc->header_done=1;
+	if(bf_setup(enc)) return -1;
+	return bf_update(enc, head, headlen);
+}
+
+int enc_update(struct enc *enc, const uint8_t *in, size_t inlen,
+	uint8_t **out, size_t *outlen)
+{
+	int r;
+	enc->outlen=0;
+	if(!enc->header_done)
+	{
+		if(enc->encrypt)
+		{
+			if(write_header(enc)) return -1;
+		}
+		else if((r=read_header(enc, &in, &inlen, 0)))
+		{
+			if(r<0) return -1;
+			goto end;
+		}
+	}
+	if(enc->cipher==ENC_CIPHER_BLOWFISH)
+		r=bf_update(enc, in, inlen);
+	else
+		r=aead_update(enc, in, inlen);
+	if(r) return -1;
+end:
+	*out=enc->out;
+	*outlen=enc->outlen;
+	return 0;
+}
+
+int enc_final(struct enc *enc, uint8_t **out, size_t *outlen)
+{
+	int len=0;
+	enc->outlen=0;
+	if(!enc->header_done)
+	{
+		if(enc->encrypt)
+		{
+			if(write_header(enc)) return -1;
+		}
+		else
+		{
+			size_t inlen=0;
+			const uint8_t *in=NULL;
+			if(read_header(enc, &in, &inlen, 1)<0) return -1;
+		}
+	}
+	if(enc->cipher==ENC_CIPHER_BLOWFISH)
+	{
+		if(out_reserve(enc, 0)) return -1;
+		if(!EVP_CipherFinal_ex(enc->ctx, enc->out+enc->outlen, &len))
+		{
+			logp("%s failure at the end.\n",
+				enc->encrypt?"Encryption":"Decryption");
+			return -1;
+		}
+		enc->outlen+=len;
+	}
+	else if(enc->encrypt?aead_seal(enc, 1):aead_open(enc, 1))
+		return -1;
+	*out=enc->out;
+	*outlen=enc->outlen;
+	return 0;
+}
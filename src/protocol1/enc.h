@@ -0,0 +1,40 @@
+#ifndef _ENC_PROTOCOL1_H
+#define _ENC_PROTOCOL1_H
+
+// Client side encryption of protocol1 file data.
+// Blowfish is the original format, and has no header. The newer format
+// starts with a header that gives its version and cipher, followed by the
+// data in separately authenticated chunks, so that anything that has been
+// changed, reordered or cut short is noticed. When decrypting, the header
+// decides which one is being read, so old backups can still be restored.
+
+enum enc_cipher
+{
+	ENC_CIPHER_BLOWFISH=0,
+	ENC_CIPHER_AES_256_GCM
+};
+
+#define ENC_MAGIC	"BURPAEAD"
+#define ENC_MAGIC_LEN	8
+#define ENC_VERSION	1
+#define ENC_SALT_LEN	16
+#define ENC_HEADER_LEN	(ENC_MAGIC_LEN+4+ENC_SALT_LEN)
+#define ENC_CHUNK	(64*1024)
+#define ENC_TAG_LEN	16
+
+struct enc;
+
+// The cipher is ignored when decrypting.
+extern struct enc *enc_alloc(int encrypt, const char *password,
+	enum enc_cipher cipher);
+extern void enc_free(struct enc **enc);
+
+// The output is only good until the next call.
+extern int enc_update(struct enc *enc, const uint8_t *in, size_t inlen,
+	uint8_t **out, size_t *outlen);
+extern int enc_final(struct enc *enc, uint8_t **out, size_t *outlen);
+
+extern int enc_cipher_parse(const char *v);
+extern const char *enc_cipher_name(enum enc_cipher cipher);
+
+#endif
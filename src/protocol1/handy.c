@@ -2,61 +2,47 @@
 #include "cmd.h"
 #include "hexmap.h"
 
-static int do_encryption(struct asfd *asfd, EVP_CIPHER_CTX *ctx,
-	uint8_t *inbuf, int inlen, uint8_t *outbuf, int *outlen,
-	MD5_CTX *md5)
+// The encrypted output can be bigger than what went in, and can come in
+// lumps of more than one chunk, so it is split up to be sent.
+static int send_encrypted(struct asfd *asfd,
+	uint8_t *buf, size_t len, MD5_CTX *md5)
 {
-	if(!inlen) return 0;
-	if(!EVP_CipherUpdate(ctx, outbuf, outlen, inbuf, inlen))
+	size_t n;
+	if(len && !MD5_Update(md5, buf, len))
 	{
-		logp("Encryption failure.\n");
+		logp("MD5_Update() failed\n");
 		return -1;
 	}
-	if(*outlen>0)
+	while(len)
 	{
-		if(asfd->write_strn(asfd, CMD_APPEND,
-			(char *)outbuf, (size_t)*outlen)) return -1;
-		if(!MD5_Update(md5, outbuf, *outlen))
-		{
-			logp("MD5_Update() failed\n");
+		n=min(len, (size_t)ZCHUNK);
+		if(asfd->write_strn(asfd, CMD_APPEND, (char *)buf, n))
 			return -1;
-		}
+		buf+=n;
+		len-=n;
 	}
 	return 0;
 }
 
-EVP_CIPHER_CTX *enc_setup(int encrypt, const char *encryption_password)
+static int do_encryption(struct asfd *asfd, struct enc *enc,
+	uint8_t *inbuf, size_t inlen, MD5_CTX *md5)
 {
-	EVP_CIPHER_CTX *ctx=NULL;
-	// Declare enc_iv with individual characters so that the weird last
-	// character can be specified as a hex number in order to prevent
-	// compilation warnings on Macs.
-	uint8_t enc_iv[]={'[', 'l', 'k', 'd', '.', '$', 'G', 0xa3, '\0'};
-
-	if(!(ctx=(EVP_CIPHER_CTX *)
-		calloc_w(1, sizeof(EVP_CIPHER_CTX), __func__)))
-
-	// Don't set key or IV because we will modify the parameters.
-	EVP_CIPHER_CTX_init(ctx);
-	if(!(EVP_CipherInit_ex(ctx, EVP_bf_cbc(), NULL, NULL, NULL, encrypt)))
-	{
-		logp("EVP_CipherInit_ex failed\n");
-		goto error;
-	}
-	EVP_CIPHER_CTX_set_key_length(ctx, strlen(encryption_password));
-	// We finished modifying parameters so now we can set key and IV
+	size_t outlen=0;
+	uint8_t *outbuf=NULL;
+	if(!inlen) return 0;
+	if(enc_update(enc, inbuf, inlen, &outbuf, &outlen))
+		return -1;
+	return send_encrypted(asfd, outbuf, outlen, md5);
+}
 
-	if(!EVP_CipherInit_ex(ctx, NULL, NULL,
-		(uint8_t *)encryption_password,
-		enc_iv, encrypt))
-	{
-		logp("Second EVP_CipherInit_ex failed\n");
-		goto error;
-	}
-	return ctx;
-error:
-	if(ctx) free(ctx);
-	return NULL;
+static int do_encryption_final(struct asfd *asfd, struct enc *enc,
+	MD5_CTX *md5)
+{
+	size_t outlen=0;
+	uint8_t *outbuf=NULL;
+	if(enc_final(enc, &outbuf, &outlen))
+		return -1;
+	return send_encrypted(asfd, outbuf, outlen, md5);
 }
 
 #ifdef HAVE_WIN32
@@ -83,6 +69,113 @@ int write_endfile(struct asfd *asfd,
 		CMD_END_FILE, get_endfile_str(bytes, checksum));
 }
 
+#ifndef HAVE_WIN32
+struct pgz_send
+{
+	struct asfd *asfd;
+	struct enc *enc;
+	MD5_CTX *md5;
+	int quick_read;
+	const char *datapth;
+	struct conf **confs;
+};
+
+// Called with the compressed data in order, while the next blocks are
+// being compressed.
+static int pgz_send_output(void *arg, uint8_t *buf, size_t len)
+{
+	size_t n;
+	struct pgz_send *s=(struct pgz_send *)arg;
+
+	while(len)
+	{
+		n=min(len, (size_t)ZCHUNK);
+		if(s->enc)
+		{
+			if(do_encryption(s->asfd, s->enc, buf, n, s->md5))
+				return -1;
+		}
+		else if(s->asfd->write_strn(s->asfd, CMD_APPEND,
+			(char *)buf, n))
+				return -1;
+		buf+=n;
+		len-=n;
+	}
+	if(s->quick_read && s->datapth)
+	{
+		int qr;
+		if((qr=do_quick_read(s->asfd, s->datapth, s->confs))<0)
+			return -1;
+		if(qr) // client wants to interrupt
+			return 1;
+	}
+	return 0;
+}
+
+// Large files are compressed on several threads at once. The result is
+// still a normal gzip stream, so the other end does not need to know.
+static int pgz_threads(BFILE *bfd, int compression,
+	const char *extrameta, struct conf **confs)
+{
+	struct stat statp;
+	int threads=get_int(confs[OPT_COMPRESSION_THREADS]);
+	if(threads<=0 || compression<=0 || extrameta
+	  || fstat(bfd->fd, &statp)
+	  || statp.st_size<PGZ_MIN_SIZE)
+		return 0;
+	return threads;
+}
+
+// Returns 0 on success or interruption, -1 on error.
+static int send_whole_file_pgz(struct asfd *asfd,
+	const char *datapth, int quick_read, unsigned long long *bytes,
+	struct enc *enc, MD5_CTX *md5, struct conf **confs,
+	int compression, int threads, BFILE *bfd)
+{
+	int ret=-1;
+	ssize_t got;
+	uint8_t in[ZCHUNK];
+	struct pgz *pgz=NULL;
+	struct pgz_send s;
+
+	s.asfd=asfd;
+	s.enc=enc;
+	s.md5=md5;
+	s.quick_read=quick_read;
+	s.datapth=datapth;
+	s.confs=confs;
+	if(!(pgz=pgz_alloc(threads, compression, pgz_send_output, &s)))
+		goto end;
+
+	while((got=bfd->read(bfd, in, ZCHUNK))>0)
+	{
+		*bytes+=got;
+		throttle_wait();
+		// The checksum needs to be later if encryption is being used.
+		if(!enc && !MD5_Update(md5, in, got))
+		{
+			logp("MD5_Update() failed\n");
+			goto end;
+		}
+		if((ret=pgz_write(pgz, in, got)))
+			goto end;
+	}
+	if(got<0)
+	{
+		ret=-1;
+		goto end;
+	}
+	if((ret=pgz_close(pgz)))
+		goto end;
+	if(enc) ret=do_encryption_final(asfd, enc, md5);
+end:
+	pgz_free(&pgz);
+	// Interrupted by the client.
+	if(ret>0) ret=0;
+	return ret;
+}
+#endif
+
 /* OK, this function is getting a bit out of control.
    One problem is that, if you give deflateInit2 compression=0, it still
    writes gzip headers and footers, so I had to add extra
@@ -110,18 +203,18 @@ int send_whole_file_gzl(struct asfd *asfd,
 	uint8_t in[ZCHUNK];
 	uint8_t out[ZCHUNK];
 
-	int eoutlen;
-	uint8_t eoutbuf[ZCHUNK+EVP_MAX_BLOCK_LENGTH];
-
-	EVP_CIPHER_CTX *enc_ctx=NULL;
+	struct enc *enc=NULL;
 #ifdef HAVE_WIN32
 	int do_known_byte_count=0;
 	size_t datalen=bfd->datalen;
 	if(datalen>0) do_known_byte_count=1;
+#else
+	int threads=0;
 #endif
 
-	if(encpassword && !(enc_ctx=enc_setup(1, encpassword)))
-		return -1;
+	if(encpassword && !(enc=enc_alloc(1, encpassword,
+		(enum enc_cipher)get_int(confs[OPT_ENCRYPTION_CIPHER]))))
+			return -1;
 
 	if(!MD5_Init(&md5))
 	{
@@ -136,6 +229,15 @@ int send_whole_file_gzl(struct asfd *asfd,
 		metalen=elen;
 	}
 
+#ifndef HAVE_WIN32
+	if((threads=pgz_threads(bfd, compression, extrameta, confs)))
+	{
+		ret=send_whole_file_pgz(asfd, datapth, quick_read, bytes,
+			enc, &md5, confs, compression, threads, bfd);
+		goto end;
+	}
+#endif
+
 	/* allocate deflate state */
 	strm.zalloc = Z_NULL;
 	strm.zfree = Z_NULL;
@@ -180,9 +282,10 @@ int send_whole_file_gzl(struct asfd *asfd,
 		if(!compression && !strm.avail_in) break;
 
 		*bytes+=strm.avail_in;
+		throttle_wait();
 
 		// The checksum needs to be later if encryption is being used.
-		if(!enc_ctx)
+		if(!enc)
 		{
 			if(!MD5_Update(&md5, in, strm.avail_in))
 			{
@@ -224,10 +327,9 @@ int send_whole_file_gzl(struct asfd *asfd,
 				memcpy(out, in, have);
 			}
 
-			if(enc_ctx)
+			if(enc)
 			{
-				if(do_encryption(asfd, enc_ctx, out, have,
-					eoutbuf, &eoutlen, &md5))
+				if(do_encryption(asfd, enc, out, have, &md5))
 				{
 					ret=-1;
 					break;
@@ -277,35 +379,16 @@ int send_whole_file_gzl(struct asfd *asfd,
 			logp("ret OK, but zstream not finished: %d\n", zret);
 			ret=-1;
 		}
-		else if(enc_ctx)
-		{
-			if(!EVP_CipherFinal_ex(enc_ctx, eoutbuf, &eoutlen))
-			{
-				logp("Encryption failure at the end\n");
-				ret=-1;
-			}
-			else if(eoutlen>0)
-			{
-			  if(asfd->write_strn(asfd, CMD_APPEND,
-				(char *)eoutbuf, (size_t)eoutlen))
-					ret=-1;
-			  else if(!MD5_Update(&md5, eoutbuf, eoutlen))
-			  {
-				logp("MD5_Update() failed\n");
-				ret=-1;
-			  }
-			}
-		}
+		else if(enc)
+			ret=do_encryption_final(asfd, enc, &md5);
 	}
 
 cleanup:
 	deflateEnd(&strm);
-
-	if(enc_ctx)
-	{
-		EVP_CIPHER_CTX_cleanup(enc_ctx);
-		free(enc_ctx);
-	}
+#ifndef HAVE_WIN32
+end:
+#endif
+	enc_free(&enc);
 
 	if(!ret)
 	{
@@ -458,6 +541,7 @@ int send_whole_filel(struct asfd *asfd,
 			if(s<=0) break;
 
 			*bytes+=s;
+			throttle_wait();
 			if(!MD5_Update(&md5, buf, s))
 			{
 				logp("MD5_Update() failed\n");
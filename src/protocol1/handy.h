@@ -21,8 +21,6 @@ extern int send_whole_filel(struct asfd *asfd,
 	BFILE *bfd,
 	const char *extrameta, size_t elen);
 
-extern EVP_CIPHER_CTX *enc_setup(int encrypt, const char *encryption_password);
-
 extern char *get_endfile_str(unsigned long long bytes, uint8_t *checksum);
 extern int write_endfile(struct asfd *asfd,
 	unsigned long long bytes, uint8_t *checksum);
@@ -3,8 +3,10 @@
 
 #include "../include.h"
 
+#include "enc.h"
 #include "handy.h"
 #include "msg.h"
+#include "pgzip.h"
 #include "rs_buf.h"
 #include "sbuf_protocol1.h"
 #include "sbufl.h"
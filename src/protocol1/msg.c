@@ -160,14 +160,13 @@ int transfer_gzfile_inl(struct asfd *asfd,
 	int quit=0;
 	int ret=-1;
 	uint8_t out[ZCHUNK];
-	int doutlen=0;
-	//uint8_t doutbuf[1000+EVP_MAX_BLOCK_LENGTH];
-	uint8_t doutbuf[ZCHUNK-EVP_MAX_BLOCK_LENGTH];
+	size_t doutlen=0;
+	uint8_t *doutbuf=NULL;
 	struct iobuf *rbuf=asfd->rbuf;
 
 	z_stream zstrm;
 
-	EVP_CIPHER_CTX *enc_ctx=NULL;
+	struct enc *enc=NULL;
 
 	// Checksum stuff
 	//MD5_CTX md5;
@@ -196,7 +195,10 @@ int transfer_gzfile_inl(struct asfd *asfd,
 		return -1;
 	}
 
-	if(encpassword && !(enc_ctx=enc_setup(0, encpassword)))
+	// Old Blowfish data and the newer format are told apart by the
+	// data itself.
+	if(encpassword && !(enc=enc_alloc(0, encpassword,
+		ENC_CIPHER_BLOWFISH)))
 	{
 		inflateEnd(&zstrm);
 		return -1;
@@ -207,11 +209,7 @@ int transfer_gzfile_inl(struct asfd *asfd,
 		iobuf_free_content(rbuf);
 		if(asfd->read(asfd))
 		{
-			if(enc_ctx)
-			{
-				EVP_CIPHER_CTX_cleanup(enc_ctx);
-				free(enc_ctx);
-			}
+			enc_free(&enc);
 			inflateEnd(&zstrm);
 			return -1;
 		}
@@ -242,7 +240,7 @@ int transfer_gzfile_inl(struct asfd *asfd,
 */
 					// If doing decryption, it needs
 					// to be done before uncompressing.
-					if(enc_ctx)
+					if(enc)
 					{
 					  // updating our checksum needs to
 					  // be done first
@@ -255,17 +253,17 @@ int transfer_gzfile_inl(struct asfd *asfd,
 					  }
 					  else 
 */
-					  if(!EVP_CipherUpdate(enc_ctx,
-						doutbuf, &doutlen,
+					  if(enc_update(enc,
 						(uint8_t *)rbuf->buf,
-						rbuf->len))
+						rbuf->len,
+						&doutbuf, &doutlen))
 					  {
 						logp("Decryption error\n");
 						quit++; ret=-1;
 					  	break;
 					  }
 					  if(!doutlen) break;
-					  lentouse=(size_t)doutlen;
+					  lentouse=doutlen;
 					  buftouse=doutbuf;
 					}
 					else
@@ -287,10 +285,9 @@ int transfer_gzfile_inl(struct asfd *asfd,
 				}
 				break;
 			case CMD_END_FILE: // finish up
-				if(enc_ctx)
+				if(enc)
 				{
-					if(!EVP_CipherFinal_ex(enc_ctx,
-						doutbuf, &doutlen))
+					if(enc_final(enc, &doutbuf, &doutlen))
 					{
 						logp("Decryption failure at the end.\n");
 						ret=-1; quit++;
@@ -298,7 +295,7 @@ int transfer_gzfile_inl(struct asfd *asfd,
 					}
 					if(doutlen && do_inflate(asfd,
 					  &zstrm, bfd,
-					  out, doutbuf, (size_t)doutlen,
+					  out, doutbuf, doutlen,
 					  metadata, encpassword,
 					  enccompressed, sent))
 					{
@@ -341,11 +338,7 @@ int transfer_gzfile_inl(struct asfd *asfd,
 		}
 	}
 	inflateEnd(&zstrm);
-	if(enc_ctx)
-	{
-		EVP_CIPHER_CTX_cleanup(enc_ctx);
-		free(enc_ctx);
-	}
+	enc_free(&enc);
 
 	iobuf_free_content(rbuf);
 	if(ret) logp("transfer file returning: %d\n", ret);
@@ -0,0 +1,218 @@
+#include "include.h"
+#include "../workq.h"
+#include "pgzip.h"
+
+// The most that deflate can look back.
+#define PGZ_DICT	(32*1024)
+
+// One block of input and the compressed output for it.
+// The buffers are allocated up front by the calling thread, as the *_w
+// wrappers are not thread safe.
+struct pgz_job
+{
+	int level;
+	int last;
+	uint8_t dict[PGZ_DICT];
+	size_t dictlen;
+	uint8_t *in;
+	size_t inlen;
+	uint8_t *out;
+	size_t outlen;
+	size_t outsize;
+	uLong crc;
+	int ret;
+};
+
+static void compress_block(void *data)
+{
+	int zret;
+	z_stream strm;
+	struct pgz_job *job=(struct pgz_job *)data;
+
+	job->ret=-1;
+	job->outlen=0;
+	job->crc=crc32(crc32(0L, Z_NULL, 0), job->in, job->inlen);
+
+	memset(&strm, 0, sizeof(strm));
+	// Raw deflate - the gzip header and trailer are added around the
+	// whole lot.
+	if(deflateInit2(&strm, job->level, Z_DEFLATED, -15,
+		8, Z_DEFAULT_STRATEGY)!=Z_OK)
+			return;
+	if(job->dictlen
+	  && deflateSetDictionary(&strm, job->dict, job->dictlen)!=Z_OK)
+		goto end;
+	strm.next_in=job->in;
+	strm.avail_in=job->inlen;
+	strm.next_out=job->out;
+	strm.avail_out=job->outsize;
+	// A sync flush ends the block on a byte boundary, so that the next
+	// block can follow straight on.
+	zret=deflate(&strm, job->last?Z_FINISH:Z_SYNC_FLUSH);
+	if(job->last)
+	{
+		if(zret!=Z_STREAM_END) goto end;
+	}
+	else if(zret!=Z_OK || strm.avail_in || !strm.avail_out)
+		goto end;
+	job->outlen=job->outsize-strm.avail_out;
+	job->ret=0;
+end:
+	deflateEnd(&strm);
+}
+
+struct pgz *pgz_alloc(int threads, int level,
+	pgz_output_t *output, void *arg)
+{
+	int i;
+	int max=threads>0?threads*2:1;
+	struct pgz *pgz;
+	if(!(pgz=(struct pgz *)calloc_w(1, sizeof(struct pgz), __func__)))
+		return NULL;
+	pgz->level=level;
+	pgz->output=output;
+	pgz->arg=arg;
+	pgz->crc=crc32(0L, Z_NULL, 0);
+	// One more job than the queue holds, for the block being filled.
+	pgz->njobs=max+1;
+	if(!(pgz->workq=workq_alloc(threads, max))
+	  || !(pgz->jobs=(struct pgz_job *)
+		calloc_w(pgz->njobs, sizeof(struct pgz_job), __func__)))
+			goto error;
+	for(i=0; i<pgz->njobs; i++)
+	{
+		struct pgz_job *job=&pgz->jobs[i];
+		// Room for a block that does not compress, and its flush.
+		job->outsize=compressBound(PGZ_BLOCK)+64;
+		if(!(job->in=(uint8_t *)malloc_w(PGZ_BLOCK, __func__))
+		  || !(job->out=(uint8_t *)malloc_w(job->outsize, __func__)))
+			goto error;
+	}
+	return pgz;
+error:
+	pgz_free(&pgz);
+	return NULL;
+}
+
+void pgz_free(struct pgz **pgz)
+{
+	int i;
+	if(!pgz || !*pgz) return;
+	// Stops the workers before their buffers go.
+	workq_free(&(*pgz)->workq);
+	if((*pgz)->jobs)
+	{
+		for(i=0; i<(*pgz)->njobs; i++)
+		{
+			free_v((void **)&(*pgz)->jobs[i].in);
+			free_v((void **)&(*pgz)->jobs[i].out);
+		}
+		free_v((void **)&(*pgz)->jobs);
+	}
+	free_v((void **)pgz);
+}
+
+static int output(struct pgz *pgz, uint8_t *buf, size_t len)
+{
+	if(pgz->stop) return 0;
+	if((pgz->stop=pgz->output(pgz->arg, buf, len))<0) return -1;
+	return 0;
+}
+
+// Returns 1 if a job was collected, 0 if there were none, or -1 on error.
+static int collect(struct pgz *pgz, int block)
+{
+	struct pgz_job *job;
+	// Same as what zlib writes, with no name and no time.
+	static uint8_t header[10]=
+		{0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3};
+
+	if(!(job=(struct pgz_job *)workq_get(pgz->workq, block)))
+		return 0;
+	if(job->ret)
+	{
+		logp("Compression of a block failed\n");
+		return -1;
+	}
+	pgz->crc=crc32_combine(pgz->crc, job->crc, job->inlen);
+	if(!pgz->header_sent)
+	{
+		if(output(pgz, header, sizeof(header))) return -1;
+		pgz->header_sent=1;
+	}
+	if(output(pgz, job->out, job->outlen)) return -1;
+	return 1;
+}
+
+static int submit(struct pgz *pgz, int last)
+{
+	int r;
+	struct pgz_job *job=&pgz->jobs[pgz->cur];
+	struct pgz_job *next;
+
+	job->level=pgz->level;
+	job->last=last;
+	while(workq_full(pgz->workq))
+		if(collect(pgz, 1)<0) return -1;
+	workq_set_active(pgz->workq, throttle_threads(pgz->workq->threads));
+	if(workq_add(pgz->workq, compress_block, job)) return -1;
+
+	// The queue is one short of the number of jobs, so the next one is
+	// not in use. Prime it with the end of this block.
+	pgz->cur=(pgz->cur+1)%pgz->njobs;
+	next=&pgz->jobs[pgz->cur];
+	next->dictlen=min(job->inlen, (size_t)PGZ_DICT);
+	memcpy(next->dict, job->in+job->inlen-next->dictlen, next->dictlen);
+	next->inlen=0;
+
+	// Send whatever is ready, without waiting for the rest.
+	while((r=collect(pgz, 0))>0) { }
+	if(r<0) return -1;
+	return pgz->stop;
+}
+
+int pgz_write(struct pgz *pgz, const uint8_t *buf, size_t len)
+{
+	int r;
+	size_t n;
+	struct pgz_job *job;
+
+	if(pgz->stop) return pgz->stop;
+	pgz->total+=len;
+	while(len)
+	{
+		job=&pgz->jobs[pgz->cur];
+		n=min(len, (size_t)(PGZ_BLOCK-job->inlen));
+		memcpy(job->in+job->inlen, buf, n);
+		job->inlen+=n;
+		buf+=n;
+		len-=n;
+		if(job->inlen==PGZ_BLOCK && (r=submit(pgz, 0)))
+			return r;
+	}
+	return 0;
+}
+
+int pgz_close(struct pgz *pgz)
+{
+	int r;
+	uint8_t trailer[8];
+
+	if(pgz->stop) return pgz->stop;
+	if((r=submit(pgz, 1))) return r;
+	while((r=collect(pgz, 1))>0) { }
+	if(r<0) return -1;
+	if(pgz->stop) return pgz->stop;
+
+	// CRC and length, little endian.
+	trailer[0]=pgz->crc;
+	trailer[1]=pgz->crc>>8;
+	trailer[2]=pgz->crc>>16;
+	trailer[3]=pgz->crc>>24;
+	trailer[4]=pgz->total;
+	trailer[5]=pgz->total>>8;
+	trailer[6]=pgz->total>>16;
+	trailer[7]=pgz->total>>24;
+	if(output(pgz, trailer, sizeof(trailer))) return -1;
+	return pgz->stop;
+}
@@ -0,0 +1,46 @@
+#ifndef _PGZIP_H
+#define _PGZIP_H
+
+#include <zlib.h>
+
+// Compresses a stream in blocks on a pool of threads, in the same way as
+// pigz. Each block is primed with the end of the block before it, and the
+// blocks are joined with sync flushes, so the result is one ordinary gzip
+// stream that anything can read.
+// The compressed data is handed to 'output' in order, in the calling thread,
+// while the workers carry on with the blocks after it. 'output' returns 0 to
+// carry on, 1 to stop quietly, or -1 on error.
+
+#define PGZ_BLOCK	(128*1024)
+// Files smaller than this are not worth starting the threads for.
+#define PGZ_MIN_SIZE	(8*1024*1024)
+
+typedef int (pgz_output_t)(void *arg, uint8_t *buf, size_t len);
+
+struct pgz_job;
+struct workq;
+
+struct pgz
+{
+	int level;
+	struct workq *workq;
+	struct pgz_job *jobs;
+	int njobs;
+	int cur;
+	uLong crc;
+	uint64_t total;
+	uint8_t header_sent;
+	int stop;
+	pgz_output_t *output;
+	void *arg;
+};
+
+extern struct pgz *pgz_alloc(int threads, int level,
+	pgz_output_t *output, void *arg);
+extern void pgz_free(struct pgz **pgz);
+
+// These return 0 on success, 1 if 'output' asked to stop, or -1 on error.
+extern int pgz_write(struct pgz *pgz, const uint8_t *buf, size_t len);
+extern int pgz_close(struct pgz *pgz);
+
+#endif
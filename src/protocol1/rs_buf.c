@@ -41,9 +41,11 @@
 #define fseek fseeko
 #endif
 
+// Plain calloc(), as librsync is run by the jiggle's worker threads too. The
+// same goes for the filebufs, which are freed with plain free().
 void *rs_alloc(size_t size)
 {
-	return calloc_w(1, size, __func__);
+	return calloc(1, size);
 }
 
 rs_filebuf_t *rs_filebuf_new(struct asfd *asfd,
@@ -51,10 +53,10 @@ rs_filebuf_t *rs_filebuf_new(struct asfd *asfd,
 	size_t buf_len, size_t data_len, struct cntr *cntr)
 {
 	rs_filebuf_t *pf=NULL;
-	if(!(pf=(struct rs_filebuf *)calloc_w(1,
-		sizeof(struct rs_filebuf), __func__))) return NULL;
+	if(!(pf=(struct rs_filebuf *)calloc(1,
+		sizeof(struct rs_filebuf)))) return NULL;
 
-	if(!(pf->buf=(char *)calloc_w(1, buf_len, __func__)))
+	if(!(pf->buf=(char *)calloc(1, buf_len)))
 	{
 		free(pf);
 		return NULL;
@@ -73,7 +75,6 @@ rs_filebuf_t *rs_filebuf_new(struct asfd *asfd,
 	pf->cntr=cntr;
 	if(!MD5_Init(&(pf->md5)))
 	{
-		logp("MD5_Init() failed\n");
 		rs_filebuf_free(pf);
 		return NULL;
 	}
@@ -236,18 +237,13 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 				buf->eof_in=1;
 				return RS_DONE;
 			}
-			else
-			{
-				logp("rs_infilebuf_fill: got return %d when trying to read\n", len);
-				return RS_IO_ERROR;
-			}
+			// Left for the caller to report, as it might be
+			// a worker thread.
+			return RS_IO_ERROR;
 		}
 		fb->bytes+=len;
 		if(!MD5_Update(&(fb->md5), fb->buf, len))
-		{
-			logp("rs_infilebuf_fill: MD5_Update() failed\n");
 			return RS_IO_ERROR;
-		}
 	}
 	else if(zp)
 	{
@@ -262,18 +258,13 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 				buf->eof_in=1;
 				return RS_DONE;
 			}
-			else
-			{
-				logp("rs_infilebuf_fill: got return %d when trying to read\n", len);
-				return RS_IO_ERROR;
-			}
+			// Left for the caller to report, as it might be
+			// a worker thread.
+			return RS_IO_ERROR;
 		}
 		fb->bytes+=len;
 		if(!MD5_Update(&(fb->md5), fb->buf, len))
-		{
-			logp("rs_infilebuf_fill: MD5_Update() failed\n");
 			return RS_IO_ERROR;
-		}
 	}
 
 	buf->avail_in = len;
@@ -357,12 +348,10 @@ rs_result rs_outfilebuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 			size_t result=0;
 			if(fp) result=fwrite(fb->buf, 1, wlen, fp);
 			else if(zp) result=gzwrite(zp, fb->buf, wlen);
+			// Left for the caller to report, as it might be
+			// a worker thread.
 			if(wlen!=result)
-			{
-				logp("error draining buf to file: %s",
-						strerror(errno));
 				return RS_IO_ERROR;
-			}
 		}
 	}
 
@@ -461,13 +450,18 @@ static rs_result rs_whole_gzrun(struct asfd *asfd,
 	rs_filebuf_t *in_fb=NULL;
 	rs_filebuf_t *out_fb=NULL;
 
-	if(in_file || in_zfile)
-		in_fb=rs_filebuf_new(asfd, NULL,
-			in_file, in_zfile, -1, ASYNC_BUF_LEN, -1, cntr);
+	if((in_file || in_zfile)
+	  && !(in_fb=rs_filebuf_new(asfd, NULL,
+		in_file, in_zfile, -1, ASYNC_BUF_LEN, -1, cntr)))
+			return RS_MEM_ERROR;
 
-	if(out_file || out_zfile)
-	out_fb=rs_filebuf_new(asfd, NULL,
-		out_file, out_zfile, -1, ASYNC_BUF_LEN, -1, cntr);
+	if((out_file || out_zfile)
+	  && !(out_fb=rs_filebuf_new(asfd, NULL,
+		out_file, out_zfile, -1, ASYNC_BUF_LEN, -1, cntr)))
+	{
+		if(in_fb) rs_filebuf_free(in_fb);
+		return RS_MEM_ERROR;
+	}
 	result=rs_job_drive(job, &buf,
 		in_fb ? rs_infilebuf_fill : NULL, in_fb,
 		out_fb ? rs_outfilebuf_drain : NULL, out_fb);
@@ -478,14 +472,17 @@ static rs_result rs_whole_gzrun(struct asfd *asfd,
 	return result;
 }
 
-rs_result rs_patch_gzfile(struct asfd *asfd, FILE *basis_file, FILE *delta_file,
+// The basis is read with copy_cb, which is rs_file_copy_cb() for a plain
+// FILE.
+rs_result rs_patch_gzfile(struct asfd *asfd,
+	rs_copy_cb *copy_cb, void *copy_arg, FILE *delta_file,
 	gzFile delta_zfile, FILE *new_file, gzFile new_zfile,
 	rs_stats_t *stats, struct cntr *cntr)
 {
 	rs_job_t *job;
 	rs_result r;
 
-	job=rs_patch_begin(rs_file_copy_cb, basis_file);
+	job=rs_patch_begin(copy_cb, copy_arg);
 	r=rs_whole_gzrun(asfd, job,
 		delta_file, delta_zfile, new_file, new_zfile, cntr);
 	rs_job_free(job);
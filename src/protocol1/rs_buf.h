@@ -66,7 +66,7 @@ rs_result rs_async(rs_job_t *job,
 	rs_buffers_t *rsbuf, rs_filebuf_t *infb, rs_filebuf_t *outfb);
 
 rs_result rs_patch_gzfile(struct asfd *asfd,
-	FILE *basis_file, FILE *delta_file,
+	rs_copy_cb *copy_cb, void *copy_arg, FILE *delta_file,
 	gzFile delta_zfile, FILE *new_file, gzFile new_zfile,
 	rs_stats_t *stats, struct cntr *cntr);
 rs_result rs_sig_gzfile(struct asfd *asfd,
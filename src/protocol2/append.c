@@ -0,0 +1,181 @@
+#include "include.h"
+#include "../cmd.h"
+#include "../hexmap.h"
+#include "append.h"
+
+int append_keep_sig(struct protocol2 *protocol2, struct blk *blk,
+	struct blk **tail, int *count)
+{
+	struct blk *b;
+	if(*count<0) return 0; // Too many to keep.
+	if(++(*count)>PREFIX_SIGS_MAX)
+	{
+		sbuf_protocol2_free_content(protocol2);
+		*tail=NULL;
+		*count=-1;
+		return 0;
+	}
+	if(!(b=blk_alloc())) return -1;
+	b->fingerprint=blk->fingerprint;
+	memcpy(b->md5sum, blk->md5sum, MD5_DIGEST_LENGTH);
+	memcpy(b->savepath, blk->savepath, SAVE_PATH_LEN);
+	b->got=BLK_GOT;
+	b->got_save_path=1;
+	if(*tail) (*tail)->next=b;
+	else protocol2->prefix=b;
+	*tail=b;
+	return 0;
+}
+
+// The message is the offset where the last block starts, and its length and
+// md5sum, then the length and md5sum of the first block.
+int append_request(struct protocol2 *protocol2, uint32_t first_length,
+	uint32_t last_length, char *buf, size_t len)
+{
+	int n;
+	struct blk *b;
+	struct blk *first=protocol2->prefix;
+	if(!first) return -1;
+	if(!last_length
+	  || last_length>protocol2->prefix_size
+	  || !first_length
+	  || first_length>protocol2->prefix_size-(first->next?last_length:0))
+	{
+		// Just ask for all of it.
+		sbuf_protocol2_free_content(protocol2);
+		return -1;
+	}
+	for(b=first; b->next; b=b->next) { }
+	protocol2->append_offset=protocol2->prefix_size-last_length;
+	protocol2->append_length=last_length;
+	memcpy(protocol2->append_md5sum, b->md5sum, MD5_DIGEST_LENGTH);
+	protocol2->append_first_length=first_length;
+	memcpy(protocol2->append_first_md5sum, first->md5sum,
+		MD5_DIGEST_LENGTH);
+	n=snprintf(buf, len, "%" PRIx64 ":%x:%s:",
+		protocol2->append_offset, protocol2->append_length,
+		bytes_to_md5str(b->md5sum));
+	snprintf(buf+n, len-n, "%x:%s", protocol2->append_first_length,
+		bytes_to_md5str(first->md5sum));
+	return 0;
+}
+
+// The client found that the file had only grown, and its sigs start from
+// where the last of the old ones did.
+int append_confirm(struct sbuf *sb, struct iobuf *rbuf)
+{
+	uint64_t offset=0;
+	if(!sb
+	  || !sb->protocol2->prefix
+	  || !sb->protocol2->append_length
+	  || sscanf(rbuf->buf, "%" SCNx64, &offset)!=1
+	  || offset!=sb->protocol2->append_offset)
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		return -1;
+	}
+	sb->flags|=SBUF_APPENDED;
+	return 0;
+}
+
+struct blk *append_prefix(struct sbuf *sb)
+{
+	struct blk *b;
+	struct protocol2 *protocol2=sb->protocol2;
+	if(!(sb->flags & SBUF_APPENDED))
+	{
+		// The client sent the whole file.
+		sbuf_protocol2_free_content(protocol2);
+		return NULL;
+	}
+	sb->flags &= ~SBUF_APPENDED;
+	// The last one is left out, because the client started again from
+	// there.
+	if(!(b=protocol2->prefix)) return NULL;
+	if(!b->next)
+	{
+		blk_free(&protocol2->prefix);
+		return NULL;
+	}
+	for(; b->next->next; b=b->next) { }
+	blk_free(&b->next);
+	return protocol2->prefix;
+}
+
+// The server wants only the end of the next file, if the rest is still the
+// same as in the last backup.
+int append_parse(struct protocol2 *protocol2, struct iobuf *rbuf)
+{
+	char extra;
+	uint64_t offset;
+	unsigned int length;
+	unsigned int first_length;
+	char md5str[MD5_DIGEST_LENGTH*2+1]="";
+	char first_md5str[MD5_DIGEST_LENGTH*2+1]="";
+	if(!rbuf->buf
+	  || sscanf(rbuf->buf, "%" SCNx64 ":%x:%32[0-9a-fA-F]"
+		":%x:%32[0-9a-fA-F]%c", &offset, &length, md5str,
+		&first_length, first_md5str, &extra)!=5
+	  || strlen(md5str)!=MD5_DIGEST_LENGTH*2
+	  || strlen(first_md5str)!=MD5_DIGEST_LENGTH*2
+	  || !length
+	  || !first_length)
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		return -1;
+	}
+	protocol2->append_offset=offset;
+	protocol2->append_length=length;
+	md5str_to_bytes(md5str, protocol2->append_md5sum);
+	protocol2->append_first_length=first_length;
+	md5str_to_bytes(first_md5str, protocol2->append_first_md5sum);
+	return 0;
+}
+
+#ifndef HAVE_WIN32
+static int same_blk(int fd, char *buf, uint64_t offset, uint32_t length,
+	const uint8_t *want)
+{
+	MD5_CTX md5;
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	return pread(fd, buf, length, offset)==(ssize_t)length
+	  && MD5_Init(&md5)
+	  && MD5_Update(&md5, buf, length)
+	  && MD5_Final(md5sum, &md5)
+	  && !memcmp(md5sum, want, MD5_DIGEST_LENGTH);
+}
+#endif
+
+int append_check(struct sbuf *sb)
+{
+#ifdef HAVE_WIN32
+	return 0;
+#else
+	char *buf=NULL;
+	struct protocol2 *protocol2=sb->protocol2;
+	BFILE *bfd=&protocol2->bfd;
+
+	if(!protocol2->append_length) return 0;
+	if(sb->statp.st_size<(off_t)(protocol2->append_offset
+		+protocol2->append_length)
+	  || !(buf=(char *)malloc_w(
+		protocol2->append_length>protocol2->append_first_length?
+		protocol2->append_length:protocol2->append_first_length,
+		__func__)))
+		goto whole;
+	if(!same_blk(bfd->fd, buf, 0, protocol2->append_first_length,
+		protocol2->append_first_md5sum)
+	  || !same_blk(bfd->fd, buf, protocol2->append_offset,
+		protocol2->append_length, protocol2->append_md5sum)
+	  || lseek(bfd->fd, protocol2->append_offset, SEEK_SET)<0)
+		goto whole;
+	free_w(&buf);
+	bfd->pos=protocol2->append_offset;
+	sb->flags|=SBUF_APPENDED;
+	return 0;
+whole:
+	free_w(&buf);
+	protocol2->append_length=0;
+	return lseek(bfd->fd, 0, SEEK_SET)<0?-1:0;
+#endif
+}
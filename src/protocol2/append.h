@@ -0,0 +1,40 @@
+#ifndef _PROTOCOL2_APPEND_H
+#define _PROTOCOL2_APPEND_H
+
+// For a file that looks like it has only grown since the last backup, such
+// as a log file. The server keeps the sigs from then, and asks the client
+// for only the end of the file, from where the last of those blocks starts.
+// The client checks that block, and the first block, and sends the whole
+// file if either has changed.
+
+// The most sigs to keep hold of for a file that might have only grown.
+#define PREFIX_SIGS_MAX		0x40000
+
+// Server side.
+
+// Keeps a copy of the sig of 'blk' on the end of the prefix. 'tail' and
+// 'count' start at NULL and 0. If there turn out to be too many, they are
+// all dropped, and the rest are ignored.
+extern int append_keep_sig(struct protocol2 *protocol2, struct blk *blk,
+	struct blk **tail, int *count);
+// Given the lengths of the first and last kept blocks, puts what to ask the
+// client for in 'buf' and returns 0. Returns -1 and drops the kept sigs if
+// they are no good for it.
+extern int append_request(struct protocol2 *protocol2, uint32_t first_length,
+	uint32_t last_length, char *buf, size_t len);
+// The client says that it is only sending the end of the file.
+extern int append_confirm(struct sbuf *sb, struct iobuf *rbuf);
+// The kept sigs that go into the new manifest, which is all but the last of
+// them if the client confirmed, or none of them otherwise. They stay on
+// 'sb' until sbuf_protocol2_free_content().
+extern struct blk *append_prefix(struct sbuf *sb);
+
+// Client side.
+
+extern int append_parse(struct protocol2 *protocol2, struct iobuf *rbuf);
+// With the file open, checks the blocks that the server asked about and
+// seeks to the start of the last one if they are the same, or to the start
+// of the file if not.
+extern int append_check(struct sbuf *sb);
+
+#endif
@@ -68,8 +68,28 @@ static int md5_generation(uint8_t md5sum[], const char *data, uint32_t length)
 	return 0;
 }
 
+static int is_zero(const char *data, uint32_t length)
+{
+	return length && !data[0] && !memcmp(data, data+1, length-1);
+}
+
 int blk_md5_update(struct blk *blk)
 {
+	// Blocks of zeros from sparse files are all the same, so remember
+	// the last one rather than generating it again.
+	static uint32_t zero_length=0;
+	static uint8_t zero_md5sum[MD5_DIGEST_LENGTH];
+	if(is_zero(blk->data, blk->length))
+	{
+		if(zero_length!=blk->length)
+		{
+			if(md5_generation(zero_md5sum, blk->data, blk->length))
+				return -1;
+			zero_length=blk->length;
+		}
+		memcpy(blk->md5sum, zero_md5sum, MD5_DIGEST_LENGTH);
+		return 0;
+	}
 	return md5_generation(blk->md5sum, blk->data, blk->length);
 }
 
@@ -95,3 +115,13 @@ int blk_verify(struct blk *blk, struct conf **confs)
 	if(!memcmp(md5sum, blk->md5sum, MD5_DIGEST_LENGTH)) return 1;
 	return 0;
 }
+
+// On the server, for a block that the client only referred to, but which
+// turned out not to be one that the server knew about.
+int blk_sig_from_data(struct blk *blk, const char *data, uint32_t length)
+{
+	blk->fingerprint=blk_fingerprint(data, length);
+	if(md5_generation(blk->md5sum, data, length)) return -1;
+	blk->sig_unknown=0;
+	return 0;
+}
@@ -36,7 +36,7 @@ struct blk
 	uint8_t got;				// 1
 	uint8_t requested;			// 1
 	uint8_t got_save_path;			// 1
-	uint8_t pad;				// 1
+	uint8_t sig_unknown;			// 1
 	uint32_t length;			// 4
 	uint64_t fingerprint;			// 8
 	uint8_t md5sum[MD5_DIGEST_LENGTH];	// 16
@@ -52,5 +52,7 @@ extern int blk_md5_update(struct blk *blk);
 extern void blk_print_alloc_stats(void);
 extern int blk_is_zero_length(struct blk *blk);
 extern int blk_verify(struct blk *blk, struct conf **confs);
+extern int blk_sig_from_data(struct blk *blk, const char *data,
+	uint32_t length);
 
 #endif
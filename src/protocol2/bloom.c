@@ -0,0 +1,79 @@
+#include "include.h"
+#include "bloom.h"
+
+struct bloom *bloom_alloc(uint32_t bytes, uint32_t hashes)
+{
+	struct bloom *bloom;
+	if(!bytes || !hashes || hashes>BLOOM_HASHES_MAX)
+	{
+		logp("Bloom filter of %u bytes and %u hashes is no good\n",
+			bytes, hashes);
+		return NULL;
+	}
+	if(!(bloom=(struct bloom *)calloc_w(1, sizeof(struct bloom), __func__))
+	  || !(bloom->bits=(uint8_t *)calloc_w(1, bytes, __func__)))
+	{
+		bloom_free(&bloom);
+		return NULL;
+	}
+	bloom->bytes=bytes;
+	bloom->hashes=hashes;
+	return bloom;
+}
+
+struct bloom *bloom_alloc_for_keys(uint64_t keys)
+{
+	uint64_t bytes=(keys*BLOOM_BITS_PER_KEY+7)/8;
+	if(bytes<8) bytes=8;
+	if(bytes>BLOOM_BYTES_MAX) bytes=BLOOM_BYTES_MAX;
+	return bloom_alloc((uint32_t)bytes, BLOOM_HASHES);
+}
+
+void bloom_free(struct bloom **bloom)
+{
+	if(!bloom || !*bloom) return;
+	free_v((void **)&(*bloom)->bits);
+	free_v((void **)bloom);
+}
+
+// The md5sum is already well mixed, so two words out of it will do as the
+// hashes. Each bit is picked by the first plus 'i' times the second.
+// Go byte by byte so that both ends agree, whatever their endian-ness.
+static uint32_t word(const uint8_t *p)
+{
+	return ((uint32_t)p[0]<<24)
+		| ((uint32_t)p[1]<<16)
+		| ((uint32_t)p[2]<<8)
+		| (uint32_t)p[3];
+}
+
+static uint64_t bit_for(struct bloom *bloom, const uint8_t *md5sum, uint32_t i)
+{
+	uint64_t h1=word(md5sum);
+	uint64_t h2=word(md5sum+4)|1;
+	return (h1+i*h2)%((uint64_t)bloom->bytes*8);
+}
+
+void bloom_add(struct bloom *bloom, const uint8_t *md5sum)
+{
+	uint32_t i;
+	uint64_t bit;
+	for(i=0; i<bloom->hashes; i++)
+	{
+		bit=bit_for(bloom, md5sum, i);
+		bloom->bits[bit/8]|=1<<(bit%8);
+	}
+}
+
+int bloom_test(struct bloom *bloom, const uint8_t *md5sum)
+{
+	uint32_t i;
+	uint64_t bit;
+	for(i=0; i<bloom->hashes; i++)
+	{
+		bit=bit_for(bloom, md5sum, i);
+		if(!(bloom->bits[bit/8] & (1<<(bit%8))))
+			return 0;
+	}
+	return 1;
+}
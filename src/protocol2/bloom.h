@@ -0,0 +1,44 @@
+#ifndef _PROTOCOL2_BLOOM_H
+#define _PROTOCOL2_BLOOM_H
+
+// A Bloom filter of block md5sums. The server fills one in from the blocks
+// that it already has for a client and sends it over, so that the client
+// can tell which of its blocks the server probably has already.
+// A 'no' is always right. A 'yes' is wrong about one time in a hundred.
+
+// About one percent false positives.
+#define BLOOM_BITS_PER_KEY	10
+#define BLOOM_HASHES		7
+
+// The biggest one that a client will take, and the most hashes, so that a
+// bad one cannot make every block take ages to test.
+#define BLOOM_BYTES_MAX		0x200000
+#define BLOOM_HASHES_MAX	32
+// How much of it goes in each CMD_SIG_FILTER.
+#define BLOOM_CHUNK		0x8000
+
+// Instead of a sig, the client can send this much of the start of the
+// md5sum of a block that passes the filter, in a CMD_SIG_REF. Up to
+// SIG_REF_RUN_MAX of them go in each one.
+#define SIG_REF_LEN		12
+#define SIG_REF_RUN_MAX		4096
+
+struct bloom
+{
+	uint8_t *bits;
+	uint32_t bytes;
+	uint32_t hashes;
+	// How much of it has been sent or received so far.
+	uint32_t pos;
+};
+
+extern struct bloom *bloom_alloc(uint32_t bytes, uint32_t hashes);
+// Big enough for 'keys' md5sums.
+extern struct bloom *bloom_alloc_for_keys(uint64_t keys);
+extern void bloom_free(struct bloom **bloom);
+
+extern void bloom_add(struct bloom *bloom, const uint8_t *md5sum);
+// Returns 1 if 'md5sum' was probably added, 0 if it definitely was not.
+extern int bloom_test(struct bloom *bloom, const uint8_t *md5sum);
+
+#endif
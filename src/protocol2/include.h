@@ -5,6 +5,7 @@
 
 #include "blist.h"
 #include "blk.h"
+#include "bloom.h"
 #include "sbuf_protocol2.h"
 
 #endif
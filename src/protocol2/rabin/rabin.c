@@ -1,4 +1,5 @@
 #include "include.h"
+#include "../append.h"
 
 static struct blk *blk=NULL;
 static char *gcp=NULL;
@@ -19,12 +20,41 @@ int blks_generate_init(void)
 	return 0;
 }
 
+static int win_is_zero(void)
+{
+	uint32_t i;
+	if(win->checksum) return 0;
+	for(i=0; i<rconf.win_size; i++)
+		if(win->data[i]) return 0;
+	return 1;
+}
+
+// Within a run of zeros, such as a hole in a sparse file, the fingerprint
+// and the window checksum both stay at zero, and the only place that a
+// block can end is at blk_max. So there is no need to go through the zeros
+// one at a time.
+// Return 1 for got a block, 0 for no block got.
+static int blk_read_zeros(void)
+{
+	uint32_t n;
+	uint32_t max=rconf.blk_max-blk->length;
+	for(n=0; n<max && gcp+n<gbuf_end && !gcp[n]; n++) { }
+	if(blk->data) memset(blk->data+blk->length, 0, n);
+	blk->length+=n;
+	win->pos=(win->pos+n)%rconf.win_size;
+	gcp+=n;
+	return blk->length==rconf.blk_max;
+}
+
 // This is where the magic happens.
 // Return 1 for got a block, 0 for no block got.
 static int blk_read(void)
 {
 	char c;
 
+	while(gcp<gbuf_end && !*gcp && !blk->fingerprint && win_is_zero())
+		if(blk_read_zeros()) return 1;
+
 	for(; gcp<gbuf_end; gcp++)
 	{
 		c=*gcp;
@@ -78,7 +108,8 @@ int blks_generate(struct asfd *asfd, struct conf **confs,
 
 	if(sb->protocol2->bfd.mode==BF_CLOSED)
 	{
-		if(sbuf_open_file(sb, asfd, confs)) return -1;
+		if(sbuf_open_file(sb, asfd, confs)
+		  || append_check(sb)) return -1;
 		first=1;
 	}
 
@@ -168,3 +199,15 @@ int blk_read_verify(struct blk *blk_to_verify, struct conf **confs)
 		return 1;
 	return 0;
 }
+
+// The server uses this for blocks that arrive without their signature.
+// Goes the same way as blk_read().
+uint64_t blk_fingerprint(const char *data, uint32_t length)
+{
+	uint32_t i;
+	uint64_t fingerprint=0;
+	if(!rconf.prime) rconf_init(&rconf);
+	for(i=0; i<length; i++)
+		fingerprint=(fingerprint*rconf.prime)+data[i];
+	return fingerprint;
+}
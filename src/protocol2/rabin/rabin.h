@@ -7,5 +7,6 @@ extern int blks_generate_init(void);
 extern int blks_generate(struct asfd *asfd, struct conf **confs,
 	struct sbuf *sb, struct blist *blist);
 extern int blk_read_verify(struct blk *blk_to_verify, struct conf **confs);
+extern uint64_t blk_fingerprint(const char *data, uint32_t length);
 
 #endif
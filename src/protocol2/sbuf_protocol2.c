@@ -12,5 +12,14 @@ struct protocol2 *sbuf_protocol2_alloc(void)
 
 void sbuf_protocol2_free_content(struct protocol2 *protocol2)
 {
-	return; // Nothing to do.
+	struct blk *blk;
+	if(!protocol2) return;
+	while((blk=protocol2->prefix))
+	{
+		protocol2->prefix=blk->next;
+		blk_free(&blk);
+	}
+	protocol2->prefix_size=0;
+	protocol2->append_offset=0;
+	protocol2->append_length=0;
 }
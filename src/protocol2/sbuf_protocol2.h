@@ -16,6 +16,22 @@ struct protocol2
 	struct blk *bstart;
 	struct blk *bend;
 	struct blk *bsighead;
+
+	// For a file that looks like it has only grown since the last
+	// backup. On the server, the sigs from then, and the size then.
+	struct blk *prefix;
+	uint64_t prefix_size;
+	// Where the last of those blocks starts, which is where the sigs of
+	// the end of the file start from, and its length and md5sum for the
+	// client to check.
+	uint64_t append_offset;
+	uint32_t append_length;
+	uint8_t append_md5sum[MD5_DIGEST_LENGTH];
+	// The first of those blocks as well, which starts at 0. A file that
+	// gets changed in place as well as added to, like a database, often
+	// changes near the start.
+	uint32_t append_first_length;
+	uint8_t append_first_md5sum[MD5_DIGEST_LENGTH];
 };
 
 extern struct protocol2 *sbuf_protocol2_alloc(void);
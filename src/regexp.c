@@ -2,18 +2,23 @@
 
 #include <stdlib.h>
 
-int compile_regex(regex_t **regex, const char *str)
+static int regex_cflags(void)
 {
-	if(str && *str)
-	{
-		if(!(*regex=(regex_t *)malloc_w(sizeof(regex_t), __func__))
-		  || regcomp(*regex, str, REG_EXTENDED
+	return REG_EXTENDED
 #ifdef HAVE_WIN32
 // Give Windows another helping hand and make the regular expressions
 // case insensitive.
-			| REG_ICASE
+		| REG_ICASE
 #endif
-		))
+	;
+}
+
+int compile_regex(regex_t **regex, const char *str)
+{
+	if(str && *str)
+	{
+		if(!(*regex=(regex_t *)malloc_w(sizeof(regex_t), __func__))
+		  || regcomp(*regex, str, regex_cflags()))
 		{
 			logp("unable to compile regex\n");
 			return -1;
@@ -22,6 +27,28 @@ int compile_regex(regex_t **regex, const char *str)
 	return 0;
 }
 
+// For when all that is wanted is whether there was a match, which lets the
+// matching skip the work of finding out where.
+// Does not log anything if 'str' does not compile.
+int compile_regex_nosub(regex_t **regex, const char *str)
+{
+	if(!(*regex=(regex_t *)malloc_w(sizeof(regex_t), __func__)))
+		return -1;
+	if(regcomp(*regex, str, regex_cflags()|REG_NOSUB))
+	{
+		free_v((void **)regex);
+		return -1;
+	}
+	return 0;
+}
+
+void regex_free(regex_t **regex)
+{
+	if(!regex || !*regex) return;
+	regfree(*regex);
+	free_v((void **)regex);
+}
+
 int check_regex(regex_t *regex, const char *buf)
 {
 	if(!regex) return 1;
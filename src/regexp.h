@@ -8,6 +8,8 @@
 #endif
 
 extern int compile_regex(regex_t **regex, const char *str);
+extern int compile_regex_nosub(regex_t **regex, const char *str);
+extern void regex_free(regex_t **regex);
 extern int check_regex(regex_t *regex, const char *buf);
 
 #endif
@@ -327,7 +327,8 @@ int run_backup(struct async *as, struct sdirs *sdirs, struct conf **cconfs,
 	}
 
 	snprintf(okstr, sizeof(okstr), "%s:%d",
-		resume?"resume":"ok", get_int(cconfs[OPT_COMPRESSION]));
+		resume?"resume":"ok",
+		codec_client_level(get_int(cconfs[OPT_COMPRESSION])));
 	if(asfd->write_str(asfd, CMD_GEN, okstr)) return -1;
 
 	return do_backup_server(as, sdirs, cconfs, incexc, resume);
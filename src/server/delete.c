@@ -3,6 +3,7 @@
 #include "../cmd.h"
 #include "bu_get.h"
 #include "sdirs.h"
+#include "protocol1/hlindex.h"
 
 static int do_rename_w(const char *a, const char *b)
 {
@@ -167,16 +168,25 @@ end:
 	return ret;
 }
 
+// Deleted backups may have left data files that only the inline_dedup
+// index refers to.
+static int prune_hlindex(struct sdirs *sdirs)
+{
+	if(!sdirs->hlindex) return 0;
+	return hlindex_prune(sdirs);
+}
+
 int delete_backups(struct sdirs *sdirs, struct conf **cconfs)
 {
+	int deleted=0;
 sleep(20);
 	// Deleting a backup might mean that more become available to delete.
 	// Keep trying to delete until we cannot delete any more.
 	while(1) switch(do_delete_backups(sdirs, cconfs))
 	{
-		case 0: return 0;
+		case 0: return deleted?prune_hlindex(sdirs):0;
 		case -1: return -1;
-		default: continue;
+		default: deleted++; continue;
 	}
 	return -1; // Not reached.
 }
@@ -209,7 +219,8 @@ int do_delete_server(struct asfd *asfd,
 			{
 				found=1;
 				if(asfd->write_str(asfd, CMD_GEN, "ok")
-				  || delete_backup(sdirs, cconfs, bu))
+				  || delete_backup(sdirs, cconfs, bu)
+				  || prune_hlindex(sdirs))
 					goto end;
 			}
 			else
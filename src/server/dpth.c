@@ -1,33 +1,250 @@
 #include "../burp.h"
 #include "../alloc.h"
 #include "../fsops.h"
-#include "../lock.h"
 #include "../log.h"
 #include "dpth.h"
 
+#include <sys/mman.h>
+
 struct dpth *dpth_alloc(void)
 {
-        return (struct dpth *)calloc_w(1, sizeof(struct dpth), __func__);
+	struct dpth *dpth;
+        if(!(dpth=(struct dpth *)calloc_w(1, sizeof(struct dpth), __func__)))
+		return NULL;
+	dpth->fd=-1;
+	return dpth;
 }
 
 void dpth_free(struct dpth **dpth)
 {
 	if(!dpth || !*dpth) return;
 	dpth_release_all(*dpth);
+	if((*dpth)->counter)
+		munmap((*dpth)->counter, sizeof(struct dpth_counter));
 	free_w(&((*dpth)->base_path));
+	free_w(&((*dpth)->reserved));
+	free_w(&((*dpth)->wbuf));
 	free_v((void **)dpth);
 }
 
+// Remember which data file has space reserved past its end, so that the
+// reservation can still be given back if this child does not get to close
+// the file.
+static int write_reserved(struct dpth *dpth, const char *path)
+{
+	int ret=0;
+	FILE *fp;
+	if(!dpth->reserved) return 0;
+	if(!(fp=open_file(dpth->reserved, "wb"))) return -1;
+	if(fprintf(fp, "%s\n", path)<0) ret=-1;
+	if(close_fp(&fp)) ret=-1;
+	return ret;
+}
+
+int dpth_open_data_file(struct dpth *dpth, const char *path, off_t prealloc)
+{
+	free_w(&dpth->fd_path);
+	if(build_path_w(path)) return -1;
+	if((dpth->fd=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666))<0)
+	{
+		logp("Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(!dpth->wbuf
+	  && !(dpth->wbuf=(char *)malloc_w(DPTH_WBUF_SIZE, __func__)))
+		goto error;
+	if(!(dpth->fd_path=strdup_w(path, __func__)))
+		goto error;
+	dpth->wlen=0;
+	dpth->written=0;
+	dpth->synced=0;
+	dpth->prealloc=0;
+#ifdef HAVE_LINUX_OS
+	// Reserve the space up front, so that the file does not get
+	// fragmented by the other children writing at the same time.
+	// Keep the size, so that a partially written file still looks sane.
+	// Failure is not a problem, not all filesystems support it.
+	if(prealloc>0)
+	{
+		if(write_reserved(dpth, path))
+			goto error;
+		if(!fallocate(dpth->fd, FALLOC_FL_KEEP_SIZE, 0, prealloc))
+			dpth->prealloc=prealloc;
+	}
+#endif
+	return 0;
+error:
+	close_fd(&dpth->fd);
+	free_w(&dpth->fd_path);
+	return -1;
+}
+
+static int write_all(struct dpth *dpth, const char *buf, size_t len)
+{
+	ssize_t w;
+	while(len)
+	{
+		if((w=write(dpth->fd, buf, len))<0)
+		{
+			if(errno==EINTR) continue;
+			logp("Write to %s failed: %s\n",
+				dpth->fd_path, strerror(errno));
+			return -1;
+		}
+		buf+=w;
+		len-=w;
+		dpth->written+=w;
+	}
+#ifdef HAVE_LINUX_OS
+	if(dpth->sync==DATA_FILE_SYNC_RANGE)
+	{
+		// Just start the writeback, do not wait for it.
+		if(sync_file_range(dpth->fd, dpth->synced,
+			dpth->written-dpth->synced, SYNC_FILE_RANGE_WRITE))
+		{
+			logp("sync_file_range on %s failed: %s\n",
+				dpth->fd_path, strerror(errno));
+			return -1;
+		}
+		dpth->synced=dpth->written;
+	}
+#endif
+	return 0;
+}
+
+static int flush_wbuf(struct dpth *dpth)
+{
+	if(!dpth->wlen) return 0;
+	if(write_all(dpth, dpth->wbuf, dpth->wlen)) return -1;
+	dpth->wlen=0;
+	return 0;
+}
+
+int dpth_write_data_file(struct dpth *dpth, const char *buf, size_t len)
+{
+	if(dpth->wlen+len>DPTH_WBUF_SIZE && flush_wbuf(dpth))
+		return -1;
+	if(len>=DPTH_WBUF_SIZE)
+		return write_all(dpth, buf, len);
+	memcpy(dpth->wbuf+dpth->wlen, buf, len);
+	dpth->wlen+=len;
+	return 0;
+}
+
+static int sync_parent_dir(const char *path)
+{
+	int fd;
+	int ret=0;
+	char *cp;
+	char *dir=NULL;
+	if(!(dir=strdup_w(path, __func__))) return -1;
+	if((cp=strrchr(dir, '/'))) *cp='\0';
+	if((fd=open(cp?dir:".", O_RDONLY))<0 || fsync(fd))
+	{
+		logp("Could not sync directory of %s: %s\n",
+			path, strerror(errno));
+		ret=-1;
+	}
+	close_fd(&fd);
+	free_w(&dir);
+	return ret;
+}
+
+// Get everything for the open data file onto the disk, if so configured,
+// before it gets closed.
+int dpth_close_data_file(struct dpth *dpth)
+{
+	int ret=0;
+	if(dpth->fd<0) return 0;
+	if(flush_wbuf(dpth)) ret=-1;
+	// Give back any of the preallocated space that did not get used,
+	// even if the writing went wrong. Truncating to the size that it
+	// already is still frees the blocks past the end.
+	if(dpth->prealloc && ftruncate(dpth->fd, dpth->written))
+	{
+		logp("Could not truncate %s: %s\n",
+			dpth->fd_path, strerror(errno));
+		ret=-1;
+	}
+	else if(dpth->reserved)
+		unlink(dpth->reserved);
+	if(!ret && dpth->sync!=DATA_FILE_SYNC_NONE)
+	{
+#ifdef HAVE_FDATASYNC
+		if(fdatasync(dpth->fd))
+#else
+		if(fsync(dpth->fd))
+#endif
+		{
+			logp("Could not sync %s: %s\n",
+				dpth->fd_path, strerror(errno));
+			ret=-1;
+		}
+		else if(sync_parent_dir(dpth->fd_path))
+			ret=-1;
+	}
+	if(close(dpth->fd))
+	{
+		logp("Could not close %s: %s\n",
+			dpth->fd_path, strerror(errno));
+		ret=-1;
+	}
+	dpth->fd=-1;
+	dpth->wlen=0;
+	dpth->prealloc=0;
+	free_w(&dpth->fd_path);
+	return ret;
+}
+
+int dpth_set_reserved(struct dpth *dpth, const char *reserved)
+{
+	free_w(&dpth->reserved);
+	if(!(dpth->reserved=strdup_w(reserved, __func__)))
+		return -1;
+	return 0;
+}
+
+// After a crash, the data file that was being written may still have space
+// reserved past its end. Give it back.
+int dpth_trim_reserved(const char *reserved)
+{
+	int fd=-1;
+	int ret=-1;
+	FILE *fp=NULL;
+	char path[4096]="";
+	struct stat statp;
+
+	if(!(fp=fopen(reserved, "rb")))
+		return 0; // Nothing to do.
+	if(!fgets(path, sizeof(path), fp))
+		goto done;
+	strtok(path, "\n");
+	if((fd=open(path, O_WRONLY))<0)
+		goto done; // It never got created, or has gone since.
+	if(fstat(fd, &statp)
+	  || ftruncate(fd, statp.st_size))
+	{
+		logp("Could not give back space reserved for %s: %s\n",
+			path, strerror(errno));
+		goto end;
+	}
+	logp("Gave back space reserved for %s\n", path);
+done:
+	unlink(reserved);
+	ret=0;
+end:
+	close_fd(&fd);
+	close_fp(&fp);
+	return ret;
+}
+
 int dpth_release_and_move_to_next_in_list(struct dpth *dpth)
 {
 	int ret=0;
 	struct dpth_lock *next=NULL;
 
-	// Try to release (and unlink) the lock even if close_fp failed, just
-	// to be tidy.
-	if(close_fp(&dpth->fp)) ret=-1;
-	if(lock_release(dpth->head->lock)) ret=-1;
-	lock_free(&dpth->head->lock);
+	// Move on even if closing the data file failed, just to be tidy.
+	if(dpth_close_data_file(dpth)) ret=-1;
 
 	next=dpth->head->next;
 	if(dpth->head==dpth->tail) dpth->tail=next;
@@ -40,14 +257,12 @@ int dpth_release_all(struct dpth *dpth)
 {
 	int ret=0;
 	if(!dpth) return 0;
-	if(dpth->fp && close_fp(&dpth->fp)) ret=-1;
+	if(dpth_close_data_file(dpth)) ret=-1;
 	while(dpth->head)
 		if(dpth_release_and_move_to_next_in_list(dpth)) ret=-1;
 	return ret;
 }
 
-#define MAX_FILES_PER_DIR       0xFFFF
-
 static int incr(uint16_t *component, uint16_t max)
 {
 	if((*component)++<max) return 1;
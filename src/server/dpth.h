@@ -4,15 +4,46 @@
 // ext3 maximum number of subdirs is 32000, so leave a little room.
 #define MAX_STORAGE_SUBDIRS	30000
 
-// Wrapper around the lock stuff, so that we can have a list of them and
-// also keep the save_path without the leading directories.
+// Names the protocol2 data file that a client's backup has reserved space
+// for, in the client directory.
+#define DPTH_RESERVED		"data_file_reserved"
+
+// Writes to data files are coalesced into a buffer of this size.
+#define DPTH_WBUF_SIZE		(1024*1024)
+
+// What to do to make sure data files have reached the disk before any
+// manifest refers to them.
+enum data_file_sync
+{
+	// Leave it up to the operating system.
+	DATA_FILE_SYNC_NONE=0,
+	// fdatasync() each data file as it is closed.
+	DATA_FILE_SYNC_CLOSE,
+	// Also start writeback of each batch as it is written, so that
+	// there is little left to do by the time the file is closed.
+	DATA_FILE_SYNC_RANGE
+};
+
+#define MAX_FILES_PER_DIR	0xFFFF
+
+// A data file that has been handed out to us, so that we can have a list of
+// them and also keep the save_path without the leading directories.
 struct dpth_lock
 {
 	char save_path[15];
-	struct lock *lock;
 	struct dpth_lock *next;
 };
 
+// Protocol 2 data files are handed out to the backup children in ranges,
+// from a counter that lives in a file in the data directory and is mapped
+// into each of them.
+struct dpth_counter
+{
+	char magic[8];
+	// The next free prim/seco/tert, packed 16 bits each.
+	uint64_t next;
+};
+
 struct dpth
 {
 	// Protocol 1 only uses these.
@@ -23,13 +54,31 @@ struct dpth
 	// Protocol 2 also uses these.
 	uint16_t sig;
 	char *base_path;
-	// Whether we need to lock another data file.
-	uint8_t need_data_lock;
+	// Whether we need another data file.
+	uint8_t need_data_file;
 	int max_storage_subdirs;
+	// The shared counter, and the range of data files that we have
+	// taken from it, packed like the counter.
+	struct dpth_counter *counter;
+	uint64_t range_start;
+	uint64_t range_end;
 	// Currently open data file. Only one is open at a time, while many
-	// may be locked.
-	FILE *fp;
-	// List of locked data files. 
+	// may be handed out.
+	int fd;
+	char *fd_path;
+	// How much space was reserved for the open data file, and the file
+	// that names it until the reservation has been given back.
+	off_t prealloc;
+	char *reserved;
+	// Pending writes for the open data file.
+	char *wbuf;
+	size_t wlen;
+	// How much has been written to the open data file, and how much of
+	// that has had writeback started.
+	off_t written;
+	off_t synced;
+	enum data_file_sync sync;
+	// List of data files handed out, in the order they will be written.
 	struct dpth_lock *head;
 	struct dpth_lock *tail;
 };
@@ -38,6 +87,14 @@ extern struct dpth *dpth_alloc(void);
 extern void dpth_free(struct dpth **dpth);
 
 extern int dpth_incr(struct dpth *dpth);
+
+extern int dpth_open_data_file(struct dpth *dpth,
+	const char *path, off_t prealloc);
+extern int dpth_write_data_file(struct dpth *dpth,
+	const char *buf, size_t len);
+extern int dpth_close_data_file(struct dpth *dpth);
+extern int dpth_set_reserved(struct dpth *dpth, const char *reserved);
+extern int dpth_trim_reserved(const char *reserved);
 extern int dpth_release_and_move_to_next_in_list(struct dpth *dpth);
 extern int dpth_release_all(struct dpth *dpth);
 
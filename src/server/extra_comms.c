@@ -65,6 +65,26 @@ static int send_features(struct asfd *asfd, struct conf **cconfs)
 	  && append_to_feat(&feat, "sincexc:"))
 		goto end;
 
+	/* Clients can send a reference to extra meta data that they have
+	   already sent, instead of sending it again. */
+	if(append_to_feat(&feat, "metaref:"))
+		goto end;
+
+	/* Protocol2 clients can send just the end of a file that has only
+	   grown since the last backup, if this client is allowed to. It
+	   stays off unless the client says that it wants to. */
+	if(get_int(cconfs[OPT_APPEND_FROM]))
+	{
+		if(append_to_feat(&feat, "appendfrom:"))
+			goto end;
+		set_int(cconfs[OPT_APPEND_FROM], 0);
+	}
+
+	/* Protocol2 clients can be sent a filter of the blocks that the
+	   server already has, and refer to those instead of sending sigs. */
+	if(append_to_feat(&feat, "sigfilter:"))
+		goto end;
+
 	/* Clients can be sent cntrs on resume/verify/restore. */
 /* FIX THIS: Disabled until I rewrite a better protocol.
 	if(append_to_feat(&feat, "counters:"))
@@ -198,7 +218,8 @@ static int extra_comms_read(struct async *as,
 				char comp[32]="";
 				snprintf(comp, sizeof(comp),
 					"compression = %d\n",
-					get_int(cconfs[OPT_COMPRESSION]));
+					codec_client_level(get_int(
+						cconfs[OPT_COMPRESSION])));
 				if(!(tmp=prepend(*incexc, comp,
 					strlen(comp), 0))) goto end;
 				free_w(incexc);
@@ -212,6 +233,21 @@ static int extra_comms_read(struct async *as,
 			logp("Client supports being sent counters.\n");
 			set_int(cconfs[OPT_SEND_CLIENT_CNTR], 1);
 		}
+		else if(!strcmp(rbuf->buf, "metarefok"))
+		{
+			logp("Client will refer back to repeated meta data.\n");
+			set_int(cconfs[OPT_META_REF], 1);
+		}
+		else if(!strcmp(rbuf->buf, "appendfromok"))
+		{
+			logp("Client can send just the end of grown files.\n");
+			set_int(cconfs[OPT_APPEND_FROM], 1);
+		}
+		else if(!strcmp(rbuf->buf, "sigfilterok"))
+		{
+			logp("Client can refer to blocks that are already got.\n");
+			set_int(cconfs[OPT_SIG_FILTER], 1);
+		}
 		else if(!strncmp_w(rbuf->buf, "uname=")
 		  && strlen(rbuf->buf)>strlen("uname="))
 		{
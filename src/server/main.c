@@ -209,6 +209,9 @@ static int run_child(int *cfd, SSL_CTX *ctx,
 		goto end;
 	}
 	SSL_set_bio(ssl, sbio, sbio);
+	// Only protocol2 restores send from files.
+	if(get_e_protocol(confs[OPT_PROTOCOL])!=PROTO_1)
+		ssl_enable_ktls_send(ssl);
 
 	/* Do not try to check peer certificate straight away.
 	   Clients can send a certificate signing request when they have
@@ -2,6 +2,8 @@
 #include "../../cmd.h"
 #include "../../conf.h"
 #include "dpth.h"
+#include "hlindex.h"
+#include "metaref.h"
 
 static size_t treepathlen=0;
 
@@ -82,10 +84,32 @@ static char *set_new_datapth(struct asfd *asfd,
 	return rpath;
 }
 
+// With codecs other than gzip, the client sends file data as it is, and the
+// server does the compression.
+// Returns 1 if the server should compress the data for sb, having recorded
+// that in its attributes, 0 if not, and -1 on error.
+static int server_compresses(struct sbuf *sb, struct conf **cconfs)
+{
+	int compression=get_int(cconfs[OPT_COMPRESSION]);
+	if(codec_get(compression)==CODEC_GZIP
+	  || cmd_is_encrypted(sb->path.cmd)
+	  || sb->path.cmd==CMD_EFS_FILE)
+		return 0;
+	attribs_decode(sb);
+	// Anything that the client compressed itself is kept as it is.
+	if(sb->compression>0)
+		return 0;
+	sb->compression=compression;
+	if(attribs_encode(sb))
+		return -1;
+	return 1;
+}
+
 static int start_to_receive_new_file(struct asfd *asfd,
 	struct sdirs *sdirs, struct conf **cconfs,
 	struct sbuf *sb, struct dpth *dpth)
 {
+	int compress;
 	char *rpath=NULL;
 	int istreedata=0;
 
@@ -95,8 +119,19 @@ static int start_to_receive_new_file(struct asfd *asfd,
 		sdirs, cconfs, sb, dpth, &istreedata)))
 			return -1;
 	
-	if(!(sb->protocol1->fp=open_file(rpath, "wb")))
+	if((compress=server_compresses(sb, cconfs))<0)
+	{
+		if(rpath) free(rpath);
+		return -1;
+	}
+	if(compress)
+		sb->protocol1->fp=codec_fopen(rpath, "wb", sb->compression);
+	else
+		sb->protocol1->fp=open_file(rpath, "wb");
+	if(!sb->protocol1->fp)
 	{
+		if(compress)
+			logp("could not open %s: %s\n", rpath, strerror(errno));
 		log_and_send(asfd, "make file failed");
 		if(rpath) free(rpath);
 		return -1;
@@ -124,11 +159,8 @@ static int process_changed_file(struct asfd *asfd,
 		log_out_of_memory(__func__);
 		return -1;
 	}
-	if(dpth_protocol1_is_compressed(cb->compression, curpath))
-		p1b->protocol1->sigzp=gzopen_file(curpath, "rb");
-	else
-		p1b->protocol1->sigfp=open_file(curpath, "rb");
-	if(!p1b->protocol1->sigzp && !p1b->protocol1->sigfp)
+	if(open_data_file(curpath, cb->compression,
+		&p1b->protocol1->sigfp, &p1b->protocol1->sigzp))
 	{
 		logp("could not open %s: %s\n", curpath, strerror(errno));
 		free(curpath);
@@ -333,13 +365,16 @@ static int maybe_do_delta_stuff(struct asfd *asfd,
 	  || p1b->path.cmd==CMD_ENC_VSS_T)
 		return process_new_file(sdirs, cconfs, cb, p1b, ucfp);
 
-	// Get new files if they have switched between compression on or off.
+	// Get new files if they have switched between compression on or off,
+	// or from one codec to another.
 	if(cb->protocol1->datapth.buf
 	  && dpth_protocol1_is_compressed(cb->compression,
 	    cb->protocol1->datapth.buf))
 		oldcompressed=1;
 	if( ( oldcompressed && !compression)
-	 || (!oldcompressed &&  compression))
+	 || (!oldcompressed &&  compression)
+	 || ( oldcompressed
+		&& codec_get(cb->compression)!=codec_get(compression)))
 		return process_new_file(sdirs, cconfs, cb, p1b, ucfp);
 
 	// Otherwise, do the delta stuff (if possible).
@@ -465,6 +500,10 @@ static int do_stuff_to_send(struct asfd *asfd,
 static int start_to_receive_delta(struct sdirs *sdirs, struct conf **cconfs,
 	struct sbuf *rb)
 {
+	// The delta itself is always gzipped, but the manifest needs to know
+	// what the patched file will be.
+	if(server_compresses(rb, cconfs)<0)
+		return -1;
 	if(get_int(cconfs[OPT_COMPRESSION]))
 	{
 		if(!(rb->protocol1->zp=gzopen_file(sdirs->deltmppath,
@@ -498,8 +537,25 @@ static int finish_delta(struct sdirs *sdirs, struct sbuf *rb)
 	return ret;
 }
 
+static int maybe_hlindex_link(struct sdirs *sdirs, struct sbuf *rb,
+	struct conf **cconfs)
+{
+	int ret;
+	char *path=NULL;
+	if(!get_int(cconfs[OPT_INLINE_DEDUP])
+	  || (rb->flags & SBUFL_RECV_DELTA))
+		return 0;
+	if(!(path=prepend_s(sdirs->datadirtmp, rb->protocol1->datapth.buf)))
+		return -1;
+	ret=hlindex_link(sdirs, path, rb->protocol1->endfile.buf,
+		rb->compression, cconfs);
+	free_w(&path);
+	return ret<0?-1:0;
+}
+
 static int deal_with_receive_end_file(struct asfd *asfd, struct sdirs *sdirs,
-	struct sbuf *rb, FILE *chfp, struct conf **cconfs, char **last_requested)
+	struct sbuf *rb, FILE *chfp, struct conf **cconfs, char **last_requested,
+	struct metarefs *metarefs)
 {
 	static char *cp=NULL;
 	static struct iobuf *rbuf;
@@ -520,6 +576,14 @@ static int deal_with_receive_end_file(struct asfd *asfd, struct sdirs *sdirs,
 	iobuf_move(&rb->protocol1->endfile, rbuf);
 	if(rb->flags & SBUFL_RECV_DELTA && finish_delta(sdirs, rb))
 		goto error;
+	if(maybe_hlindex_link(sdirs, rb, cconfs))
+		goto error;
+	if(metarefs
+	  && get_int(cconfs[OPT_META_REF])
+	  && !(rb->flags & SBUFL_RECV_DELTA)
+	  && (rb->path.cmd==CMD_METADATA || rb->path.cmd==CMD_ENC_METADATA)
+	  && metarefs_add(metarefs, rb))
+		goto error;
 
 	if(sbufl_to_manifest(rb, chfp, NULL))
 		goto error;
@@ -551,6 +615,36 @@ error:
 	return -1;
 }
 
+static int deal_with_receive_meta_ref(struct asfd *asfd, struct sdirs *sdirs,
+	struct sbuf *rb, FILE *chfp, struct conf **cconfs, char **last_requested,
+	struct metarefs *metarefs)
+{
+	const char *endfile=NULL;
+	struct iobuf *rbuf=asfd->rbuf;
+
+	cntr_add_recvbytes(get_cntr(cconfs[OPT_CNTR]), rbuf->len);
+	if(close_fp(&rb->protocol1->fp)
+	  || gzclose_fp(&rb->protocol1->zp))
+	{
+		logp("error closing %s in %s\n", rb->path.buf, __func__);
+		goto error;
+	}
+	if(metarefs_link(asfd, metarefs, rbuf->buf, rb, sdirs->datadirtmp,
+		cconfs, &endfile))
+			goto error;
+
+	iobuf_free_content(rbuf);
+	if(!(rbuf->buf=strdup_w(endfile, __func__)))
+		goto error;
+	rbuf->cmd=CMD_END_FILE;
+	rbuf->len=strlen(rbuf->buf);
+	return deal_with_receive_end_file(asfd, sdirs, rb, chfp, cconfs,
+		last_requested, NULL);
+error:
+	sbuf_free_content(rb);
+	return -1;
+}
+
 static int deal_with_receive_append(struct asfd *asfd, struct sbuf *rb,
 	struct conf **cconfs)
 {
@@ -601,7 +695,7 @@ static int deal_with_filedata(struct asfd *asfd,
 static int do_stuff_to_receive(struct asfd *asfd,
 	struct sdirs *sdirs, struct conf **cconfs,
 	struct sbuf *rb, FILE *chfp,
-	struct dpth *dpth, char **last_requested)
+	struct dpth *dpth, char **last_requested, struct metarefs *metarefs)
 {
 	struct iobuf *rbuf=asfd->rbuf;
 
@@ -633,7 +727,12 @@ static int do_stuff_to_receive(struct asfd *asfd,
 				return 0;
 			case CMD_END_FILE:
 				if(deal_with_receive_end_file(asfd, sdirs, rb,
-					chfp, cconfs, last_requested))
+					chfp, cconfs, last_requested, metarefs))
+						goto error;
+				return 0;
+			case CMD_META_REF:
+				if(deal_with_receive_meta_ref(asfd, sdirs, rb,
+					chfp, cconfs, last_requested, metarefs))
 						goto error;
 				return 0;
 			default:
@@ -779,8 +878,11 @@ int backup_phase2_server_protocol1(struct async *as, struct sdirs *sdirs,
 	struct sbuf *cb=NULL; // file list in current manifest
 	struct sbuf *p1b=NULL; // file list from client
 	struct sbuf *rb=NULL; // receiving file from client
+	struct metarefs metarefs;
 	struct asfd *asfd=as->asfd;
 
+	memset(&metarefs, 0, sizeof(metarefs));
+
 	logp("Begin phase2 (receive file data)\n");
 
 	if(!(dpth=dpth_alloc())
@@ -829,7 +931,8 @@ int backup_phase2_server_protocol1(struct async *as, struct sdirs *sdirs,
 		if(last_requested || !p1zp || asfd->writebuflen)
 		{
 			switch(do_stuff_to_receive(asfd, sdirs,
-				cconfs, rb, chfp, dpth, &last_requested))
+				cconfs, rb, chfp, dpth, &last_requested,
+				&metarefs))
 			{
 				case 0: break;
 				case 1: goto end; // Finished ok.
@@ -923,6 +1026,7 @@ end:
 	gzclose_fp(&p1zp);
 	gzclose_fp(&cmanfp);
 	dpth_free(&dpth);
+	metarefs_free(&metarefs);
 	if(!ret) unlink(sdirs->phase1data);
 
 	logp("End phase2 (receive file data)\n");
@@ -2,56 +2,108 @@
 #include "../../cmd.h"
 #include "../timestamp.h"
 #include "fdirs.h"
+#include "hlindex.h"
+#include "../../workq.h"
 
 #include <netdb.h>
 #include <librsync.h>
 #include <dirent.h>
 
+// The gzopen() mode for writing at the gzip level of 'compression'. Not
+// comp_level(), which has a static buffer, as this is used by the jiggle's
+// worker threads.
+static void gz_write_mode(char *mode, size_t len, int compression)
+{
+	snprintf(mode, len, "wb%d", codec_gzip_level(compression));
+}
+
 // Also used by restore.c.
 // FIX THIS: This stuff is very similar to make_rev_delta, can maybe share
 // some code.
-int do_patch(struct asfd *asfd, const char *dst, const char *del,
-	const char *upd, bool gzupd, int compression, struct conf **cconfs)
+// dstcomp and updcomp are the compression of the basis file and of the file
+// to write, or 0 for neither. A gzipped basis file is read through a zbasis
+// instead of being inflated to a temporary file first.
+// This does not log, as the jiggle's worker threads use it. If a file could
+// not be opened or closed, *failed says which, and errno says why. If it is
+// left NULL, it was librsync that failed.
+int do_patch(struct asfd *asfd, const char *dst, int dstcomp, const char *del,
+	const char *upd, int updcomp, int compression, struct conf **cconfs,
+	const char **failed)
 {
 	FILE *dstp=NULL;
+	struct zbasis *dstzb=NULL;
 	FILE *delfp=NULL;
 	gzFile delzp=NULL;
 	gzFile updp=NULL;
 	FILE *updfp=NULL;
+	char mode[8]="";
 	rs_result result=RS_IO_ERROR;
 
+	*failed=NULL;
+
 	//logp("patching...\n");
 
-	if(!(dstp=open_file(dst, "rb"))) goto end;
+	if(!dstcomp)
+		dstp=fopen(dst, "rb");
+	else if(codec_get(dstcomp)==CODEC_GZIP)
+		dstzb=zbasis_open(dst);
+	else
+		dstp=codec_fopen(dst, "rb", dstcomp);
+
+	if(!dstzb && !dstp)
+	{
+		*failed="open the basis file";
+		goto end;
+	}
 
 	if(dpth_protocol1_is_compressed(compression, del))
-		delzp=gzopen_file(del, "rb");
+		delzp=gzopen(del, "rb");
 	else
-		delfp=open_file(del, "rb");
+		delfp=fopen(del, "rb");
 
-	if(!delzp && !delfp) goto end;
+	if(!delzp && !delfp)
+	{
+		*failed="open the delta";
+		goto end;
+	}
 
-	if(gzupd)
-		updp=gzopen(upd, comp_level(cconfs));
-	else
+	if(!updcomp)
 		updfp=fopen(upd, "wb");
+	else if(codec_get(updcomp)==CODEC_GZIP)
+	{
+		gz_write_mode(mode, sizeof(mode), updcomp);
+		updp=gzopen(upd, mode);
+	}
+	else
+		updfp=codec_fopen(upd, "wb", updcomp);
 
-	if(!updp && !updfp) goto end;
+	if(!updp && !updfp)
+	{
+		*failed="create the patched file";
+		goto end;
+	}
 
-	result=rs_patch_gzfile(asfd,
-		dstp, delfp, delzp, updfp, updp, NULL, get_cntr(cconfs[OPT_CNTR]));
+	if(dstzb)
+		result=rs_patch_gzfile(asfd, zbasis_copy_cb, dstzb,
+			delfp, delzp, updfp, updp, NULL,
+			get_cntr(cconfs[OPT_CNTR]));
+	else
+		result=rs_patch_gzfile(asfd, rs_file_copy_cb, dstp,
+			delfp, delzp, updfp, updp, NULL,
+			get_cntr(cconfs[OPT_CNTR]));
 end:
-	close_fp(&dstp);
-	gzclose_fp(&delzp);
-	close_fp(&delfp);
-	if(close_fp(&updfp))
+	zbasis_close(&dstzb);
+	if(dstp) fclose(dstp);
+	if(delzp) gzclose(delzp);
+	if(delfp) fclose(delfp);
+	if(updfp && fclose(updfp) && result==RS_DONE)
 	{
-		logp("error closing %s in %s\n", upd, __func__);
+		*failed="close the patched file";
 		result=RS_IO_ERROR;
 	}
-	if(gzclose_fp(&updp))
+	if(updp && gzclose(updp)!=Z_OK && result==RS_DONE)
 	{
-		logp("error gzclosing %s in %s\n", upd, __func__);
+		*failed="close the patched file";
 		result=RS_IO_ERROR;
 	}
 	return result;
@@ -62,8 +114,12 @@ end:
 #define RS_DEFAULT_STRONG_LEN	8
 #endif
 
+// These are run by the worker threads, so they do not log. If they fail,
+// *failed says what they were doing with the file given by the caller, and
+// errno says why.
+
 static int make_rev_sig(const char *dst, const char *sig, const char *endfile,
-	int compression, struct conf **confs)
+	int compression, struct conf **confs, const char **failed)
 {
 	int ret=-1;
 	FILE *dstfp=NULL;
@@ -71,33 +127,40 @@ static int make_rev_sig(const char *dst, const char *sig, const char *endfile,
 	FILE *sigp=NULL;
 //logp("make rev sig: %s %s\n", dst, sig);
 
-	if(dpth_protocol1_is_compressed(compression, dst))
-		dstzp=gzopen_file(dst, "rb");
-	else
-		dstfp=open_file(dst, "rb");
-
-	if((!dstzp && !dstfp)
-	  || !(sigp=open_file(sig, "wb"))
-	  || rs_sig_gzfile(NULL, dstfp, dstzp, sigp,
+	if(open_data_file(dst, compression, &dstfp, &dstzp))
+	{
+		*failed="open";
+		goto end;
+	}
+	if(!(sigp=fopen(sig, "wb")))
+	{
+		*failed="create a signature file for";
+		goto end;
+	}
+	if(rs_sig_gzfile(NULL, dstfp, dstzp, sigp,
 		get_librsync_block_len(endfile),
 		RS_DEFAULT_STRONG_LEN,
 		NULL, get_cntr(confs[OPT_CNTR]))!=RS_DONE)
-			goto end;
+	{
+		*failed="make a signature from";
+		errno=EIO;
+		goto end;
+	}
 	ret=0;
 end:
 //logp("end of make rev sig\n");
-	gzclose_fp(&dstzp);
-	close_fp(&dstfp);
-	if(close_fp(&sigp))
+	if(dstzp) gzclose(dstzp);
+	if(dstfp) fclose(dstfp);
+	if(sigp && fclose(sigp) && !ret)
 	{
-		logp("error closing %s in %s\n", sig, __func__);
-		return -1;
+		*failed="write the signature for";
+		ret=-1;
 	}
 	return ret;
 }
 
 static int make_rev_delta(const char *src, const char *sig, const char *del,
-	int compression, struct conf **cconfs)
+	int compression, struct conf **cconfs, const char **failed)
 {
 	int ret=-1;
 	FILE *srcfp=NULL;
@@ -105,144 +168,285 @@ static int make_rev_delta(const char *src, const char *sig, const char *del,
 	FILE *sigp=NULL;
 	gzFile srczp=NULL;
 	gzFile delzp=NULL;
+	char mode[8]="";
 	rs_signature_t *sumset=NULL;
 
 //logp("make rev delta: %s %s %s\n", src, sig, del);
-	if(!(sigp=open_file(sig, "rb"))) goto end;
+	if(!(sigp=fopen(sig, "rb")))
+	{
+		*failed="open the signature for";
+		goto end;
+	}
 
 	if(rs_loadsig_file(sigp, &sumset, NULL)!=RS_DONE
 	  || rs_build_hash_table(sumset)!=RS_DONE)
+	{
+		*failed="load the signature for";
+		errno=EIO;
 		goto end;
+	}
 
 //logp("make rev deltb: %s %s %s\n", src, sig, del);
 
-	if(dpth_protocol1_is_compressed(compression, src))
-		srczp=gzopen_file(src, "rb");
-	else
-		srcfp=open_file(src, "rb");
-
-	if(!srczp && !srcfp) goto end;
+	if(open_data_file(src, compression, &srcfp, &srczp))
+	{
+		*failed="open";
+		goto end;
+	}
 
 	if(get_int(cconfs[OPT_COMPRESSION]))
-		delzp=gzopen_file(del, comp_level(cconfs));
+	{
+		gz_write_mode(mode, sizeof(mode),
+			get_int(cconfs[OPT_COMPRESSION]));
+		delzp=gzopen(del, mode);
+	}
 	else
-		delfp=open_file(del, "wb");
-	if(!delzp && !delfp) goto end;
+		delfp=fopen(del, "wb");
+	if(!delzp && !delfp)
+	{
+		*failed="create the reverse delta for";
+		goto end;
+	}
 
 	if(rs_delta_gzfile(NULL, sumset, srcfp, srczp,
 		delfp, delzp, NULL, get_cntr(cconfs[OPT_CNTR]))!=RS_DONE)
-			goto end;
+	{
+		*failed="make a delta from";
+		errno=EIO;
+		goto end;
+	}
 	ret=0;
 end:
 	if(sumset) rs_free_sumset(sumset);
-	gzclose_fp(&srczp);
-	close_fp(&srcfp);
-	close_fp(&sigp);
-	if(gzclose_fp(&delzp))
+	if(srczp) gzclose(srczp);
+	if(srcfp) fclose(srcfp);
+	if(sigp) fclose(sigp);
+	if(delzp && gzclose(delzp)!=Z_OK && !ret)
 	{
-		logp("error closing zp %s in %s\n", del, __func__);
+		*failed="write the reverse delta for";
 		ret=-1;
 	}
-	if(close_fp(&delfp))
+	if(delfp && fclose(delfp) && !ret)
 	{
-		logp("error closing fp %s in %s\n", del, __func__);
+		*failed="write the reverse delta for";
 		ret=-1;
 	}
 	return ret;
 }
 
-static int gen_rev_delta(const char *sigpath, const char *deltadir,
-	const char *oldpath, const char *finpath, const char *path,
-	struct sbuf *sb, struct conf **cconfs)
+// The expensive part of the jiggle - patching a changed file and generating
+// its reverse delta - is done by a pool of worker threads.
+// The rest is done in the main thread, which also collects the finished jobs
+// in manifest order, so that the deletions file stays in order.
+struct patch_job
 {
-	int ret=-1;
-	char *delpath=NULL;
-	if(!(delpath=prepend_s(deltadir, path)))
-	{
-		log_out_of_memory(__func__);
-		goto end;
-	}
-	//logp("Generating reverse delta...\n");
-/*
-	logp("delpath: %s\n", delpath);
-	logp("finpath: %s\n", finpath);
-	logp("sigpath: %s\n", sigpath);
-	logp("oldpath: %s\n", oldpath);
-*/
-	if(mkpath(&delpath, deltadir))
-	{
-		logp("could not mkpaths for: %s\n", delpath);
-		goto end;
-	}
-	else if(make_rev_sig(finpath, sigpath,
-		sb->protocol1->endfile.buf, sb->compression, cconfs))
-	{
-		logp("could not make signature from: %s\n", finpath);
-		goto end;
+	struct sbuf *sb;
+	char *oldpath;
+	char *newpath;
+	char *finpath;
+	char *deltafpath;
+	char *sigpath;
+	// Where the reverse delta goes, unless keeping a hardlinked archive.
+	char *delpath;
+	int hardlinked_current;
+	struct sdirs *sdirs;
+	struct conf **cconfs;
+	// 0 for OK, 1 if the file could not be patched, -1 for error.
+	int ret;
+	// Set if something went wrong, for the main thread to report.
+	const char *failed;
+	const char *failed_path;
+	int err;
+	int lrs;
+};
+
+static void patch_job_free(struct patch_job **job)
+{
+	if(!job || !*job) return;
+	sbuf_free(&(*job)->sb);
+	free_w(&(*job)->oldpath);
+	free_w(&(*job)->newpath);
+	free_w(&(*job)->finpath);
+	free_w(&(*job)->deltafpath);
+	free_w(&(*job)->sigpath);
+	free_w(&(*job)->delpath);
+	free_v((void **)job);
+}
+
+static void patch_job_failed(struct patch_job *job,
+	const char *failed, const char *path)
+{
+	job->failed=failed;
+	job->failed_path=path;
+	job->err=errno;
+}
+
+// Runs in a worker thread, so it must not log, or use the *_w functions.
+// Anything that goes wrong is left in the job for patch_job_finish() to
+// report.
+static void patch_job_run(void *data)
+{
+	const char *failed=NULL;
+	struct patch_job *job=(struct patch_job *)data;
+	struct sbuf *sb=job->sb;
+	struct conf **cconfs=job->cconfs;
+
+	job->ret=-1;
+
+	// Got a forward patch to do.
+	// A gzipped old file is read through a zbasis, which gives librsync
+	// the random access that it needs without inflating the whole thing
+	// to a temporary file first.
+
+	//logp("Fixing up: %s\n", datapth);
+	if((job->lrs=do_patch(NULL, job->oldpath,
+		dpth_protocol1_is_compressed(sb->compression, job->oldpath),
+		job->deltafpath, job->newpath,
+		get_int(cconfs[OPT_COMPRESSION]),
+		sb->compression /* from the manifest */, cconfs, &failed)))
+	{
+		if(failed) patch_job_failed(job, failed, job->oldpath);
+		// Try to carry on with the rest of the backup
+		// regardless.
+		// Remove anything that got written.
+		unlink(job->newpath);
+		job->ret=1;
+		return;
+	}
+
+	// Need to generate a reverse diff, unless we are keeping a
+	// hardlinked archive.
+	if(!job->hardlinked_current)
+	{
+		//logp("Generating reverse delta...\n");
+		if(make_rev_sig(job->newpath, job->sigpath,
+			sb->protocol1->endfile.buf, sb->compression,
+			cconfs, &failed))
+		{
+			patch_job_failed(job, failed, job->newpath);
+			return;
+		}
+		if(make_rev_delta(job->oldpath, job->sigpath,
+			job->delpath, sb->compression, cconfs, &failed))
+		{
+			patch_job_failed(job, failed, job->oldpath);
+			return;
+		}
+		unlink(job->sigpath);
 	}
-	else if(make_rev_delta(oldpath, sigpath,
-		delpath, sb->compression, cconfs))
+
+	// Power interruptions should be recoverable. If it happens
+	// before this point, the data jiggle for this file has to be
+	// done again.
+	// Once finpath is in place, no more jiggle is required.
+
+	// Use the fresh new file.
+	// Rename race condition is of no consequence, because finpath
+	// will just get recreated automatically.
+	if(rename(job->newpath, job->finpath))
 	{
-		logp("could not make delta from: %s\n", oldpath);
-		goto end;
+		patch_job_failed(job, "rename", job->newpath);
+		return;
 	}
-	else unlink(sigpath);	
 
-	ret=0;
-end:
-	if(delpath) free(delpath);
-	return ret;
+	// Remove the forward delta, as it is no longer needed. There
+	// is a reverse diff and the finished finished file is in place.
+	//logp("Deleting delta.forward...\n");
+	unlink(job->deltafpath);
+
+	job->ret=0;
 }
 
-static int inflate_oldfile(const char *opath, const char *infpath,
-	struct stat *statp, struct conf **confs)
+// Back on the main thread, where problems can be reported.
+static int patch_job_finish(struct patch_job **job, struct fdirs *fdirs,
+	FILE **delfp, struct conf **cconfs)
 {
-	int ret=0;
+	int ret=-1;
+	struct patch_job *j=*job;
+	switch(j->ret)
+	{
+		case 0:
+			// The patched file may well be the same as something
+			// that another backup already has.
+			if(get_int(cconfs[OPT_INLINE_DEDUP])
+			  && hlindex_link(j->sdirs, j->finpath,
+				j->sb->protocol1->endfile.buf,
+				j->sb->compression, cconfs)<0)
+					goto end;
 
-	if(!statp->st_size)
-	{
-		FILE *dest;
-		// Empty file - cannot inflate.
-		// just close the destination and we have duplicated a
-		// zero length file.
-		if(!(dest=open_file(infpath, "wb"))) goto end;
-		logp("asked to inflate zero length file: %s\n", opath);
-		if(close_fp(&dest))
-			logp("error closing %s in %s\n", infpath, __func__);
-	}
-	else if(zlib_inflate(NULL, opath, infpath, confs))
-	{
-		logp("zlib_inflate returned error\n");
-		ret=-1;
+			// Remove the old file. If a power cut happens just
+			// before this, the old file will hang around forever.
+			// FIX THIS: maybe put in something to detect this.
+			// ie, both a reverse delta and the old file exist.
+			if(!j->hardlinked_current)
+			{
+				//logp("Deleting oldpath...\n");
+				unlink(j->oldpath);
+			}
+			break;
+		case 1:
+			if(j->failed)
+				logp("WARNING: could not %s when patching %s: %s\n",
+					j->failed, j->failed_path,
+					strerror(j->err));
+			else
+				logp("WARNING: librsync error when patching %s: %d\n",
+					j->oldpath, j->lrs);
+			cntr_add(get_cntr(cconfs[OPT_CNTR]), CMD_WARNING, 1);
+			// First, note that we want to remove this entry from
+			// the manifest.
+			if(!*delfp
+			  && !(*delfp=open_file(fdirs->deletionsfile, "ab")))
+			{
+				// Could not mark this file as deleted. Fatal.
+				goto end;
+			}
+			if(sbufl_to_manifest(j->sb, *delfp, NULL))
+				goto end;
+			if(fflush(*delfp))
+			{
+				logp("error fflushing deletions file in %s: %s\n", __func__, strerror(errno));
+				goto end;
+			}
+			break;
+		default:
+			if(j->failed)
+				logp("could not %s %s: %s\n", j->failed,
+					j->failed_path, strerror(j->err));
+			goto end;
 	}
+	ret=0;
 end:
+	patch_job_free(job);
 	return ret;
 }
 
-static int inflate_or_link_oldfile(const char *oldpath, const char *infpath,
-	int compression, struct conf **cconfs)
+// Collect the finished jobs, in the order that they were added. If block is
+// set, wait for all of them to finish.
+static int collect_patch_jobs(struct workq *workq, int block,
+	struct fdirs *fdirs, FILE **delfp, struct conf **cconfs)
 {
-	struct stat statp;
-
-	if(lstat(oldpath, &statp))
-	{
-		logp("could not lstat %s\n", oldpath);
-		return -1;
-	}
-
-	if(dpth_protocol1_is_compressed(compression, oldpath))
-		return inflate_oldfile(oldpath, infpath, &statp, cconfs);
+	struct patch_job *job;
+	while((job=(struct patch_job *)workq_get(workq, block)))
+		if(patch_job_finish(&job, fdirs, delfp, cconfs))
+			return -1;
+	return 0;
+}
 
-	// If it was not a compressed file, just hard link it.
-	// It is possible that infpath already exists, if the server
-	// was interrupted on a previous run just after this point.
-	return do_link(oldpath, infpath, &statp, cconfs,
-		1 /* allow overwrite of infpath */);
+// Per job temporary files are named after the slot that the job has in the
+// queue, so that there are a limited number of them to get overwritten if
+// the jiggle is interrupted.
+static char *get_slot_path(const char *path, int slot)
+{
+	char tmp[16]="";
+	snprintf(tmp, sizeof(tmp), "%d", slot);
+	return prepend(path, tmp, strlen(tmp), ".");
 }
 
 static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 	int hardlinked_current, const char *deltabdir, const char *deltafdir,
-	const char *sigpath, FILE **delfp, struct conf **cconfs)
+	const char *sigpath, int slot, struct patch_job **job,
+	struct conf **cconfs)
 {
 	int ret=-1;
 	struct stat statp;
@@ -292,102 +496,40 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 	}
 	else if(!lstat(deltafpath, &statp) && S_ISREG(statp.st_mode))
 	{
-		int lrs;
-		char *infpath=NULL;
-
-		// Got a forward patch to do.
-		// First, need to gunzip the old file,
-		// otherwise the librsync patch will take
-		// forever, because it will be doing seeks
-		// all over the place, and gzseeks are slow.
-	  	if(!(infpath=prepend_s(deltafdir, "inflate")))
+		// Got a forward patch to do. Hand it over to a worker.
+		if(!(*job=(struct patch_job *)
+			calloc_w(1, sizeof(struct patch_job), __func__))
+		  || !((*job)->sigpath=get_slot_path(sigpath, slot)))
 		{
-			log_out_of_memory(__func__);
+			patch_job_free(job);
 			goto end;
 		}
-
-		//logp("Fixing up: %s\n", datapth);
-		if(inflate_or_link_oldfile(oldpath, infpath,
-			sb->compression, cconfs))
-		{
-			logp("error when inflating old file: %s\n", oldpath);
-			free(infpath);
-			goto end;
-		}
-
-		if((lrs=do_patch(NULL, infpath, deltafpath, newpath,
-			get_int(cconfs[OPT_COMPRESSION]),
-			sb->compression /* from the manifest */, cconfs)))
+		// The worker cannot log, so the directories for the reverse
+		// delta are made here.
+		if(!hardlinked_current)
 		{
-			logp("WARNING: librsync error when patching %s: %d\n",
-				oldpath, lrs);
-			cntr_add(get_cntr(cconfs[OPT_CNTR]), CMD_WARNING, 1);
-			// Try to carry on with the rest of the backup
-			// regardless.
-			//ret=-1;
-			// Remove anything that got written.
-			unlink(newpath);
-			unlink(infpath);
-			free(infpath);
-
-			// First, note that we want to remove this entry from
-			// the manifest.
-			if(!*delfp
-			  && !(*delfp=open_file(fdirs->deletionsfile, "ab")))
+			if(!((*job)->delpath=prepend_s(deltabdir, datapth)))
 			{
-				// Could not mark this file as deleted. Fatal.
+				patch_job_free(job);
 				goto end;
 			}
-			if(sbufl_to_manifest(sb, *delfp, NULL))
-				goto end;
-			if(fflush(*delfp))
+			if(mkpath(&(*job)->delpath, deltabdir))
 			{
-				logp("error fflushing deletions file in %s: %s\n", __func__, strerror(errno));
+				logp("could not mkpaths for: %s\n",
+					(*job)->delpath);
+				patch_job_free(job);
 				goto end;
 			}
-	
-			ret=0;
-			goto end;
-		}
-
-		// Get rid of the inflated old file.
-		unlink(infpath);
-		free(infpath);
-
-		// Need to generate a reverse diff, unless we are keeping a
-		// hardlinked archive.
-		if(!hardlinked_current)
-		{
-			if(gen_rev_delta(sigpath, deltabdir,
-				oldpath, newpath, datapth, sb, cconfs))
-					goto end;
-		}
-
-		// Power interruptions should be recoverable. If it happens
-		// before this point, the data jiggle for this file has to be
-		// done again.
-		// Once finpath is in place, no more jiggle is required.
-
-		// Use the fresh new file.
-		// Rename race condition is of no consequence, because finpath
-		// will just get recreated automatically.
-		if(do_rename(newpath, finpath))
-			goto end;
-
-		// Remove the forward delta, as it is no longer needed. There
-		// is a reverse diff and the finished finished file is in place.
-		//logp("Deleting delta.forward...\n");
-		unlink(deltafpath);
-
-		// Remove the old file. If a power cut happens just before
-		// this, the old file will hang around forever.
-		// FIX THIS: maybe put in something to detect this.
-		// ie, both a reverse delta and the old file exist.
-		if(!hardlinked_current)
-		{
-			//logp("Deleting oldpath...\n");
-			unlink(oldpath);
 		}
+		(*job)->sb=sb;
+		(*job)->oldpath=oldpath;
+		(*job)->newpath=newpath;
+		(*job)->finpath=finpath;
+		(*job)->deltafpath=deltafpath;
+		(*job)->hardlinked_current=hardlinked_current;
+		(*job)->sdirs=sdirs;
+		(*job)->cconfs=cconfs;
+		return 0;
 	}
 	else if(!lstat(newpath, &statp) && S_ISREG(statp.st_mode))
 	{
@@ -591,6 +733,12 @@ static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
 
 	FILE *delfp=NULL;
 
+	int slot=0;
+	struct workq *workq=NULL;
+	struct patch_job *job=NULL;
+	struct patch_job *done=NULL;
+	int threads=get_int(cconfs[OPT_SHUFFLE_THREADS]);
+
 	logp("Doing the atomic data jiggle...\n");
 
 	if(!(tmpman=get_tmp_filename(fdirs->manifest)))
@@ -609,17 +757,21 @@ static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
 
 	if(!(deltabdir=prepend_s(fdirs->currentdup, "deltas.reverse"))
 	  || !(deltafdir=prepend_s(sdirs->finishing, "deltas.forward"))
-	  || !(sigpath=prepend_s(fdirs->currentdup, "sig.tmp"))
-	  || !(sb=sbuf_alloc(cconfs)))
+	  || !(sigpath=prepend_s(fdirs->currentdup, "sig.tmp")))
 	{
 		log_out_of_memory(__func__);
 		goto error;
 	}
+	if(threads<0) threads=0;
+	if(!(workq=workq_alloc(threads, threads?threads*2:1)))
+		goto error;
 
 	mkdir(fdirs->datadir, 0777);
 
 	while(1)
 	{
+		if(!sb && !(sb=sbuf_alloc(cconfs)))
+			goto error;
 		switch(sbufl_fill(sb,
 			NULL, NULL, zp, get_cntr(cconfs[OPT_CNTR])))
 		{
@@ -633,13 +785,33 @@ static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
 				sb->protocol1->datapth.buf, cconfs)
 			  || jiggle(sdirs, fdirs, sb, hardlinked_current,
 				deltabdir, deltafdir,
-				sigpath, &delfp, cconfs))
+				sigpath, slot, &job, cconfs))
 					goto error;
 		}
-		sbuf_free_content(sb);
+		if(job)
+		{
+			// The job has the sbuf now.
+			sb=NULL;
+			// Wait for the oldest job, if there is no room.
+			if(workq_full(workq)
+			  && (done=(struct patch_job *)workq_get(workq, 1))
+			  && patch_job_finish(&done, fdirs, &delfp, cconfs))
+				goto error;
+			if(workq_add(workq, patch_job_run, job))
+				goto error;
+			job=NULL;
+			slot=(slot+1)%workq->max;
+		}
+		else
+			sbuf_free_content(sb);
+		if(collect_patch_jobs(workq, 0, fdirs, &delfp, cconfs))
+			goto error;
 	}
 
 end:
+	if(collect_patch_jobs(workq, 1, fdirs, &delfp, cconfs))
+		goto error;
+
 	if(close_fp(&delfp))
 	{
 		logp("error closing %s in atomic_data_jiggle\n",
@@ -657,6 +829,14 @@ end:
 
 	ret=0;
 error:
+	if(workq)
+	{
+		// Let anything still going finish before freeing things.
+		while((job=(struct patch_job *)workq_get(workq, 1)))
+			patch_job_free(&job);
+		workq_free(&workq);
+	}
+	patch_job_free(&job);
 	gzclose_fp(&zp);
 	close_fp(&delfp);
 	sbuf_free(&sb);
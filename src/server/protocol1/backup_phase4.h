@@ -2,8 +2,9 @@
 #define _BACKUP_PHASE4_SERVER_PROTOCOL1_H
 
 extern int do_patch(struct asfd *asfd,
-	const char *dst, const char *del, const char *upd,
-	bool gzupd, int compression, struct conf **cconfs);
+	const char *dst, int dstcomp, const char *del, const char *upd,
+	int updcomp, int compression, struct conf **cconfs,
+	const char **failed);
 
 extern int backup_phase4_server_protocol1(struct sdirs *sdirs,
 	struct conf **cconfs);
@@ -1,13 +1,16 @@
 #include "include.h"
 #include "../../lock.h"
+#include "../../workq.h"
 
 #include <uthash.h>
 #include <dirent.h>
 
 #define LOCKFILE_NAME		"lockfile"
 #define BEDUP_LOCKFILE_NAME	"lockfile.bedup"
+#define BEDUP_CACHE_NAME	"bedup.cache"
 
 #define DEF_MAX_LINKS		10000
+#define DEF_THREADS		4
 
 static int makelinks=0;
 static int deletedups=0;
@@ -20,6 +23,9 @@ static struct lock *locklist=NULL;
 
 static int verbose=0;
 
+// Directory walks and checksums are done by these threads.
+static struct workq *workq=NULL;
+
 typedef struct file file_t;
 
 struct file
@@ -28,8 +34,13 @@ struct file
 	dev_t dev;
 	ino_t ino;
 	nlink_t nlink;
+	off_t size;
+	time_t mtime;
 	unsigned long full_cksum;
 	unsigned long part_cksum;
+	uint8_t need_cksum;
+	// Other paths to the same inode, while working out checksums.
+	file_t *same_ino;
 	file_t *next;
 };
 
@@ -37,41 +48,42 @@ struct mystruct
 {
 	off_t st_size;
 	file_t *files;
+	// Files found by the directory walks, in the order they were found,
+	// waiting to be checked against 'files'.
+	file_t *pending;
+	file_t *pending_tail;
+	size_t npending;
 	UT_hash_handle hh;
 };
 
 struct mystruct *myfiles=NULL;
 
-struct mystruct *find_key(off_t st_size)
+static struct mystruct *find_key(off_t st_size)
 {
 	struct mystruct *s;
 
-	HASH_FIND_INT(myfiles, &st_size, s);
+	HASH_FIND(hh, myfiles, &st_size, sizeof(st_size), s);
 	return s;
 }
 
-static int add_file(struct mystruct *s, struct file *f)
-{
-	struct file *newfile;
-	if(!(newfile=(struct file *)malloc_w(sizeof(struct file), __func__)))
-		return -1;
-	memcpy(newfile, f, sizeof(struct file));
-	newfile->next=s->files;
-	s->files=newfile;
-	return 0;
-}
-
-static int add_key(off_t st_size, struct file *f)
+static struct mystruct *add_key(off_t st_size)
 {
 	struct mystruct *s;
 
-	if(!(s=(struct mystruct *)malloc_w(sizeof(struct mystruct), __func__)))
-		return -1;
+	if(!(s=(struct mystruct *)calloc_w(1, sizeof(struct mystruct), __func__)))
+		return NULL;
 	s->st_size = st_size;
-	s->files=NULL;
-	if(add_file(s, f)) return -1;
-	HASH_ADD_INT(myfiles, st_size, s);
-	return 0;
+	HASH_ADD(hh, myfiles, st_size, sizeof(st_size), s);
+	return s;
+}
+
+static void add_pending(struct mystruct *s, struct file *f)
+{
+	f->next=NULL;
+	if(s->pending_tail) s->pending_tail->next=f;
+	else s->pending=f;
+	s->pending_tail=f;
+	s->npending++;
 }
 
 static char *prepend(const char *oldpath, const char *newpath, const char *sep)
@@ -87,6 +99,177 @@ static char *prepend(const char *oldpath, const char *newpath, const char *sep)
 	return path;
 }
 
+// Like prepend(), but with plain malloc(), for the worker threads.
+static char *join_path(const char *dir, const char *name)
+{
+	char *path=NULL;
+	size_t len=strlen(dir)+strlen(name)+2;
+	if(!(path=(char *)malloc(len)))
+		return NULL;
+	snprintf(path, len, "%s%s%s", dir, *dir?"/":"", name);
+	return path;
+}
+
+/* A cache of checksums from previous runs, so that files that have not
+   changed since then do not need reading again. */
+
+#define CACHE_MAGIC	"bedupc01"
+
+struct cache_key
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+};
+
+struct cache_rec
+{
+	struct cache_key key;
+	uint64_t part_cksum;
+	uint64_t full_cksum;
+};
+
+struct cache_ent
+{
+	struct cache_rec rec;
+	// Only entries for files found in this run are saved.
+	uint8_t seen;
+	UT_hash_handle hh;
+};
+
+static char *cachepath=NULL;
+static struct cache_ent *cache=NULL;
+
+static void cache_key_init(struct cache_key *key, struct file *f)
+{
+	memset(key, 0, sizeof(struct cache_key));
+	key->dev=f->dev;
+	key->ino=f->ino;
+	key->size=f->size;
+	key->mtime=f->mtime;
+}
+
+static struct cache_ent *cache_find(struct cache_key *key)
+{
+	struct cache_ent *e;
+	HASH_FIND(hh, cache, key, sizeof(struct cache_key), e);
+	return e;
+}
+
+static struct cache_ent *cache_add(struct cache_rec *rec)
+{
+	struct cache_ent *e;
+	if(!(e=(struct cache_ent *)
+		calloc_w(1, sizeof(struct cache_ent), __func__)))
+			return NULL;
+	memcpy(&e->rec, rec, sizeof(struct cache_rec));
+	HASH_ADD(hh, cache, rec.key, sizeof(struct cache_key), e);
+	return e;
+}
+
+// Fill in any checksums that were worked out in previous runs.
+static void cache_lookup(struct file *f)
+{
+	struct cache_key key;
+	struct cache_ent *e;
+	cache_key_init(&key, f);
+	if(!(e=cache_find(&key))) return;
+	f->part_cksum=e->rec.part_cksum;
+	f->full_cksum=e->rec.full_cksum;
+	e->seen=1;
+}
+
+static int cache_update(struct file *f)
+{
+	struct cache_rec rec;
+	struct cache_ent *e;
+	if(!cachepath || !f->part_cksum) return 0;
+	cache_key_init(&rec.key, f);
+	if(!(e=cache_find(&rec.key)))
+	{
+		rec.part_cksum=0;
+		rec.full_cksum=0;
+		if(!(e=cache_add(&rec))) return -1;
+	}
+	e->rec.part_cksum=f->part_cksum;
+	if(f->full_cksum) e->rec.full_cksum=f->full_cksum;
+	e->seen=1;
+	return 0;
+}
+
+static int cache_load(void)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	struct cache_rec rec;
+	char magic[sizeof(CACHE_MAGIC)]="";
+
+	if(!(fp=fopen(cachepath, "rb")))
+	{
+		if(errno==ENOENT) return 0;
+		logp("Could not open %s: %s\n", cachepath, strerror(errno));
+		return -1;
+	}
+	if(fread(magic, 1, strlen(CACHE_MAGIC), fp)!=strlen(CACHE_MAGIC)
+	  || strcmp(magic, CACHE_MAGIC))
+	{
+		logp("Ignoring %s, as it is not a checksum cache\n", cachepath);
+		ret=0;
+		goto end;
+	}
+	while(fread(&rec, sizeof(rec), 1, fp)==1)
+		if(!cache_add(&rec)) goto end;
+	logp("Loaded %u cached checksums from %s\n",
+		HASH_COUNT(cache), cachepath);
+	ret=0;
+end:
+	close_fp(&fp);
+	return ret;
+}
+
+static int cache_save(void)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	char *tmppath=NULL;
+	struct cache_ent *e;
+	struct cache_ent *tmp;
+
+	if(!(tmppath=prepend(cachepath, ".tmp", ""))
+	  || !(fp=open_file(tmppath, "wb")))
+		goto end;
+	if(fwrite(CACHE_MAGIC, 1, strlen(CACHE_MAGIC), fp)
+		!=strlen(CACHE_MAGIC))
+			goto end;
+	HASH_ITER(hh, cache, e, tmp)
+	{
+		if(!e->seen) continue;
+		if(fwrite(&e->rec, sizeof(e->rec), 1, fp)!=1)
+			goto end;
+	}
+	if(close_fp(&fp))
+		goto end;
+	ret=do_rename(tmppath, cachepath);
+end:
+	if(ret) logp("Could not save checksum cache %s\n", cachepath);
+	close_fp(&fp);
+	free_w(&tmppath);
+	return ret;
+}
+
+static void cache_free(void)
+{
+	struct cache_ent *e;
+	struct cache_ent *tmp;
+	HASH_ITER(hh, cache, e, tmp)
+	{
+		HASH_DEL(cache, e);
+		free_v((void **)&e);
+	}
+	free_w(&cachepath);
+}
+
 static FILE *open_file(struct file *f)
 {
 	FILE *fp=NULL;
@@ -95,25 +278,38 @@ static FILE *open_file(struct file *f)
 	return fp;
 }
 
-#define FULL_CHUNK	4096
+static int open_fd(struct file *f)
+{
+	int fd;
+	if((fd=open(f->path, O_RDONLY))<0)
+		return -1;
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	return fd;
+}
+
+// Files that cannot be read are blanked, so that they are ignored from now
+// on. The files are made by the worker threads, so they use plain malloc().
+static void file_blank(struct file *f)
+{
+	free(f->path);
+	f->path=NULL;
+}
+
+#define FULL_CHUNK	65536
 
 static int full_match(struct file *o, struct file *n, FILE **ofp, FILE **nfp)
 {
 	size_t ogot;
 	size_t ngot;
-	unsigned int i=0;
 	static char obuf[FULL_CHUNK];
 	static char nbuf[FULL_CHUNK];
 
 	if(*ofp) fseek(*ofp, 0, SEEK_SET);
 	else if(!(*ofp=open_file(o)))
 	{
-		if(o->path)
-		{
-			// Blank this entry so that it can be ignored from
-			// now on.
-			free_w(&o->path);
-		}
+		file_blank(o);
 		return 0;
 	}
 
@@ -125,52 +321,59 @@ static int full_match(struct file *o, struct file *n, FILE **ofp, FILE **nfp)
 		ogot=fread(obuf, 1, FULL_CHUNK, *ofp);
 		ngot=fread(nbuf, 1, FULL_CHUNK, *nfp);
 		if(ogot!=ngot) return 0;
-		for(i=0; i<ogot; i++)
-			if(obuf[i]!=nbuf[i]) return 0;
+		if(memcmp(obuf, nbuf, ogot)) return 0;
 		if(ogot<FULL_CHUNK) break;
 	}
 
 	return 1;
 }
 
+static int md5_to_cksum(MD5_CTX *md5, unsigned long *cksum)
+{
+	unsigned char checksum[MD5_DIGEST_LENGTH+1];
+	if(!MD5_Final(checksum, md5))
+		return -1;
+	memcpy(cksum, checksum, sizeof(unsigned));
+	return 0;
+}
+
 #define PART_CHUNK	1024
 
-static int get_part_cksum(struct file *f, FILE **fp)
+// These get called from the worker threads, so they log nothing and use no
+// static buffers. On failure, they return -1 with errno set, and 'failed'
+// saying what could not be done.
+static int get_part_cksum(struct file *f, const char **failed)
 {
+	int fd;
+	int err;
+	ssize_t got=0;
 	MD5_CTX md5;
-	int got=0;
-	static char buf[PART_CHUNK];
-	unsigned char checksum[MD5_DIGEST_LENGTH+1];
+	char buf[PART_CHUNK];
 
-	if(*fp) fseek(*fp, 0, SEEK_SET);
-	else if(!(*fp=open_file(f)))
+	if((fd=open_fd(f))<0)
 	{
-		f->part_cksum=0;
-		return 0;
-	}
-
-	if(!MD5_Init(&md5))
-	{
-		logp("MD5_Init() failed\n");
+		*failed="open";
 		return -1;
 	}
 
-	got=fread(buf, 1, PART_CHUNK, *fp);
-
-	if(!MD5_Update(&md5, buf, got))
+	got=read(fd, buf, PART_CHUNK);
+	err=errno;
+	close(fd);
+	if(got<0)
 	{
-		logp("MD5_Update() failed\n");
+		errno=err;
+		*failed="read";
 		return -1;
 	}
 
-	if(!MD5_Final(checksum, &md5))
+	if(!MD5_Init(&md5)
+	  || !MD5_Update(&md5, buf, got)
+	  || md5_to_cksum(&md5, &f->part_cksum))
 	{
-		logp("MD5_Final() failed\n");
+		*failed="checksum";
 		return -1;
 	}
 
-	memcpy(&(f->part_cksum), checksum, sizeof(unsigned));
-
 	// Try for a bit of efficiency - no need to calculate the full checksum
 	// again if we already read the whole file.
 	if(got<PART_CHUNK) f->full_cksum=f->part_cksum;
@@ -178,45 +381,77 @@ static int get_part_cksum(struct file *f, FILE **fp)
 	return 0;
 }
 
-static int get_full_cksum(struct file *f, FILE **fp)
+#define READ_CHUNK	(1024*1024)
+
+static int get_full_cksum(struct file *f, const char **failed)
 {
-	size_t s=0;
+	int fd;
+	int err;
+	int ret=-1;
+	ssize_t s=0;
 	MD5_CTX md5;
-	static char buf[FULL_CHUNK];
-	unsigned char checksum[MD5_DIGEST_LENGTH+1];
+	char *buf=NULL;
+	size_t buflen=READ_CHUNK;
 
-	if(*fp) fseek(*fp, 0, SEEK_SET);
-	else if(!(*fp=open_file(f)))
+	if((fd=open_fd(f))<0)
 	{
-		f->full_cksum=0;
-		return 0;
+		*failed="open";
+		return -1;
+	}
+
+	if(f->size>0 && (size_t)f->size<buflen) buflen=f->size;
+	if(!(buf=(char *)malloc(buflen)))
+	{
+		*failed="allocate memory to read";
+		goto end;
 	}
 
 	if(!MD5_Init(&md5))
 	{
-		logp("MD5_Init() failed\n");
-		return -1;
+		*failed="checksum";
+		goto end;
 	}
 
-	while((s=fread(buf, 1, FULL_CHUNK, *fp))>0)
+	while((s=read(fd, buf, buflen))>0)
 	{
 		if(!MD5_Update(&md5, buf, s))
 		{
-			logp("MD5_Update() failed\n");
-			return -1;
+			*failed="checksum";
+			goto end;
 		}
-		if(s<FULL_CHUNK) break;
+	}
+	if(s<0)
+	{
+		// Only part of it was read, so there is no checksum to keep.
+		*failed="read";
+		goto end;
 	}
 
-	if(!MD5_Final(checksum, &md5))
+	if(md5_to_cksum(&md5, &f->full_cksum))
 	{
-		logp("MD5_Final() failed\n");
-		return -1;
+		*failed="checksum";
+		goto end;
 	}
 
-	memcpy(&(f->full_cksum), checksum, sizeof(unsigned));
+	ret=0;
+end:
+	err=errno;
+	free(buf);
+	close(fd);
+	errno=err;
+	return ret;
+}
 
-	return 0;
+// For checksums that are needed, but that the worker threads did not work
+// out, such as for other paths to an inode that could not be read.
+static int file_cksum(struct file *f, int full)
+{
+	const char *failed=NULL;
+	if(!(full?get_full_cksum(f, &failed):get_part_cksum(f, &failed)))
+		return 0;
+	logp("Could not %s %s: %s\n", failed, f->path, strerror(errno));
+	file_blank(f);
+	return -1;
 }
 
 /* Make it atomic by linking to a temporary file, then moving it into place. */
@@ -243,17 +478,27 @@ end:
 	return ret;
 }
 
-static void reset_old_file(struct file *oldfile, struct file *newfile, struct stat *info)
+static void reset_old_file(struct file *oldfile, struct file *newfile)
 {
 	//printf("reset %s with %s %d\n", oldfile->path, newfile->path,
-	//	info->st_nlink);
-	oldfile->nlink=info->st_nlink;
-	free_w(&oldfile->path);
+	//	newfile->nlink);
+	oldfile->nlink=newfile->nlink;
+	free(oldfile->path);
 	oldfile->path=newfile->path;
 	newfile->path=NULL;
 }
 
-static int check_files(struct mystruct *find, struct file *newfile, struct stat *info, const char *ext, unsigned int maxlinks)
+static void file_free(struct file **f)
+{
+	if(!f || !*f) return;
+	free((*f)->path);
+	free(*f);
+	*f=NULL;
+}
+
+// Takes ownership of newfile.
+static int check_files(struct mystruct *find, struct file *newfile,
+	const char *ext, unsigned int maxlinks)
 {
 	int found=0;
 	FILE *nfp=NULL;
@@ -284,12 +529,11 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 			found++;
 			break;
 		}
-		if((!newfile->part_cksum && get_part_cksum(newfile, &nfp))
-		  || (!f->part_cksum && get_part_cksum(f, &ofp)))
-		{
-			// Some error with md5sums Give up.
-			return -1;
-		}
+		// Files that cannot be read are left alone.
+		if(!newfile->part_cksum && file_cksum(newfile, 0))
+			break;
+		if(!f->part_cksum && file_cksum(f, 0))
+			continue;
 		if(newfile->part_cksum!=f->part_cksum)
 		{
 			close_fp(&ofp);
@@ -298,12 +542,10 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 		//printf("  %s, %s\n", find->files->path, newfile->path);
 		//printf("  part cksum matched\n");
 
-		if((!newfile->full_cksum && get_full_cksum(newfile, &nfp))
-		  || (!f->full_cksum && get_full_cksum(f, &ofp)))
-		{
-			// Some error with md5sums Give up.
-			return -1;
-		}
+		if(!newfile->full_cksum && file_cksum(newfile, 1))
+			break;
+		if(!f->full_cksum && file_cksum(f, 1))
+			continue;
 		if(newfile->full_cksum!=f->full_cksum)
 		{
 			close_fp(&ofp);
@@ -314,6 +556,7 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 		if(!full_match(newfile, f, &nfp, &ofp))
 		{
 			close_fp(&ofp);
+			if(!newfile->path) break;
 			continue;
 		}
 		//printf("  full match\n");
@@ -327,7 +570,7 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 			// Just need to reset the path name and the number
 			// of links, and pretend that it was found otherwise
 			// NULL newfile will get added to the memory.
-			reset_old_file(f, newfile, info);
+			reset_old_file(f, newfile);
 			found++;
 			break;
 		}
@@ -347,7 +590,7 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 					// Only count bytes as saved if we
 					// removed the last link.
 					if(newfile->nlink==1)
-						savedbytes+=info->st_size;
+						savedbytes+=newfile->size;
 					break;
 				case -1:
 					// On error, replace the memory of the
@@ -355,7 +598,7 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 					// found. It might work better when
 					// someone later tries to link to the
 					// new one instead of the old one.
-					reset_old_file(f, newfile, info);
+					reset_old_file(f, newfile);
 					count--;
 					break;
 				default:
@@ -365,7 +608,7 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 					// the target file was unlinked without
 					// being replaced - ie, if the max
 					// number of hardlinks is being hit.
-					return -1;
+					goto error;
 			}
 		}
 		else if(deletedups)
@@ -380,14 +623,14 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 				// Only count bytes as saved if we removed the
 				// last link.
 				if(newfile->nlink==1)
-					savedbytes+=info->st_size;
+					savedbytes+=newfile->size;
 			}
 		}
 		else
 		{
 			// To be able to tell how many bytes
 			// are saveable.
-			savedbytes+=info->st_size;
+			savedbytes+=newfile->size;
 		}
 
 		break;
@@ -395,153 +638,546 @@ static int check_files(struct mystruct *find, struct file *newfile, struct stat
 	close_fp(&nfp);
 	close_fp(&ofp);
 
-	if(found)
+	if(found || !newfile->path)
 	{
-		free_w(&newfile->path);
+		file_free(&newfile);
 		return 0;
 	}
 
-	if(add_file(find, newfile)) return -1;
+	newfile->next=find->files;
+	find->files=newfile;
 
 	return 0;
+error:
+	close_fp(&nfp);
+	close_fp(&ofp);
+	file_free(&newfile);
+	return -1;
 }
 
 static int get_link(const char *basedir, const char *lnk, char real[], size_t r)
 {
-	int len=0;
+	ssize_t len=0;
 	char *tmp=NULL;
-	if(!(tmp=prepend(basedir, lnk, "/")))
-	{
-		log_out_of_memory(__func__);
+	if(!(tmp=join_path(basedir, lnk)))
 		return -1;
-	}
 	if((len=readlink(tmp, real, r-1))<0) len=0;
 	real[len]='\0';
-	free_w(&tmp);
+	free(tmp);
 	// Strip any trailing slash.
-	if(real[strlen(real)-1]=='/') real[strlen(real)-1]='\0';
+	if(len && real[len-1]=='/') real[len-1]='\0';
 	return 0;
 }
 
+// One directory, read by one of the worker threads. These, and the files
+// that they find, are allocated with plain malloc(), as the *_w functions
+// are not thread safe.
+struct dir_job
+{
+	char *path;
+	int level;
+	int burp_mode;
+	// What was found, in the order that it was found.
+	file_t *files;
+	file_t *files_tail;
+	struct dir_job *dirs;
+	struct dir_job *dirs_tail;
+	// Set if something went wrong, for the main thread to report. 'ret'
+	// is set too if it is bad enough to give up on the whole run.
+	const char *failed;
+	int err;
+	int ret;
+	struct dir_job *next;
+};
+
+// Directories that have been found, but not yet given to the workers.
+static struct dir_job *waiting=NULL;
+static struct dir_job *waiting_tail=NULL;
 
-static int process_dir(const char *oldpath, const char *newpath,
-	const char *ext, unsigned int maxlinks, int burp_mode, int level)
+// Takes ownership of 'path' if it works.
+static struct dir_job *dir_job_alloc(char *path, int level, int burp_mode)
 {
-	int ret=-1;
-	DIR *dirp=NULL;
-	char *path=NULL;
-	struct stat info;
-	struct dirent *dirinfo=NULL;
-	struct file newfile;
-	struct mystruct *find=NULL;
-	static char working[256]="";
-	static char finishing[256]="";
+	struct dir_job *job;
+	if(!(job=(struct dir_job *)calloc(1, sizeof(struct dir_job))))
+		return NULL;
+	job->path=path;
+	job->level=level;
+	job->burp_mode=burp_mode;
+	return job;
+}
 
-	newfile.path=NULL;
+static void dir_job_free(struct dir_job **job)
+{
+	file_t *f;
+	struct dir_job *sub;
+	if(!job || !*job) return;
+	while((f=(*job)->files))
+	{
+		(*job)->files=f->next;
+		file_free(&f);
+	}
+	while((sub=(*job)->dirs))
+	{
+		(*job)->dirs=sub->next;
+		dir_job_free(&sub);
+	}
+	free((*job)->path);
+	free(*job);
+	*job=NULL;
+}
 
-	if(!(path=prepend(oldpath, newpath, "/"))) goto end;
+static void waiting_free(void)
+{
+	struct dir_job *job;
+	while((job=waiting))
+	{
+		waiting=job->next;
+		dir_job_free(&job);
+	}
+	waiting_tail=NULL;
+}
+
+static void dir_job_failed(struct dir_job *job, const char *failed)
+{
+	job->failed=failed;
+	job->err=errno;
+}
 
-	if(burp_mode && level==0)
+static int skip_entry(struct dir_job *job, const char *name,
+	const char *working, const char *finishing)
+{
+	if(!strcmp(name, ".")
+	  || !strcmp(name, ".."))
+		return 1;
+
+	if(!job->burp_mode) return 0;
+
+	if(job->level==0)
 	{
-		if(get_link(path, "working", working, sizeof(working))
-		  || get_link(path, "finishing", finishing, sizeof(finishing)))
-			goto end;
+		/* Be careful not to try to dedup the lockfiles.
+		   The lock actually gets lost if you open one to do a
+		   checksum
+		   and then close it. This caused me major headaches to
+		   figure out. */
+		if(!strcmp(name, LOCKFILE_NAME)
+		  || !strcmp(name, BEDUP_LOCKFILE_NAME))
+			return 1;
+
+		/* Skip places where backups are going on. */
+		if(!strcmp(name, working)
+		  || !strcmp(name, finishing))
+			return 1;
+
+		if(!strcmp(name, "deleteme"))
+			return 1;
 	}
+	else if(job->level==1)
+	{
+		// Do not dedup stuff that might be appended to later.
+		if(!strncmp(name, "log", strlen("log"))
+		  || !strncmp(name, "verifylog", strlen("verifylog"))
+		  || !strncmp(name, "restorelog", strlen("restorelog")))
+			return 1;
+	}
+	return 0;
+}
 
-	if(!(dirp=opendir(path)))
+// Runs in a worker thread, so it must not log, or use the *_w functions.
+// The directories below this one are left for the main thread to queue up.
+static void dir_job_run(void *data)
+{
+	DIR *dirp=NULL;
+	char *path=NULL;
+	struct stat info;
+	struct dirent *dirinfo=NULL;
+	struct file *newfile=NULL;
+	struct dir_job *sub=NULL;
+	char working[256]="";
+	char finishing[256]="";
+	struct dir_job *job=(struct dir_job *)data;
+
+	if(job->burp_mode && job->level==0
+	  && (get_link(job->path, "working", working, sizeof(working))
+		|| get_link(job->path, "finishing",
+			finishing, sizeof(finishing))))
+				goto error;
+
+	if(!(dirp=opendir(job->path)))
 	{
-		logp("Could not opendir '%s': %s\n", path, strerror(errno));
-		ret=0;
-		goto end;
+		dir_job_failed(job, "opendir");
+		return;
 	}
 	while((dirinfo=readdir(dirp)))
 	{
-		if(!strcmp(dirinfo->d_name, ".")
-		  || !strcmp(dirinfo->d_name, ".."))
-			continue;
-
 		//printf("try %s\n", dirinfo->d_name);
 
-		if(burp_mode)
-		{
-		  if(level==0)
-		  {
-			/* Be careful not to try to dedup the lockfiles.
-			   The lock actually gets lost if you open one to do a
-			   checksum
-			   and then close it. This caused me major headaches to
-			   figure out. */
-			if(!strcmp(dirinfo->d_name, LOCKFILE_NAME)
-			  || !strcmp(dirinfo->d_name, BEDUP_LOCKFILE_NAME))
-				continue;
-
-			/* Skip places where backups are going on. */
-			if(!strcmp(dirinfo->d_name, working)
-			  || !strcmp(dirinfo->d_name, finishing))
-				continue;
+		if(skip_entry(job, dirinfo->d_name, working, finishing))
+			continue;
 
-			if(!strcmp(dirinfo->d_name, "deleteme"))
-				continue;
-		  }
-		  else if(level==1)
-		  {
-			// Do not dedup stuff that might be appended to later.
-			if(!strncmp(dirinfo->d_name, "log",
-				strlen("log"))
-			  || !strncmp(dirinfo->d_name, "verifylog",
-				strlen("verifylog"))
-			  || !strncmp(dirinfo->d_name, "restorelog",
-				strlen("restorelog")))
-					continue;
-		  }
-		}
-
-		free_w(&newfile.path);
-		if(!(newfile.path=prepend(path, dirinfo->d_name, "/")))
-			goto end;
+		free(path);
+		if(!(path=join_path(job->path, dirinfo->d_name)))
+			goto error;
 
-		if(lstat(newfile.path, &info))
+		if(lstat(path, &info))
 			continue;
 
 		if(S_ISDIR(info.st_mode))
 		{
-			if(process_dir(path, dirinfo->d_name, ext, maxlinks,					burp_mode, level+1))
-					goto end;
+			if(!(sub=dir_job_alloc(path,
+				job->level+1, job->burp_mode)))
+					goto error;
+			path=NULL;
+			if(job->dirs_tail) job->dirs_tail->next=sub;
+			else job->dirs=sub;
+			job->dirs_tail=sub;
 			continue;
 		}
 		else if(!S_ISREG(info.st_mode)
 		  || !info.st_size) // ignore zero-length files
 			continue;
 
-		newfile.dev=info.st_dev;
-		newfile.ino=info.st_ino;
-		newfile.nlink=info.st_nlink;
-		newfile.full_cksum=0;
-		newfile.part_cksum=0;
-		newfile.next=NULL;
-
-		//printf("%s\n", newfile.path);
+		if(!(newfile=(struct file *)calloc(1, sizeof(struct file))))
+			goto error;
+		newfile->path=path;
+		path=NULL;
+		newfile->dev=info.st_dev;
+		newfile->ino=info.st_ino;
+		newfile->nlink=info.st_nlink;
+		newfile->size=info.st_size;
+		newfile->mtime=info.st_mtime;
+
+		//printf("%s\n", newfile->path);
+
+		if(job->files_tail) job->files_tail->next=newfile;
+		else job->files=newfile;
+		job->files_tail=newfile;
+	}
+	goto end;
+error:
+	dir_job_failed(job, "allocate memory to read");
+	job->ret=-1;
+end:
+	if(dirp) closedir(dirp);
+	free(path);
+}
 
-		if((find=find_key(info.st_size)))
+// Put the files from a directory that has been read into the lists of files
+// with the same size, keeping them in the order that they were found, and
+// queue up the directories that were found in it.
+static int dir_done(struct dir_job *job)
+{
+	int ret=-1;
+	file_t *f;
+	struct mystruct *find;
+
+	if(job->failed)
+		logp("Could not %s '%s': %s\n",
+			job->failed, job->path, strerror(job->err));
+	if(job->ret) goto end;
+	while((f=job->files))
+	{
+		job->files=f->next;
+		f->next=NULL;
+		if(!(find=find_key(f->size))
+		  && !(find=add_key(f->size)))
 		{
-			if(check_files(find, &newfile, &info, ext, maxlinks))
-				goto end;
+			file_free(&f);
+			goto end;
 		}
-		else
+		if(cachepath) cache_lookup(f);
+		add_pending(find, f);
+	}
+	if(job->dirs)
+	{
+		if(waiting_tail) waiting_tail->next=job->dirs;
+		else waiting=job->dirs;
+		waiting_tail=job->dirs_tail;
+		job->dirs=NULL;
+		job->dirs_tail=NULL;
+	}
+	ret=0;
+end:
+	dir_job_free(&job);
+	return ret;
+}
+
+// Give the workers as many of the waiting directories as they can take, then
+// deal with the ones that have been read. With 'block' set, this carries on
+// until every directory has been read, so that a single large tree is read
+// by all the threads.
+static int walk_collect(int block)
+{
+	struct dir_job *job;
+	while(1)
+	{
+		while((job=waiting) && !workq_full(workq))
 		{
-			//printf("add: %s\n", newfile.path);
-			if(add_key(info.st_size, &newfile))
-				goto end;
+			if(!(waiting=job->next)) waiting_tail=NULL;
+			job->next=NULL;
+			if(workq_add(workq, dir_job_run, job))
+			{
+				dir_job_free(&job);
+				return -1;
+			}
 		}
+		if(!(job=(struct dir_job *)workq_get(workq, block)))
+			return 0;
+		if(dir_done(job)) return -1;
 	}
-	ret=0;
+}
+
+static int walk_add(const char *oldpath, const char *newpath, int burp_mode)
+{
+	char *path=NULL;
+	struct dir_job *job=NULL;
+	if(!(path=join_path(oldpath, newpath))
+	  || !(job=dir_job_alloc(path, 0, burp_mode)))
+	{
+		free(path);
+		log_out_of_memory(__func__);
+		return -1;
+	}
+	if(waiting_tail) waiting_tail->next=job;
+	else waiting=job;
+	waiting_tail=job;
+	return walk_collect(0);
+}
+
+// A checksum for one of the worker threads to work out.
+struct cksum_job
+{
+	struct file *file;
+	int full;
+	const char *failed;
+	int err;
+};
+
+static void cksum_job_run(void *data)
+{
+	struct cksum_job *job=(struct cksum_job *)data;
+	if(job->full?get_full_cksum(job->file, &job->failed)
+		:get_part_cksum(job->file, &job->failed))
+			job->err=errno;
+}
+
+static int cksum_done(struct cksum_job *job)
+{
+	int ret=0;
+	file_t *o;
+	struct file *f=job->file;
+	if(job->failed)
+	{
+		logp("Could not %s %s: %s\n",
+			job->failed, f->path, strerror(job->err));
+		// Nothing gets cached for it, and it gets dropped.
+		file_blank(f);
+		goto end;
+	}
+	// Other paths to the same inode do not need reading again.
+	for(o=f->same_ino; o; o=o->same_ino)
+	{
+		o->part_cksum=f->part_cksum;
+		o->full_cksum=f->full_cksum;
+	}
+	ret=cache_update(f);
 end:
-	closedir(dirp);
-	free_w(&newfile.path);
-	free_w(&path);
+	free_v((void **)&job);
 	return ret;
 }
 
+static int cksum_collect(int block)
+{
+	struct cksum_job *job;
+	while((job=(struct cksum_job *)workq_get(workq, block)))
+		if(cksum_done(job)) return -1;
+	return 0;
+}
+
+static int cksum_add(struct file *f, int full)
+{
+	struct cksum_job *job;
+	while(workq_full(workq))
+	{
+		if(!(job=(struct cksum_job *)workq_get(workq, 1))
+		  || cksum_done(job))
+			return -1;
+	}
+	if(!(job=(struct cksum_job *)
+		calloc_w(1, sizeof(struct cksum_job), __func__)))
+			return -1;
+	job->file=f;
+	job->full=full;
+	if(workq_add(workq, cksum_job_run, job))
+	{
+		free_v((void **)&job);
+		return -1;
+	}
+	return cksum_collect(0);
+}
+
+static int cmp_inode(const void *a, const void *b)
+{
+	const struct file *x=*(const struct file **)a;
+	const struct file *y=*(const struct file **)b;
+	if(x->dev!=y->dev) return x->dev<y->dev?-1:1;
+	if(x->ino!=y->ino) return x->ino<y->ino?-1:1;
+	return 0;
+}
+
+static int cmp_part(const void *a, const void *b)
+{
+	const struct file *x=*(const struct file **)a;
+	const struct file *y=*(const struct file **)b;
+	if(x->dev!=y->dev) return x->dev<y->dev?-1:1;
+	if(x->part_cksum!=y->part_cksum)
+		return x->part_cksum<y->part_cksum?-1:1;
+	if(x->ino!=y->ino) return x->ino<y->ino?-1:1;
+	return 0;
+}
+
+/* Mark one file for each inode that needs a checksum, in runs of the sorted
+   array that share a device (and partial checksum, if 'full' is set) but
+   have more than one inode. */
+static void mark_cksums(struct file **arr, size_t n, int full)
+{
+	size_t i;
+	size_t j;
+	size_t k;
+	for(i=0; i<n; i=j)
+	{
+		int inodes=1;
+		for(j=i+1; j<n && arr[j]->dev==arr[i]->dev
+		  && (!full || arr[j]->part_cksum==arr[i]->part_cksum); j++)
+			if(arr[j]->ino!=arr[j-1]->ino) inodes++;
+		if(inodes<2) continue;
+		for(k=i; k<j; k++)
+		{
+			if(k>i && arr[k]->ino==arr[k-1]->ino) continue;
+			if(!arr[k]->path) continue;
+			if(full ? arr[k]->full_cksum : arr[k]->part_cksum)
+				continue;
+			if(full && !arr[k]->part_cksum) continue;
+			arr[k]->need_cksum=1;
+		}
+	}
+}
+
+static int do_cksums(struct file **arr, size_t n, int full)
+{
+	size_t i;
+	size_t j;
+	mark_cksums(arr, n, full);
+	for(i=0; i<n; i=j)
+	{
+		for(j=i+1; j<n && arr[j]->dev==arr[i]->dev
+		  && arr[j]->ino==arr[i]->ino; j++)
+			arr[j-1]->same_ino=arr[j];
+		arr[j-1]->same_ino=NULL;
+		if(!arr[i]->need_cksum) continue;
+		arr[i]->need_cksum=0;
+		if(cksum_add(arr[i], full))
+			return -1;
+	}
+	return 0;
+}
+
+/* Queue up the checksums that are going to be needed for a set of files with
+   the same size. First the partial checksums, then on the second pass the
+   full checksums of those with matching partial checksums. */
+static int bucket_cksums(struct mystruct *s, int full)
+{
+	int ret;
+	size_t i=0;
+	file_t *f;
+	struct file **arr=NULL;
+
+	if(s->npending<2) return 0;
+	if(!(arr=(struct file **)
+		malloc_w(s->npending*sizeof(struct file *), __func__)))
+			return -1;
+	for(f=s->pending; f; f=f->next) arr[i++]=f;
+
+	qsort(arr, s->npending, sizeof(struct file *),
+		full?cmp_part:cmp_inode);
+	ret=do_cksums(arr, s->npending, full);
+	free_v((void **)&arr);
+	return ret;
+}
+
+static int dedup(const char *ext, unsigned int maxlinks)
+{
+	int full;
+	file_t *f;
+	struct mystruct *s;
+	struct mystruct *tmp;
+
+	for(full=0; full<2; full++)
+	{
+		HASH_ITER(hh, myfiles, s, tmp)
+			if(bucket_cksums(s, full)) return -1;
+		if(cksum_collect(1)) return -1;
+	}
+
+	// Now go through the files in the order that they were found.
+	HASH_ITER(hh, myfiles, s, tmp)
+	{
+		while((f=s->pending))
+		{
+			s->pending=f->next;
+			s->npending--;
+			// It could not be read.
+			if(!f->path)
+			{
+				file_free(&f);
+				continue;
+			}
+			if(!s->files)
+			{
+				f->next=NULL;
+				s->files=f;
+				continue;
+			}
+			if(check_files(s, f, ext, maxlinks))
+				return -1;
+		}
+		s->pending_tail=NULL;
+	}
+	return 0;
+}
+
+static void myfiles_free(void)
+{
+	file_t *f;
+	struct mystruct *s;
+	struct mystruct *tmp;
+	HASH_ITER(hh, myfiles, s, tmp)
+	{
+		while((f=s->files))
+		{
+			s->files=f->next;
+			file_free(&f);
+		}
+		while((f=s->pending))
+		{
+			s->pending=f->next;
+			file_free(&f);
+		}
+		HASH_DEL(myfiles, s);
+		free_v((void **)&s);
+	}
+}
+
+// Wait for the walks to finish, then find the duplicates.
+static int finish_dedup(const char *ext, unsigned int maxlinks)
+{
+	if(walk_collect(1)
+	  || dedup(ext, maxlinks))
+		return -1;
+	// Not being able to save the cache is not the end of the world.
+	if(cachepath) cache_save();
+	return 0;
+}
+
 static void sighandler(int signum)
 {
 	locks_release_and_free(&locklist);
@@ -663,9 +1299,8 @@ static int iterate_over_clients(struct conf **globalcs,
 		// Remember that we got that lock.
 		lock_add_to_list(&locklist, lock);
 
-		if(process_dir(get_string(cconfs[OPT_DIRECTORY]),
-			dirinfo->d_name,
-			ext, maxlinks, 1 /* burp mode */, 0 /* level */))
+		if(walk_add(get_string(cconfs[OPT_DIRECTORY]),
+			dirinfo->d_name, 1 /* burp mode */))
 		{
 			ret=-1;
 			break;
@@ -675,6 +1310,10 @@ static int iterate_over_clients(struct conf **globalcs,
 	}
 	closedir(dirp);
 
+	// Do this while the locks are still held.
+	if(!ret && finish_dedup(ext, maxlinks))
+		ret=-1;
+
 	locks_release_and_free(&locklist);
 
 	confs_free(&cconfs);
@@ -701,6 +1340,12 @@ static int usage(void)
 	printf("                           group, use the 'dedup_group' option in the client\n");
 	printf("                           configuration file on the server.\n");
 	printf("  -h|-?                    Print this text and exit.\n");
+	printf("  -j <number>              Number of threads to use for walking directories\n");
+	printf("                           and reading files. The default is %d.\n", DEF_THREADS);
+	printf("  -k <path>                Path to a cache of checksums to keep between runs,\n");
+	printf("                           so that unchanged files are not read again.\n");
+	printf("                           In burp mode, the default is '%s' in the\n", BEDUP_CACHE_NAME);
+	printf("                           storage directory.\n");
 	printf("  -d                       Delete any duplicate files found.\n");
 	printf("                           (non-burp mode only)\n");
 	printf("  -l                       Hard link any duplicate files found.\n");
@@ -729,6 +1374,7 @@ int run_bedup(int argc, char *argv[])
 	int ret=0;
 	int option=0;
 	int nonburp=0;
+	int threads=DEF_THREADS;
 	unsigned int maxlinks=DEF_MAX_LINKS;
 	char *groups=NULL;
 	char ext[16]="";
@@ -738,7 +1384,15 @@ int run_bedup(int argc, char *argv[])
 	configfile=get_config_path();
 	snprintf(ext, sizeof(ext), ".bedup.%d", getpid());
 
-	while((option=getopt(argc, argv, "c:dg:hlm:nvV?"))!=-1)
+	// In case of an earlier run in the same process.
+	makelinks=0;
+	deletedups=0;
+	savedbytes=0;
+	count=0;
+	ccount=0;
+	verbose=0;
+
+	while((option=getopt(argc, argv, "c:dg:hj:k:lm:nvV?"))!=-1)
 	{
 		switch(option)
 		{
@@ -752,6 +1406,14 @@ int run_bedup(int argc, char *argv[])
 			case 'g':
 				groups=optarg;
 				break;
+			case 'j':
+				threads=atoi(optarg);
+				break;
+			case 'k':
+				free_w(&cachepath);
+				if(!(cachepath=strdup_w(optarg, __func__)))
+					return 1;
+				break;
 			case 'l':
 				makelinks=1;
 				break;
@@ -821,28 +1483,46 @@ int run_bedup(int argc, char *argv[])
 		logp("The argument to -m needs to be greater than 1.\n");
 		return 1;
 	}
+	if(threads<0)
+	{
+		logp("The argument to -j cannot be negative.\n");
+		return 1;
+	}
+	if(!(workq=workq_alloc(threads, threads*2)))
+		return 1;
 
 	if(nonburp)
 	{
+		if(cachepath && cache_load())
+			ret=1;
 		// Read directories from command line.
-		for(i=optind; i<argc; i++)
+		for(i=optind; !ret && i<argc; i++)
 		{
 			// Strip trailing slashes, for tidiness.
 			if(argv[i][strlen(argv[i])-1]=='/')
 				argv[i][strlen(argv[i])-1]='\0';
-			if(process_dir("", argv[i], ext, maxlinks,
-				0 /* not burp mode */, 0 /* level */))
+			if(walk_add("", argv[i], 0 /* not burp mode */))
 			{
 				ret=1;
 				break;
 			}
 		}
+		if(!ret && finish_dedup(ext, maxlinks))
+			ret=1;
 	}
 	else
 	{
 		struct conf **globalcs=NULL;
 		struct strlist *grouplist=NULL;
 		struct lock *globallock=NULL;
+		char cachename[256]="";
+
+		// Runs for different groups see different files, so they
+		// get their own caches.
+		snprintf(cachename, sizeof(cachename), "%s%s%s",
+			BEDUP_CACHE_NAME, groups?".":"", groups?groups:"");
+		for(i=0; cachename[i]; i++)
+			if(cachename[i]=='/') cachename[i]='_';
 
 		if(groups)
 		{
@@ -878,6 +1558,10 @@ int run_bedup(int argc, char *argv[])
 		logp("Dedup clients from %s\n",
 			get_string(globalcs[OPT_CLIENTCONFDIR]));
 		maxlinks=get_int(globalcs[OPT_MAX_HARDLINKS]);
+		if(!cachepath && !(cachepath=prepend_s(
+			get_string(globalcs[OPT_DIRECTORY]), cachename)))
+				return 1;
+		if(cache_load()) return 1;
 		if(grouplist)
 		{
 			struct strlist *g=NULL;
@@ -915,6 +1599,11 @@ int run_bedup(int argc, char *argv[])
 		strlists_free(&grouplist);
 	}
 
+	waiting_free();
+	workq_free(&workq);
+	myfiles_free();
+	cache_free();
+
 	if(!nonburp)
 	{
 		logp("%d client storages scanned\n", ccount);
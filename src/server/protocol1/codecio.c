@@ -0,0 +1,535 @@
+#include "include.h"
+#include "codecio.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+// Data is written as a run of independent frames, each holding up to
+// CODEC_FRAME bytes of the original file. Anything that understands the codec
+// can still decompress the whole thing in one go, but a reader that needs to
+// go backwards only has to start again from the beginning of a frame, rather
+// than the beginning of the file. The frame boundaries are noted as the file
+// is read.
+// The jiggle's worker threads use these, so nothing here logs or uses the *_w
+// functions. Failures leave errno set for the caller to report.
+
+#ifdef HAVE_FOPENCOOKIE
+
+#define CODEC_FRAME	(1024*1024)
+#define CODEC_CHUNK	65536
+
+struct cframe
+{
+	off_t out;
+	off_t in;
+};
+
+struct cstream
+{
+	int fd;
+	int writing;
+	enum codec codec;
+	int level;
+	uint8_t *buf;
+	size_t bufsize;
+	size_t len;
+	size_t pos;
+	off_t in;	// Offset in the file of the end of buf.
+	off_t out;	// Position in the uncompressed data.
+	off_t framed;	// Uncompressed bytes written to the current frame.
+	int midframe;
+	int eof;
+	uint8_t *skip;
+	struct cframe *frames;
+	size_t nframes;
+	size_t aframes;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zc;
+	ZSTD_DCtx *zd;
+#endif
+#ifdef HAVE_LZ4
+	LZ4F_cctx *lc;
+	LZ4F_dctx *ld;
+	LZ4F_preferences_t prefs;
+#endif
+};
+
+static void cs_free(struct cstream **cs)
+{
+	if(!cs || !*cs) return;
+	close_fd(&(*cs)->fd);
+#ifdef HAVE_ZSTD
+	if((*cs)->zc) ZSTD_freeCCtx((*cs)->zc);
+	if((*cs)->zd) ZSTD_freeDCtx((*cs)->zd);
+#endif
+#ifdef HAVE_LZ4
+	if((*cs)->lc) LZ4F_freeCompressionContext((*cs)->lc);
+	if((*cs)->ld) LZ4F_freeDecompressionContext((*cs)->ld);
+#endif
+	free((*cs)->buf);
+	free((*cs)->skip);
+	free((*cs)->frames);
+	free(*cs);
+	*cs=NULL;
+}
+
+static int cs_add_frame(struct cstream *cs)
+{
+	struct cframe *f;
+	if(cs->nframes && cs->frames[cs->nframes-1].out>=cs->out)
+		return 0;
+	if(cs->nframes==cs->aframes)
+	{
+		size_t a=cs->aframes?cs->aframes*2:16;
+		if(!(f=(struct cframe *)realloc(cs->frames,
+			a*sizeof(struct cframe))))
+				return -1;
+		cs->frames=f;
+		cs->aframes=a;
+	}
+	f=&cs->frames[cs->nframes++];
+	f->out=cs->out;
+	f->in=cs->in-(off_t)(cs->len-cs->pos);
+	return 0;
+}
+
+static int cs_init(struct cstream *cs)
+{
+	cs->bufsize=CODEC_CHUNK;
+	switch(cs->codec)
+	{
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			if(cs->writing)
+			{
+				if(!(cs->zc=ZSTD_createCCtx())
+				  || ZSTD_isError(ZSTD_CCtx_setParameter(cs->zc,
+					ZSTD_c_compressionLevel, cs->level))
+				  || ZSTD_isError(ZSTD_CCtx_setParameter(cs->zc,
+					ZSTD_c_checksumFlag, 1)))
+						goto error;
+			}
+			else if(!(cs->zd=ZSTD_createDCtx()))
+				goto error;
+			break;
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4:
+			if(cs->writing)
+			{
+				memset(&cs->prefs, 0, sizeof(cs->prefs));
+				cs->prefs.compressionLevel=cs->level;
+				cs->prefs.frameInfo.contentChecksumFlag=
+					LZ4F_contentChecksumEnabled;
+				if(LZ4F_isError(LZ4F_createCompressionContext(
+					&cs->lc, LZ4F_VERSION)))
+						goto error;
+				cs->bufsize=LZ4F_compressBound(CODEC_CHUNK,
+					&cs->prefs)+LZ4F_HEADER_SIZE_MAX;
+			}
+			else if(LZ4F_isError(LZ4F_createDecompressionContext(
+				&cs->ld, LZ4F_VERSION)))
+					goto error;
+			break;
+#endif
+		default:
+			goto error;
+	}
+	if(!(cs->buf=(uint8_t *)malloc(cs->bufsize)))
+		return -1;
+	if(!cs->writing)
+	{
+		if(!(cs->skip=(uint8_t *)malloc(CODEC_CHUNK))
+		  || cs_add_frame(cs))
+			return -1;
+	}
+	return 0;
+error:
+	errno=ENOMEM;
+	return -1;
+}
+
+static int cs_flush(struct cstream *cs)
+{
+	ssize_t w;
+	size_t done=0;
+	while(done<cs->len)
+	{
+		if((w=write(cs->fd, cs->buf+done, cs->len-done))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		done+=w;
+	}
+	cs->in+=cs->len;
+	cs->len=0;
+	return 0;
+}
+
+// Compress n bytes, ending the frame afterwards if 'end' is set.
+static int cs_compress(struct cstream *cs,
+	const uint8_t *src, size_t n, int end)
+{
+	size_t r;
+	switch(cs->codec)
+	{
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+		{
+			ZSTD_inBuffer in={src, n, 0};
+			while(1)
+			{
+				ZSTD_outBuffer out={cs->buf, cs->bufsize,
+					cs->len};
+				r=ZSTD_compressStream2(cs->zc, &out, &in,
+					end?ZSTD_e_end:ZSTD_e_continue);
+				cs->len=out.pos;
+				if(ZSTD_isError(r))
+				{
+					errno=EIO;
+					return -1;
+				}
+				if(cs->len==cs->bufsize && cs_flush(cs))
+					return -1;
+				if(end?!r:in.pos==in.size)
+					break;
+			}
+			return 0;
+		}
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4:
+			if(!cs->midframe)
+			{
+				if(cs->bufsize-cs->len<LZ4F_HEADER_SIZE_MAX
+				  && cs_flush(cs))
+					return -1;
+				r=LZ4F_compressBegin(cs->lc, cs->buf+cs->len,
+					cs->bufsize-cs->len, &cs->prefs);
+				if(LZ4F_isError(r)) goto lz4_error;
+				cs->len+=r;
+				cs->midframe=1;
+			}
+			if(n)
+			{
+				if(cs->bufsize-cs->len
+					<LZ4F_compressBound(n, &cs->prefs)
+				  && cs_flush(cs))
+					return -1;
+				r=LZ4F_compressUpdate(cs->lc,
+					cs->buf+cs->len, cs->bufsize-cs->len,
+					src, n, NULL);
+				if(LZ4F_isError(r)) goto lz4_error;
+				cs->len+=r;
+			}
+			if(end)
+			{
+				if(cs->bufsize-cs->len
+					<LZ4F_compressBound(0, &cs->prefs)
+				  && cs_flush(cs))
+					return -1;
+				r=LZ4F_compressEnd(cs->lc,
+					cs->buf+cs->len, cs->bufsize-cs->len,
+					NULL);
+				if(LZ4F_isError(r)) goto lz4_error;
+				cs->len+=r;
+				cs->midframe=0;
+			}
+			return 0;
+lz4_error:
+			errno=EIO;
+			return -1;
+#endif
+		default:
+			return -1;
+	}
+}
+
+static ssize_t cs_write(void *cookie, const char *buf, size_t size)
+{
+	size_t n;
+	size_t done=0;
+	struct cstream *cs=(struct cstream *)cookie;
+	while(done<size)
+	{
+		n=size-done;
+		if(n>CODEC_CHUNK) n=CODEC_CHUNK;
+		if((off_t)n>CODEC_FRAME-cs->framed) n=CODEC_FRAME-cs->framed;
+		if(cs_compress(cs, (const uint8_t *)buf+done, n, 0))
+			return 0;
+		done+=n;
+		cs->out+=n;
+		cs->framed+=n;
+		if(cs->framed==CODEC_FRAME)
+		{
+			if(cs_compress(cs, NULL, 0, 1))
+				return 0;
+			cs->framed=0;
+		}
+	}
+	return size;
+}
+
+static int cs_fill(struct cstream *cs)
+{
+	ssize_t r;
+	cs->len=0;
+	cs->pos=0;
+	while((r=read(cs->fd, cs->buf, cs->bufsize))<0)
+	{
+		if(errno==EINTR) continue;
+		return -1;
+	}
+	cs->len=r;
+	cs->in+=r;
+	return 0;
+}
+
+// Returns the number of bytes decompressed, 0 at the end, or -1 on error.
+static ssize_t cs_decompress(struct cstream *cs, uint8_t *dst, size_t size)
+{
+	size_t r=0;
+	size_t got=0;
+	while(1)
+	{
+		if(cs->pos==cs->len)
+		{
+			if(cs->eof || cs_fill(cs)) return cs->eof?0:-1;
+			if(!cs->len)
+			{
+				cs->eof=1;
+				if(!cs->midframe) return 0;
+				// Ended part way through a frame.
+				errno=EIO;
+				return -1;
+			}
+		}
+		switch(cs->codec)
+		{
+#ifdef HAVE_ZSTD
+			case CODEC_ZSTD:
+			{
+				ZSTD_inBuffer in={cs->buf, cs->len, cs->pos};
+				ZSTD_outBuffer out={dst, size, 0};
+				r=ZSTD_decompressStream(cs->zd, &out, &in);
+				if(ZSTD_isError(r))
+				{
+					errno=EIO;
+					return -1;
+				}
+				cs->pos=in.pos;
+				got=out.pos;
+				break;
+			}
+#endif
+#ifdef HAVE_LZ4
+			case CODEC_LZ4:
+			{
+				size_t dlen=size;
+				size_t slen=cs->len-cs->pos;
+				r=LZ4F_decompress(cs->ld, dst, &dlen,
+					cs->buf+cs->pos, &slen, NULL);
+				if(LZ4F_isError(r))
+				{
+					errno=EIO;
+					return -1;
+				}
+				cs->pos+=slen;
+				got=dlen;
+				break;
+			}
+#endif
+			default:
+				return -1;
+		}
+		cs->out+=got;
+		cs->midframe=(r!=0);
+		if(!cs->midframe && cs_add_frame(cs))
+			return -1;
+		if(got) return got;
+	}
+}
+
+static ssize_t cs_read(void *cookie, char *buf, size_t size)
+{
+	return cs_decompress((struct cstream *)cookie, (uint8_t *)buf, size);
+}
+
+static struct cframe *cs_find_frame(struct cstream *cs, off_t target)
+{
+	size_t lo=0;
+	size_t mid;
+	size_t hi=cs->nframes;
+	while(hi-lo>1)
+	{
+		mid=(lo+hi)/2;
+		if(cs->frames[mid].out<=target) lo=mid;
+		else hi=mid;
+	}
+	return &cs->frames[lo];
+}
+
+static int cs_restart(struct cstream *cs, struct cframe *f)
+{
+	if(lseek(cs->fd, f->in, SEEK_SET)<0)
+		return -1;
+	cs->in=f->in;
+	cs->out=f->out;
+	cs->len=0;
+	cs->pos=0;
+	cs->eof=0;
+	cs->midframe=0;
+	switch(cs->codec)
+	{
+#ifdef HAVE_ZSTD
+		case CODEC_ZSTD:
+			ZSTD_DCtx_reset(cs->zd, ZSTD_reset_session_only);
+			return 0;
+#endif
+#ifdef HAVE_LZ4
+		case CODEC_LZ4:
+			LZ4F_resetDecompressionContext(cs->ld);
+			return 0;
+#endif
+		default:
+			return -1;
+	}
+}
+
+static int cs_seek(void *cookie, off64_t *offset, int whence)
+{
+	off_t target;
+	ssize_t r;
+	struct cframe *f;
+	struct cstream *cs=(struct cstream *)cookie;
+
+	switch(whence)
+	{
+		case SEEK_SET: target=*offset; break;
+		case SEEK_CUR: target=cs->out+*offset; break;
+		default: errno=EINVAL; return -1;
+	}
+	if(cs->writing)
+	{
+		// Can only say where we are.
+		if(target==cs->out)
+		{
+			*offset=cs->out;
+			return 0;
+		}
+		errno=ESPIPE;
+		return -1;
+	}
+	if(target<0)
+	{
+		errno=EINVAL;
+		return -1;
+	}
+
+	// Go back to the last frame that starts before the target, if that
+	// is nearer than where we are now.
+	f=cs_find_frame(cs, target);
+	if((target<cs->out || f->out>cs->out) && cs_restart(cs, f))
+		return -1;
+
+	while(cs->out<target)
+	{
+		size_t n=CODEC_CHUNK;
+		if(target-cs->out<(off_t)n) n=target-cs->out;
+		if((r=cs_decompress(cs, cs->skip, n))<0) return -1;
+		if(!r) break;
+	}
+	*offset=cs->out;
+	return 0;
+}
+
+static int cs_close(void *cookie)
+{
+	int ret=0;
+	struct cstream *cs=(struct cstream *)cookie;
+	if(cs->writing)
+	{
+		// An empty file still gets a frame, so that it looks like
+		// any other to the codec's own tools.
+		if((cs->framed || cs->midframe || !cs->out)
+		  && cs_compress(cs, NULL, 0, 1))
+			ret=-1;
+		else if(cs_flush(cs))
+			ret=-1;
+	}
+	if(close(cs->fd))
+		ret=-1;
+	cs->fd=-1;
+	cs_free(&cs);
+	return ret;
+}
+
+FILE *codec_fopen(const char *path, const char *mode, int compression)
+{
+	int e;
+	FILE *fp=NULL;
+	struct cstream *cs=NULL;
+	cookie_io_functions_t funcs;
+	enum codec codec=codec_get(compression);
+
+	if(codec==CODEC_GZIP || !codec_available(codec))
+	{
+		// No support for it here.
+		errno=ENOTSUP;
+		return NULL;
+	}
+	if(!(cs=(struct cstream *)calloc(1, sizeof(struct cstream))))
+		return NULL;
+	cs->codec=codec;
+	cs->level=codec_level(compression);
+	cs->writing=(*mode=='w');
+	if((cs->fd=open(path, cs->writing?(O_WRONLY|O_CREAT|O_TRUNC):O_RDONLY,
+		0666))<0)
+			goto error;
+	if(cs_init(cs))
+		goto error;
+
+	memset(&funcs, 0, sizeof(funcs));
+	funcs.read=cs_read;
+	funcs.write=cs_write;
+	funcs.seek=cs_seek;
+	funcs.close=cs_close;
+	if(!(fp=fopencookie(cs, cs->writing?"w":"r", funcs)))
+		goto error;
+	return fp;
+error:
+	e=errno;
+	cs_free(&cs);
+	errno=e;
+	return NULL;
+}
+
+#else
+
+FILE *codec_fopen(const char *path, const char *mode, int compression)
+{
+	// No support for it here.
+	errno=ENOTSUP;
+	return NULL;
+}
+
+#endif
+
+// Open a stored data file for reading, according to the compression that
+// the manifest has for it. Gzipped files come back in *zp. Anything else
+// comes back in *fp, with any other codec undone as it is read.
+int open_data_file(const char *path, int compression, FILE **fp, gzFile *zp)
+{
+	if(!dpth_protocol1_is_compressed(compression, path))
+		*fp=fopen(path, "rb");
+	else if(codec_get(compression)==CODEC_GZIP)
+		*zp=gzopen(path, "rb");
+	else
+		*fp=codec_fopen(path, "rb", compression);
+	return (*fp || *zp)?0:-1;
+}
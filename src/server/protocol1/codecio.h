@@ -0,0 +1,13 @@
+#ifndef _CODECIO_H
+#define _CODECIO_H
+
+// Reading and writing protocol1 data files that are compressed with a codec
+// other than gzip. They look like normal FILE pointers to the rest of the
+// code, so they can be handed to the existing librsync and md5sum loops.
+// Reading supports seeking, which librsync needs for a basis file.
+
+extern FILE *codec_fopen(const char *path, const char *mode, int compression);
+extern int open_data_file(const char *path, int compression,
+	FILE **fp, gzFile *zp);
+
+#endif
@@ -1,5 +1,6 @@
 #include "../../burp.h"
 #include "../../alloc.h"
+#include "../../codec.h"
 #include "../../cmd.h"
 #include "../../conf.h"
 #include "../../log.h"
@@ -8,14 +9,24 @@
 
 #include <dirent.h>
 
+static const char *get_ext(int compression, enum cmd cmd)
+{
+	// Because of the way EFS works, it cannot be compressed.
+	if(!compression || cmd==CMD_EFS_FILE) return "";
+	// Codecs other than gzip are done by the server, which cannot
+	// compress encrypted data.
+	if(codec_get(compression)!=CODEC_GZIP && cmd_is_encrypted(cmd))
+		return "";
+	return codec_ext(compression);
+}
+
 char *dpth_protocol1_mk(struct dpth *dpth, int compression, enum cmd cmd)
 {
 	static char path[32];
 	// File data.
 	snprintf(path, sizeof(path), "%04X/%04X/%04X%s",
 		dpth->prim, dpth->seco, dpth->tert,
-		// Because of the way EFS works, it cannot be compressed.
-		(compression && cmd!=CMD_EFS_FILE)?".gz":"");
+		get_ext(compression, cmd));
 	return path;
 }
 
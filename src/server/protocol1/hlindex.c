@@ -0,0 +1,212 @@
+#include "include.h"
+#include "hlindex.h"
+
+#include <dirent.h>
+
+// An index of the data files that have been received whole, so that a new
+// file that is the same as one already stored (by this client or by another
+// client in the same dedup_group) can be hard linked to it straight away,
+// instead of waiting for bedup to find it.
+// Each entry is a hard link to a stored data file, named after the md5sum,
+// length and compression of the original file. An entry with only one link
+// left is no longer referenced by any backup, and can be removed.
+
+#define HLINDEX_BUF_LEN	65536
+
+static char *get_entry_path(const char *hlindex,
+	const char *endfile, int compression)
+{
+	const char *cp;
+	char sub[3]="";
+	char name[64]="";
+	char *dir=NULL;
+	char *entry=NULL;
+	unsigned long long bytes;
+
+	// The end file looks like '<bytes>:<md5sum>'.
+	if(!endfile || !(cp=strchr(endfile, ':'))) return NULL;
+	bytes=strtoull(endfile, NULL, 10);
+	cp++;
+	if(strlen(cp)!=32 || strspn(cp, "0123456789abcdef")!=32)
+		return NULL;
+	snprintf(name, sizeof(name), "%s.%llu.%d", cp, bytes, compression);
+
+	// Spread the entries over some subdirectories.
+	snprintf(sub, sizeof(sub), "%s", cp);
+	if(!(dir=prepend_s(hlindex, sub))) return NULL;
+	entry=prepend_s(dir, name);
+	free_w(&dir);
+	return entry;
+}
+
+static int same_contents(const char *a, const char *b)
+{
+	int ret=0;
+	int afd=-1;
+	int bfd=-1;
+	ssize_t alen;
+	ssize_t blen;
+	char *abuf=NULL;
+	char *bbuf=NULL;
+
+	if(!(abuf=(char *)malloc_w(HLINDEX_BUF_LEN, __func__))
+	  || !(bbuf=(char *)malloc_w(HLINDEX_BUF_LEN, __func__))
+	  || (afd=open(a, O_RDONLY))<0
+	  || (bfd=open(b, O_RDONLY))<0)
+		goto end;
+	while(1)
+	{
+		alen=read(afd, abuf, HLINDEX_BUF_LEN);
+		blen=read(bfd, bbuf, HLINDEX_BUF_LEN);
+		if(alen<0 || alen!=blen) goto end;
+		if(!alen) break;
+		if(memcmp(abuf, bbuf, alen)) goto end;
+	}
+	ret=1;
+end:
+	close_fd(&afd);
+	close_fd(&bfd);
+	free_w(&abuf);
+	free_w(&bbuf);
+	return ret;
+}
+
+// Atomically replace 'path' with a hard link to 'target'.
+static int replace_with_link(const char *target, const char *path)
+{
+	int ret=-1;
+	char *tmp=NULL;
+	char suffix[32]="";
+
+	snprintf(suffix, sizeof(suffix), "hltmp.%d", (int)getpid());
+	if(!(tmp=prepend(path, suffix, strlen(suffix), ".")))
+		goto end;
+	unlink(tmp);
+	if(link(target, tmp))
+		goto end;
+	if(do_rename(tmp, path))
+	{
+		unlink(tmp);
+		goto end;
+	}
+	ret=0;
+end:
+	free_w(&tmp);
+	return ret;
+}
+
+// Returns 1 if 'path' was replaced by a link to an existing data file,
+// 0 if it was not, and -1 on error.
+// Problems with the index itself are not errors - the file just does not
+// get deduplicated.
+int hlindex_link(struct sdirs *sdirs, const char *path,
+	const char *endfile, int compression, struct conf **cconfs)
+{
+	int ret=0;
+	char *entry=NULL;
+	struct stat nstatp;
+	struct stat estatp;
+	int max_hardlinks=get_int(cconfs[OPT_MAX_HARDLINKS]);
+
+	if(lstat(path, &nstatp) || !S_ISREG(nstatp.st_mode)
+	  || !nstatp.st_size)
+		goto end;
+	if(!(entry=get_entry_path(sdirs->hlindex, endfile, compression)))
+		goto end;
+
+	if(!lstat(entry, &estatp))
+	{
+		if(estatp.st_dev==nstatp.st_dev
+		  && estatp.st_ino==nstatp.st_ino)
+			goto end;
+		if(estatp.st_nlink<=1)
+		{
+			// Nothing else refers to it any more.
+			unlink(entry);
+		}
+		else if(estatp.st_nlink>=(unsigned int)max_hardlinks)
+		{
+			// Full up. Start again with the new file, so that
+			// the ones that come after can link to that.
+			replace_with_link(path, entry);
+			goto end;
+		}
+		else
+		{
+			if(estatp.st_dev!=nstatp.st_dev
+			  || estatp.st_size!=nstatp.st_size
+			  || !same_contents(entry, path))
+				goto end;
+			if(replace_with_link(entry, path))
+			{
+				logp("could not hard link '%s' to '%s': %s\n",
+					path, entry, strerror(errno));
+				ret=-1;
+				goto end;
+			}
+			ret=1;
+			goto end;
+		}
+	}
+
+	// First time that this data has been seen.
+	if(mkpath(&entry, sdirs->base))
+		goto end;
+	if(link(path, entry) && errno!=EEXIST && errno!=EXDEV)
+		logp("could not add %s to %s: %s\n",
+			path, sdirs->hlindex, strerror(errno));
+end:
+	free_w(&entry);
+	return ret;
+}
+
+// Remove the entries that no backup refers to any more.
+int hlindex_prune(struct sdirs *sdirs)
+{
+	const char *hlindex=sdirs->hlindex;
+	int ret=-1;
+	DIR *top=NULL;
+	DIR *sub=NULL;
+	char *dir=NULL;
+	char *entry=NULL;
+	struct stat statp;
+	struct dirent *d;
+	struct dirent *e;
+
+	if(!(top=opendir(hlindex)))
+	{
+		if(errno==ENOENT) ret=0;
+		else logp("could not opendir %s: %s\n",
+			hlindex, strerror(errno));
+		goto end;
+	}
+	while((d=readdir(top)))
+	{
+		if(d->d_name[0]=='.') continue;
+		free_w(&dir);
+		if(!(dir=prepend_s(hlindex, d->d_name)))
+			goto end;
+		if(!(sub=opendir(dir)))
+			continue;
+		while((e=readdir(sub)))
+		{
+			if(e->d_name[0]=='.') continue;
+			free_w(&entry);
+			if(!(entry=prepend_s(dir, e->d_name)))
+				goto end;
+			if(!lstat(entry, &statp)
+			  && S_ISREG(statp.st_mode)
+			  && statp.st_nlink<=1)
+				unlink(entry);
+		}
+		closedir(sub);
+		sub=NULL;
+	}
+	ret=0;
+end:
+	if(sub) closedir(sub);
+	if(top) closedir(top);
+	free_w(&dir);
+	free_w(&entry);
+	return ret;
+}
@@ -0,0 +1,8 @@
+#ifndef _HLINDEX_H
+#define _HLINDEX_H
+
+extern int hlindex_link(struct sdirs *sdirs, const char *path,
+	const char *endfile, int compression, struct conf **cconfs);
+extern int hlindex_prune(struct sdirs *sdirs);
+
+#endif
@@ -12,6 +12,7 @@
 #include "backup_phase4.h"
 #include "bedup.h"
 #include "blocklen.h"
+#include "codecio.h"
 #include "deleteme.h"
 #include "link.h"
 #include "restore.h"
@@ -82,47 +82,19 @@ int recursive_hardlink(const char *src, const char *dst, struct conf **confs)
 	return ret;
 }
 
-#define DUP_CHUNK	4096
-static int duplicate_file(const char *oldpath, const char *newpath)
-{
-	int ret=-1;
-	size_t s=0;
-	size_t t=0;
-	FILE *op=NULL;
-	FILE *np=NULL;
-	char buf[DUP_CHUNK]="";
-	if(!(op=open_file(oldpath, "rb"))
-	  || !(np=open_file(newpath, "wb")))
-		goto end;
-
-	while((s=fread(buf, 1, DUP_CHUNK, op))>0)
-	{
-		t=fwrite(buf, 1, s, np);
-		if(t!=s)
-		{
-			logp("could not write all bytes: %d!=%d\n", s, t);
-			goto end;
-		}
-	}
-
-	ret=0;
-end:
-	close_fp(&np);
-	close_fp(&op);
-	if(ret) logp("could not duplicate %s to %s\n", oldpath, newpath);
-	return ret;
-}
-
 int do_link(const char *oldpath, const char *newpath, struct stat *statp,
 	struct conf **confs, uint8_t overwrite)
 {
 	/* Avoid creating too many hardlinks */
 	if(statp->st_nlink >= (unsigned int)get_int(confs[OPT_MAX_HARDLINKS]))
 	{
-		return duplicate_file(oldpath, newpath);
+		return clone_file(oldpath, newpath);
 	}
 	else if(link(oldpath, newpath))
 	{
+		// The filesystem has its own limit.
+		if(errno==EMLINK)
+			return clone_file(oldpath, newpath);
 		if(overwrite && errno==EEXIST)
 		{
 			unlink(newpath);
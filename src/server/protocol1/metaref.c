@@ -0,0 +1,114 @@
+#include "include.h"
+#include "../../cmd.h"
+#include "metaref.h"
+
+void metarefs_free(struct metarefs *metarefs)
+{
+	int i;
+	for(i=0; i<metarefs->count; i++)
+	{
+		free_w(&metarefs->refs[i].datapth);
+		free_w(&metarefs->refs[i].endfile);
+	}
+	free_v((void **)&metarefs->refs);
+	metarefs->count=0;
+	metarefs->alloc=0;
+}
+
+int metarefs_add(struct metarefs *metarefs, struct sbuf *rb)
+{
+	struct metaref *ref;
+	if(metarefs->count>=META_REF_MAX)
+		return 0;
+	if(metarefs->count>=metarefs->alloc)
+	{
+		int alloc=metarefs->alloc?metarefs->alloc*2:64;
+		struct metaref *refs;
+		if(!(refs=(struct metaref *)realloc_w(metarefs->refs,
+			alloc*sizeof(struct metaref), __func__)))
+				return -1;
+		metarefs->refs=refs;
+		metarefs->alloc=alloc;
+	}
+	ref=&metarefs->refs[metarefs->count];
+	memset(ref, 0, sizeof(struct metaref));
+	attribs_decode(rb);
+	ref->cmd=rb->path.cmd;
+	ref->compression=rb->compression;
+	if(!(ref->datapth=strdup_w(rb->protocol1->datapth.buf, __func__))
+	  || !(ref->endfile=strdup_w(rb->protocol1->endfile.buf, __func__)))
+	{
+		free_w(&ref->datapth);
+		return -1;
+	}
+	metarefs->count++;
+	return 0;
+}
+
+// The client has extra meta data that is the same as some that it sent
+// earlier, and 'refstr' says which, as '<number>:<length>'. Instead of the
+// file that was started on in 'datadir', this entry gets a hard link to the
+// earlier one, and 'endfile' is set to what it would have been if the data
+// had been sent whole.
+int metarefs_link(struct asfd *asfd, struct metarefs *metarefs,
+	const char *refstr, struct sbuf *rb, const char *datadir,
+	struct conf **cconfs, const char **endfile)
+{
+	int ret=-1;
+	int num=0;
+	const char *cp=NULL;
+	char *rpath=NULL;
+	char *opath=NULL;
+	struct stat statp;
+	struct metaref *ref=NULL;
+
+	attribs_decode(rb);
+	num=atoi(refstr);
+	if(!get_int(cconfs[OPT_META_REF])
+	  || num<0 || num>=metarefs->count
+	  || !(cp=strchr(refstr, ':')))
+	{
+		log_and_send(asfd, "bad meta data reference");
+		goto end;
+	}
+	ref=&metarefs->refs[num];
+	if(ref->cmd!=rb->path.cmd
+	  || ref->compression!=rb->compression
+	  || strtoull(cp+1, NULL, 10)!=strtoull(ref->endfile, NULL, 10))
+	{
+		log_and_send(asfd, "meta data reference does not match");
+		goto end;
+	}
+
+	if(!(rpath=prepend_s(datadir, rb->protocol1->datapth.buf))
+	  || !(opath=prepend_s(datadir, ref->datapth)))
+	{
+		log_out_of_memory(__func__);
+		goto end;
+	}
+	if(unlink_w(rpath, __func__))
+		goto end;
+	if(lstat(opath, &statp))
+	{
+		logp("could not lstat %s: %s\n", opath, strerror(errno));
+		goto end;
+	}
+	if(do_link(opath, rpath, &statp, cconfs, 0))
+		goto end;
+	// If it had to be copied, the ones that come after can link to the
+	// copy.
+	if(!lstat(rpath, &statp) && statp.st_nlink==1)
+	{
+		char *datapth;
+		if(!(datapth=strdup_w(rb->protocol1->datapth.buf, __func__)))
+			goto end;
+		free_w(&ref->datapth);
+		ref->datapth=datapth;
+	}
+	*endfile=ref->endfile;
+	ret=0;
+end:
+	free_w(&rpath);
+	free_w(&opath);
+	return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef _METAREF_H
+#define _METAREF_H
+
+// Extra meta data that the client sent whole, in the order that it came, so
+// that a CMD_META_REF can refer back to it.
+struct metaref
+{
+	char *datapth;
+	char *endfile;
+	enum cmd cmd;
+	int compression;
+};
+
+struct metarefs
+{
+	struct metaref *refs;
+	int count;
+	int alloc;
+};
+
+extern void metarefs_free(struct metarefs *metarefs);
+extern int metarefs_add(struct metarefs *metarefs, struct sbuf *rb);
+extern int metarefs_link(struct asfd *asfd, struct metarefs *metarefs,
+	const char *refstr, struct sbuf *rb, const char *datadir,
+	struct conf **cconfs, const char **endfile);
+
+#endif
@@ -7,52 +7,6 @@
 
 #include <librsync.h>
 
-static int inflate_or_link_oldfile(struct asfd *asfd, const char *oldpath,
-	const char *infpath, struct conf **cconfs, int compression)
-{
-	int ret=0;
-	struct stat statp;
-
-	if(lstat(oldpath, &statp))
-	{
-		logp("could not lstat %s\n", oldpath);
-		return -1;
-	}
-
-	if(dpth_protocol1_is_compressed(compression, oldpath))
-	{
-		//logp("inflating...\n");
-
-		if(!statp.st_size)
-		{
-			FILE *dest;
-			// Empty file - cannot inflate.
-			// Just open and close the destination and we have
-			// duplicated a zero length file.
-			logp("asked to inflate zero length file: %s\n",
-				oldpath);
-			if(!(dest=open_file(infpath, "wb")))
-			{
-				close_fp(&dest);
-				return -1;
-			}
-			close_fp(&dest);
-			return 0;
-		}
-
-		if((ret=zlib_inflate(asfd, oldpath, infpath, cconfs)))
-			logp("zlib_inflate returned: %d\n", ret);
-	}
-	else
-	{
-		// Not compressed - just hard link it.
-		if(do_link(oldpath, infpath, &statp, cconfs,
-			1 /* allow overwrite of infpath */))
-				return -1;
-	}
-	return ret;
-}
-
 static int send_file(struct asfd *asfd, struct sbuf *sb,
 	int patches, const char *best,
 	unsigned long long *bytes, struct conf **cconfs)
@@ -141,14 +95,21 @@ static int verify_file(struct asfd *asfd, struct sbuf *sb,
 	  || sb->path.cmd==CMD_ENC_METADATA
 	  || sb->path.cmd==CMD_EFS_FILE
 	  || sb->path.cmd==CMD_ENC_VSS
-	  || (!patches && !dpth_protocol1_is_compressed(sb->compression, best)))
+	  || (!patches && !dpth_protocol1_is_compressed(sb->compression, best))
+	  || (!patches && codec_get(sb->compression)!=CODEC_GZIP))
 	{
 		// If we did some patches or encryption, or the compression
 		// was turned off, the resulting file is not gzipped.
+		// Other codecs are undone as the file is read.
 		FILE *fp=NULL;
-		if(!(fp=open_file(best, "rb")))
+		if(!patches && codec_get(sb->compression)!=CODEC_GZIP)
+			fp=codec_fopen(best, "rb", sb->compression);
+		else
+			fp=open_file(best, "rb");
+		if(!fp)
 		{
-			logw(asfd, cconfs, "could not open %s\n", best);
+			logw(asfd, cconfs, "could not open %s: %s\n",
+				best, strerror(errno));
 			return 0;
 		}
 		while((b=fread(in, 1, ZCHUNK, fp))>0)
@@ -163,7 +124,8 @@ static int verify_file(struct asfd *asfd, struct sbuf *sb,
 		}
 		if(!feof(fp))
 		{
-			logw(asfd, cconfs, "error while reading %s\n", best);
+			logw(asfd, cconfs, "error while reading %s: %s\n",
+				best, strerror(errno));
 			close_fp(&fp);
 			return 0;
 		}
@@ -218,6 +180,45 @@ static int verify_file(struct asfd *asfd, struct sbuf *sb,
 	return 0;
 }
 
+static int decompress_file(const char *src, const char *dst, int compression)
+{
+	int ret=-1;
+	size_t b;
+	FILE *sfp=NULL;
+	FILE *dfp=NULL;
+	uint8_t in[ZCHUNK];
+
+	if(!(sfp=codec_fopen(src, "rb", compression)))
+	{
+		logp("could not open %s: %s\n", src, strerror(errno));
+		goto end;
+	}
+	if(!(dfp=open_file(dst, "wb")))
+		goto end;
+	while((b=fread(in, 1, ZCHUNK, sfp))>0)
+	{
+		if(fwrite(in, 1, b, dfp)!=b)
+		{
+			logp("error writing %s: %s\n", dst, strerror(errno));
+			goto end;
+		}
+	}
+	if(ferror(sfp))
+	{
+		logp("error while reading %s: %s\n", src, strerror(errno));
+		goto end;
+	}
+	ret=0;
+end:
+	close_fp(&sfp);
+	if(close_fp(&dfp))
+	{
+		logp("error closing %s in %s\n", dst, __func__);
+		ret=-1;
+	}
+	return ret;
+}
+
 static int process_data_dir_file(struct asfd *asfd,
 	struct bu *bu, struct bu *b, const char *path,
 	struct sbuf *sb, enum action act, struct sdirs *sdirs,
@@ -225,10 +226,12 @@ static int process_data_dir_file(struct asfd *asfd,
 {
 	int ret=-1;
 	int patches=0;
+	int decompressed=0;
 	char *dpath=NULL;
 	struct stat dstatp;
 	const char *tmp=NULL;
 	const char *best=NULL;
+	const char *failed=NULL;
 	unsigned long long bytes=0;
 	static char *tmppath1=NULL;
 	static char *tmppath2=NULL;
@@ -249,28 +252,20 @@ static int process_data_dir_file(struct asfd *asfd,
 		if(lstat(dpath, &dstatp) || !S_ISREG(dstatp.st_mode))
 			continue;
 
-		if(!patches)
-		{
-			// Need to gunzip the first one.
-			if(inflate_or_link_oldfile(asfd, best, tmp,
-				cconfs, sb->compression))
-			{
-				char msg[256]="";
-				snprintf(msg, sizeof(msg),
-				  "error when inflating %s\n", best);
-				log_and_send(asfd, msg);
-				goto end;
-			}
-			best=tmp;
-			if(tmp==tmppath1) tmp=tmppath2;
-			else tmp=tmppath1;
-		}
-
-		if(do_patch(asfd, best, dpath, tmp,
-			0 /* do not gzip the result */,
-			sb->compression /* from the manifest */, cconfs))
+		// The first one may be compressed. The later ones are the
+		// results of earlier patches, which are not.
+		if(do_patch(asfd, best,
+			patches?0:dpth_protocol1_is_compressed(
+				sb->compression, best),
+			dpath, tmp,
+			0 /* do not compress the result */,
+			sb->compression /* from the manifest */, cconfs,
+			&failed))
 		{
 			char msg[256]="";
+			if(failed)
+				logp("could not %s when patching %s: %s\n",
+					failed, best, strerror(errno));
 			snprintf(msg, sizeof(msg), "error when patching %s\n",
 				path);
 			log_and_send(asfd, msg);
@@ -284,11 +279,30 @@ static int process_data_dir_file(struct asfd *asfd,
 		patches++;
 	}
 
+	// The client only knows about gzip, so anything stored with another
+	// codec is decompressed here, then gzipped on the way out like the
+	// result of a patch.
+	if(act==ACTION_RESTORE && !patches
+	  && codec_get(sb->compression)!=CODEC_GZIP)
+	{
+		if(decompress_file(best, tmp, sb->compression))
+		{
+			char msg[256]="";
+			snprintf(msg, sizeof(msg),
+				"error when decompressing %s\n", path);
+			log_and_send(asfd, msg);
+			goto end;
+		}
+		best=tmp;
+		decompressed=1;
+	}
+
 	switch(act)
 	{
 		case ACTION_RESTORE:
-			if(send_file(asfd, sb, patches, best, &bytes, cconfs))
-				goto end;
+			if(send_file(asfd, sb, patches || decompressed,
+				best, &bytes, cconfs))
+					goto end;
 			break;
 		case ACTION_VERIFY:
 			if(verify_file(asfd, sb, patches, best, &bytes, cconfs))
@@ -1,50 +1,284 @@
 #include "include.h"
 
-int zlib_inflate(struct asfd *asfd, const char *source,
-	const char *dest, struct conf **confs)
+// Random access to the uncompressed contents of a gzipped data file, so that
+// librsync can use it as the basis for a patch without it first being
+// inflated to a temporary file.
+// The file is inflated from the start as far as it is needed. Every so often,
+// at a deflate block boundary, enough state is kept to be able to start
+// inflating again from that point, so that going backwards does not mean
+// going back to the start of the file.
+// It is read by the jiggle's worker threads, so nothing here logs or uses the
+// *_w functions. Failures leave errno set for the caller to report.
+
+static size_t zbasis_index(struct zbasis *zb, off_t pos)
+{
+	return (size_t)(((pos-zb->woff)%ZBASIS_WINDOW+ZBASIS_WINDOW)
+		%ZBASIS_WINDOW);
+}
+
+static void zbasis_add_point(struct zbasis *zb, int bits)
+{
+	size_t have;
+	size_t copy;
+	struct zpoint *p;
+
+	if(zb->npoints==zb->apoints && zb->apoints<ZBASIS_POINTS)
+	{
+		int a=zb->apoints?zb->apoints*2:16;
+		struct zpoint *tmp;
+		if(a>ZBASIS_POINTS) a=ZBASIS_POINTS;
+		if(!(tmp=(struct zpoint *)realloc(zb->points,
+			a*sizeof(struct zpoint))))
+				return; // Just do without.
+		zb->points=tmp;
+		zb->apoints=a;
+	}
+	if(zb->npoints==ZBASIS_POINTS)
+	{
+		// Full up. Keep every other point and make them further apart.
+		int i;
+		for(i=0; i<ZBASIS_POINTS/2; i++)
+			memcpy(&zb->points[i], &zb->points[i*2],
+				sizeof(struct zpoint));
+		zb->npoints=ZBASIS_POINTS/2;
+		zb->span*=2;
+	}
+	p=&zb->points[zb->npoints++];
+	p->out=zb->out;
+	p->in=zb->in-zb->strm.avail_in;
+	p->bits=bits;
+	have=zb->out-zb->hist;
+	if(have>ZBASIS_WINDOW) have=ZBASIS_WINDOW;
+	p->have=have;
+	// The window is circular - copy out the last 'have' bytes in order.
+	copy=have<=zb->wpos?have:zb->wpos;
+	memcpy(p->window+have-copy, zb->window+zb->wpos-copy, copy);
+	if(copy<have)
+		memcpy(p->window, zb->window+ZBASIS_WINDOW-(have-copy),
+			have-copy);
+	zb->last=zb->out;
+}
+
+// Start inflating from point p, or from the start of the file if p is NULL.
+static int zbasis_start(struct zbasis *zb, struct zpoint *p)
+{
+	uint8_t c;
+	if(zb->started) inflateEnd(&zb->strm);
+	zb->started=0;
+	memset(&zb->strm, 0, sizeof(zb->strm));
+	zb->wpos=0;
+	zb->eof=0;
+	if(!p)
+	{
+		// From the start, with the gzip header.
+		if(lseek(zb->fd, 0, SEEK_SET)<0
+		  || inflateInit2(&zb->strm, 15+16)!=Z_OK)
+			return -1;
+		zb->started=1;
+		zb->raw=0;
+		zb->in=0;
+		zb->out=0;
+		zb->woff=0;
+		zb->hist=0;
+		return 0;
+	}
+	if(lseek(zb->fd, p->in-(p->bits?1:0), SEEK_SET)<0
+	  || inflateInit2(&zb->strm, -15)!=Z_OK)
+		return -1;
+	zb->started=1;
+	zb->raw=1;
+	zb->in=p->in;
+	zb->out=p->out;
+	zb->woff=p->out;
+	zb->hist=p->out-p->have;
+	if(p->bits)
+	{
+		if(read(zb->fd, &c, 1)!=1
+		  || inflatePrime(&zb->strm, p->bits, c>>(8-p->bits))!=Z_OK)
+			return -1;
+	}
+	if(inflateSetDictionary(&zb->strm, p->window, p->have)!=Z_OK)
+		return -1;
+	// Keep the history in the window too, for the points after this one.
+	memcpy(zb->window+ZBASIS_WINDOW-p->have, p->window, p->have);
+	return 0;
+}
+
+static int zbasis_fill(struct zbasis *zb)
 {
-	int ret=-1;
-	size_t b=0;
-	FILE *fp=NULL;
-	gzFile zp=NULL;
-	uint8_t in[ZCHUNK];
+	ssize_t r;
+	if(zb->strm.avail_in) return 0;
+	if((r=read(zb->fd, zb->inbuf, ZBASIS_CHUNK))<0)
+		return -1;
+	zb->in+=r;
+	zb->strm.avail_in=r;
+	zb->strm.next_in=zb->inbuf;
+	return 0;
+}
 
-	if(!(zp=gzopen_file(source, "rb")))
+// After the end of a deflate stream, there may be another gzip member.
+static int zbasis_stream_end(struct zbasis *zb)
+{
+	if(zb->raw)
 	{
-		logw(asfd, confs,
-			"could not open %s in %s\n", source, __func__);
-		goto end;
+		// Skip the gzip trailer, which inflate did not look at.
+		size_t s;
+		size_t skip=8;
+		while(skip)
+		{
+			if(zbasis_fill(zb)) return -1;
+			if(!zb->strm.avail_in) break;
+			s=skip<zb->strm.avail_in?skip:zb->strm.avail_in;
+			zb->strm.avail_in-=s;
+			zb->strm.next_in+=s;
+			skip-=s;
+		}
 	}
-	if(!(fp=open_file(dest, "wb")))
+	if(zbasis_fill(zb)) return -1;
+	if(!zb->strm.avail_in || !*zb->strm.next_in)
 	{
-		logw(asfd, confs, "could not open %s in %s: %s\n",
-			dest, __func__, strerror(errno));
-		goto end;
+		zb->eof=1;
+		return 0;
 	}
-	while((b=gzread(zp, in, ZCHUNK))>0)
+	if(inflateReset2(&zb->strm, 15+16)!=Z_OK)
+		return -1;
+	zb->raw=0;
+	return 0;
+}
+
+// Inflate some more into the window. Returns the number of new bytes, which
+// start at *start, 0 at the end of the data, or -1 on error.
+static ssize_t zbasis_inflate(struct zbasis *zb, uint8_t **start)
+{
+	int zret;
+	size_t got;
+
+	while(!zb->eof)
 	{
-		if(fwrite(in, 1, b, fp)!=b)
+		if(zbasis_fill(zb)) return -1;
+		if(zb->wpos==ZBASIS_WINDOW) zb->wpos=0;
+		*start=zb->window+zb->wpos;
+		zb->strm.next_out=*start;
+		zb->strm.avail_out=ZBASIS_WINDOW-zb->wpos;
+
+		zret=inflate(&zb->strm, Z_BLOCK);
+		// Includes the compressed data ending unexpectedly.
+		if(zret!=Z_OK && zret!=Z_STREAM_END)
+		{
+			errno=EIO;
+			return -1;
+		}
+		got=(ZBASIS_WINDOW-zb->wpos)-zb->strm.avail_out;
+		zb->wpos+=got;
+		zb->out+=got;
+
+		if(zret==Z_STREAM_END)
+		{
+			if(zbasis_stream_end(zb)) return -1;
+		}
+		else if((zb->strm.data_type & 128)
+		  && !(zb->strm.data_type & 64)
+		  && zb->out-zb->last>=zb->span)
 		{
-			logw(asfd, confs, "error when writing to %s\n", dest);
-			goto end;
+			// At the end of a deflate block that is not the last
+			// one, and past any points that were kept before.
+			zbasis_add_point(zb, zb->strm.data_type & 7);
 		}
+		if(got) return got;
+	}
+	return 0;
+}
+
+struct zbasis *zbasis_open(const char *path)
+{
+	struct zbasis *zb=NULL;
+	int e;
+	if(!(zb=(struct zbasis *)calloc(1, sizeof(struct zbasis))))
+		return NULL;
+	zb->fd=-1;
+	zb->span=ZBASIS_SPAN;
+	if((zb->fd=open(path, O_RDONLY))<0
+	  || zbasis_start(zb, NULL))
+		goto error;
+	return zb;
+error:
+	e=errno;
+	zbasis_close(&zb);
+	errno=e;
+	return NULL;
+}
+
+void zbasis_close(struct zbasis **zb)
+{
+	if(!zb || !*zb) return;
+	if((*zb)->started) inflateEnd(&(*zb)->strm);
+	close_fd(&(*zb)->fd);
+	free((*zb)->points);
+	free(*zb);
+	*zb=NULL;
+}
+
+// Like rs_file_copy_cb(), but reading from a zbasis.
+rs_result zbasis_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+{
+	int i;
+	off_t low;
+	off_t from;
+	ssize_t got;
+	size_t done=0;
+	uint8_t *start=NULL;
+	struct zpoint *p=NULL;
+	struct zbasis *zb=(struct zbasis *)arg;
+
+	for(i=zb->npoints-1; i>=0; i--)
+	{
+		if(zb->points[i].out>pos) continue;
+		p=&zb->points[i];
+		break;
 	}
-	if(!gzeof(zp))
+
+	// Go back if 'pos' is no longer in the window, or jump forward if
+	// there is a point that is closer.
+	low=zb->out-ZBASIS_WINDOW;
+	if(low<zb->hist) low=zb->hist;
+	if(pos<low || (pos>zb->out && p && p->out>zb->out))
 	{
-		logw(asfd, confs,
-			"error while gzreading %s in %s\n", source, __func__);
-		goto end;
+		if(zbasis_start(zb, p))
+			return RS_IO_ERROR;
 	}
-	if(close_fp(&fp))
+
+	// Anything that is still in the window.
+	while(done<*len && pos+(off_t)done<zb->out)
+	{
+		size_t n;
+		size_t idx=zbasis_index(zb, pos+done);
+		n=ZBASIS_WINDOW-idx;
+		if((off_t)n>zb->out-(pos+(off_t)done))
+			n=zb->out-(pos+done);
+		if(n>*len-done) n=*len-done;
+		memcpy((uint8_t *)*buf+done, zb->window+idx, n);
+		done+=n;
+	}
+
+	while(done<*len)
 	{
-		logw(asfd, confs,
-			"error when closing %s in %s: %s\n",
-				dest, __func__, strerror(errno));
-		goto end;
+		if((got=zbasis_inflate(zb, &start))<0)
+			return RS_IO_ERROR;
+		if(!got) break;
+		// The new bytes are for [zb->out-got, zb->out).
+		from=zb->out-got;
+		if(zb->out<=pos+(off_t)done) continue;
+		if(from<pos+(off_t)done)
+		{
+			start+=pos+done-from;
+			got-=pos+done-from;
+		}
+		if((size_t)got>*len-done) got=*len-done;
+		memcpy((uint8_t *)*buf+done, start, got);
+		done+=got;
 	}
-	ret=0;
-end:
-	gzclose_fp(&zp);
-	close_fp(&fp);
-	return ret;
+	if(!done)
+		return RS_INPUT_ENDED;
+	*len=done;
+	return RS_DONE;
 }
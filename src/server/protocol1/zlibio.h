@@ -1,7 +1,49 @@
 #ifndef _ZLIBIO_H
 #define _ZLIBIO_H
 
-extern int zlib_inflate(struct asfd *asfd, const char *source,
-	const char *dest, struct conf **confs);
+#include <librsync.h>
+
+#define ZBASIS_WINDOW	32768
+#define ZBASIS_CHUNK	16384
+#define ZBASIS_SPAN	(1024*1024)
+#define ZBASIS_POINTS	512
+
+// A place in a gzipped file to start inflating from.
+struct zpoint
+{
+	off_t out; // Offset in the uncompressed data.
+	off_t in; // Offset in the compressed file.
+	int bits; // Bits of the byte before 'in' that are still to be used.
+	size_t have;
+	uint8_t window[ZBASIS_WINDOW];
+};
+
+struct zbasis
+{
+	int fd;
+	z_stream strm;
+	uint8_t started;
+	uint8_t raw;
+	uint8_t eof;
+	off_t in;
+	off_t out;
+	uint8_t inbuf[ZBASIS_CHUNK];
+	// The most recently inflated data. The byte for offset 'woff' is at
+	// the start, and the history goes back as far as 'hist'.
+	uint8_t window[ZBASIS_WINDOW];
+	size_t wpos;
+	off_t woff;
+	off_t hist;
+	struct zpoint *points;
+	int npoints;
+	int apoints;
+	off_t span;
+	off_t last; // Offset of the furthest point.
+};
+
+extern struct zbasis *zbasis_open(const char *path);
+extern void zbasis_close(struct zbasis **zb);
+extern rs_result zbasis_copy_cb(void *arg, rs_long_t pos,
+	size_t *len, void **buf);
 
 #endif
@@ -6,7 +6,9 @@
 #include "../../server/manio.h"
 #include "../../protocol2/blist.h"
 #include "../../slist.h"
+#include "../../protocol2/append.h"
 #include "dpth.h"
+#include "rblk.h"
 
 static int data_needed(struct sbuf *sb)
 {
@@ -14,6 +16,60 @@ static int data_needed(struct sbuf *sb)
 	return 0;
 }
 
+// A file that is bigger, but otherwise looks like the same one, might just
+// have been added to, like a log file.
+static int maybe_appended(struct sbuf *csb, struct sbuf *sb,
+	struct conf **confs)
+{
+	return get_int(confs[OPT_APPEND_FROM])
+	  && sb->path.cmd==CMD_FILE
+	  && csb->statp.st_size>0
+	  && sb->statp.st_size>csb->statp.st_size
+	  && sb->statp.st_dev==csb->statp.st_dev
+	  && sb->statp.st_ino==csb->statp.st_ino;
+}
+
+// Like manio_forward_through_sigs(), but keeps the sigs on 'sb', in case the
+// client finds that only the end of the file needs sending.
+static int forward_keeping_sigs(struct asfd *asfd,
+	struct sbuf **csb, struct sbuf *sb, struct blk **blk,
+	struct manio *cmanio, struct conf **confs)
+{
+	int ars;
+	int count=0;
+	char *copy=NULL;
+	struct blk *tail=NULL;
+	struct protocol2 *protocol2=sb->protocol2;
+
+	if(!(copy=strdup_w((*csb)->path.buf, __func__)))
+		return -1;
+	protocol2->prefix_size=(*csb)->statp.st_size;
+
+	while(1)
+	{
+		if((ars=manio_sbuf_fill(cmanio, asfd, *csb,
+			*blk, NULL, confs))<0) goto error;
+		else if(ars>0)
+		{
+			// Finished.
+			sbuf_free(csb);
+			blk_free(blk);
+			break;
+		}
+		// Got something.
+		if(strcmp((*csb)->path.buf, copy))
+			break; // Found the next entry.
+
+		if(append_keep_sig(protocol2, *blk, &tail, &count))
+			goto error;
+	}
+	free_w(&copy);
+	return ars;
+error:
+	free_w(&copy);
+	return -1;
+}
+
 // Return -1 for error, 0 for entry not changed, 1 for entry changed (or new).
 static int found_in_current_manifest(struct asfd *asfd,
 	struct sbuf *csb, struct sbuf *sb,
@@ -54,6 +110,12 @@ static int found_in_current_manifest(struct asfd *asfd,
 	}
 
 	// File data changed.
+	if(maybe_appended(csb, sb, confs))
+	{
+		if(forward_keeping_sigs(asfd, &csb, sb, blk, cmanio, confs)<0)
+			return -1;
+		return 1;
+	}
 	if(manio_forward_through_sigs(asfd, &csb, blk, cmanio, confs)<0)
 		return -1;
 	return 1;
@@ -149,6 +211,12 @@ static int add_data_to_store(struct conf **confs,
 	// Add it to the data store straight away.
 	if(dpth_protocol2_fwrite(dpth, rbuf, blk)) return -1;
 
+	// The client referred to it, but it was not in the current manifest
+	// after all, so its sig has to come from the data.
+	if(blk->sig_unknown
+	  && blk_sig_from_data(blk, rbuf->buf, rbuf->len))
+		return -1;
+
 	cntr_add(get_cntr(confs[OPT_CNTR]), CMD_DATA, 0);
 	cntr_add_recvbytes(get_cntr(confs[OPT_CNTR]), blk->length);
 
@@ -197,32 +265,62 @@ static void dump_blks(const char *msg, struct blk *b)
 }
 */
 
-static int add_to_sig_list(struct slist *slist, struct blist *blist,
-	struct iobuf *rbuf, struct dpth *dpth, struct conf **confs)
+static struct blk *add_blk_to_sig_list(struct slist *slist,
+	struct blist *blist)
 {
 	// Goes on slist->add_sigs_here
 	struct blk *blk;
 	struct protocol2 *protocol2;
 
-	if(!(blk=blk_alloc())) return -1;
+	if(!(blk=blk_alloc())) return NULL;
 	blist_add_blk(blist, blk);
 
 	protocol2=slist->add_sigs_here->protocol2;
         if(!protocol2->bstart) protocol2->bstart=blk;
         if(!protocol2->bsighead) protocol2->bsighead=blk;
 
-	if(split_sig(rbuf, blk)) return -1;
-
 	// Need to send sigs to champ chooser, therefore need to point
 	// to the oldest unsent one if nothing is pointed to yet.
 	if(!blist->blk_for_champ_chooser) blist->blk_for_champ_chooser=blk;
 
+	return blk;
+}
+
+static int add_to_sig_list(struct slist *slist, struct blist *blist,
+	struct iobuf *rbuf, struct dpth *dpth, struct conf **confs)
+{
+	struct blk *blk;
+	if(!(blk=add_blk_to_sig_list(slist, blist))) return -1;
+	return split_sig(rbuf, blk);
+}
+
+// The client sent references to blocks that passed the filter, instead of
+// their sigs. Where the filter was wrong, the block is left with an empty
+// sig. The champ chooser will not find that, so the data gets asked for,
+// and the sig gets worked out from it when it arrives.
+static int add_refs_to_sig_list(struct slist *slist, struct blist *blist,
+	struct iobuf *rbuf, struct sigref *sigref)
+{
+	size_t off;
+	struct blk *blk;
+
+	if(!rbuf->len || rbuf->len%SIG_REF_LEN)
+	{
+		logp("Sig references wrong length: %u\n", rbuf->len);
+		return -1;
+	}
+	for(off=0; off<rbuf->len; off+=SIG_REF_LEN)
+	{
+		if(!(blk=add_blk_to_sig_list(slist, blist))) return -1;
+		sigref_resolve(sigref, rbuf->buf+off, blk);
+	}
 	return 0;
 }
 
 static int deal_with_read(struct iobuf *rbuf,
 	struct slist *slist, struct blist *blist, struct conf **confs,
-	int *sigs_end, int *backup_end, struct dpth *dpth)
+	int *sigs_end, int *backup_end, struct dpth *dpth,
+	struct sigref *sigref)
 {
 	int ret=0;
 	static struct sbuf *inew=NULL;
@@ -248,11 +346,19 @@ static int deal_with_read(struct iobuf *rbuf,
 			// entry.
 			if(set_up_for_sig_info(slist, blist, inew)) goto error;
 			return 0;
+		case CMD_APPEND_FROM:
+			if(append_confirm(slist->add_sigs_here, rbuf))
+				goto error;
+			goto end;
 		case CMD_SIG:
 			if(add_to_sig_list(slist, blist,
 				rbuf, dpth, confs))
 					goto error;
 			goto end;
+		case CMD_SIG_REF:
+			if(add_refs_to_sig_list(slist, blist, rbuf, sigref))
+				goto error;
+			goto end;
 
 		/* Incoming control/message stuff. */
 		case CMD_WARNING:
@@ -356,7 +462,40 @@ static int get_wbuf_from_sigs(struct iobuf *wbuf, struct slist *slist, struct bl
 	return 0;
 }
 
-static void get_wbuf_from_files(struct iobuf *wbuf, struct slist *slist, struct manio *p1manio, int *requests_end)
+// The length of a kept block, from the data store, or 0 if it is not there.
+static uint32_t stored_length(const char *datpath, struct blk *b)
+{
+	struct blk copy;
+	memcpy(&copy, b, sizeof(copy));
+	copy.data=NULL;
+	copy.next=NULL;
+	if(rblk_retrieve_data(datpath, &copy))
+		return 0;
+	return copy.length;
+}
+
+// Ask for only the end of the file, from where its last block was in the
+// last backup, if the client finds that block and the first one the same.
+// Returns 1 if it asked.
+static int get_wbuf_for_append(struct iobuf *wbuf, struct sbuf *sb,
+	const char *datpath)
+{
+	static char msg[160];
+	uint32_t first_length;
+	struct blk *b;
+	struct protocol2 *protocol2=sb->protocol2;
+
+	first_length=stored_length(datpath, protocol2->prefix);
+	for(b=protocol2->prefix; b->next; b=b->next) { }
+	if(append_request(protocol2, first_length,
+		stored_length(datpath, b), msg, sizeof(msg)))
+			return 0; // Just ask for all of it.
+	iobuf_from_str(wbuf, CMD_APPEND_FROM, msg);
+	return 1;
+}
+
+static void get_wbuf_from_files(struct iobuf *wbuf, struct slist *slist,
+	struct manio *p1manio, const char *datpath, int *requests_end)
 {
 	static uint64_t file_no=1;
 	struct sbuf *sb=slist->last_requested;
@@ -376,6 +515,11 @@ static void get_wbuf_from_files(struct iobuf *wbuf, struct slist *slist, struct
 		return;
 	}
 
+	if(sb->protocol2->prefix
+	  && !sb->protocol2->append_length
+	  && get_wbuf_for_append(wbuf, sb, datpath))
+		return;
+
 	// Only need to request the path at this stage.
 	iobuf_copy(wbuf, &sb->path);
 	sb->flags |= SBUF_SENT_PATH;
@@ -402,6 +546,37 @@ static void get_wbuf_from_index(struct iobuf *wbuf, uint64_t index)
 	iobuf_from_str(wbuf, CMD_WRAP_UP, tmp);
 }
 
+// Returns 1 if that finished a manifest file, which the champ chooser then
+// gets told about, 0 if not, or -1 on error.
+static int write_sig_to_manifest(struct asfd *chfd, struct manio *chmanio,
+	struct iobuf *wbuf, struct blk *blk)
+{
+	if(manio_write_sig_and_path(chmanio, blk)) return -1;
+	if(chmanio->sig_count) return 0;
+	// Have finished a manifest file. Want to start using it as a dedup
+	// candidate now.
+	iobuf_from_str(wbuf, CMD_MANIFEST, chmanio->fpath);
+	if(chfd->write(chfd, wbuf)) return -1;
+	return 1;
+}
+
+// The sigs of the part of a grown file that is still the same come from the
+// last backup.
+static int write_prefix_to_manifest(struct sbuf *sb, struct asfd *chfd,
+	struct manio *chmanio, struct iobuf *wbuf)
+{
+	int ret=0;
+	struct blk *b;
+	for(b=append_prefix(sb); b; b=b->next)
+		if(write_sig_to_manifest(chfd, chmanio, wbuf, b)<0)
+		{
+			ret=-1;
+			break;
+		}
+	sbuf_protocol2_free_content(sb->protocol2);
+	return ret;
+}
+
 static int sbuf_needs_data(struct sbuf *sb, struct asfd *asfd,
         struct asfd *chfd, struct manio *chmanio,
         struct slist *slist, struct blist *blist,
@@ -418,6 +593,13 @@ static int sbuf_needs_data(struct sbuf *sb, struct asfd *asfd,
 
         if(!wbuf && !(wbuf=iobuf_alloc())) return -1;
 
+	// Once the sigs have started arriving, it is known whether the
+	// client sent only the end of the file.
+	if(sb->protocol2->prefix
+	  && sb->protocol2->bstart
+	  && write_prefix_to_manifest(sb, chfd, chmanio, wbuf))
+		goto error;
+
 	while((blk=sb->protocol2->bstart)
 		&& blk->got==BLK_GOT
 		&& (blk->next || backup_end))
@@ -425,24 +607,20 @@ static int sbuf_needs_data(struct sbuf *sb, struct asfd *asfd,
 		if(blk->got_save_path
 		  && !blk_is_zero_length(blk))
 		{
-			if(manio_write_sig_and_path(chmanio, blk)) goto error;
-			if(chmanio->sig_count==0)
+			switch(write_sig_to_manifest(chfd, chmanio, wbuf, blk))
 			{
-				// Have finished a manifest file. Want to start
-				// using it as a dedup candidate now.
-				iobuf_from_str(wbuf, CMD_MANIFEST,
-					chmanio->fpath);
-				if(chfd->write(chfd, wbuf)) goto error;
-
-				if(!blk->requested)
-				{
+				case 0: break;
+				case 1:
+					if(blk->requested) break;
 					// Also let the client know, so that it
 					// can free memory if there was a long
 					// consecutive number of unrequested
 					// blocks.
 					get_wbuf_from_index(wbuf, blk->index);
 					if(asfd->write(asfd, wbuf)) goto error;
-				}
+					break;
+				default:
+					goto error;
 			}
 		}
 
@@ -742,10 +920,12 @@ int backup_phase2_server_protocol2(struct async *as, struct sdirs *sdirs,
 	struct blist *blist=NULL;
 	struct iobuf *wbuf=NULL;
 	struct dpth *dpth=NULL;
+	char *reserved=NULL;
 	struct manio *cmanio=NULL;	// current manifest
 	struct manio *p1manio=NULL;	// phase1 scan manifest
 	struct manio *chmanio=NULL;	// changed manifest
 	struct manio *unmanio=NULL;	// unchanged manifest
+	struct sigref *sigref=NULL;
 	// This is used to tell the client that a number of consecutive blocks
 	// have been found and can be freed.
 	uint64_t wrap_up=0;
@@ -771,16 +951,32 @@ int backup_phase2_server_protocol2(struct async *as, struct sdirs *sdirs,
 	  || dpth_protocol2_init(dpth,
 		sdirs->data, get_int(confs[OPT_MAX_STORAGE_SUBDIRS])))
 			goto end;
+	dpth->sync=(enum data_file_sync)get_int(confs[OPT_DATA_FILE_SYNC]);
+	if(!(reserved=prepend_s(sdirs->client, DPTH_RESERVED))
+	  || dpth_set_reserved(dpth, reserved))
+		goto end;
 
 	// The phase1 manifest looks the same as a protocol1 one.
 	manio_set_protocol(p1manio, PROTO_1);
 
+	if(get_int(confs[OPT_SIG_FILTER])
+	  && (!(sigref=sigref_alloc())
+	    || sigref_load(sigref,
+		sdirs->cmanifest, sdirs->phase1data, confs)))
+		goto end;
+
 	while(!backup_end)
 	{
 		if(maybe_add_from_scan(asfd,
 			p1manio, cmanio, unmanio, slist, confs))
 				goto end;
 
+		if(!wbuf->len)
+		{
+			// The sooner that the client has the whole filter,
+			// the more sigs that it can leave out.
+			sigref_get_wbuf(sigref, wbuf);
+		}
 		if(!wbuf->len)
 		{
 			if(get_wbuf_from_sigs(wbuf, slist, blist,
@@ -789,7 +985,7 @@ int backup_phase2_server_protocol2(struct async *as, struct sdirs *sdirs,
 			if(!wbuf->len)
 			{
 				get_wbuf_from_files(wbuf, slist,
-					p1manio, &requests_end);
+					p1manio, sdirs->data, &requests_end);
 			}
 		}
 
@@ -808,7 +1004,7 @@ int backup_phase2_server_protocol2(struct async *as, struct sdirs *sdirs,
 		while(asfd->rbuf->buf)
 		{
 			if(deal_with_read(asfd->rbuf, slist, blist,
-				confs, &sigs_end, &backup_end, dpth))
+				confs, &sigs_end, &backup_end, dpth, sigref))
 					goto end;
 			// Get as much out of the
 			// readbuf as possible.
@@ -851,15 +1047,16 @@ int backup_phase2_server_protocol2(struct async *as, struct sdirs *sdirs,
 		goto end;
 	}
 
-	// Need to release the last left. There should be one at most.
+	// Need to release the last one left. There should be one at most.
 	if(dpth->head && dpth->head->next)
 	{
-		logp("ERROR: More data locks remaining after: %s\n",
+		logp("ERROR: More data files remaining after: %s\n",
 			dpth->head->save_path);
 		goto end;
 	}
 	if(dpth_release_all(dpth)) goto end;
 
+	sigref_log_stats(sigref);
 	ret=0;
 end:
 	logp("End backup\n");
@@ -872,9 +1069,11 @@ end:
 	iobuf_free(&wbuf);
 	dpth_release_all(dpth);
 	dpth_free(&dpth);
+	free_w(&reserved);
 	manio_free(&cmanio);
 	manio_free(&p1manio);
 	manio_free(&chmanio);
 	manio_free(&unmanio);
+	sigref_free(&sigref);
 	return ret;
 }
@@ -4,33 +4,19 @@
 #include "../../fsops.h"
 #include "../../hexmap.h"
 #include "../../iobuf.h"
-#include "../../lock.h"
 #include "../../log.h"
 #include "../../prepend.h"
 #include "../../protocol2/blk.h"
+#include "../../protocol2/rabin/rconf.h"
 #include "dpth.h"
 
 #include <dirent.h>
+#include <sys/mman.h>
 
-static int get_data_lock(struct lock *lock, struct dpth *dpth, const char *path)
-{
-	int ret=-1;
-	char *p=NULL;
-	char *lockfile=NULL;
-	// Use just the first three components, excluding sig number.
-	if(!(p=prepend_slash(dpth->base_path, path, 14))
-	  || !(lockfile=prepend(p, ".lock", strlen(".lock"), "")))
-		goto end;
-	if(lock_init(lock, lockfile)
-	  || build_path_w(lock->path))
-		goto end;
-	lock_get_quick(lock);
-	ret=0;
-end:
-	free_w(&p);
-	free_w(&lockfile);
-	return ret;
-}
+#define COUNTER_FILE		"data_counter"
+#define COUNTER_MAGIC		"dpthcnt1"
+// How many data files to take from the shared counter at once.
+#define DATA_FILE_RANGE		16
 
 static char *dpth_mk_prim(struct dpth *dpth)
 {
@@ -57,25 +43,93 @@ static struct dpth_lock *dpth_lock_alloc(const char *save_path)
         return dpth_lock;
 }
 
-static int add_lock_to_list(struct dpth *dpth,
-	struct lock *lock, const char *save_path)
+static int add_to_list(struct dpth *dpth, const char *save_path)
 {
 	struct dpth_lock *dlnew;
 	if(!(dlnew=dpth_lock_alloc(save_path))) return -1;
-	dlnew->lock=lock;
 
 	// Add to the end of the list.
 	if(dpth->tail) dpth->tail->next=dlnew;
 	else if(!dpth->head) dpth->head=dlnew;
 	dpth->tail=dlnew;
-/*
-printf("added: %s\n", dlnew->save_path);
-printf("head: %s\n", dpth->head->save_path);
-printf("tail: %s\n", dpth->tail->save_path);
-*/
 	return 0;
 }
 
+static uint64_t pack(uint16_t prim, uint16_t seco, uint16_t tert)
+{
+	return ((uint64_t)prim<<32)|((uint64_t)seco<<16)|tert;
+}
+
+static void unpack(uint64_t n, struct dpth *dpth)
+{
+	dpth->prim=(n>>32)&0xFFFF;
+	dpth->seco=(n>>16)&0xFFFF;
+	dpth->tert=n&0xFFFF;
+}
+
+// Take the next range of data files from the shared counter. No locks are
+// needed, as the counter is only ever moved on with a compare and swap.
+static int take_range(struct dpth *dpth)
+{
+	uint64_t old;
+	uint64_t next;
+	unsigned int end;
+	struct dpth_counter *counter=dpth->counter;
+
+	do
+	{
+		old=counter->next;
+		unpack(old, dpth);
+		// Cope with max_storage_subdirs having been lowered.
+		if(dpth->seco>dpth->max_storage_subdirs)
+		{
+			dpth->tert=0;
+			dpth->seco=0;
+			dpth->prim++;
+		}
+		if(dpth->prim>dpth->max_storage_subdirs)
+		{
+			logp("No free data file entries out of the %d*%d*%d available!\n",
+				MAX_FILES_PER_DIR,
+				dpth->max_storage_subdirs,
+				dpth->max_storage_subdirs);
+			logp("Maybe move the storage directory aside and start again.\n");
+			return -1;
+		}
+		// Do not let a range go past the end of a directory.
+		end=dpth->tert+DATA_FILE_RANGE;
+		if(end>MAX_FILES_PER_DIR+1) end=MAX_FILES_PER_DIR+1;
+		dpth->range_start=pack(dpth->prim, dpth->seco, dpth->tert);
+		dpth->range_end=pack(dpth->prim, dpth->seco, 0)+end;
+		if(end>MAX_FILES_PER_DIR) next=pack(dpth->prim, dpth->seco+1, 0);
+		else next=dpth->range_end;
+	} while(!__sync_bool_compare_and_swap(&counter->next, old, next));
+
+	// Make sure that the counter cannot go backwards over a crash, before
+	// any of the range gets used.
+	if(msync(counter, sizeof(struct dpth_counter), MS_SYNC))
+	{
+		logp("Could not sync %s/%s: %s\n",
+			dpth->base_path, COUNTER_FILE, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// The counter should always be ahead of what is on disk, but do not take the
+// chance of overwriting existing data.
+static int data_file_exists(struct dpth *dpth, const char *save_path)
+{
+	int ret;
+	char *path;
+	struct stat statp;
+	if(!(path=prepend_slash(dpth->base_path, save_path, 14))) return -1;
+	ret=!lstat(path, &statp);
+	if(ret) logp("Data file %s already exists, skipping\n", path);
+	free_w(&path);
+	return ret;
+}
+
 char *dpth_protocol2_get_save_path(struct dpth *dpth)
 {
 	static char save_path[32];
@@ -86,35 +140,33 @@ char *dpth_protocol2_get_save_path(struct dpth *dpth)
 
 char *dpth_protocol2_mk(struct dpth *dpth)
 {
-	static char *save_path=NULL;
-	static struct lock *lock=NULL;
+	char *save_path=NULL;
 	while(1)
 	{
+		uint64_t n;
 		save_path=dpth_protocol2_get_save_path(dpth);
-		if(!dpth->need_data_lock) return save_path;
+		if(!dpth->need_data_file) return save_path;
 
-		if(!lock && !(lock=lock_alloc())) goto error;
-		if(get_data_lock(lock, dpth, save_path)) goto error;
-		switch(lock->status)
+		n=pack(dpth->prim, dpth->seco, dpth->tert);
+		if(n<dpth->range_start || n>=dpth->range_end)
+		{
+			if(take_range(dpth)) return NULL;
+			continue;
+		}
+		switch(data_file_exists(dpth, save_path))
 		{
-			case GET_LOCK_GOT: break;
-			case GET_LOCK_NOT_GOT:
-				// Increment and try again.
-				if(dpth_incr(dpth)) goto error;
+			case 0: break;
+			case 1:
+				if(dpth_incr(dpth)) return NULL;
 				continue;
-			case GET_LOCK_ERROR:
 			default:
-				goto error;
+				return NULL;
 		}
 
-		dpth->need_data_lock=0; // Got it.
-		if(add_lock_to_list(dpth, lock, save_path)) goto error;
-		lock=NULL;
+		dpth->need_data_file=0; // Got it.
+		if(add_to_list(dpth, save_path)) return NULL;
 		return save_path;
 	}
-error:
-	lock_free(&lock);
-	return NULL;
 }
 
 // Returns 0 on OK, -1 on error. *max gets set to the next entry.
@@ -147,26 +199,18 @@ int dpth_protocol2_incr_sig(struct dpth *dpth)
 {
 	if(++dpth->sig<DATA_FILE_SIG_MAX) return 0;
 	dpth->sig=0;
-	dpth->need_data_lock=1;
+	dpth->need_data_file=1;
 	return dpth_incr(dpth);
 }
 
-int dpth_protocol2_init(struct dpth *dpth, const char *base_path,
-	int max_storage_subdirs)
+// Find the first free data file by looking at what is on disk. This is only
+// needed when the shared counter does not exist yet.
+static int get_first_free(struct dpth *dpth)
 {
 	int max;
 	int ret=0;
 	char *tmp=NULL;
 
-	dpth->max_storage_subdirs=max_storage_subdirs;
-
-	free_w(&dpth->base_path);
-	if(!(dpth->base_path=strdup_w(base_path, __func__)))
-		goto error;
-
-	dpth->sig=0;
-	dpth->need_data_lock=1;
-
 	if(get_highest_entry(dpth->base_path, &max))
 		goto error;
 	if(max<0) max=0;
@@ -204,39 +248,122 @@ end:
 	return ret;
 }
 
-static int fprint_tag(FILE *fp, enum cmd cmd, unsigned int s)
+// Write the new counter to a temporary file and then link it into place, so
+// that a complete one appears atomically, and whoever gets there first wins.
+static int create_counter(struct dpth *dpth, const char *path)
 {
-	if(fprintf(fp, "%c%04X", cmd, s)!=5)
+	int fd=-1;
+	int ret=-1;
+	char *tmp=NULL;
+	char pid[16];
+	struct dpth_counter counter;
+
+	if(get_first_free(dpth)) return -1;
+	memset(&counter, 0, sizeof(counter));
+	memcpy(counter.magic, COUNTER_MAGIC, sizeof(counter.magic));
+	counter.next=pack(dpth->prim, dpth->seco, dpth->tert);
+
+	snprintf(pid, sizeof(pid), ".%d", (int)getpid());
+	if(!(tmp=prepend(path, pid, strlen(pid), ""))
+	  || build_path_w(tmp))
+		goto end;
+	if((fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666))<0
+	  || write(fd, &counter, sizeof(counter))!=(ssize_t)sizeof(counter)
+	  || fsync(fd))
 	{
-		logp("Short fprintf\n");
-		return -1;
+		logp("Could not write %s: %s\n", tmp, strerror(errno));
+		goto end;
 	}
-	return 0;
+	if(link(tmp, path) && errno!=EEXIST)
+	{
+		logp("Could not link %s to %s: %s\n",
+			tmp, path, strerror(errno));
+		goto end;
+	}
+	ret=0;
+end:
+	close_fd(&fd);
+	if(tmp) unlink(tmp);
+	free_w(&tmp);
+	return ret;
 }
 
-static int fwrite_buf(enum cmd cmd, const char *buf, unsigned int s, FILE *fp)
+static int map_counter(struct dpth *dpth)
 {
-	static size_t bytes;
-	if(fprint_tag(fp, cmd, s)) return -1;
-	if((bytes=fwrite(buf, 1, s, fp))!=s)
+	int fd=-1;
+	int ret=-1;
+	char *path=NULL;
+	void *map;
+
+	if(!(path=prepend_s(dpth->base_path, COUNTER_FILE)))
+		goto end;
+	if((fd=open(path, O_RDWR))<0)
 	{
-		logp("Short write: %d\n", (int)bytes);
-		return -1;
+		if(errno!=ENOENT
+		  || create_counter(dpth, path)
+		  || (fd=open(path, O_RDWR))<0)
+		{
+			logp("Could not open %s: %s\n", path, strerror(errno));
+			goto end;
+		}
+	}
+	if((map=mmap(NULL, sizeof(struct dpth_counter),
+		PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0))==MAP_FAILED)
+	{
+		logp("Could not map %s: %s\n", path, strerror(errno));
+		goto end;
+	}
+	dpth->counter=(struct dpth_counter *)map;
+	if(memcmp(dpth->counter->magic,
+		COUNTER_MAGIC, sizeof(dpth->counter->magic)))
+	{
+		logp("%s looks corrupt\n", path);
+		goto end;
 	}
+	ret=0;
+end:
+	close_fd(&fd);
+	free_w(&path);
+	return ret;
+}
+
+int dpth_protocol2_init(struct dpth *dpth, const char *base_path,
+	int max_storage_subdirs)
+{
+	dpth->max_storage_subdirs=max_storage_subdirs;
+
+	free_w(&dpth->base_path);
+	if(!(dpth->base_path=strdup_w(base_path, __func__)))
+		return -1;
+
+	dpth->sig=0;
+	dpth->need_data_file=1;
+	dpth->range_start=0;
+	dpth->range_end=0;
+
+	if(!dpth->counter && map_counter(dpth))
+		return -1;
+	unpack(dpth->counter->next, dpth);
 	return 0;
 }
 
-static FILE *file_open_w(const char *path, const char *mode)
+// A full data file will be no bigger than this.
+#define DATA_FILE_MAX_SIZE	(DATA_FILE_SIG_MAX*(5+RABIN_MAX))
+
+static int write_buf(struct dpth *dpth,
+	enum cmd cmd, const char *buf, unsigned int s)
 {
-	FILE *fp;
-	if(build_path_w(path)) return NULL;
-	fp=open_file(path, "wb");
-	return fp;
+	char tag[6];
+	snprintf(tag, sizeof(tag), "%c%04X", cmd, s);
+	if(dpth_write_data_file(dpth, tag, 5)
+	  || dpth_write_data_file(dpth, buf, s))
+		return -1;
+	return 0;
 }
 
-static FILE *open_data_file_for_write(struct dpth *dpth, struct blk *blk)
+static int open_data_file_for_write(struct dpth *dpth, struct blk *blk)
 {
-	FILE *fp=NULL;
+	int ret=-1;
 	char *path=NULL;
 	char *savepathstr=NULL;
 	struct dpth_lock *head=dpth->head;
@@ -245,25 +372,25 @@ static FILE *open_data_file_for_write(struct dpth *dpth, struct blk *blk)
 	savepathstr=bytes_to_savepathstr(blk->savepath);
 
 	// Sanity check. They should be coming through from the client
-	// in the same order in which we locked them.
-	// Remember that the save_path on the lock list is shorter than the
+	// in the same order in which they were handed out.
+	// Remember that the save_path on the list is shorter than the
 	// full save_path on the blk.
 	if(!head
 	  || strncmp(head->save_path,
 		//FIX THIS
 		savepathstr, sizeof(head->save_path)-1))
 	{
-		logp("lock and block save_path mismatch: %s %s\n",
+		logp("data file and block save_path mismatch: %s %s\n",
 			head?head->save_path:"(null)", savepathstr);
 		goto end;
 	}
 
 	if(!(path=prepend_slash(dpth->base_path, savepathstr, 14)))
 		goto end;
-	fp=file_open_w(path, "wb");
+	ret=dpth_open_data_file(dpth, path, DATA_FILE_MAX_SIZE);
 end:
 	free_w(&path);
-	return fp;
+	return ret;
 }
 
 int dpth_protocol2_fwrite(struct dpth *dpth,
@@ -271,18 +398,18 @@ int dpth_protocol2_fwrite(struct dpth *dpth,
 {
 	//printf("want to write: %s\n", blk->save_path);
 
-	// Remember that the save_path on the lock list is shorter than the
+	// Remember that the save_path on the list is shorter than the
 	// full save_path on the blk.
-	if(dpth->fp
+	if(dpth->fd>=0
 	  && strncmp(dpth->head->save_path,
 		bytes_to_savepathstr(blk->savepath),
 		sizeof(dpth->head->save_path)-1)
 	  && dpth_release_and_move_to_next_in_list(dpth))
 		return -1;
 
-	// Open the current list head if we have no fp.
-	if(!dpth->fp
-	  && !(dpth->fp=open_data_file_for_write(dpth, blk))) return -1;
+	// Open the current list head if we have no data file open.
+	if(dpth->fd<0
+	  && open_data_file_for_write(dpth, blk)) return -1;
 
-	return fwrite_buf(CMD_DATA, iobuf->buf, iobuf->len, dpth->fp);
+	return write_buf(dpth, CMD_DATA, iobuf->buf, iobuf->len);
 }
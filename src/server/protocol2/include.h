@@ -9,5 +9,6 @@
 #include "restore.h"
 #include "restore_spool.h"
 #include "rubble.h"
+#include "sigref.h"
 
 #endif
@@ -2,26 +2,44 @@
 #include "../../cmd.h"
 #include "../../hexmap.h"
 
-// For retrieving stored data.
+#include <sys/mman.h>
+
+// For retrieving stored data. Each data file is mapped rather than read, so
+// that the blocks can be handed out straight from the page cache.
 struct rblk
 {
 	char *datpath;
-	struct iobuf readbuf[DATA_FILE_SIG_MAX];
+	int fd;
+	char *map;
+	size_t maplen;
+	// Where each block starts in the data file, and its length.
+	uint32_t offset[DATA_FILE_SIG_MAX];
+	uint16_t length[DATA_FILE_SIG_MAX];
 	unsigned int readbuflen;
 };
 
 #define RBLK_MAX	10
 
+static struct rblk *rblks=NULL;
+
+static void unload_rblk(struct rblk *rblk)
+{
+	if(rblk->map) munmap(rblk->map, rblk->maplen);
+	rblk->map=NULL;
+	rblk->maplen=0;
+	rblk->readbuflen=0;
+	close_fd(&rblk->fd);
+	free_w(&rblk->datpath);
+}
+
 // Return 0 on OK, -1 on error, 1 when there is no more to read.
-static int read_next_data(FILE *fp, struct rblk *rblk, int ind, int r)
+static int read_next_data(struct rblk *rblk, size_t *pos, int r)
 {
 	enum cmd cmd=CMD_ERROR;
-	size_t bytes;
 	unsigned int len;
-	char buf[5];
-	// FIX THIS: Check for the appropriate return value that means there
-	// is no more to read.
-	if(fread(buf, 1, 5, fp)!=5) return 1;
+	char buf[6]="";
+	if(*pos+5>rblk->maplen) return 1;
+	memcpy(buf, rblk->map+*pos, 5);
 	if((sscanf(buf, "%c%04X", (uint8_t *)&cmd, &len))!=2)
 	{
 		logp("sscanf failed in %s: %s\n", __func__, buf);
@@ -32,16 +50,16 @@ static int read_next_data(FILE *fp, struct rblk *rblk, int ind, int r)
 		logp("unknown cmd in %s: %c\n", __func__, cmd);
 		return -1;
 	}
-	if(!(rblk[ind].readbuf[r].buf=
-		(char *)realloc_w(rblk[ind].readbuf[r].buf, len, __func__)))
-		return -1;
-	if((bytes=fread(rblk[ind].readbuf[r].buf, 1, len, fp))!=len)
+	*pos+=5;
+	if(*pos+len>rblk->maplen)
 	{
-		logp("Short read: %d wanted: %d\n", (int)bytes, (int)len);
+		logp("Short read: %d wanted: %d\n",
+			(int)(rblk->maplen-*pos), (int)len);
 		return -1;
 	}
-	rblk[ind].readbuf[r].len=len;
-	//printf("read: %d:%d %04X\n", r, len, r);
+	rblk->offset[r]=*pos;
+	rblk->length[r]=len;
+	*pos+=len;
 
 	return 0;
 }
@@ -49,27 +67,51 @@ static int read_next_data(FILE *fp, struct rblk *rblk, int ind, int r)
 static int load_rblk(struct rblk *rblks, int ind, const char *datpath)
 {
 	int r;
-	FILE *dfp;
-	free_w(&rblks[ind].datpath);
-	if(!(rblks[ind].datpath=strdup_w(datpath, __func__)))
+	size_t pos=0;
+	struct stat statp;
+	struct rblk *rblk=&rblks[ind];
+
+	unload_rblk(rblk);
+	if(!(rblk->datpath=strdup_w(datpath, __func__)))
 		return -1;
 	printf("swap %d to: %s\n", ind, datpath);
 
-	if(!(dfp=open_file(datpath, "rb"))) return -1;
+	if((rblk->fd=open(datpath, O_RDONLY))<0
+	  || fstat(rblk->fd, &statp))
+	{
+		logp("Could not open %s: %s\n", datpath, strerror(errno));
+		goto error;
+	}
+	rblk->maplen=statp.st_size;
+	if(rblk->maplen
+	  && (rblk->map=(char *)mmap(NULL, rblk->maplen, PROT_READ,
+		MAP_PRIVATE, rblk->fd, 0))==MAP_FAILED)
+	{
+		logp("Could not map %s: %s\n", datpath, strerror(errno));
+		rblk->map=NULL;
+		goto error;
+	}
+#ifdef HAVE_LINUX_OS
+	// Restores tend to want most of a data file, in order.
+	if(rblk->map) madvise(rblk->map, rblk->maplen, MADV_WILLNEED);
+#endif
 	for(r=0; r<DATA_FILE_SIG_MAX; r++)
 	{
-		switch(read_next_data(dfp, rblks, ind, r))
+		switch(read_next_data(rblk, &pos, r))
 		{
 			case 0: continue;
 			case 1: break;
 			case -1:
 			default:
-				return -1;
+				goto error;
 		}
+		break;
 	}
-	rblks[ind].readbuflen=r;
-	fclose(dfp);
+	rblk->readbuflen=r;
 	return 0;
+error:
+	unload_rblk(rblk);
+	return -1;
 }
 
 static struct rblk *get_rblk(struct rblk *rblks, const char *datpath)
@@ -111,7 +153,6 @@ static struct rblk *get_rblk(struct rblk *rblks, const char *datpath)
 int rblk_retrieve_data(const char *datpath, struct blk *blk)
 {
 	static char fulldatpath[256]="";
-	static struct rblk *rblks=NULL;
 	char *cp;
 	unsigned int datno;
 	struct rblk *rblk;
@@ -130,10 +171,14 @@ int rblk_retrieve_data(const char *datpath, struct blk *blk)
 	datno=strtoul(cp, NULL, 16);
 //printf("y: %s\n", fulldatpath);
 
-	if(!rblks
-	  && !(rblks=(struct rblk *)
-		calloc_w(RBLK_MAX, sizeof(struct rblk), __func__)))
-			return -1;
+	if(!rblks)
+	{
+		int i;
+		if(!(rblks=(struct rblk *)
+			calloc_w(RBLK_MAX, sizeof(struct rblk), __func__)))
+				return -1;
+		for(i=0; i<RBLK_MAX; i++) rblks[i].fd=-1;
+	}
 
 	if(!(rblk=get_rblk(rblks, fulldatpath)))
 	{
@@ -141,15 +186,36 @@ int rblk_retrieve_data(const char *datpath, struct blk *blk)
 	}
 
 //	printf("lookup: %s (%s)\n", fulldatpath, cp);
-	if(datno>rblk->readbuflen)
+	if(datno>=rblk->readbuflen)
 	{
-		logp("dat index %d is greater than readbuflen: %d\n",
+		logp("dat index %d is not less than readbuflen: %d\n",
 			datno, rblk->readbuflen);
 		return -1;
 	}
-	blk->data=rblk->readbuf[datno].buf;
-	blk->length=rblk->readbuf[datno].len;
+	blk->data=rblk->map+rblk->offset[datno];
+	blk->length=rblk->length[datno];
 //	printf("length: %d\n", blk->length);
 
         return 0;
 }
+
+// Find where block data given out by rblk_retrieve_data() lives on disk, so
+// that it can be sent without copying it. Returns 0 if found.
+int rblk_get_data_location(const char *data, uint32_t length,
+	int *fd, off_t *offset)
+{
+	int i;
+	if(!rblks) return -1;
+	for(i=0; i<RBLK_MAX; i++)
+	{
+		struct rblk *rblk=&rblks[i];
+		if(!rblk->map
+		  || data<rblk->map
+		  || data+length>rblk->map+rblk->maplen)
+			continue;
+		*fd=rblk->fd;
+		*offset=data-rblk->map;
+		return 0;
+	}
+	return -1;
+}
@@ -2,5 +2,7 @@
 #define _RBLK_H
 
 extern int rblk_retrieve_data(const char *datpath, struct blk *blk);
+extern int rblk_get_data_location(const char *data, uint32_t length,
+	int *fd, off_t *offset);
 
 #endif
@@ -15,9 +15,25 @@ static int send_data(struct asfd *asfd, struct blk *blk,
 	switch(act)
 	{
 		case ACTION_RESTORE:
+		{
+			int fd;
+			off_t offset;
+			// Try to send it straight from the data file.
+			if(!rblk_get_data_location(blk->data, blk->length,
+				&fd, &offset))
+			{
+				switch(asfd->write_from_fd(asfd,
+					CMD_DATA, fd, offset, blk->length))
+				{
+					case 0: return 0;
+					case 1: break;
+					default: return -1;
+				}
+			}
 			iobuf_set(&wbuf, CMD_DATA, blk->data, blk->length);
 			if(asfd->write(asfd, &wbuf)) return -1;
 			return 0;
+		}
 		case ACTION_VERIFY:
 			// Need to check that the block has the correct
 			// checksums.
@@ -1,13 +1,236 @@
 #include "include.h"
 #include "../../cmd.h"
-#include "champ_chooser/hash.h"
 #include "../../slist.h"
 #include "../../hexmap.h"
+#include "../../workq.h"
 #include "../../server/protocol1/restore.h"
-#include "../../protocol2/rabin/rconf.h"
 #include "../manio.h"
 #include "../sdirs.h"
 
+#include <uthash.h>
+
+// One of these for each data file referred to by the restore.
+struct spool_dat
+{
+	uint64_t key;
+	char path[16];
+	uint16_t max_sig;
+	UT_hash_handle hh;
+};
+
+// A data file read and compressed by a worker, waiting to be sent.
+// The workers allocate with plain malloc(), as the *_w wrappers are not
+// thread safe.
+struct spool_job
+{
+	char *fdatpath;
+	char *path;
+	uint8_t *buf;
+	size_t len;
+	size_t alloc;
+	unsigned long long bytes;
+	int ret;
+};
+
+static uint64_t savepath_to_key(uint8_t *savepath)
+{
+	int i;
+	uint64_t key=0;
+	// The first six bytes are the data file, the rest is the signature
+	// number within it.
+	for(i=0; i<6; i++)
+		key=(key<<8)|savepath[i];
+	return key;
+}
+
+static int add_dat(struct spool_dat **table, uint8_t *savepath)
+{
+	uint16_t sig;
+	uint64_t key=savepath_to_key(savepath);
+	struct spool_dat *dat=NULL;
+
+	sig=(savepath[6]<<8)|savepath[7];
+	HASH_FIND(hh, *table, &key, sizeof(key), dat);
+	if(dat)
+	{
+		if(sig>dat->max_sig) dat->max_sig=sig;
+		return 0;
+	}
+	if(!(dat=(struct spool_dat *)
+		calloc_w(1, sizeof(struct spool_dat), __func__)))
+			return -1;
+	dat->key=key;
+	dat->max_sig=sig;
+	snprintf(dat->path, sizeof(dat->path), "%s",
+		bytes_to_savepathstr(savepath));
+	HASH_ADD(hh, *table, key, sizeof(key), dat);
+	return 1;
+}
+
+static void free_dats(struct spool_dat **table)
+{
+	struct spool_dat *dat;
+	struct spool_dat *tmp;
+	HASH_ITER(hh, *table, dat, tmp)
+	{
+		HASH_DEL(*table, dat);
+		free_v((void **)&dat);
+	}
+}
+
+static int job_append(struct spool_job *job, uint8_t *out, size_t have)
+{
+	if(job->len+have>job->alloc)
+	{
+		uint8_t *tmp;
+		size_t alloc=job->alloc?job->alloc*2:ZCHUNK*16;
+		while(alloc<job->len+have) alloc*=2;
+		if(!(tmp=(uint8_t *)realloc(job->buf, alloc)))
+			return -1;
+		job->buf=tmp;
+		job->alloc=alloc;
+	}
+	memcpy(job->buf+job->len, out, have);
+	job->len+=have;
+	return 0;
+}
+
+// Runs in a worker thread. Read the data file and gzip it into memory, in
+// the same format that send_a_file() would have sent it.
+static void compress_dat(void *data)
+{
+	int fd=-1;
+	int zret=Z_OK;
+	ssize_t got;
+	z_stream strm;
+	int flush=Z_NO_FLUSH;
+	uint8_t in[ZCHUNK];
+	uint8_t out[ZCHUNK];
+	struct spool_job *job=(struct spool_job *)data;
+
+	job->ret=-1;
+	memset(&strm, 0, sizeof(strm));
+	if(deflateInit2(&strm, 9, Z_DEFLATED, (15+16),
+		8, Z_DEFAULT_STRATEGY)!=Z_OK)
+			return;
+	if((fd=open(job->fdatpath, O_RDONLY))<0)
+		goto end;
+	do
+	{
+		if((got=read(fd, in, ZCHUNK))<0)
+			goto end;
+		job->bytes+=got;
+		flush=got?Z_NO_FLUSH:Z_FINISH;
+		strm.next_in=in;
+		strm.avail_in=got;
+		do
+		{
+			strm.next_out=out;
+			strm.avail_out=ZCHUNK;
+			if((zret=deflate(&strm, flush))==Z_STREAM_ERROR
+			  || job_append(job, out, ZCHUNK-strm.avail_out))
+				goto end;
+		} while(!strm.avail_out);
+	} while(flush!=Z_FINISH);
+	if(zret==Z_STREAM_END) job->ret=0;
+end:
+	deflateEnd(&strm);
+	if(fd>=0) close(fd);
+}
+
+static void spool_job_free(struct spool_job **job)
+{
+	if(!job || !*job) return;
+	free_w(&(*job)->fdatpath);
+	free((*job)->buf);
+	free_v((void **)job);
+}
+
+static int send_job(struct asfd *asfd, struct spool_job *job)
+{
+	size_t s;
+	char msg[32];
+	struct iobuf wbuf;
+
+	if(job->ret)
+	{
+		logp("Could not read %s\n", job->fdatpath);
+		return -1;
+	}
+	snprintf(msg, sizeof(msg), "dat=%s", job->path);
+	if(asfd->write_str(asfd, CMD_GEN, msg))
+		return -1;
+	for(s=0; s<job->len; s+=wbuf.len)
+	{
+		wbuf.cmd=CMD_APPEND;
+		wbuf.buf=(char *)job->buf+s;
+		wbuf.len=min(job->len-s, (size_t)ZCHUNK);
+		if(asfd->write(asfd, &wbuf))
+			return -1;
+	}
+	snprintf(msg, sizeof(msg), "%"PRIu64 ":", (uint64_t)job->bytes);
+	if(asfd->write_str(asfd, CMD_END_FILE, msg))
+		return -1;
+	logp("Sent %s\n", job->fdatpath);
+	return 0;
+}
+
+static int send_next_job(struct asfd *asfd, struct workq *workq)
+{
+	int ret;
+	struct spool_job *job;
+	if(!(job=(struct spool_job *)workq_get(workq, 1 /* block */)))
+		return -1;
+	ret=send_job(asfd, job);
+	spool_job_free(&job);
+	return ret;
+}
+
+// Read and compress the data files with a pool of workers, while sending
+// the ones that are ready to the client in the order they were queued.
+static int send_dats(struct asfd *asfd, struct spool_dat *table,
+	struct sdirs *sdirs, struct conf **confs)
+{
+	int ret=-1;
+	int threads;
+	struct spool_dat *dat;
+	struct spool_dat *tmp;
+	struct spool_job *job=NULL;
+	struct workq *workq=NULL;
+
+	threads=get_int(confs[OPT_RESTORE_SPOOL_THREADS]);
+	if(!(workq=workq_alloc(threads, threads*2)))
+		goto end;
+
+	HASH_ITER(hh, table, dat, tmp)
+	{
+		while(workq_full(workq))
+			if(send_next_job(asfd, workq)) goto end;
+		if(!(job=(struct spool_job *)
+			calloc_w(1, sizeof(struct spool_job), __func__))
+		  || !(job->fdatpath=prepend_s(sdirs->data, dat->path)))
+			goto end;
+		job->path=dat->path;
+		if(workq_add(workq, compress_dat, job))
+			goto end;
+		job=NULL;
+	}
+	while(!workq_empty(workq))
+		if(send_next_job(asfd, workq)) goto end;
+
+	ret=0;
+end:
+	spool_job_free(&job);
+	if(workq)
+	{
+		// Wait for anything still in progress before freeing it.
+		while((job=(struct spool_job *)workq_get(workq, 1)))
+			spool_job_free(&job);
+		workq_free(&workq);
+	}
+	return ret;
+}
+
 /* This function reads the manifest to determine whether it may be more
    efficient to just copy the data files across and unpack them on the other
    side. If it thinks it is, it will then do it.
@@ -24,11 +247,15 @@ int maybe_restore_spool(struct asfd *asfd, const char *manifest,
 	struct manio *manio=NULL;
 	uint64_t blkcount=0;
 	uint64_t datcount=0;
-	struct hash_weak *tmpw;
-	struct hash_weak *hash_weak;
+	uint64_t sigcount=0;
 	uint64_t estimate_blks;
-	uint64_t estimate_dats;
+	uint64_t estimate_dats=0;
 	uint64_t estimate_one_dat;
+	uint64_t estimate_one_blk;
+	struct stat statp;
+	struct spool_dat *dat;
+	struct spool_dat *tmp;
+	struct spool_dat *table=NULL;
 	struct sbuf *need_data=NULL;
 	int last_ent_was_dir=0;
 	char sig[128]="";
@@ -64,37 +291,63 @@ int maybe_restore_spool(struct asfd *asfd, const char *manifest,
 		if(want_to_restore(srestore, sb, regex, confs))
 		{
 			blkcount++;
-			if(!hash_weak_find((uint64_t)blk->savepath))
+			switch(add_dat(&table, blk->savepath))
 			{
-				if(!hash_weak_add((uint64_t)blk->savepath))
-					goto end;
-				datcount++;
+				case 0: break;
+				case 1: datcount++; break;
+				default: goto end;
 			}
 		}
 
 		sbuf_free_content(sb);
 	}
 
-	// FIX THIS: should read rabin_avg of a struct rconf.
-	estimate_blks=blkcount*RABIN_AVG;
-	estimate_one_dat=DATA_FILE_SIG_MAX*RABIN_AVG;
-	estimate_dats=datcount*estimate_one_dat;
+	if(!datcount)
+	{
+		ret=0;
+		goto end;
+	}
+
+	// Measure the data files, rather than guessing. The highest signature
+	// referred to in each is the best cheap guess at how many blocks it
+	// holds, which gives an average block size for the stream estimate.
+	HASH_ITER(hh, table, dat, tmp)
+	{
+		char *fdatpath;
+		if(!(fdatpath=prepend_s(sdirs->data, dat->path)))
+			goto end;
+		if(lstat(fdatpath, &statp))
+		{
+			logp("Could not stat %s: %s\n",
+				fdatpath, strerror(errno));
+			free_w(&fdatpath);
+			goto end;
+		}
+		free_w(&fdatpath);
+		estimate_dats+=statp.st_size;
+		sigcount+=dat->max_sig+1;
+	}
+	estimate_one_dat=estimate_dats/datcount;
+	estimate_one_blk=estimate_dats/sigcount;
+	estimate_blks=blkcount*estimate_one_blk;
 	printf("%"PRIu64 " blocks = %"PRIu64 " bytes in stream approx\n",
 		blkcount, estimate_blks);
-	printf("%"PRIu64 " data files = %"PRIu64 " bytes approx\n",
+	printf("%"PRIu64 " data files = %"PRIu64 " bytes\n",
 		datcount, estimate_dats);
 
 	if(estimate_blks < estimate_one_dat)
 	{
 		printf("Stream is less than the size of a data file.\n");
 		printf("Use restore stream\n");
-		return 0;
+		ret=0;
+		goto end;
 	}
 	else if(estimate_dats >= 90*(estimate_blks/100))
 	{
 		printf("Stream is more than 90%% size of data files.\n");
 		printf("Use restore stream\n");
-		return 0;
+		ret=0;
+		goto end;
 	}
 	else
 	{
@@ -109,26 +362,8 @@ int maybe_restore_spool(struct asfd *asfd, const char *manifest,
 		goto end;
 
 	// Send each of the data files that we found to the client.
-	HASH_ITER(hh, hash_table, hash_weak, tmpw)
-	{
-		char msg[32];
-		char path[32];
-		char *fdatpath=NULL;
-		snprintf(path, sizeof(path), "%014"PRIX64, hash_weak->weak);
-		path[4]='/';
-		path[9]='/';
-		snprintf(msg, sizeof(msg), "dat=%s", path);
-		printf("got: %s\n", msg);
-		if(asfd->write_str(asfd, CMD_GEN, msg)) goto end;
-		if(!(fdatpath=prepend_s(sdirs->data, path)))
-			goto end;
-		if(send_a_file(asfd, fdatpath, confs))
-		{
-			free(fdatpath);
-			goto end;
-		}
-		free(fdatpath);
-	}
+	if(send_dats(asfd, table, sdirs, confs))
+		goto end;
 
 	if(asfd->write_str(asfd, CMD_GEN, "datfilesend")
 	  || asfd->read_expect(asfd, CMD_GEN, "datfilesend_ok"))
@@ -184,6 +419,6 @@ end:
 	sbuf_free(&sb);
 	sbuf_free(&need_data);
 	manio_free(&manio);
-	hash_delete_all();
+	free_dats(&table);
 	return ret;
 }
@@ -1,7 +1,24 @@
 #include "include.h"
 
+#include "../dpth.h"
 #include "../sdirs.h"
 
+// A data file that was being written when the last backup went away may
+// still have space reserved past its end.
+static int trim_reserved(struct async *as, struct sdirs *sdirs)
+{
+	int ret;
+	char *reserved=NULL;
+	if(!(reserved=prepend_s(sdirs->client, DPTH_RESERVED)))
+	{
+		log_and_send_oom(as->asfd, __func__);
+		return -1;
+	}
+	ret=dpth_trim_reserved(reserved);
+	free_w(&reserved);
+	return ret;
+}
+
 int check_for_rubble_protocol2(struct async *as, struct sdirs *sdirs,
 	const char *incexc, int *resume, struct conf **cconfs)
 {
@@ -9,6 +26,8 @@ int check_for_rubble_protocol2(struct async *as, struct sdirs *sdirs,
 	ssize_t len=0;
 	char *real=NULL;
 	char lnk[32]="";
+	if(trim_reserved(as, sdirs))
+		return -1;
 	if((len=readlink(sdirs->working, lnk, sizeof(lnk)-1))<0)
 		return 0;
 	else if(!len)
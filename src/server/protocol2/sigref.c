@@ -0,0 +1,275 @@
+#include "include.h"
+#include "../../cmd.h"
+#include "../../server/manio.h"
+#include "../../protocol2/bloom.h"
+#include "../../protocol2/rabin/rconf.h"
+#include "sigref.h"
+
+// The most blocks to keep from the current manifest. That is 24MB of them,
+// and a 1.25MB filter.
+#define SIGREF_MAX	0x100000
+
+// Each reference is this much smaller than the sig that it stands for.
+#define SIGREF_SAVING	(CHECKSUM_LEN-SIG_REF_LEN)
+
+struct sigref_entry
+{
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	uint64_t fingerprint;
+};
+
+struct sigref
+{
+	struct sigref_entry *entries;
+	size_t len;
+	size_t alloc;
+	struct bloom *bloom;
+	uint8_t header_sent;
+	uint64_t resolved;
+	uint64_t unknown;
+};
+
+// Going through the phase1 scan alongside the current manifest, to see
+// roughly how much data is going to be sent.
+struct changes
+{
+	struct manio *manio;
+	struct sbuf *sb;
+	int end;
+	uint64_t bytes;
+};
+
+struct sigref *sigref_alloc(void)
+{
+	return (struct sigref *)calloc_w(1, sizeof(struct sigref), __func__);
+}
+
+void sigref_free(struct sigref **sigref)
+{
+	if(!sigref || !*sigref) return;
+	free_v((void **)&(*sigref)->entries);
+	bloom_free(&(*sigref)->bloom);
+	free_v((void **)sigref);
+}
+
+static int add_entry(struct sigref *sigref, struct blk *blk)
+{
+	struct sigref_entry *e;
+	if(sigref->len==sigref->alloc)
+	{
+		size_t alloc=sigref->alloc?sigref->alloc*2:0x10000;
+		if(!(e=(struct sigref_entry *)realloc_w(sigref->entries,
+			alloc*sizeof(struct sigref_entry), __func__)))
+				return -1;
+		sigref->entries=e;
+		sigref->alloc=alloc;
+	}
+	e=&sigref->entries[sigref->len++];
+	memcpy(e->md5sum, blk->md5sum, MD5_DIGEST_LENGTH);
+	e->fingerprint=blk->fingerprint;
+	return 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	return memcmp(((struct sigref_entry *)a)->md5sum,
+		((struct sigref_entry *)b)->md5sum, MD5_DIGEST_LENGTH);
+}
+
+// Keep one of each block. If two different blocks start the same way, a
+// reference to either of them cannot be trusted, so drop them both. Those
+// blocks just get their sigs sent as usual.
+static void drop_repeats(struct sigref *sigref)
+{
+	size_t i=0;
+	size_t j;
+	size_t len=0;
+	int ambiguous;
+	struct sigref_entry *e=sigref->entries;
+
+	while(i<sigref->len)
+	{
+		ambiguous=0;
+		for(j=i+1; j<sigref->len
+		  && !memcmp(e[j].md5sum, e[i].md5sum, SIG_REF_LEN); j++)
+			if(memcmp(e[j].md5sum, e[i].md5sum, MD5_DIGEST_LENGTH))
+				ambiguous=1;
+		if(!ambiguous) e[len++]=e[i];
+		i=j;
+	}
+	sigref->len=len;
+}
+
+static int changes_next(struct changes *c, struct conf **confs)
+{
+	int ars;
+	sbuf_free_content(c->sb);
+	if((ars=manio_sbuf_fill_phase1(c->manio,
+		NULL, c->sb, NULL, NULL, confs))<0)
+			return -1;
+	if(ars>0) c->end=1;
+	return 0;
+}
+
+// Counts the files in the phase1 scan that come before 'csb' from the
+// current manifest, or all the rest of them if there is no 'csb', that are
+// new or have had their data changed.
+static int changes_up_to(struct changes *c, struct sbuf *csb,
+	struct conf **confs)
+{
+	int cmp=-1;
+	while(!c->end)
+	{
+		if(csb && (cmp=sbuf_pathcmp(c->sb, csb))>0)
+			return 0;
+		if(cmd_is_filedata(c->sb->path.cmd)
+		  && (cmp
+		    || csb->path.cmd!=c->sb->path.cmd
+		    || csb->statp.st_mtime!=c->sb->statp.st_mtime))
+			c->bytes+=c->sb->statp.st_size;
+		if(changes_next(c, confs)) return -1;
+		if(!cmp) return 0;
+	}
+	return 0;
+}
+
+int sigref_load(struct sigref *sigref, const char *directory,
+	const char *phase1data, struct conf **confs)
+{
+	int ars;
+	int ret=-1;
+	size_t i;
+	uint64_t most;
+	struct manio *manio=NULL;
+	struct sbuf *sb=NULL;
+	struct blk *blk=NULL;
+	struct changes c;
+
+	memset(&c, 0, sizeof(c));
+	if(!(manio=manio_alloc())
+	  || manio_init_read(manio, directory)
+	  || !(sb=sbuf_alloc(confs))
+	  || !(blk=blk_alloc()))
+		goto end;
+	if(phase1data)
+	{
+		if(!(c.manio=manio_alloc())
+		  || manio_init_read(c.manio, phase1data)
+		  || !(c.sb=sbuf_alloc(confs)))
+			goto end;
+		// The phase1 manifest looks the same as a protocol1 one.
+		manio_set_protocol(c.manio, PROTO_1);
+		if(changes_next(&c, confs)) goto end;
+	}
+	else
+		c.end=1;
+
+	while(1)
+	{
+		blk->got_save_path=0;
+		if((ars=manio_sbuf_fill(manio, NULL, sb, blk, NULL, confs))<0)
+			goto end;
+		else if(ars>0)
+			break; // Finished.
+		if(blk->got_save_path)
+		{
+			if(sigref->len<SIGREF_MAX && add_entry(sigref, blk))
+				goto end;
+		}
+		else if(sb->path.buf && changes_up_to(&c, sb, confs))
+			goto end;
+		sbuf_free_content(sb);
+	}
+	if(changes_up_to(&c, NULL, confs)) goto end;
+
+	qsort(sigref->entries, sigref->len, sizeof(struct sigref_entry),
+		entry_cmp);
+	drop_repeats(sigref);
+
+	if(sigref->len)
+	{
+		if(!(sigref->bloom=bloom_alloc_for_keys(sigref->len)))
+			goto end;
+		// Even if every block of the new and changed data were already
+		// stored, the references would not save more than this.
+		most=c.bytes/RABIN_AVG*SIGREF_SAVING;
+		if(phase1data && most<sigref->bloom->bytes)
+		{
+			logp("Not sending a filter of %u bytes for about %" PRIu64 " bytes of changed data\n",
+				sigref->bloom->bytes, c.bytes);
+			bloom_free(&sigref->bloom);
+			free_v((void **)&sigref->entries);
+			sigref->len=0;
+			sigref->alloc=0;
+			ret=0;
+			goto end;
+		}
+		for(i=0; i<sigref->len; i++)
+			bloom_add(sigref->bloom, sigref->entries[i].md5sum);
+		logp("Filter of %lu blocks from the current manifest: %u bytes\n",
+			(unsigned long)sigref->len, sigref->bloom->bytes);
+	}
+	ret=0;
+end:
+	manio_free(&manio);
+	sbuf_free(&sb);
+	blk_free(&blk);
+	manio_free(&c.manio);
+	sbuf_free(&c.sb);
+	return ret;
+}
+
+void sigref_get_wbuf(struct sigref *sigref, struct iobuf *wbuf)
+{
+	static char header[64];
+	uint32_t len;
+	struct bloom *bloom;
+
+	if(!sigref || !(bloom=sigref->bloom)) return;
+	if(!sigref->header_sent)
+	{
+		snprintf(header, sizeof(header), "sigfilter:%u:%u",
+			bloom->bytes, bloom->hashes);
+		iobuf_from_str(wbuf, CMD_GEN, header);
+		sigref->header_sent=1;
+		return;
+	}
+	if(bloom->pos==bloom->bytes) return;
+	len=bloom->bytes-bloom->pos;
+	if(len>BLOOM_CHUNK) len=BLOOM_CHUNK;
+	iobuf_set(wbuf, CMD_SIG_FILTER, (char *)bloom->bits+bloom->pos, len);
+	bloom->pos+=len;
+}
+
+static int ref_cmp(const void *ref, const void *entry)
+{
+	return memcmp(ref,
+		((struct sigref_entry *)entry)->md5sum, SIG_REF_LEN);
+}
+
+int sigref_resolve(struct sigref *sigref, const char *ref, struct blk *blk)
+{
+	struct sigref_entry *e=NULL;
+	if(sigref && sigref->len)
+		e=(struct sigref_entry *)bsearch(ref, sigref->entries,
+			sigref->len, sizeof(struct sigref_entry), ref_cmp);
+	if(!e)
+	{
+		if(sigref) sigref->unknown++;
+		blk->sig_unknown=1;
+		return 0;
+	}
+	blk->fingerprint=e->fingerprint;
+	memcpy(blk->md5sum, e->md5sum, MD5_DIGEST_LENGTH);
+	sigref->resolved++;
+	return 1;
+}
+
+void sigref_log_stats(struct sigref *sigref)
+{
+	if(!sigref || !sigref->bloom) return;
+	logp("Blocks referred to: %" PRIu64 " known, %" PRIu64 " not known\n",
+		sigref->resolved, sigref->unknown);
+	logp("Bytes saved by references: %" PRIu64 ", for a filter of %u bytes\n",
+		sigref->resolved*SIGREF_SAVING, sigref->bloom->bytes);
+}
@@ -0,0 +1,29 @@
+#ifndef _SERVER_PROTOCOL2_SIGREF_H
+#define _SERVER_PROTOCOL2_SIGREF_H
+
+// The blocks from the current manifest, looked up by the start of their
+// md5sums, and a Bloom filter of them for sending to the client. The client
+// then sends references to the blocks that pass the filter, instead of their
+// sigs, and this turns the references back into sigs.
+
+struct sigref;
+
+extern struct sigref *sigref_alloc(void);
+extern void sigref_free(struct sigref **sigref);
+// Loads the blocks from the current manifest in 'directory'. If the phase1
+// scan has too little new or changed data for the filter to be worth
+// sending, the filter is left out, and no references will come. With no
+// 'phase1data' to go by, the filter is always sent.
+extern int sigref_load(struct sigref *sigref, const char *directory,
+	const char *phase1data, struct conf **confs);
+
+// Puts the next bit of the filter in 'wbuf', if there is any more to send.
+extern void sigref_get_wbuf(struct sigref *sigref, struct iobuf *wbuf);
+// Fills in the sig of the block that 'ref' refers to and returns 1, or
+// marks the block's sig as unknown and returns 0 if the filter was wrong
+// about it.
+extern int sigref_resolve(struct sigref *sigref, const char *ref,
+	struct blk *blk);
+extern void sigref_log_stats(struct sigref *sigref);
+
+#endif
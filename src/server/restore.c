@@ -204,8 +204,7 @@ static int restore_sbuf(struct asfd *asfd, struct sbuf *sb, struct bu *bu,
 	if(sb->path.cmd==CMD_HARD_LINK)
 	{
 		struct f_link *lp=NULL;
-		struct f_link **bucket=NULL;
-		if((lp=linkhash_search(&sb->statp, &bucket)))
+		if((lp=linkhash_search(&sb->statp)))
 		{
 			// It is in the list of stuff that is in the manifest,
 			// but was skipped on this restore.
@@ -423,9 +422,8 @@ static int restore_stream(struct asfd *asfd, struct sdirs *sdirs,
 		{
 			// Add it to the list of filedata that was not
 			// restored.
-			struct f_link **bucket=NULL;
-			if(!linkhash_search(&sb->statp, &bucket)
-			  && linkhash_add(sb->path.buf, &sb->statp, bucket))
+			if(!linkhash_search(&sb->statp)
+			  && linkhash_add(sb->path.buf, &sb->statp))
 				goto end;
 		}
 
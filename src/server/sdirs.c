@@ -131,6 +131,9 @@ static int do_common_dirs(struct sdirs *sdirs, struct conf **confs)
 // Maybe should be in a protocol1 directory.
 static int do_protocol1_dirs(struct sdirs *sdirs, struct conf **confs)
 {
+	const char *dedup_group=get_string(confs[OPT_DEDUP_GROUP]);
+	// Without a dedup_group, inline_dedup only works within the client.
+	if(!dedup_group) dedup_group=get_string(confs[OPT_CNAME]);
 	if(!(sdirs->client=prepend_s(sdirs->base, get_string(confs[OPT_CNAME])))
 	  || do_common_dirs(sdirs, confs)
 	  || !(sdirs->currentdata=prepend_s(sdirs->current, DATA_DIR))
@@ -138,7 +141,10 @@ static int do_protocol1_dirs(struct sdirs *sdirs, struct conf **confs)
 	  || !(sdirs->datadirtmp=prepend_s(sdirs->working, "data.tmp"))
 	  || !(sdirs->cmanifest=prepend_s(sdirs->current, "manifest.gz"))
 	  || !(sdirs->cincexc=prepend_s(sdirs->current, "incexc"))
-	  || !(sdirs->deltmppath=prepend_s(sdirs->working, "deltmppath")))
+	  || !(sdirs->deltmppath=prepend_s(sdirs->working, "deltmppath"))
+	  || !(sdirs->hlindex=prepend_s(sdirs->base,
+		HLINDEX_DIR "/"))
+	  || astrcat(&sdirs->hlindex, dedup_group, __func__))
 		return -1;
 	// sdirs->rworking gets set later.
 	// sdirs->treepath gets set later.
@@ -233,6 +239,7 @@ void sdirs_free_content(struct sdirs *sdirs)
 	free_w(&sdirs->cincexc);
 	free_w(&sdirs->deltmppath);
 	free_w(&sdirs->treepath);
+	free_w(&sdirs->hlindex);
 }
 
 void sdirs_free(struct sdirs **sdirs)
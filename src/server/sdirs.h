@@ -3,6 +3,7 @@
 
 #define TREE_DIR	"t"
 #define DATA_DIR	"data"
+#define HLINDEX_DIR	".hlindex"
 
 // Server directories.
 struct sdirs
@@ -40,6 +41,7 @@ struct sdirs
 	char *cincexc;
 	char *deltmppath;
 	char *treepath;
+	char *hlindex;
 };
 
 extern struct sdirs *sdirs_alloc(void);
@@ -110,6 +110,16 @@ SSL_CTX *ssl_initialise_ctx(struct conf **confs)
 	return ctx;
 }
 
+// Use kernel TLS for sending where possible, so that protocol2 restores can
+// send block data straight from the data files. This has to be set before
+// the handshake.
+void ssl_enable_ktls_send(SSL *ssl)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
 void ssl_destroy_ctx(SSL_CTX *ctx)
 {
 	SSL_CTX_free(ctx);
@@ -6,6 +6,7 @@
 
 extern SSL_CTX *ssl_initialise_ctx(struct conf **confs);
 extern void ssl_destroy_ctx(SSL_CTX *ctx);
+extern void ssl_enable_ktls_send(SSL *ssl);
 extern int ssl_load_dh_params(SSL_CTX *ctx, struct conf **confs);
 extern void ssl_load_globals(void);
 extern int ssl_check_cert(SSL *ssl, struct conf **confs);
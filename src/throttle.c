@@ -0,0 +1,192 @@
+#include "burp.h"
+#include "alloc.h"
+#include "cntr.h"
+#include "log.h"
+#include "prepend.h"
+#include "throttle.h"
+
+#include <sys/time.h>
+
+// The slowest that it goes, as a share of full speed.
+#define LEVEL_MIN	5
+// How much sleeping to save up before doing it, and the most to do in one
+// go, in microseconds.
+#define SLEEP_MIN	10000
+#define SLEEP_MAX	1000000
+
+static const char *resources[]={ "cpu", "io", "memory" };
+#define RESOURCES	(int)(sizeof(resources)/sizeof(resources[0]))
+
+struct throttle
+{
+	struct cntr *cntr;
+	int limit;
+	int level;
+	char *paths[RESOURCES];
+	time_t checked;
+	// When the main thread last woke up.
+	struct timeval woke;
+	// Time asleep that has not gone into the counters yet.
+	unsigned long long slept;
+};
+
+static struct throttle *throttle=NULL;
+
+// Returns the 'some avg10' percentage from a pressure file, or -1.
+static float read_pressure(const char *path)
+{
+	FILE *fp;
+	float avg10=-1;
+	char buf[256]="";
+	if(!(fp=fopen(path, "r")))
+		return -1;
+	while(fgets(buf, sizeof(buf), fp))
+		if(sscanf(buf, "some avg10=%f", &avg10)==1)
+			break;
+	fclose(fp);
+	return avg10;
+}
+
+static float worst_pressure(void)
+{
+	int i;
+	float p;
+	float worst=-1;
+	for(i=0; i<RESOURCES; i++)
+		if((p=read_pressure(throttle->paths[i]))>worst)
+			worst=p;
+	return worst;
+}
+
+void throttle_free(void)
+{
+	int i;
+	if(!throttle) return;
+	for(i=0; i<RESOURCES; i++)
+		free_w(&throttle->paths[i]);
+	free_v((void **)&throttle);
+}
+
+int throttle_init(struct cntr *cntr, int limit, const char *dir)
+{
+	int i;
+	throttle_free();
+	if(limit<=0) return 0;
+	if(!(throttle=(struct throttle *)
+		calloc_w(1, sizeof(struct throttle), __func__)))
+			return -1;
+	for(i=0; i<RESOURCES; i++)
+	{
+		if(!(throttle->paths[i]=prepend_s(dir, resources[i])))
+		{
+			throttle_free();
+			return -1;
+		}
+	}
+	if(worst_pressure()<0)
+	{
+		logp("No pressure stall information in %s - not throttling\n",
+			dir);
+		throttle_free();
+		return 0;
+	}
+	throttle->cntr=cntr;
+	throttle->limit=limit;
+	throttle->level=100;
+	gettimeofday(&throttle->woke, NULL);
+	logp("Will slow down when pressure is above %d%%\n", limit);
+	return 0;
+}
+
+void throttle_check(void)
+{
+	float worst;
+	if(!throttle
+	  || (worst=worst_pressure())<0)
+		return;
+	if(worst>throttle->limit)
+	{
+		if(throttle->level<=LEVEL_MIN)
+			return;
+		if((throttle->level/=2)<LEVEL_MIN)
+			throttle->level=LEVEL_MIN;
+		logp("Pressure is %.1f%% - slowing down to %d%%\n",
+			worst, throttle->level);
+	}
+	else if(worst<throttle->limit*3/4.0 && throttle->level<100)
+	{
+		if((throttle->level+=10)>=100)
+		{
+			throttle->level=100;
+			logp("Pressure is %.1f%% - back to full speed\n",
+				worst);
+		}
+	}
+}
+
+static long long usecs_since(struct timeval *then, struct timeval *now)
+{
+	return (long long)(now->tv_sec-then->tv_sec)*1000000
+		+(now->tv_usec-then->tv_usec);
+}
+
+static void add_slept(unsigned long long usecs)
+{
+	throttle->slept+=usecs;
+	if(throttle->slept<1000000) return;
+	cntr_add_throttled(throttle->cntr, throttle->slept/1000000);
+	throttle->slept%=1000000;
+}
+
+void throttle_wait(void)
+{
+	long long worked;
+	long long usecs;
+	struct timeval now;
+
+	if(!throttle) return;
+	gettimeofday(&now, NULL);
+	if(now.tv_sec!=throttle->checked)
+	{
+		throttle->checked=now.tv_sec;
+		throttle_check();
+	}
+	if(throttle->level>=100
+	  || (worked=usecs_since(&throttle->woke, &now))<0)
+	{
+		throttle->woke=now;
+		return;
+	}
+	// Sleep for long enough that the time spent working is only 'level'
+	// percent of the whole.
+	usecs=worked*(100-throttle->level)/throttle->level;
+	if(usecs<SLEEP_MIN) return;
+	if(usecs>SLEEP_MAX) usecs=SLEEP_MAX;
+#ifdef HAVE_WIN32
+	Sleep(usecs/1000);
+#else
+	usleep(usecs);
+#endif
+	add_slept(usecs);
+	gettimeofday(&throttle->woke, NULL);
+}
+
+int throttle_threads(int threads)
+{
+	int n;
+	if(!throttle) return threads;
+	if((n=threads*throttle->level/100)<1) n=1;
+	return n;
+}
+
+float throttle_ratelimit(float ratelimit)
+{
+	if(!throttle) return ratelimit;
+	return ratelimit*throttle->level/100;
+}
+
+int throttle_level(void)
+{
+	if(!throttle) return 100;
+	return throttle->level;
+}
@@ -0,0 +1,35 @@
+#ifndef _THROTTLE_H
+#define _THROTTLE_H
+
+#define PRESSURE_DIR	"/proc/pressure"
+
+// Makes a client backup back off while the host is under pressure, going by
+// the Linux pressure stall information in PRESSURE_DIR. Once a second, the
+// highest 'some avg10' of cpu, io and memory is compared with the limit.
+// Above it, the backup runs at half the speed that it did. Comfortably below
+// it, the speed creeps back up.
+// The speed is kept down by:
+// - the main thread sleeping between bits of reading and sending, for
+//   long enough that it only works for that share of the time,
+// - letting only that share of the worker threads run,
+// - lowering the ratelimit, if there is one.
+// The time spent asleep is added to the counters.
+// Before throttle_init(), or without pressure stall information, nothing is
+// slowed down.
+
+extern int throttle_init(struct cntr *cntr, int limit, const char *dir);
+extern void throttle_free(void);
+
+// Call from the main thread between bits of work.
+extern void throttle_wait(void);
+// Reads the pressure and sets the speed. throttle_wait() does this once a
+// second.
+extern void throttle_check(void);
+// How many out of 'threads' worker threads should be running.
+extern int throttle_threads(int threads);
+// Bytes per second, instead of 'ratelimit'.
+extern float throttle_ratelimit(float ratelimit);
+// The share of full speed, in percent.
+extern int throttle_level(void);
+
+#endif
@@ -0,0 +1,181 @@
+#include "burp.h"
+#include "alloc.h"
+#include "log.h"
+#include "workq.h"
+
+#ifndef HAVE_WIN32
+static void *worker(void *arg)
+{
+	struct workq *workq=(struct workq *)arg;
+	struct workq_job *job;
+
+	pthread_mutex_lock(&workq->lock);
+	while(1)
+	{
+		while(!workq->stop
+		  && (!workq->queued || workq->running>=workq->active))
+			pthread_cond_wait(&workq->work_cond, &workq->lock);
+		if(workq->stop) break;
+		job=&workq->jobs[workq->next];
+		workq->next=(workq->next+1)%workq->max;
+		workq->queued--;
+		workq->running++;
+
+		pthread_mutex_unlock(&workq->lock);
+		job->func(job->data);
+		pthread_mutex_lock(&workq->lock);
+
+		job->done=1;
+		workq->running--;
+		pthread_cond_broadcast(&workq->done_cond);
+		// One that was held back by workq_set_active() can go now.
+		if(workq->queued && workq->active<workq->threads)
+			pthread_cond_signal(&workq->work_cond);
+	}
+	pthread_mutex_unlock(&workq->lock);
+	return NULL;
+}
+#endif
+
+struct workq *workq_alloc(int threads, int max)
+{
+	struct workq *workq;
+	if(max<1) max=1;
+	if(!(workq=(struct workq *)calloc_w(1, sizeof(struct workq), __func__))
+	  || !(workq->jobs=(struct workq_job *)
+		calloc_w(max, sizeof(struct workq_job), __func__)))
+			goto error;
+	workq->max=max;
+#ifndef HAVE_WIN32
+	pthread_mutex_init(&workq->lock, NULL);
+	pthread_cond_init(&workq->work_cond, NULL);
+	pthread_cond_init(&workq->done_cond, NULL);
+	if(threads>0
+	  && !(workq->tids=(pthread_t *)
+		calloc_w(threads, sizeof(pthread_t), __func__)))
+			goto error;
+	workq->active=threads;
+	for(workq->threads=0; workq->threads<threads; workq->threads++)
+	{
+		if(pthread_create(&workq->tids[workq->threads],
+			NULL, worker, workq))
+		{
+			logp("Could not create worker thread: %s\n",
+				strerror(errno));
+			goto error;
+		}
+	}
+#endif
+	return workq;
+error:
+	workq_free(&workq);
+	return NULL;
+}
+
+void workq_free(struct workq **workq)
+{
+	if(!workq || !*workq) return;
+#ifndef HAVE_WIN32
+	{
+		int i;
+		pthread_mutex_lock(&(*workq)->lock);
+		(*workq)->stop=1;
+		pthread_cond_broadcast(&(*workq)->work_cond);
+		pthread_mutex_unlock(&(*workq)->lock);
+		for(i=0; i<(*workq)->threads; i++)
+			pthread_join((*workq)->tids[i], NULL);
+		pthread_cond_destroy(&(*workq)->work_cond);
+		pthread_cond_destroy(&(*workq)->done_cond);
+		pthread_mutex_destroy(&(*workq)->lock);
+		free_v((void **)&(*workq)->tids);
+	}
+#endif
+	free_v((void **)&(*workq)->jobs);
+	free_v((void **)workq);
+}
+
+int workq_full(struct workq *workq)
+{
+	return workq->count==workq->max;
+}
+
+int workq_empty(struct workq *workq)
+{
+	return !workq->count;
+}
+
+// Returns -1 if the queue is full. Collect some results with workq_get()
+// first.
+int workq_add(struct workq *workq, workq_func_t *func, void *data)
+{
+	struct workq_job *job;
+	if(workq_full(workq))
+	{
+		logp("%s called on full queue\n", __func__);
+		return -1;
+	}
+	job=&workq->jobs[workq->tail];
+	job->func=func;
+	job->data=data;
+	job->done=0;
+	workq->count++;
+#ifndef HAVE_WIN32
+	if(workq->threads)
+	{
+		pthread_mutex_lock(&workq->lock);
+		workq->tail=(workq->tail+1)%workq->max;
+		workq->queued++;
+		pthread_cond_signal(&workq->work_cond);
+		pthread_mutex_unlock(&workq->lock);
+		return 0;
+	}
+#endif
+	// No threads, so do it now.
+	workq->tail=(workq->tail+1)%workq->max;
+	workq->next=workq->tail;
+	func(data);
+	job->done=1;
+	return 0;
+}
+
+// Let only 'active' of the threads run jobs at once, though always at least
+// one. Jobs that are already running carry on.
+void workq_set_active(struct workq *workq, int active)
+{
+	if(active<1) active=1;
+	if(active>workq->threads) active=workq->threads;
+#ifndef HAVE_WIN32
+	if(!workq->threads) return;
+	pthread_mutex_lock(&workq->lock);
+	if(active>workq->active)
+		pthread_cond_broadcast(&workq->work_cond);
+	workq->active=active;
+	pthread_mutex_unlock(&workq->lock);
+#endif
+}
+
+// Get the data of the oldest job, if it has finished. If block is set, wait
+// for it to finish. Returns NULL if there are no jobs, or if not blocking and
+// the oldest job has not finished yet.
+void *workq_get(struct workq *workq, int block)
+{
+	int done;
+	void *data;
+	struct workq_job *job;
+	if(workq_empty(workq)) return NULL;
+	job=&workq->jobs[workq->head];
+#ifndef HAVE_WIN32
+	pthread_mutex_lock(&workq->lock);
+	while(block && !job->done)
+		pthread_cond_wait(&workq->done_cond, &workq->lock);
+	done=job->done;
+	pthread_mutex_unlock(&workq->lock);
+#else
+	done=job->done;
+#endif
+	if(!done) return NULL;
+	data=job->data;
+	workq->head=(workq->head+1)%workq->max;
+	workq->count--;
+	return data;
+}
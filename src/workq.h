@@ -0,0 +1,58 @@
+#ifndef _WORKQ_H
+#define _WORKQ_H
+
+#ifndef HAVE_WIN32
+#include <pthread.h>
+#endif
+
+// A small pool of worker threads with a bounded queue of jobs. Results are
+// collected by the calling thread in the same order that the jobs were added,
+// so that whatever is done with them (usually writing to an asfd, which is
+// not thread safe) can stay in the calling thread.
+// Without threads, the jobs are run as they are added.
+
+typedef void (workq_func_t)(void *);
+
+struct workq_job
+{
+	workq_func_t *func;
+	void *data;
+	uint8_t done;
+};
+
+struct workq
+{
+	int threads;
+	// Jobs in a ring, from 'head' (next to be collected) to 'tail' (next
+	// free slot). Workers take jobs from 'next', while 'queued' says there
+	// are some that no worker has taken yet.
+	struct workq_job *jobs;
+	int max;
+	int head;
+	int next;
+	int tail;
+	int count;
+	int queued;
+	// How many of the threads may be running jobs at once, and how many
+	// are.
+	int active;
+	int running;
+	uint8_t stop;
+#ifndef HAVE_WIN32
+	pthread_t *tids;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+#endif
+};
+
+extern struct workq *workq_alloc(int threads, int max);
+extern void workq_free(struct workq **workq);
+
+extern int workq_full(struct workq *workq);
+extern int workq_empty(struct workq *workq);
+extern int workq_add(struct workq *workq, workq_func_t *func, void *data);
+extern void *workq_get(struct workq *workq, int block);
+extern void workq_set_active(struct workq *workq, int active);
+
+#endif
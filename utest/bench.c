@@ -0,0 +1,27 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "test.h"
+
+// The benchmarks take a while, and their timings only mean something on a
+// quiet machine, so they are left out unless asked for with 'make bench'.
+int bench_wanted(void)
+{
+	return getenv("UTEST_BENCH")!=NULL;
+}
+
+double bench_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+void bench_report(const char *name, long n, const char *what,
+	const char *old_name, double old_time,
+	const char *new_name, double new_time)
+{
+	printf("%s: %ld %s, %s %.3fs, %s %.3fs\n", name, n, what,
+		old_name, old_time, new_name, new_time);
+}
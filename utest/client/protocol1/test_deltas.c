@@ -0,0 +1,409 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../../test.h"
+#include "../../../src/client/protocol1/include.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/protocol1/rs_buf.h"
+
+#define BASE		"utest_deltas"
+#define JOBS		10
+// The most that a worker should get ahead of the sending, in chunks of
+// ASYNC_BUF_LEN. One more is being filled.
+#define MAX_CHUNKS	64
+
+// Stand-ins for librsync. The 'signature' says how much delta to make, and
+// the delta is made up of the letter for its job.
+
+struct fake_sig
+{
+	char letter;
+	size_t len;
+};
+
+static struct fake_sig sigs[JOBS];
+// How many times each job has drained its output, and whether the jobs may
+// start at all, so that the tests can tell where the workers have got to.
+static size_t drains[JOBS];
+static int gate_open=1;
+static pthread_mutex_t drain_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond=PTHREAD_COND_INITIALIZER;
+
+static void open_gate(int open)
+{
+	pthread_mutex_lock(&drain_lock);
+	gate_open=open;
+	pthread_cond_broadcast(&drain_cond);
+	pthread_mutex_unlock(&drain_lock);
+}
+
+// Waits for a job to have drained at least 'n' times, and returns how many
+// times it has.
+static size_t wait_for_drains(int i, size_t n)
+{
+	size_t ret;
+	pthread_mutex_lock(&drain_lock);
+	while(drains[i]<n)
+		pthread_cond_wait(&drain_cond, &drain_lock);
+	ret=drains[i];
+	pthread_mutex_unlock(&drain_lock);
+	return ret;
+}
+
+rs_job_t *rs_delta_begin(rs_signature_t *sumset)
+{
+	return (rs_job_t *)sumset;
+}
+
+rs_result rs_job_drive(rs_job_t *rsjob, rs_buffers_t *buf,
+	rs_driven_cb in_cb, void *in_opaque,
+	rs_driven_cb out_cb, void *out_opaque)
+{
+	rs_result r;
+	size_t n;
+	struct fake_sig *sig=(struct fake_sig *)rsjob;
+	size_t left=sig->len;
+	pthread_mutex_lock(&drain_lock);
+	while(!gate_open)
+		pthread_cond_wait(&drain_cond, &drain_lock);
+	pthread_mutex_unlock(&drain_lock);
+	while(1)
+	{
+		if(!buf->avail_out || !left)
+		{
+			pthread_mutex_lock(&drain_lock);
+			drains[sig-sigs]++;
+			pthread_cond_broadcast(&drain_cond);
+			pthread_mutex_unlock(&drain_lock);
+			if((r=out_cb(rsjob, buf, out_opaque)))
+				return r;
+		}
+		if(!left) return RS_DONE;
+		n=left<buf->avail_out?left:buf->avail_out;
+		memset(buf->next_out, sig->letter, n);
+		buf->next_out+=n;
+		buf->avail_out-=n;
+		left-=n;
+	}
+}
+
+rs_result rs_infilebuf_fill(rs_job_t *rsjob, rs_buffers_t *buf, void *fb)
+{
+	return RS_DONE;
+}
+
+rs_filebuf_t *rs_filebuf_new(struct asfd *asfd,
+	BFILE *bfd, FILE *fp, gzFile zp,
+	int fd, size_t buf_len, size_t data_len, struct cntr *cntr)
+{
+	rs_filebuf_t *fb;
+	if(!(fb=(rs_filebuf_t *)calloc_w(1, sizeof(rs_filebuf_t), __func__)))
+		return NULL;
+	MD5_Init(&fb->md5);
+	return fb;
+}
+
+static struct conf **confs;
+static struct async *as;
+static int peer=-1;
+
+static struct asfd *setup(int threads, struct deltas **deltas)
+{
+	int sv[2];
+	struct cntr *cntr;
+	struct asfd *asfd;
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(!mkdir(BASE, 0777));
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	fail_unless((cntr=cntr_alloc())!=NULL);
+	fail_unless(!cntr_init(cntr, "utest"));
+	set_cntr(confs[OPT_CNTR], cntr);
+	set_int(confs[OPT_NETWORK_TIMEOUT], 10);
+	fail_unless(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fail_unless((as=async_alloc())!=NULL);
+	fail_unless(!as->init(as, 0));
+	fail_unless((asfd=setup_asfd(as, "test", &sv[0], NULL,
+		ASFD_STREAM_STANDARD, ASFD_FD_CHILD_MAIN,
+		-1, confs))!=NULL);
+	peer=sv[1];
+	fail_unless((*deltas=deltas_alloc(threads))!=NULL);
+	memset(drains, 0, sizeof(drains));
+	open_gate(1);
+	return asfd;
+}
+
+static void tear_down(struct asfd *asfd, struct deltas **deltas)
+{
+	deltas_free(deltas);
+	fail_unless(*deltas==NULL);
+	// iobuf_free() leaves the rbuf alone.
+	free_v((void **)&asfd->rbuf);
+	close_fd(&peer);
+	async_asfd_free_all(&as);
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+}
+
+static void add_job(struct deltas *deltas, struct asfd *asfd, int i,
+	size_t len)
+{
+	char path[256];
+	BFILE *bfd;
+	struct sbuf *sb;
+	snprintf(path, sizeof(path), "%s/%d", BASE, i);
+	fail_unless((sb=sbuf_alloc_protocol(PROTO_1))!=NULL);
+	// The job frees these with plain free().
+	iobuf_from_str(&sb->protocol1->datapth, CMD_DATAPTH, strdup(path));
+	iobuf_from_str(&sb->attr, CMD_ATTRIBS, strdup("attribs"));
+	iobuf_from_str(&sb->path, CMD_FILE, strdup(path));
+	fail_unless((bfd=bfile_alloc())!=NULL);
+	bfile_init(bfd, 0, confs);
+	fail_unless(!bfd->open(bfd, asfd, path,
+		O_WRONLY|O_CREAT|O_TRUNC, 0600));
+	sigs[i].letter='a'+i;
+	sigs[i].len=len;
+	fail_unless(!deltas_add(deltas, asfd, sb, &bfd,
+		(rs_signature_t *)&sigs[i], confs));
+	fail_unless(bfd==NULL);
+	sbuf_free(&sb);
+}
+
+// What the server gets.
+struct received
+{
+	char *buf;
+	size_t len;
+	size_t alloc;
+	size_t want;
+	const char *reply;
+};
+
+static void *receive(void *arg)
+{
+	ssize_t r;
+	struct received *rec=(struct received *)arg;
+	while(rec->len<rec->want)
+	{
+		if(rec->len==rec->alloc)
+		{
+			rec->alloc=rec->alloc?rec->alloc*2:65536;
+			fail_unless((rec->buf=(char *)realloc(rec->buf,
+				rec->alloc))!=NULL);
+		}
+		if((r=read(peer, rec->buf+rec->len,
+			rec->alloc-rec->len))<=0) break;
+		rec->len+=r;
+	}
+	if(rec->reply)
+		fail_unless(write(peer, rec->reply, strlen(rec->reply))
+			==(ssize_t)strlen(rec->reply));
+	return NULL;
+}
+
+// Takes the next message off what was received, checking its command.
+static size_t next_msg(struct received *rec, size_t *pos, char cmd,
+	char **data)
+{
+	unsigned int len;
+	char tmp[5]="";
+	fail_unless(*pos+5<=rec->len);
+	ck_assert_int_eq(rec->buf[*pos], cmd);
+	memcpy(tmp, rec->buf+*pos+1, 4);
+	fail_unless(sscanf(tmp, "%04X", &len)==1);
+	*data=rec->buf+*pos+5;
+	*pos+=5+len;
+	fail_unless(*pos<=rec->len);
+	return len;
+}
+
+// The size of everything that will be sent for a job.
+static size_t expected_len(int i)
+{
+	char path[256];
+	size_t len=0;
+	size_t left=sigs[i].len;
+	snprintf(path, sizeof(path), "%s/%d", BASE, i);
+	len+=5+strlen(path)+5+strlen("attribs")+5+strlen(path);
+	while(left)
+	{
+		size_t n=left<ASYNC_BUF_LEN?left:ASYNC_BUF_LEN;
+		len+=5+n;
+		left-=n;
+	}
+	len+=5+strlen("0:d41d8cd98f00b204e9800998ecf8427e");
+	return len;
+}
+
+static void assert_received(struct received *rec, int jobs)
+{
+	int i;
+	size_t pos=0;
+	char *data;
+	char path[256];
+	for(i=0; i<jobs; i++)
+	{
+		size_t got=0;
+		size_t len;
+		snprintf(path, sizeof(path), "%s/%d", BASE, i);
+		// In the order that they were asked for, whichever finished
+		// first.
+		len=next_msg(rec, &pos, CMD_DATAPTH, &data);
+		fail_unless(len==strlen(path) && !strncmp(data, path, len));
+		next_msg(rec, &pos, CMD_ATTRIBS, &data);
+		next_msg(rec, &pos, CMD_FILE, &data);
+		while(pos<rec->len && rec->buf[pos]==CMD_APPEND)
+		{
+			len=next_msg(rec, &pos, CMD_APPEND, &data);
+			for(size_t j=0; j<len; j++)
+				fail_unless(data[j]=='a'+i);
+			got+=len;
+		}
+		fail_unless(got==sigs[i].len);
+		next_msg(rec, &pos, CMD_END_FILE, &data);
+	}
+	fail_unless(pos==rec->len);
+}
+
+static void do_test_in_order(int threads)
+{
+	int i;
+	size_t want=0;
+	pthread_t thread;
+	struct deltas *deltas;
+	struct received rec;
+	struct asfd *asfd=setup(threads, &deltas);
+	memset(&rec, 0, sizeof(rec));
+	// The first ones are the biggest, so they finish last.
+	for(i=0; i<JOBS; i++)
+	{
+		sigs[i].len=(JOBS-i)*ASYNC_BUF_LEN*3+i;
+		want+=expected_len(i);
+	}
+	rec.want=want;
+	fail_unless(!pthread_create(&thread, NULL, receive, &rec));
+	for(i=0; i<JOBS; i++)
+		add_job(deltas, asfd, i, sigs[i].len);
+	fail_unless(!deltas_send(deltas, asfd, 1, confs));
+	fail_unless(!pthread_join(thread, NULL));
+	assert_received(&rec, JOBS);
+	free(rec.buf);
+	tear_down(asfd, &deltas);
+}
+
+START_TEST(test_deltas_in_order)
+{
+	do_test_in_order(4);
+}
+END_TEST
+
+START_TEST(test_deltas_in_order_one_thread)
+{
+	do_test_in_order(1);
+}
+END_TEST
+
+START_TEST(test_deltas_memory_bounded)
+{
+	size_t len=ASYNC_BUF_LEN*MAX_CHUNKS*4;
+	pthread_t thread;
+	struct deltas *deltas;
+	struct received rec;
+	struct asfd *asfd=setup(2, &deltas);
+	memset(&rec, 0, sizeof(rec));
+	sigs[0].len=len;
+	rec.want=expected_len(0);
+	fail_unless(!pthread_create(&thread, NULL, receive, &rec));
+	// The worker does not start until the job has been added, so nothing
+	// gets sent then. After that, nothing is sending, so the worker has to
+	// stop when it has made as much as it is allowed to keep. The first
+	// drain has nothing in it, and the last one is waiting for room.
+	open_gate(0);
+	add_job(deltas, asfd, 0, len);
+	open_gate(1);
+	fail_unless(wait_for_drains(0, MAX_CHUNKS+2)==MAX_CHUNKS+2);
+	fail_unless(!deltas_send(deltas, asfd, 1, confs));
+	fail_unless(!pthread_join(thread, NULL));
+	assert_received(&rec, 1);
+	free(rec.buf);
+	tear_down(asfd, &deltas);
+}
+END_TEST
+
+START_TEST(test_deltas_sent_while_server_quiet)
+{
+	int i;
+	size_t want=0;
+	pthread_t thread;
+	struct deltas *deltas;
+	struct received rec;
+	struct asfd *asfd=setup(2, &deltas);
+	memset(&rec, 0, sizeof(rec));
+	for(i=0; i<3; i++)
+	{
+		sigs[i].len=ASYNC_BUF_LEN*(MAX_CHUNKS+10);
+		want+=expected_len(i);
+	}
+	// The server only says something once it has had all the deltas.
+	rec.want=want;
+	rec.reply="c0002ok";
+	fail_unless(!pthread_create(&thread, NULL, receive, &rec));
+	for(i=0; i<3; i++)
+		add_job(deltas, asfd, i, sigs[i].len);
+	fail_unless(!deltas_read(deltas, asfd, confs));
+	fail_unless(!pthread_join(thread, NULL));
+	fail_unless(asfd->rbuf->cmd==CMD_GEN);
+	ck_assert_str_eq(asfd->rbuf->buf, "ok");
+	iobuf_free_content(asfd->rbuf);
+	assert_received(&rec, 3);
+	free(rec.buf);
+	tear_down(asfd, &deltas);
+}
+END_TEST
+
+START_TEST(test_deltas_freed_part_way)
+{
+	pthread_t thread;
+	struct deltas *deltas;
+	struct received rec;
+	struct asfd *asfd=setup(2, &deltas);
+	memset(&rec, 0, sizeof(rec));
+	rec.want=(size_t)-1;
+	fail_unless(!pthread_create(&thread, NULL, receive, &rec));
+	add_job(deltas, asfd, 0, ASYNC_BUF_LEN*MAX_CHUNKS*4);
+	add_job(deltas, asfd, 1, ASYNC_BUF_LEN*MAX_CHUNKS*4);
+	wait_for_drains(0, MAX_CHUNKS+2);
+	wait_for_drains(1, MAX_CHUNKS+2);
+	// The workers are waiting for room, and get told to give up.
+	deltas_free(&deltas);
+	fail_unless(!shutdown(asfd->fd, SHUT_RDWR));
+	fail_unless(!pthread_join(thread, NULL));
+	free(rec.buf);
+	tear_down(asfd, &deltas);
+}
+END_TEST
+
+Suite *suite_client_protocol1_deltas(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_protocol1_deltas");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_deltas_in_order);
+	tcase_add_test(tc_core, test_deltas_in_order_one_thread);
+	tcase_add_test(tc_core, test_deltas_memory_bounded);
+	tcase_add_test(tc_core, test_deltas_sent_while_server_quiet);
+	tcase_add_test(tc_core, test_deltas_freed_part_way);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
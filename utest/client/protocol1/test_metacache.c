@@ -0,0 +1,128 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../test.h"
+#include "../../../src/burp.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/client/protocol1/metacache.h"
+
+static struct metacache *setup(void)
+{
+	struct metacache *metacache;
+	alloc_counters_reset();
+	fail_unless((metacache=metacache_alloc())!=NULL);
+	return metacache;
+}
+
+static void tear_down(struct metacache **metacache)
+{
+	metacache_free(metacache);
+	fail_unless(*metacache==NULL);
+	fail_unless(free_count==alloc_count);
+}
+
+static int find(struct metacache *metacache, enum cmd cmd, int compression,
+	const char *meta)
+{
+	return metacache_find(metacache, cmd, compression, meta, strlen(meta));
+}
+
+static void add(struct metacache *metacache, enum cmd cmd, int compression,
+	const char *meta)
+{
+	fail_unless(!metacache_add(metacache,
+		cmd, compression, meta, strlen(meta)));
+}
+
+START_TEST(test_metacache_empty)
+{
+	struct metacache *metacache=setup();
+	fail_unless(find(metacache, CMD_METADATA, 9, "A0000010user::rw-")==-1);
+	tear_down(&metacache);
+}
+END_TEST
+
+START_TEST(test_metacache_numbers)
+{
+	struct metacache *metacache=setup();
+	add(metacache, CMD_METADATA, 9, "aaa");
+	add(metacache, CMD_METADATA, 9, "bbb");
+	// The same again still uses up a number.
+	add(metacache, CMD_METADATA, 9, "aaa");
+	add(metacache, CMD_ENC_METADATA, 9, "ccc");
+	add(metacache, CMD_METADATA, 0, "ccc");
+	fail_unless(find(metacache, CMD_METADATA, 9, "aaa")==0);
+	fail_unless(find(metacache, CMD_METADATA, 9, "bbb")==1);
+	fail_unless(find(metacache, CMD_ENC_METADATA, 9, "ccc")==3);
+	fail_unless(find(metacache, CMD_METADATA, 0, "ccc")==4);
+	// Has to be sent the same way to be the same.
+	fail_unless(find(metacache, CMD_METADATA, 9, "ccc")==-1);
+	fail_unless(find(metacache, CMD_ENC_METADATA, 9, "aaa")==-1);
+	fail_unless(find(metacache, CMD_METADATA, 9, "aa")==-1);
+	fail_unless(metacache_find(metacache,
+		CMD_METADATA, 9, "aaa", 4)==-1);
+	tear_down(&metacache);
+}
+END_TEST
+
+START_TEST(test_metacache_many)
+{
+	int i;
+	char buf[64];
+	struct metacache *metacache=setup();
+	for(i=0; i<META_REF_MAX+10; i++)
+	{
+		snprintf(buf, sizeof(buf), "X0000020security.selinux%d", i);
+		add(metacache, CMD_METADATA, 9, buf);
+	}
+	for(i=0; i<META_REF_MAX+10; i++)
+	{
+		snprintf(buf, sizeof(buf), "X0000020security.selinux%d", i);
+		// Ones past the end cannot be referred to.
+		fail_unless(find(metacache, CMD_METADATA, 9, buf)
+			==(i<META_REF_MAX?i:-1));
+	}
+	tear_down(&metacache);
+}
+END_TEST
+
+START_TEST(test_metacache_full)
+{
+	char *big;
+	size_t len=10*1024*1024;
+	struct metacache *metacache=setup();
+	fail_unless((big=(char *)malloc(len))!=NULL);
+	memset(big, 'a', len);
+	fail_unless(!metacache_add(metacache, CMD_METADATA, 9, big, len));
+	big[0]='b';
+	fail_unless(!metacache_add(metacache, CMD_METADATA, 9, big, len));
+	add(metacache, CMD_METADATA, 9, "small");
+	// There was no room left for the second one.
+	fail_unless(metacache_find(metacache, CMD_METADATA, 9, big, len)==-1);
+	big[0]='a';
+	fail_unless(metacache_find(metacache, CMD_METADATA, 9, big, len)==0);
+	// But there was for a small one.
+	fail_unless(find(metacache, CMD_METADATA, 9, "small")==2);
+	free(big);
+	tear_down(&metacache);
+}
+END_TEST
+
+Suite *suite_client_protocol1_metacache(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_protocol1_metacache");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_metacache_empty);
+	tcase_add_test(tc_core, test_metacache_numbers);
+	tcase_add_test(tc_core, test_metacache_many);
+	tcase_add_test(tc_core, test_metacache_full);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,234 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../../test.h"
+#include "../../../src/burp.h"
+#include "../../../src/alloc.h"
+#include "../../../src/asfd.h"
+#include "../../../src/cmd.h"
+#include "../../../src/fsops.h"
+#include "../../../src/prepend.h"
+#include "../../../src/client/protocol1/prefetch.h"
+
+#define BASE	"utest_prefetch"
+
+static void tear_down(struct prefetch **prefetch)
+{
+	prefetch_free(prefetch);
+	fail_unless(*prefetch==NULL);
+	fail_unless(!recursive_delete(BASE, "", 1));
+	fail_unless(free_count==alloc_count);
+}
+
+static char *make_path(int i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%d", i);
+	return prepend_s(BASE, name);
+}
+
+// File 'i' is 'lines' lines of text.
+static void make_file(int i, int lines)
+{
+	FILE *fp;
+	char *path;
+	fail_unless((path=make_path(i))!=NULL);
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	for(int j=0; j<lines; j++)
+		fprintf(fp, "file %d line %d\n", i, j);
+	fail_unless(!fclose(fp));
+	free_w(&path);
+}
+
+static struct prefetch *setup(int files)
+{
+	struct prefetch *prefetch;
+	fail_unless(!recursive_delete(BASE, "", 1));
+	fail_unless(!mkdir(BASE, 0777));
+	// File 'i' has 'i' lines, so they all differ in size.
+	for(int i=0; i<files; i++)
+		make_file(i, i);
+	alloc_counters_reset();
+	prefetch=prefetch_alloc(1);
+	if(!prefetch)
+	{
+		// No io_uring here, so nothing gets read ahead.
+		fail_unless(free_count==alloc_count);
+		fail_unless(!recursive_delete(BASE, "", 1));
+	}
+	return prefetch;
+}
+
+static void add(struct prefetch *prefetch, int i)
+{
+	char *path;
+	fail_unless((path=make_path(i))!=NULL);
+	fail_unless(prefetch_add(prefetch, path)==1);
+	free_w(&path);
+}
+
+static void take(struct prefetch *prefetch, int i, int expected)
+{
+	char *buf=NULL;
+	char *path;
+	size_t len=0;
+	struct stat statp;
+	struct stat want;
+	fail_unless((path=make_path(i))!=NULL);
+	fail_unless(prefetch_take(prefetch, path, &buf, &len, &statp)
+		==expected);
+	if(expected==1)
+	{
+		char *exp;
+		size_t explen;
+		fail_unless(!lstat(path, &want));
+		fail_unless(statp.st_ino==want.st_ino);
+		fail_unless((size_t)want.st_size==len);
+		fail_unless((exp=(char *)malloc_w(len+1, __func__))!=NULL);
+		explen=0;
+		for(int j=0; j<i; j++)
+			explen+=snprintf(exp+explen, len+1-explen,
+				"file %d line %d\n", i, j);
+		fail_unless(explen==len);
+		fail_unless(!memcmp(buf, exp, len));
+		free_w(&exp);
+		free_w(&buf);
+	}
+	free_w(&path);
+}
+
+START_TEST(test_prefetch_in_order)
+{
+	struct prefetch *prefetch;
+	if(!(prefetch=setup(40))) return;
+	for(int i=0; i<40; i++)
+		add(prefetch, i);
+	for(int i=0; i<40; i++)
+		take(prefetch, i, 1);
+	// Nothing more was asked for.
+	take(prefetch, 1, 0);
+	tear_down(&prefetch);
+}
+END_TEST
+
+START_TEST(test_prefetch_missing)
+{
+	struct prefetch *prefetch;
+	if(!(prefetch=setup(3))) return;
+	add(prefetch, 0);
+	add(prefetch, 5);
+	add(prefetch, 2);
+	take(prefetch, 0, 1);
+	take(prefetch, 5, 0);
+	take(prefetch, 2, 1);
+	tear_down(&prefetch);
+}
+END_TEST
+
+START_TEST(test_prefetch_too_big)
+{
+	struct prefetch *prefetch;
+	if(!(prefetch=setup(11))) return;
+	// About 100KB.
+	make_file(100, 5000);
+	add(prefetch, 100);
+	add(prefetch, 10);
+	take(prefetch, 100, 0);
+	take(prefetch, 10, 1);
+	tear_down(&prefetch);
+}
+END_TEST
+
+START_TEST(test_prefetch_out_of_order)
+{
+	struct prefetch *prefetch;
+	if(!(prefetch=setup(4))) return;
+	add(prefetch, 1);
+	add(prefetch, 2);
+	add(prefetch, 3);
+	// Something else got asked for, so it starts again.
+	take(prefetch, 2, 0);
+	take(prefetch, 3, 0);
+	add(prefetch, 3);
+	take(prefetch, 3, 1);
+	tear_down(&prefetch);
+}
+END_TEST
+
+static size_t frame(char *buf, enum cmd cmd, const char *data)
+{
+	return sprintf(buf, "%c%04X%s", cmd, (unsigned int)strlen(data), data);
+}
+
+START_TEST(test_prefetch_peek)
+{
+	struct asfd asfd;
+	struct prefetch *prefetch;
+	char readbuf[1024];
+	char *paths[4];
+	size_t len=0;
+	if(!(prefetch=setup(4))) return;
+	for(int i=0; i<4; i++)
+		fail_unless((paths[i]=make_path(i))!=NULL);
+
+	len+=frame(readbuf+len, CMD_ATTRIBS, "attribs");
+	len+=frame(readbuf+len, CMD_FILE, paths[0]);
+	// Going to be a delta.
+	len+=frame(readbuf+len, CMD_DATAPTH, "t/00/01");
+	len+=frame(readbuf+len, CMD_ATTRIBS, "attribs");
+	len+=frame(readbuf+len, CMD_FILE, paths[1]);
+	len+=frame(readbuf+len, CMD_ATTRIBS, "attribs");
+	len+=frame(readbuf+len, CMD_METADATA, paths[2]);
+	len+=frame(readbuf+len, CMD_ATTRIBS, "attribs");
+	len+=frame(readbuf+len, CMD_ENC_FILE, paths[3]);
+	// Not all here yet.
+	len+=sprintf(readbuf+len, "%c%04X%s", CMD_FILE, 100, "abc");
+
+	memset(&asfd, 0, sizeof(asfd));
+	asfd.streamtype=ASFD_STREAM_STANDARD;
+	asfd.readbuf=readbuf;
+	asfd.readbuflen=len;
+	fail_unless(!prefetch_peek(prefetch, &asfd, 0));
+	// Looking again does not start them twice.
+	fail_unless(!prefetch_peek(prefetch, &asfd, 0));
+	take(prefetch, 0, 1);
+	take(prefetch, 3, 1);
+	take(prefetch, 0, 0);
+
+	// When the request being put together already has a datapth, its
+	// file is not a whole one.
+	len=0;
+	len+=frame(readbuf+len, CMD_ATTRIBS, "attribs");
+	len+=frame(readbuf+len, CMD_FILE, paths[0]);
+	len+=frame(readbuf+len, CMD_ATTRIBS, "attribs");
+	len+=frame(readbuf+len, CMD_FILE, paths[2]);
+	asfd.readbuf=readbuf;
+	asfd.readbuflen=len;
+	fail_unless(!prefetch_peek(prefetch, &asfd, 1));
+	take(prefetch, 2, 1);
+
+	for(int i=0; i<4; i++)
+		free_w(&paths[i]);
+	tear_down(&prefetch);
+}
+END_TEST
+
+Suite *suite_client_protocol1_prefetch(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_protocol1_prefetch");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_prefetch_in_order);
+	tcase_add_test(tc_core, test_prefetch_missing);
+	tcase_add_test(tc_core, test_prefetch_too_big);
+	tcase_add_test(tc_core, test_prefetch_out_of_order);
+	tcase_add_test(tc_core, test_prefetch_peek);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,337 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "../test.h"
+#include "../../src/client/include.h"
+#include "../../src/alloc.h"
+#include "../../src/pathcmp.h"
+
+#define BASE		"utest_journal"
+#define FANOUT		3
+#define DEPTH		2
+
+static char tree[256];
+static char jdir[256];
+static struct conf **confs;
+static pid_t watcher;
+
+static void make_tree(const char *dir, int depth)
+{
+	int i;
+	FILE *fp;
+	char path[512];
+	fail_unless(!mkdir(dir, 0777));
+	for(i=0; i<FANOUT; i++)
+	{
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		fail_unless((fp=fopen(path, "wb"))!=NULL);
+		fprintf(fp, "%4096s", "");
+		fail_unless(!fclose(fp));
+		if(depth<DEPTH)
+		{
+			snprintf(path, sizeof(path), "%s/dir%d", dir, i);
+			make_tree(path, depth+1);
+		}
+	}
+}
+
+static void wait_for_ready(void)
+{
+	int i;
+	FILE *fp;
+	char line[256];
+	char path[512];
+	snprintf(path, sizeof(path), "%s/journal", jdir);
+	for(i=0; i<1000; i++)
+	{
+		if((fp=fopen(path, "r")))
+		{
+			while(fgets(line, sizeof(line), fp))
+			{
+				if(strcmp(line, "R\n")) continue;
+				fclose(fp);
+				return;
+			}
+			fclose(fp);
+		}
+		usleep(10000);
+	}
+	fail_unless(0);
+}
+
+static void setup(void)
+{
+	char cwd[256];
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(getcwd(cwd, sizeof(cwd))!=NULL);
+	snprintf(tree, sizeof(tree), "%s/%s/tree", cwd, BASE);
+	snprintf(jdir, sizeof(jdir), "%s/%s/journal", cwd, BASE);
+	fail_unless(!mkdir(BASE, 0777));
+	fail_unless(!mkdir(jdir, 0777));
+	make_tree(tree, 0);
+
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	fail_unless(!set_string(confs[OPT_JOURNAL_DIR], jdir));
+	fail_unless(!add_to_strlist(confs[OPT_STARTDIR], tree, 1));
+
+	fail_unless((watcher=fork())>=0);
+	if(!watcher)
+	{
+		// Do not outlive the test, if it fails.
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		journal_watch(confs);
+		_exit(1);
+	}
+	wait_for_ready();
+	alloc_counters_reset();
+}
+
+static void tear_down(void)
+{
+	fail_unless(free_count==alloc_count);
+	kill(watcher, SIGKILL);
+	waitpid(watcher, NULL, 0);
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+}
+
+// What the scan sees, one line per entry.
+struct seen
+{
+	char *buf;
+	size_t len;
+	size_t alloc;
+	int dirs;
+	int clean;
+};
+
+static void see(struct seen *seen, const char *path, struct stat *statp)
+{
+	if(seen->alloc-seen->len<1024)
+	{
+		seen->alloc=seen->alloc?seen->alloc*2:65536;
+		fail_unless((seen->buf=(char *)realloc(seen->buf,
+			seen->alloc))!=NULL);
+	}
+	seen->len+=snprintf(seen->buf+seen->len, seen->alloc-seen->len,
+		"%s %o %lu %ld %ld.%09ld %ld.%09ld\n", path,
+		(unsigned int)statp->st_mode, (unsigned long)statp->st_ino,
+		(long)statp->st_size,
+		(long)statp->st_mtim.tv_sec, (long)statp->st_mtim.tv_nsec,
+		(long)statp->st_ctim.tv_sec, (long)statp->st_ctim.tv_nsec);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return pathcmp(*(char **)a, *(char **)b);
+}
+
+static void scan_plain(struct seen *seen, const char *dir)
+{
+	int i;
+	int count=0;
+	char *names[64];
+	char path[512];
+	DIR *d;
+	struct dirent *e;
+	struct stat statp;
+	fail_unless((d=opendir(dir))!=NULL);
+	while((e=readdir(d)))
+	{
+		if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+		fail_unless(count<64);
+		names[count++]=strdup(e->d_name);
+	}
+	closedir(d);
+	qsort(names, count, sizeof(char *), name_cmp);
+	for(i=0; i<count; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		fail_unless(!lstat(path, &statp));
+		see(seen, path, &statp);
+		if(S_ISDIR(statp.st_mode))
+			scan_plain(seen, path);
+		free(names[i]);
+	}
+}
+
+static void scan_walk(struct seen *seen, struct walk *walk,
+	struct journal *journal, const char *dir)
+{
+	int i;
+	char path[512];
+	struct walk_list *list=NULL;
+	seen->dirs++;
+	if(journal_is_clean(journal, dir))
+		seen->clean++;
+	fail_unless(!walk_get(walk, dir, 0, &list));
+	fail_unless(!list->noopen);
+	for(i=0; i<list->count; i++)
+	{
+		struct walk_ent *e=&list->ents[i];
+		snprintf(path, sizeof(path), "%s/%s", dir, e->name);
+		fail_unless(e->stat_done);
+		fail_unless(!e->stat_ret);
+		see(seen, path, &e->statp);
+		if(S_ISDIR(e->statp.st_mode))
+			scan_walk(seen, walk, journal, path);
+	}
+	walk_list_free(&list);
+}
+
+// Scans the tree with the journal, checks that it comes out the same as
+// reading everything, and returns how many directories came from the cache.
+static int scan(int threads)
+{
+	int clean;
+	struct seen plain;
+	struct seen walked;
+	struct walk *walk;
+	struct journal *journal;
+	memset(&plain, 0, sizeof(plain));
+	memset(&walked, 0, sizeof(walked));
+	fail_unless((journal=journal_open(confs))!=NULL);
+	fail_unless((walk=walk_alloc(threads, confs, journal))!=NULL);
+	scan_walk(&walked, walk, journal, tree);
+	walk_free(&walk);
+	fail_unless(!journal_close(journal));
+	journal_free(&journal);
+	scan_plain(&plain, tree);
+	fail_unless(plain.len==walked.len);
+	fail_unless(!memcmp(plain.buf, walked.buf, plain.len));
+	clean=walked.clean;
+	free(plain.buf);
+	free(walked.buf);
+	return clean;
+}
+
+static int count_dirs(void)
+{
+	int i;
+	int n=1;
+	for(i=1; i<=DEPTH; i++) n=n*FANOUT+1;
+	return n;
+}
+
+START_TEST(test_journal_unchanged)
+{
+	setup();
+	// Nothing to go on the first time.
+	fail_unless(scan(0)==0);
+	fail_unless(scan(0)==count_dirs());
+	fail_unless(scan(4)==count_dirs());
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_journal_changed)
+{
+	FILE *fp;
+	char path[512];
+	setup();
+	fail_unless(scan(0)==0);
+	snprintf(path, sizeof(path), "%s/dir1/dir2/new", tree);
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	fail_unless(!fclose(fp));
+	// The directory, and its parent, which keeps its times.
+	fail_unless(scan(4)==count_dirs()-2);
+	fail_unless(scan(0)==count_dirs());
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_journal_hardlink)
+{
+	char path[512];
+	char link_path[512];
+	setup();
+	snprintf(path, sizeof(path), "%s/dir0/file0", tree);
+	snprintf(link_path, sizeof(link_path), "%s/dir1/link", tree);
+	fail_unless(!link(path, link_path));
+	fail_unless(scan(0)==0);
+	fail_unless(scan(0)==count_dirs());
+
+	// Changed through the other link, so only that directory and its
+	// parent are read again, but the file is still seen to have changed.
+	fail_unless(!chmod(link_path, 0600));
+	fail_unless(scan(0)==count_dirs()-2);
+
+	// Now it has one link fewer.
+	fail_unless(!unlink(link_path));
+	fail_unless(scan(4)==count_dirs()-2);
+	fail_unless(scan(0)==count_dirs());
+	tear_down();
+}
+END_TEST
+
+static int max_queued_events(void)
+{
+	int n=0;
+	FILE *fp;
+	fail_unless((fp=fopen("/proc/sys/fs/inotify/max_queued_events",
+		"r"))!=NULL);
+	fail_unless(fscanf(fp, "%d", &n)==1);
+	fclose(fp);
+	return n;
+}
+
+START_TEST(test_journal_overflow)
+{
+	int i;
+	int max;
+	FILE *fp;
+	char path[2][512];
+	char newdir[512];
+	setup();
+	fail_unless(scan(0)==0);
+
+	// Make more happen than the watcher can be told about, and then add
+	// a directory that it is not told about either.
+	fail_unless(!kill(watcher, SIGSTOP));
+	max=max_queued_events();
+	snprintf(path[0], sizeof(path[0]), "%s/file0", tree);
+	snprintf(path[1], sizeof(path[1]), "%s/file1", tree);
+	for(i=0; i<max+10; i++)
+		fail_unless(!chmod(path[i%2], i%4?0644:0600));
+	snprintf(newdir, sizeof(newdir), "%s/dir1/newdir", tree);
+	fail_unless(!mkdir(newdir, 0777));
+	fail_unless(!kill(watcher, SIGCONT));
+
+	// Reads everything.
+	fail_unless(scan(0)==0);
+
+	// The new directory is being watched now.
+	snprintf(path[0], sizeof(path[0]), "%s/new", newdir);
+	fail_unless((fp=fopen(path[0], "wb"))!=NULL);
+	fail_unless(!fclose(fp));
+	fail_unless(scan(0)==count_dirs()+1-2);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_client_journal(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_journal");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_journal_unchanged);
+	tcase_add_test(tc_core, test_journal_changed);
+	tcase_add_test(tc_core, test_journal_hardlink);
+	tcase_add_test(tc_core, test_journal_overflow);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,336 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/conf.h"
+#include "../../src/conffile.h"
+#include "../../src/pathcmp.h"
+#include "../../src/regexp.h"
+#include "../../src/client/matcher.h"
+
+// The way that find.c used to do it, going through the rules one at a time.
+// Returns -1 if there was no extension to look at.
+static int old_ext(struct strlist *list, const char *fname)
+{
+	int i=0;
+	struct strlist *l;
+	const char *cp=NULL;
+	for(cp=fname+strlen(fname)-1; i<list->flag && cp>=fname; cp--, i++)
+	{
+		if(*cp!='.') continue;
+		for(l=list; l; l=l->next)
+			if(!strcasecmp(l->path, cp+1))
+				return 1;
+		return 0;
+	}
+	return -1;
+}
+
+static int old_include_ext(struct conf **confs, const char *fname)
+{
+	struct strlist *incext=get_strlist(confs[OPT_INCEXT]);
+	if(!incext) return 1;
+	return old_ext(incext, fname)==1;
+}
+
+static int old_exclude_comp(struct conf **confs, const char *fname,
+	int compression)
+{
+	struct strlist *excom=get_strlist(confs[OPT_EXCOM]);
+	if(!compression || !excom) return compression;
+	return old_ext(excom, fname)==1?0:compression;
+}
+
+static int old_is_included(struct conf **confs, const char *fname)
+{
+	int longest=0;
+	int matching=0;
+	struct strlist *l=NULL;
+	struct strlist *best=NULL;
+	struct strlist *excext=get_strlist(confs[OPT_EXCEXT]);
+
+	if(excext && old_ext(excext, fname)==1)
+		return 0;
+	for(l=get_strlist(confs[OPT_EXCREG]); l; l=l->next)
+		if(check_regex(l->re, fname))
+			return 0;
+	for(l=get_strlist(confs[OPT_INCEXCDIR]); l; l=l->next)
+	{
+		matching=is_subdir(l->path, fname);
+		if(matching>longest)
+		{
+			longest=matching;
+			best=l;
+		}
+	}
+	return best?best->flag:0;
+}
+
+static const char *parts[] = {
+	"", "home", "user", ".cache", "keep", "a", "tmp", "x.o", "y.TXT",
+	"z.swp", "Downloads", ".git", "f.bak", "ab", "a.b.c", "tmpfile",
+	"dir.d", "README", "IMG_0001.JPG", "b", "x.tar.gz"
+};
+
+static char **make_paths(int *count, int extra)
+{
+	int i;
+	int n=0;
+	char **paths;
+	int nparts=ARR_LEN(parts);
+
+	*count=nparts*nparts*nparts+extra;
+	fail_unless((paths=(char **)calloc(*count, sizeof(char *)))!=NULL);
+	// Every path of three parts, then some longer ones.
+	for(i=0; i<nparts*nparts*nparts; i++)
+	{
+		char buf[256];
+		snprintf(buf, sizeof(buf), "/%s/%s/%s",
+			parts[i/(nparts*nparts)],
+			parts[(i/nparts)%nparts],
+			parts[i%nparts]);
+		fail_unless((paths[n++]=strdup(buf))!=NULL);
+	}
+	srand(1);
+	for(i=0; i<extra; i++)
+	{
+		int j;
+		int depth=1+rand()%8;
+		char buf[512]="";
+		for(j=0; j<depth; j++)
+		{
+			strcat(buf, "/");
+			strcat(buf, parts[rand()%nparts]);
+		}
+		if(!(rand()%20)) strcat(buf, "/");
+		fail_unless((paths[n++]=strdup(buf))!=NULL);
+	}
+	return paths;
+}
+
+static void free_paths(char **paths, int count)
+{
+	int i;
+	for(i=0; i<count; i++) free(paths[i]);
+	free(paths);
+}
+
+static struct conf **setup(const char *buf)
+{
+	struct conf **confs=NULL;
+	alloc_counters_reset();
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	if(*buf) fail_unless(!conf_parse_incexcs_buf(confs, buf));
+	return confs;
+}
+
+static void tear_down(struct conf ***confs)
+{
+	confs_free(confs);
+	fail_unless(free_count==alloc_count);
+}
+
+static void assert_same(const char *buf)
+{
+	int i;
+	int count=0;
+	char **paths;
+	struct conf **confs;
+	struct matcher *matcher;
+
+	confs=setup(buf);
+	paths=make_paths(&count, 20000);
+	fail_unless((matcher=matcher_alloc(confs))!=NULL);
+	for(i=0; i<count; i++)
+	{
+		const char *p=paths[i];
+		fail_unless(matcher_is_included(matcher, p)
+			==old_is_included(confs, p));
+		fail_unless(matcher_include_ext(matcher, p)
+			==old_include_ext(confs, p));
+		fail_unless(matcher_exclude_comp(matcher, p, 9)
+			==old_exclude_comp(confs, p, 9));
+		fail_unless(matcher_exclude_comp(matcher, p, 0)==0);
+	}
+	matcher_free(&matcher);
+	free_paths(paths, count);
+	tear_down(&confs);
+}
+
+START_TEST(test_matcher_empty)
+{
+	assert_same("");
+}
+END_TEST
+
+START_TEST(test_matcher_dirs)
+{
+	assert_same(
+		"include=/home\n"
+		"exclude=/home/user/.cache\n"
+		"include=/home/user/.cache/keep\n"
+		"exclude=/home/a/\n"
+		"include=/home/a\n"
+		"include=/home/ab/b/\n"
+		"exclude=/home/ab/b\n"
+		"exclude=/tmp\n"
+		"include=/tmp/tmpfile/\n"
+	);
+	assert_same(
+		"include=/\n"
+		"exclude=/home/\n"
+		"include=/home/user\n"
+	);
+}
+END_TEST
+
+START_TEST(test_matcher_exts)
+{
+	assert_same(
+		"include=/\n"
+		"exclude_ext=o\n"
+		"exclude_ext=SWP\n"
+		"include_ext=txt\n"
+		"include_ext=c\n"
+		"include_ext=jpg\n"
+		"exclude_comp=gz\n"
+		"exclude_comp=JpG\n"
+	);
+	assert_same(
+		"include=/\n"
+		"exclude_ext=bak\n"
+		"include_ext=gz\n"
+		"exclude_comp=gz\n"
+	);
+}
+END_TEST
+
+START_TEST(test_matcher_regex)
+{
+	assert_same(
+		"include=/\n"
+		"exclude_regex=\\.git$\n"
+		"exclude_regex=^/home/[^/]+/Downloads\n"
+		"exclude_regex=(a|b)\\.bak$\n"
+		"exclude_regex=/tmp/.*file\n"
+	);
+	// These cannot be joined together.
+	assert_same(
+		"include=/\n"
+		"exclude_regex=a[)]\n"
+		"exclude_regex=(x)\\1\n"
+		"exclude_regex=keep\n"
+	);
+}
+END_TEST
+
+// A few hundred rules of each kind.
+static char *many_rules(void)
+{
+	int i;
+	char *buf;
+	char line[128];
+	fail_unless((buf=(char *)calloc(1, 65536))!=NULL);
+	strcat(buf, "include=/\n");
+	for(i=0; i<300; i++)
+	{
+		snprintf(line, sizeof(line), "%s=/%s/%s%d\n",
+			i%2?"exclude":"include",
+			parts[i%ARR_LEN(parts)], parts[(i/3)%ARR_LEN(parts)], i);
+		strcat(buf, line);
+	}
+	for(i=0; i<100; i++)
+	{
+		snprintf(line, sizeof(line), "exclude_ext=e%d\n", i);
+		strcat(buf, line);
+	}
+	for(i=0; i<50; i++)
+	{
+		snprintf(line, sizeof(line), "exclude_regex=/r%d[a-z]+/\n", i);
+		strcat(buf, line);
+	}
+	fail_unless(strlen(buf)<65536);
+	return buf;
+}
+
+START_TEST(test_matcher_many_rules)
+{
+	char *buf=many_rules();
+	assert_same(buf);
+	free(buf);
+}
+END_TEST
+
+// Compares the speed of the two ways with a few hundred rules. The answers
+// have to come out the same as well.
+START_TEST(test_matcher_benchmark)
+{
+	int i;
+	int r;
+	int count=0;
+	int old_in=0;
+	int new_in=0;
+	char **paths;
+	double old_time;
+	double new_time;
+	char *buf=many_rules();
+	struct conf **confs;
+	struct matcher *matcher;
+
+	confs=setup(buf);
+	paths=make_paths(&count, 50000);
+	fail_unless((matcher=matcher_alloc(confs))!=NULL);
+
+	old_time=bench_now();
+	for(r=0; r<3; r++) for(i=0; i<count; i++)
+		old_in+=old_is_included(confs, paths[i]);
+	old_time=bench_now()-old_time;
+
+	new_time=bench_now();
+	for(r=0; r<3; r++) for(i=0; i<count; i++)
+		new_in+=matcher_is_included(matcher, paths[i]);
+	new_time=bench_now()-new_time;
+
+	bench_report("matcher", count*3, "paths",
+		"one rule at a time", old_time, "compiled", new_time);
+	fail_unless(old_in==new_in);
+
+	matcher_free(&matcher);
+	free_paths(paths, count);
+	free(buf);
+	tear_down(&confs);
+}
+END_TEST
+
+Suite *suite_client_matcher(void)
+{
+	Suite *s;
+	TCase *tc_core;
+	TCase *tc_bench;
+
+	s=suite_create("client_matcher");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_matcher_empty);
+	tcase_add_test(tc_core, test_matcher_dirs);
+	tcase_add_test(tc_core, test_matcher_exts);
+	tcase_add_test(tc_core, test_matcher_regex);
+	tcase_add_test(tc_core, test_matcher_many_rules);
+	suite_add_tcase(s, tc_core);
+
+	if(bench_wanted())
+	{
+		tc_bench=tcase_create("Benchmark");
+		tcase_set_timeout(tc_bench, 600);
+		tcase_add_test(tc_bench, test_matcher_benchmark);
+		suite_add_tcase(s, tc_bench);
+	}
+
+	return s;
+}
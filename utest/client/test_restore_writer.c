@@ -0,0 +1,247 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../test.h"
+#include "../../src/burp.h"
+#include "../../src/alloc.h"
+#include "../../src/bfile.h"
+#include "../../src/fsops.h"
+#include "../../src/client/restore_writer.h"
+
+#define BASE		"utest_restore_writer"
+#define FILES		20
+#define BUFMAX		1000
+
+static struct restore_writer *setup(void)
+{
+	struct restore_writer *rw;
+	alloc_counters_reset();
+	attribs_set_calls=0;
+	attribs_set_quiet_calls=0;
+	set_extrameta_quiet_calls=0;
+	logw_calls=0;
+	fail_unless(!recursive_delete(BASE, "", 1));
+	fail_unless(!mkdir(BASE, 0777));
+	fail_unless((rw=restore_writer_alloc(4, BUFMAX))!=NULL);
+	return rw;
+}
+
+static void tear_down(struct restore_writer **rw)
+{
+	restore_writer_free(rw);
+	fail_unless(*rw==NULL);
+	fail_unless(!recursive_delete(BASE, "", 1));
+	fail_unless(free_count==alloc_count);
+}
+
+static void make_path(char *path, size_t len, int i)
+{
+	snprintf(path, len, "%s/%d", BASE, i);
+}
+
+static void fill(char *buf, size_t len, int i)
+{
+	for(size_t j=0; j<len; j++) buf[j]='a'+(i+j)%26;
+}
+
+static int write_file(struct restore_writer *rw, const char *path,
+	const char *buf, size_t len)
+{
+	BFILE bfd;
+	bfile_init(&bfd, 0, NULL);
+	restore_writer_setup_bfd(rw, &bfd);
+	if(bfd.open(&bfd, NULL, path, O_WRONLY|O_CREAT|O_TRUNC, 0600))
+		return -1;
+	// In pieces, like it arrives from the server.
+	for(size_t done=0; done<len; done+=100)
+		fail_unless(bfd.write(&bfd, (void *)(buf+done),
+			len-done<100?len-done:100)>0);
+	return bfd.close(&bfd, NULL);
+}
+
+static void assert_content(const char *path, const char *buf, size_t len)
+{
+	FILE *fp;
+	char *got;
+	fail_unless((got=(char *)malloc(len+1))!=NULL);
+	fail_unless((fp=fopen(path, "rb"))!=NULL);
+	fail_unless(fread(got, 1, len+1, fp)==len);
+	fail_unless(!memcmp(got, buf, len));
+	fclose(fp);
+	free(got);
+}
+
+static void do_test_files(size_t len)
+{
+	char path[256];
+	char buf[BUFMAX*3];
+	struct restore_writer *rw=setup();
+	for(int i=0; i<FILES; i++)
+	{
+		make_path(path, sizeof(path), i);
+		fill(buf, len, i);
+		fail_unless(!write_file(rw, path, buf, len));
+	}
+	fail_unless(!restore_writer_flush(rw, NULL, NULL));
+	for(int i=0; i<FILES; i++)
+	{
+		make_path(path, sizeof(path), i);
+		fill(buf, len, i);
+		assert_content(path, buf, len);
+	}
+	// The attributes get set by the workers, once for each file.
+	fail_unless(attribs_set_quiet_calls==FILES);
+	fail_unless(!attribs_set_calls);
+	fail_unless(!logw_calls);
+	tear_down(&rw);
+}
+
+START_TEST(test_restore_writer_small_files)
+{
+	do_test_files(BUFMAX/2);
+}
+END_TEST
+
+START_TEST(test_restore_writer_big_files)
+{
+	// Too big to hold in memory, so written as they arrive.
+	do_test_files(BUFMAX*3);
+}
+END_TEST
+
+START_TEST(test_restore_writer_empty_files)
+{
+	do_test_files(0);
+}
+END_TEST
+
+static void do_test_open_fails(size_t len)
+{
+	char buf[BUFMAX*3];
+	struct restore_writer *rw=setup();
+	// The worker, or the main thread for a big file, finds out, and it
+	// gets reported when collected.
+	fill(buf, len, 0);
+	fail_unless(!write_file(rw, BASE "/no/such/dir", buf, len));
+	fail_unless(!restore_writer_flush(rw, NULL, NULL));
+	fail_unless(logw_calls==1);
+	fail_unless(!attribs_set_quiet_calls);
+	tear_down(&rw);
+}
+
+START_TEST(test_restore_writer_open_fails)
+{
+	do_test_open_fails(10);
+	do_test_open_fails(BUFMAX*3);
+}
+END_TEST
+
+START_TEST(test_restore_writer_write_fails)
+{
+	char buf[10];
+	struct restore_writer *rw=setup();
+	if(access("/dev/full", W_OK))
+	{
+		tear_down(&rw);
+		return;
+	}
+	// The worker finds out, and it gets reported when collected.
+	fill(buf, sizeof(buf), 0);
+	fail_unless(!write_file(rw, "/dev/full", buf, sizeof(buf)));
+	fail_unless(!restore_writer_flush(rw, NULL, NULL));
+	fail_unless(logw_calls==1);
+	fail_unless(!attribs_set_quiet_calls);
+	tear_down(&rw);
+}
+END_TEST
+
+START_TEST(test_restore_writer_metadata)
+{
+	char a[256];
+	char b[256];
+	char buf[10];
+	char *metadata=NULL;
+	struct restore_writer *rw=setup();
+	fill(buf, sizeof(buf), 0);
+	make_path(a, sizeof(a), 0);
+	make_path(b, sizeof(b), 1);
+
+	// The metadata for the last file goes with it to a worker.
+	fail_unless(!write_file(rw, a, buf, sizeof(buf)));
+	fail_unless((metadata=strdup_w("metadata", __func__))!=NULL);
+	fail_unless(restore_writer_add_meta(rw, NULL, NULL,
+		a, &metadata, 8)==1);
+	fail_unless(metadata==NULL);
+
+	// Not for the last file, so the caller sets it, once all the files
+	// are written.
+	fail_unless(!write_file(rw, b, buf, sizeof(buf)));
+	fail_unless((metadata=strdup_w("metadata", __func__))!=NULL);
+	fail_unless(!restore_writer_add_meta(rw, NULL, NULL,
+		a, &metadata, 8));
+	assert_content(a, buf, sizeof(buf));
+	assert_content(b, buf, sizeof(buf));
+	free_w(&metadata);
+
+	fail_unless(set_extrameta_quiet_calls==1);
+	fail_unless(attribs_set_quiet_calls==2);
+	fail_unless(!logw_calls);
+	tear_down(&rw);
+}
+END_TEST
+
+START_TEST(test_restore_writer_dirs)
+{
+	int i;
+	char path[256];
+	char buf[10];
+	struct stat statp;
+	struct restore_writer *rw=setup();
+	memset(&statp, 0, sizeof(statp));
+	fill(buf, sizeof(buf), 0);
+
+	// Directory attributes wait for the files to be written.
+	make_path(path, sizeof(path), 0);
+	fail_unless(!write_file(rw, path, buf, sizeof(buf)));
+	fail_unless(!restore_writer_add_dir(rw, NULL, NULL, BASE, &statp, 0));
+	fail_unless(!attribs_set_calls);
+	fail_unless(!restore_writer_flush(rw, NULL, NULL));
+	fail_unless(attribs_set_calls==1);
+	assert_content(path, buf, sizeof(buf));
+
+	// Not too many of them are kept.
+	for(i=0; i<RESTORE_WRITER_DIRS_MAX-1; i++)
+		fail_unless(!restore_writer_add_dir(rw,
+			NULL, NULL, BASE, &statp, 0));
+	fail_unless(attribs_set_calls==1);
+	fail_unless(!restore_writer_add_dir(rw, NULL, NULL, BASE, &statp, 0));
+	fail_unless(attribs_set_calls==1+RESTORE_WRITER_DIRS_MAX);
+	tear_down(&rw);
+}
+END_TEST
+
+Suite *suite_client_restore_writer(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_restore_writer");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_restore_writer_small_files);
+	tcase_add_test(tc_core, test_restore_writer_big_files);
+	tcase_add_test(tc_core, test_restore_writer_empty_files);
+	tcase_add_test(tc_core, test_restore_writer_open_fails);
+	tcase_add_test(tc_core, test_restore_writer_write_fails);
+	tcase_add_test(tc_core, test_restore_writer_metadata);
+	tcase_add_test(tc_core, test_restore_writer_dirs);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
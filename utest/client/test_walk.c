@@ -0,0 +1,430 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include "../test.h"
+#include "../../src/client/include.h"
+#include "../../src/alloc.h"
+#include "../../src/pathcmp.h"
+
+#define BASE		"utest_walk"
+#define FANOUT		4
+#define DEPTH		3
+
+static struct conf **confs;
+
+static void make_tree(const char *dir, int depth)
+{
+	int i;
+	FILE *fp;
+	char path[256];
+	fail_unless(!mkdir(dir, 0777));
+	for(i=0; i<FANOUT; i++)
+	{
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		fail_unless((fp=fopen(path, "wb"))!=NULL);
+		fprintf(fp, "%*s", i*100, "");
+		fail_unless(!fclose(fp));
+		if(depth<DEPTH)
+		{
+			snprintf(path, sizeof(path), "%s/dir%d", dir, i);
+			make_tree(path, depth+1);
+		}
+	}
+	snprintf(path, sizeof(path), "%s/link", dir);
+	fail_unless(!symlink("file0", path));
+	snprintf(path, sizeof(path), "%s/excluded", dir);
+	fail_unless(!mkdir(path, 0777));
+}
+
+static void setup(void)
+{
+	alloc_counters_reset();
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	make_tree(BASE, 0);
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+}
+
+static void tear_down(void)
+{
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(free_count==alloc_count);
+}
+
+// What the scan sees, one line per entry.
+struct seen
+{
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+static void see(struct seen *seen, const char *fmt, ...)
+{
+	int n;
+	va_list ap;
+	if(seen->alloc-seen->len<512)
+	{
+		seen->alloc=seen->alloc?seen->alloc*2:65536;
+		fail_unless((seen->buf=(char *)realloc(seen->buf,
+			seen->alloc))!=NULL);
+	}
+	va_start(ap, fmt);
+	n=vsnprintf(seen->buf+seen->len, seen->alloc-seen->len, fmt, ap);
+	va_end(ap);
+	seen->len+=n;
+}
+
+static void see_stat(struct seen *seen, const char *path, struct stat *statp)
+{
+	see(seen, "%s %o %lu %lu %ld\n", path,
+		(unsigned int)statp->st_mode, (unsigned long)statp->st_ino,
+		(unsigned long)statp->st_nlink, (long)statp->st_size);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return pathcmp(*(char **)a, *(char **)b);
+}
+
+// The scan as it was before the walker, for comparison.
+static void scan_plain(struct seen *seen, const char *dir)
+{
+	int i;
+	int count=0;
+	char *names[64];
+	char path[256];
+	DIR *d;
+	struct dirent *e;
+	struct stat statp;
+	fail_unless((d=opendir(dir))!=NULL);
+	while((e=readdir(d)))
+	{
+		if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+		fail_unless(count<64);
+		names[count++]=strdup(e->d_name);
+	}
+	closedir(d);
+	qsort(names, count, sizeof(char *), name_cmp);
+	for(i=0; i<count; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		if(file_is_included_no_incext(path))
+		{
+			fail_unless(!lstat(path, &statp));
+			see_stat(seen, path, &statp);
+			if(S_ISDIR(statp.st_mode))
+				scan_plain(seen, path);
+		}
+		else
+			see(seen, "%s\n", path);
+		free(names[i]);
+	}
+}
+
+// Like find_files(), going through the directories in order, but skipping
+// those that 'skip' says to.
+static void scan_walk(struct seen *seen, struct walk *walk, const char *dir,
+	const char *skip)
+{
+	int i;
+	char path[256];
+	struct walk_list *list=NULL;
+	fail_unless(!walk_get(walk, dir, 0, &list));
+	fail_unless(list!=NULL);
+	fail_unless(!list->noopen);
+	for(i=0; i<list->count; i++)
+	{
+		struct walk_ent *e=&list->ents[i];
+		snprintf(path, sizeof(path), "%s/%s", dir, e->name);
+		if(file_is_included_no_incext(path))
+		{
+			// Already looked at when it was read.
+			fail_unless(e->stat_done);
+			fail_unless(!e->stat_ret);
+			see_stat(seen, path, &e->statp);
+			if(S_ISDIR(e->statp.st_mode)
+			  && (!skip || !strstr(path, skip)))
+				scan_walk(seen, walk, path, skip);
+		}
+		else
+		{
+			// Not looked at, as the scan does not want it.
+			fail_unless(!e->stat_done);
+			see(seen, "%s\n", path);
+		}
+	}
+	walk_list_free(&list);
+}
+
+static void do_test_walk(int threads)
+{
+	struct seen plain;
+	struct seen walked;
+	struct walk *walk;
+	setup();
+	memset(&plain, 0, sizeof(plain));
+	memset(&walked, 0, sizeof(walked));
+	scan_plain(&plain, BASE);
+	fail_unless((walk=walk_alloc(threads, confs, NULL))!=NULL);
+	scan_walk(&walked, walk, BASE, NULL);
+	walk_free(&walk);
+	fail_unless(walk==NULL);
+	fail_unless(plain.len==walked.len);
+	fail_unless(!memcmp(plain.buf, walked.buf, plain.len));
+	free(plain.buf);
+	free(walked.buf);
+	tear_down();
+}
+
+START_TEST(test_walk_no_threads)
+{
+	do_test_walk(0);
+}
+END_TEST
+
+START_TEST(test_walk_one_thread)
+{
+	do_test_walk(1);
+}
+END_TEST
+
+START_TEST(test_walk_threads)
+{
+	// Fewer places to read ahead into than there are directories, so
+	// some get dropped again.
+	do_test_walk(4);
+}
+END_TEST
+
+START_TEST(test_walk_skipping)
+{
+	int i;
+	struct seen seen[2];
+	struct walk *walk;
+	setup();
+	// The scan does not go into some of the directories that were read
+	// ahead, so they get thrown away when it goes past them. Whatever
+	// it does go into still comes out the same.
+	for(i=0; i<2; i++)
+	{
+		memset(&seen[i], 0, sizeof(seen[i]));
+		fail_unless((walk=walk_alloc(i?4:0, confs, NULL))!=NULL);
+		scan_walk(&seen[i], walk, BASE, "dir1");
+		walk_free(&walk);
+	}
+	fail_unless(seen[0].len==seen[1].len);
+	fail_unless(!memcmp(seen[0].buf, seen[1].buf, seen[0].len));
+	free(seen[0].buf);
+	free(seen[1].buf);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_walk_stops_part_way)
+{
+	struct walk_list *list=NULL;
+	struct walk *walk;
+	setup();
+	// Freed with workers busy and directories still waiting to be read.
+	fail_unless((walk=walk_alloc(4, confs, NULL))!=NULL);
+	fail_unless(!walk_get(walk, BASE, 0, &list));
+	walk_list_free(&list);
+	walk_free(&walk);
+	fail_unless(walk==NULL);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_walk_no_directory)
+{
+	struct walk_list *list=NULL;
+	struct walk *walk;
+	setup();
+	fail_unless((walk=walk_alloc(4, confs, NULL))!=NULL);
+	fail_unless(!walk_get(walk, BASE "/no_such_dir", 0, &list));
+	fail_unless(list!=NULL);
+	fail_unless(list->noopen);
+	fail_unless(!list->count);
+	walk_list_free(&list);
+	walk_free(&walk);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_walk_not_a_directory)
+{
+	struct walk_list *list=NULL;
+	struct walk *walk;
+	setup();
+	// Turned away when opened, whether or not it keeps access times.
+	set_int(confs[OPT_ATIME], 0);
+	fail_unless((walk=walk_alloc(0, confs, NULL))!=NULL);
+	fail_unless(!walk_get(walk, BASE "/file0", 0, &list));
+	fail_unless(list->noopen);
+	walk_list_free(&list);
+	set_int(confs[OPT_ATIME], 1);
+	fail_unless(!walk_get(walk, BASE "/file1", 0, &list));
+	fail_unless(list->noopen);
+	walk_list_free(&list);
+	walk_free(&walk);
+	tear_down();
+}
+END_TEST
+
+// A directory that belongs to someone else cannot be opened with O_NOATIME,
+// but still gets listed.
+START_TEST(test_walk_not_owner)
+{
+	int status;
+	pid_t pid;
+	struct stat statp;
+	setup();
+	set_int(confs[OPT_ATIME], 0);
+	fail_unless(!stat("/", &statp));
+	fail_unless((pid=fork())>=0);
+	if(!pid)
+	{
+		struct walk_list *list=NULL;
+		struct walk *walk;
+		// Root may open anything with O_NOATIME.
+		if(!geteuid() && setuid(statp.st_uid==65534?65533:65534))
+			_exit(2);
+		// Nothing to try.
+		if(geteuid()==statp.st_uid) _exit(0);
+		if(!(walk=walk_alloc(0, confs, NULL))
+		  || walk_get(walk, "/", 0, &list)
+		  || list->noopen
+		  || !list->count)
+			_exit(1);
+		_exit(0);
+	}
+	fail_unless(waitpid(pid, &status, 0)==pid);
+	fail_unless(WIFEXITED(status));
+	ck_assert_int_eq(WEXITSTATUS(status), 0);
+	tear_down();
+}
+END_TEST
+
+#define BIG		BASE "/big"
+// Far more than fits in one go when reading the directory.
+#define BIG_ENTRIES	3000
+
+static void assert_same_stat(struct stat *a, struct stat *b)
+{
+	fail_unless(a->st_dev==b->st_dev);
+	fail_unless(a->st_ino==b->st_ino);
+	fail_unless(a->st_mode==b->st_mode);
+	fail_unless(a->st_nlink==b->st_nlink);
+	fail_unless(a->st_uid==b->st_uid);
+	fail_unless(a->st_gid==b->st_gid);
+	fail_unless(a->st_rdev==b->st_rdev);
+	fail_unless(a->st_size==b->st_size);
+	fail_unless(a->st_blocks==b->st_blocks);
+	fail_unless(a->st_atim.tv_sec==b->st_atim.tv_sec);
+	fail_unless(a->st_atim.tv_nsec==b->st_atim.tv_nsec);
+	fail_unless(a->st_mtim.tv_sec==b->st_mtim.tv_sec);
+	fail_unless(a->st_mtim.tv_nsec==b->st_mtim.tv_nsec);
+	fail_unless(a->st_ctim.tv_sec==b->st_ctim.tv_sec);
+	fail_unless(a->st_ctim.tv_nsec==b->st_ctim.tv_nsec);
+}
+
+static void make_big_dir(void)
+{
+	int i;
+	FILE *fp;
+	char path[256];
+	fail_unless(!mkdir(BIG, 0777));
+	for(i=0; i<BIG_ENTRIES; i++)
+	{
+		snprintf(path, sizeof(path),
+			"%s/a_long_enough_name_for_the_entry_%05d", BIG, i);
+		switch(i%5)
+		{
+			case 0:
+				fail_unless(!mkdir(path, 0750));
+				break;
+			case 1:
+				fail_unless(!symlink("somewhere", path));
+				break;
+			case 2:
+				fail_unless(!mkfifo(path, 0640));
+				break;
+			default:
+				fail_unless((fp=fopen(path, "wb"))!=NULL);
+				fprintf(fp, "%*s", i, "");
+				fail_unless(!fclose(fp));
+				break;
+		}
+	}
+	// A hard link, and a device if allowed to make one.
+	fail_unless(!link(BIG "/a_long_enough_name_for_the_entry_00003",
+		BIG "/hardlink"));
+	mknod(BIG "/device", S_IFCHR|0600, makedev(1, 3));
+}
+
+START_TEST(test_walk_big_directory)
+{
+	int i;
+	int threads;
+	char path[256];
+	struct stat statp;
+	struct walk_list *list=NULL;
+	struct walk *walk;
+	setup();
+	make_big_dir();
+	for(threads=0; threads<=4; threads+=4)
+	{
+		fail_unless((walk=walk_alloc(threads, confs, NULL))!=NULL);
+		fail_unless(!walk_get(walk, BIG, 0, &list));
+		fail_unless(!list->noopen);
+		fail_unless(list->count==BIG_ENTRIES+1+!lstat(BIG "/device",
+			&statp));
+		for(i=0; i<list->count; i++)
+		{
+			struct walk_ent *e=&list->ents[i];
+			if(i) fail_unless(pathcmp(list->ents[i-1].name,
+				e->name)<0);
+			snprintf(path, sizeof(path), "%s/%s", BIG, e->name);
+			fail_unless(e->stat_done);
+			fail_unless(!e->stat_ret);
+			fail_unless(!lstat(path, &statp));
+			assert_same_stat(&e->statp, &statp);
+		}
+		walk_list_free(&list);
+		walk_free(&walk);
+	}
+	tear_down();
+}
+END_TEST
+
+Suite *suite_client_walk(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_walk");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_walk_no_threads);
+	tcase_add_test(tc_core, test_walk_one_thread);
+	tcase_add_test(tc_core, test_walk_threads);
+	tcase_add_test(tc_core, test_walk_skipping);
+	tcase_add_test(tc_core, test_walk_stops_part_way);
+	tcase_add_test(tc_core, test_walk_no_directory);
+	tcase_add_test(tc_core, test_walk_not_a_directory);
+	tcase_add_test(tc_core, test_walk_not_owner);
+	tcase_add_test(tc_core, test_walk_big_directory);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
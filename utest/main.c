@@ -9,15 +9,39 @@ int main(void)
 
 	sr=srunner_create(NULL);
 	srunner_add_suite(sr, suite_alloc());
+	srunner_add_suite(sr, suite_asfd());
 	srunner_add_suite(sr, suite_base64());
+	srunner_add_suite(sr, suite_bfile());
 	srunner_add_suite(sr, suite_cmd());
 	srunner_add_suite(sr, suite_conf());
 	srunner_add_suite(sr, suite_conffile());
+	srunner_add_suite(sr, suite_fsops());
 	srunner_add_suite(sr, suite_hexmap());
+	srunner_add_suite(sr, suite_linkhash());
 	srunner_add_suite(sr, suite_pathcmp());
+	srunner_add_suite(sr, suite_throttle());
+	srunner_add_suite(sr, suite_workq());
+	srunner_add_suite(sr, suite_client_journal());
+	srunner_add_suite(sr, suite_client_matcher());
+	srunner_add_suite(sr, suite_client_restore_writer());
+	srunner_add_suite(sr, suite_client_walk());
+	srunner_add_suite(sr, suite_client_protocol1_deltas());
+	srunner_add_suite(sr, suite_client_protocol1_metacache());
+	srunner_add_suite(sr, suite_client_protocol1_prefetch());
+	srunner_add_suite(sr, suite_protocol1_enc());
+	srunner_add_suite(sr, suite_protocol1_pgzip());
+	srunner_add_suite(sr, suite_protocol2_append());
+	srunner_add_suite(sr, suite_protocol2_bloom());
 	srunner_add_suite(sr, suite_server_sdirs());
+	srunner_add_suite(sr, suite_server_protocol1_backup_phase4());
+	srunner_add_suite(sr, suite_server_protocol1_bedup());
+	srunner_add_suite(sr, suite_server_protocol1_codecio());
 	srunner_add_suite(sr, suite_server_protocol1_dpth());
 	srunner_add_suite(sr, suite_server_protocol1_fdirs());
+	srunner_add_suite(sr, suite_server_protocol1_hlindex());
+	srunner_add_suite(sr, suite_server_protocol1_metaref());
+	srunner_add_suite(sr, suite_server_protocol1_zlibio());
+	srunner_add_suite(sr, suite_server_protocol2_sigref());
 	// Do these last, as they have slight delays.
 	srunner_add_suite(sr, suite_server_protocol2_dpth());
 	srunner_add_suite(sr, suite_lock());
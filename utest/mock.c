@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
+#include <stdint.h>
+#include "../src/include.h"
+#include "../src/alloc.h"
+#include "../src/protocol1/rs_buf.h"
 void logp(const char *fmt, ...)
 {
 /*
@@ -12,11 +16,46 @@ void logp(const char *fmt, ...)
 */
 }
 void logc(const char *fmt, ...) { }
+void logp_ssl_err(const char *fmt, ...) { }
 void log_oom_w(const char *func, const char *orig_func) { }
 void log_out_of_memory(const char *function) { }
-const char *getdatestr(time_t t) { return ""; }
-const char *time_taken(time_t d) { return ""; }
+const char *prog="utest";
 const char *progname(void) { return "utest"; }
 
 int blk_read_verify(struct blk *blk_to_verify, struct conf **confs)
 	{ return 0; }
+uint64_t blk_fingerprint(const char *data, uint32_t length)
+	{ return 0; }
+int attribs_set_calls=0;
+int attribs_set(struct asfd *asfd, const char *path,
+	struct stat *statp, uint64_t winattr, struct conf **confs)
+		{ attribs_set_calls++; return 0; }
+// These two get called from the restore writer's threads.
+int attribs_set_quiet_calls=0;
+int attribs_set_quiet(const char *path, struct stat *statp,
+	const char **failed)
+		{ __sync_fetch_and_add(&attribs_set_quiet_calls, 1); return 0; }
+int set_extrameta_quiet_calls=0;
+int set_extrameta_quiet(const char *path,
+	const char *extrameta, size_t metalen, const char **failed)
+		{ __sync_fetch_and_add(&set_extrameta_quiet_calls, 1); return 0; }
+int logw_calls=0;
+int logw(struct asfd *asfd, struct conf **confs, const char *fmt, ...)
+	{ logw_calls++; return 0; }
+int set_logfp(const char *path, struct conf **confs) { return 0; }
+void log_and_send(struct asfd *asfd, const char *msg) { }
+void log_and_send_oom(struct asfd *asfd, const char *function) { }
+int attribs_encode(struct sbuf *sb) { return 0; }
+void attribs_decode(struct sbuf *sb) { }
+int is_hook(uint64_t fingerprint) { return 0; }
+int rblk_retrieve_data(const char *datpath, struct blk *blk) { return -1; }
+int write_status(enum cntr_status cntr_status,
+	const char *path, struct conf **confs) { return 0; }
+rs_result rs_build_hash_table(rs_signature_t *sums) { return RS_DONE; }
+void rs_free_sumset(rs_signature_t *sums) { }
+rs_result rs_job_free(rs_job_t *job) { return RS_DONE; }
+// Tests that need a filebuf make one with calloc_w().
+void rs_filebuf_free(rs_filebuf_t *fb) { free_v((void **)&fb); }
+// Stand-in for the include and exclude rules of the scan.
+int file_is_included_no_incext(const char *fname)
+	{ return !strstr(fname, "excluded"); }
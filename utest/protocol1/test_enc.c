@@ -0,0 +1,227 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/protocol1/enc.h"
+
+#define PASSWORD	"my secret password"
+
+struct buf
+{
+	uint8_t *data;
+	size_t len;
+};
+
+static void append(struct buf *b, uint8_t *data, size_t len)
+{
+	fail_unless((b->data=(uint8_t *)
+		realloc(b->data, b->len+len+1))!=NULL);
+	memcpy(b->data+b->len, data, len);
+	b->len+=len;
+}
+
+static uint8_t *make_data(size_t len)
+{
+	size_t i;
+	uint8_t *data;
+	fail_unless((data=(uint8_t *)malloc(len?len:1))!=NULL);
+	srand(len);
+	for(i=0; i<len; i++)
+		data[i]=(uint8_t)rand();
+	return data;
+}
+
+// Feeds 'in' through in pieces of 'chunk', so that the chunk and header
+// boundaries get crossed in different places.
+static int run_enc(int encrypt, const char *password, enum enc_cipher cipher,
+	uint8_t *in, size_t len, size_t chunk, struct buf *out)
+{
+	int ret=-1;
+	size_t done=0;
+	size_t outlen;
+	uint8_t *o;
+	struct enc *enc;
+
+	memset(out, 0, sizeof(*out));
+	fail_unless((enc=enc_alloc(encrypt, password, cipher))!=NULL);
+	while(done<len)
+	{
+		size_t n=len-done<chunk?len-done:chunk;
+		if(enc_update(enc, in+done, n, &o, &outlen)) goto end;
+		append(out, o, outlen);
+		done+=n;
+	}
+	if(enc_final(enc, &o, &outlen)) goto end;
+	append(out, o, outlen);
+	ret=0;
+end:
+	enc_free(&enc);
+	fail_unless(enc==NULL);
+	return ret;
+}
+
+static void round_trip(size_t len, size_t chunk)
+{
+	uint8_t *data;
+	struct buf e;
+	struct buf d;
+
+	alloc_counters_reset();
+	data=make_data(len);
+	fail_unless(!run_enc(1, PASSWORD, ENC_CIPHER_AES_256_GCM,
+		data, len, chunk, &e));
+	fail_unless(e.len==ENC_HEADER_LEN+len
+		+(len/ENC_CHUNK+(len%ENC_CHUNK?1:0)+(len?0:1))*ENC_TAG_LEN);
+	fail_unless(!memcmp(e.data, ENC_MAGIC, ENC_MAGIC_LEN));
+	fail_unless(!run_enc(0, PASSWORD, ENC_CIPHER_BLOWFISH,
+		e.data, e.len, chunk, &d));
+	fail_unless(d.len==len);
+	fail_unless(!len || !memcmp(d.data, data, len));
+	fail_unless(free_count==alloc_count);
+	free(e.data);
+	free(d.data);
+	free(data);
+}
+
+START_TEST(test_enc_round_trip)
+{
+	round_trip(0, 100);
+	round_trip(1, 100);
+	round_trip(1000, 3);
+	round_trip(ENC_CHUNK, 16000);
+	round_trip(ENC_CHUNK+1, 16000);
+	round_trip(ENC_CHUNK*3, ENC_CHUNK);
+	round_trip(ENC_CHUNK*4+12345, 7777);
+}
+END_TEST
+
+START_TEST(test_enc_salted)
+{
+	uint8_t data[100];
+	struct buf a;
+	struct buf b;
+	memset(data, 'x', sizeof(data));
+	fail_unless(!run_enc(1, PASSWORD, ENC_CIPHER_AES_256_GCM,
+		data, sizeof(data), 100, &a));
+	fail_unless(!run_enc(1, PASSWORD, ENC_CIPHER_AES_256_GCM,
+		data, sizeof(data), 100, &b));
+	fail_unless(a.len==b.len);
+	fail_unless(memcmp(a.data, b.data, a.len));
+	free(a.data);
+	free(b.data);
+}
+END_TEST
+
+static void assert_fails(struct buf *e, const char *password)
+{
+	struct buf d;
+	fail_unless(run_enc(0, password, ENC_CIPHER_BLOWFISH,
+		e->data, e->len, 5000, &d)==-1);
+	free(d.data);
+}
+
+START_TEST(test_enc_tampered)
+{
+	size_t len=ENC_CHUNK*2+100;
+	uint8_t *data=make_data(len);
+	struct buf e;
+	fail_unless(!run_enc(1, PASSWORD, ENC_CIPHER_AES_256_GCM,
+		data, len, 16000, &e));
+
+	// Wrong password.
+	assert_fails(&e, "not my password");
+
+	// A flipped bit in the data, and in the salt.
+	e.data[ENC_HEADER_LEN+ENC_CHUNK+5]^=1;
+	assert_fails(&e, PASSWORD);
+	e.data[ENC_HEADER_LEN+ENC_CHUNK+5]^=1;
+	e.data[ENC_MAGIC_LEN+4]^=1;
+	assert_fails(&e, PASSWORD);
+	e.data[ENC_MAGIC_LEN+4]^=1;
+
+	// Cut short, both in the middle of a chunk and on a chunk boundary.
+	e.len-=10;
+	assert_fails(&e, PASSWORD);
+	e.len=ENC_HEADER_LEN+(ENC_CHUNK+ENC_TAG_LEN)*2;
+	assert_fails(&e, PASSWORD);
+	e.len=ENC_HEADER_LEN-1;
+	assert_fails(&e, PASSWORD);
+
+	free(e.data);
+	free(data);
+}
+END_TEST
+
+START_TEST(test_enc_unknown_version)
+{
+	uint8_t data[10]={0};
+	struct buf e;
+	fail_unless(!run_enc(1, PASSWORD, ENC_CIPHER_AES_256_GCM,
+		data, sizeof(data), 10, &e));
+	e.data[ENC_MAGIC_LEN]=ENC_VERSION+1;
+	assert_fails(&e, PASSWORD);
+	free(e.data);
+}
+END_TEST
+
+START_TEST(test_enc_blowfish)
+{
+	size_t len=100000;
+	uint8_t *data=make_data(len);
+	struct enc *enc;
+	struct buf e;
+	struct buf d;
+
+	// Blowfish may not be available from the crypto library at all.
+	if(!(enc=enc_alloc(1, PASSWORD, ENC_CIPHER_BLOWFISH)))
+	{
+		free(data);
+		return;
+	}
+	enc_free(&enc);
+
+	// The old format has no header, and is still read.
+	fail_unless(!run_enc(1, PASSWORD, ENC_CIPHER_BLOWFISH,
+		data, len, 16000, &e));
+	fail_unless(memcmp(e.data, ENC_MAGIC, ENC_MAGIC_LEN));
+	fail_unless(!run_enc(0, PASSWORD, ENC_CIPHER_AES_256_GCM,
+		e.data, e.len, 3, &d));
+	fail_unless(d.len==len);
+	fail_unless(!memcmp(d.data, data, len));
+	free(e.data);
+	free(d.data);
+	free(data);
+}
+END_TEST
+
+START_TEST(test_enc_cipher_parse)
+{
+	fail_unless(enc_cipher_parse("blowfish")==ENC_CIPHER_BLOWFISH);
+	fail_unless(enc_cipher_parse("aes-256-gcm")==ENC_CIPHER_AES_256_GCM);
+	fail_unless(enc_cipher_parse("aes")==-1);
+	ck_assert_str_eq(enc_cipher_name(ENC_CIPHER_AES_256_GCM),
+		"aes-256-gcm");
+}
+END_TEST
+
+Suite *suite_protocol1_enc(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("protocol1_enc");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_enc_round_trip);
+	tcase_add_test(tc_core, test_enc_salted);
+	tcase_add_test(tc_core, test_enc_tampered);
+	tcase_add_test(tc_core, test_enc_unknown_version);
+	tcase_add_test(tc_core, test_enc_blowfish);
+	tcase_add_test(tc_core, test_enc_cipher_parse);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
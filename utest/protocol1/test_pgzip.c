@@ -0,0 +1,169 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/protocol1/pgzip.h"
+
+struct sink
+{
+	uint8_t *buf;
+	size_t len;
+	int calls;
+	int stop_after;
+};
+
+static int to_sink(void *arg, uint8_t *buf, size_t len)
+{
+	struct sink *sink=(struct sink *)arg;
+	fail_unless((sink->buf=(uint8_t *)
+		realloc(sink->buf, sink->len+len))!=NULL);
+	memcpy(sink->buf+sink->len, buf, len);
+	sink->len+=len;
+	if(sink->stop_after && ++sink->calls>=sink->stop_after)
+		return 1;
+	return 0;
+}
+
+static uint8_t *make_data(size_t len)
+{
+	size_t i;
+	uint8_t *data;
+	fail_unless((data=(uint8_t *)malloc(len?len:1))!=NULL);
+	// Some of it repeats, some of it does not.
+	srand(len);
+	for(i=0; i<len; i++)
+		data[i]=(i%3)?(uint8_t)rand():(uint8_t)(i/4096);
+	return data;
+}
+
+static void assert_inflates_to(struct sink *sink, uint8_t *data, size_t len)
+{
+	z_stream strm;
+	uint8_t *out;
+
+	fail_unless((out=(uint8_t *)malloc(len+1))!=NULL);
+	memset(&strm, 0, sizeof(strm));
+	fail_unless(inflateInit2(&strm, 15+16)==Z_OK);
+	strm.next_in=sink->buf;
+	strm.avail_in=sink->len;
+	strm.next_out=out;
+	strm.avail_out=len+1;
+	// Z_STREAM_END means that the crc and length in the trailer matched.
+	fail_unless(inflate(&strm, Z_FINISH)==Z_STREAM_END);
+	fail_unless(strm.avail_in==0);
+	fail_unless(strm.total_out==len);
+	fail_unless(!memcmp(out, data, len));
+	inflateEnd(&strm);
+	free(out);
+}
+
+static void run_pgz(int threads, size_t len, size_t chunk)
+{
+	size_t done=0;
+	uint8_t *data;
+	struct pgz *pgz;
+	struct sink sink;
+
+	memset(&sink, 0, sizeof(sink));
+	data=make_data(len);
+	fail_unless((pgz=pgz_alloc(threads, 6, to_sink, &sink))!=NULL);
+	while(done<len)
+	{
+		size_t n=len-done<chunk?len-done:chunk;
+		fail_unless(!pgz_write(pgz, data+done, n));
+		done+=n;
+	}
+	fail_unless(!pgz_close(pgz));
+	pgz_free(&pgz);
+	fail_unless(pgz==NULL);
+	fail_unless(free_count==alloc_count);
+
+	assert_inflates_to(&sink, data, len);
+	free(sink.buf);
+	free(data);
+}
+
+START_TEST(test_pgz_empty)
+{
+	run_pgz(2, 0, 100);
+}
+END_TEST
+
+START_TEST(test_pgz_small)
+{
+	run_pgz(2, 1000, 100);
+}
+END_TEST
+
+START_TEST(test_pgz_block_edges)
+{
+	run_pgz(3, PGZ_BLOCK, 4096);
+	run_pgz(3, PGZ_BLOCK*2, PGZ_BLOCK);
+	run_pgz(3, PGZ_BLOCK*3+17, 7777);
+}
+END_TEST
+
+START_TEST(test_pgz_many_blocks)
+{
+	run_pgz(4, PGZ_BLOCK*20+12345, 65536);
+}
+END_TEST
+
+START_TEST(test_pgz_no_threads)
+{
+	run_pgz(0, PGZ_BLOCK*5+1, 65536);
+}
+END_TEST
+
+START_TEST(test_pgz_stop)
+{
+	int r=0;
+	size_t done=0;
+	size_t len=PGZ_BLOCK*10;
+	uint8_t *data;
+	struct pgz *pgz;
+	struct sink sink;
+
+	memset(&sink, 0, sizeof(sink));
+	sink.stop_after=2;
+	data=make_data(len);
+	fail_unless((pgz=pgz_alloc(2, 6, to_sink, &sink))!=NULL);
+	while(!r && done<len)
+	{
+		r=pgz_write(pgz, data+done, 65536);
+		done+=65536;
+	}
+	if(!r) r=pgz_close(pgz);
+	fail_unless(r==1);
+	fail_unless(sink.calls==2);
+	fail_unless(pgz_write(pgz, data, 1)==1);
+	fail_unless(pgz_close(pgz)==1);
+	pgz_free(&pgz);
+	fail_unless(free_count==alloc_count);
+	free(sink.buf);
+	free(data);
+}
+END_TEST
+
+Suite *suite_protocol1_pgzip(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("protocol1_pgzip");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_pgz_empty);
+	tcase_add_test(tc_core, test_pgz_small);
+	tcase_add_test(tc_core, test_pgz_block_edges);
+	tcase_add_test(tc_core, test_pgz_many_blocks);
+	tcase_add_test(tc_core, test_pgz_no_threads);
+	tcase_add_test(tc_core, test_pgz_stop);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
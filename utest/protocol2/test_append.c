@@ -0,0 +1,363 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <openssl/md5.h>
+#include "../test.h"
+#include "../../src/protocol2/include.h"
+#include "../../src/alloc.h"
+#include "../../src/cmd.h"
+#include "../../src/fsops.h"
+#include "../../src/hexmap.h"
+#include "../../src/protocol2/append.h"
+
+#define BASE		"utest_append"
+#define FILE_PATH	BASE "/file"
+#define BLKS		4
+#define BLK_LEN		1000
+#define OLD_SIZE	(BLKS*BLK_LEN)
+
+// What the server has, and what the client has.
+static struct sbuf *ssb;
+static struct sbuf *csb;
+static char content[OLD_SIZE*2];
+
+static void setup(void)
+{
+	int i;
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(!mkdir(BASE, 0777));
+	hexmap_init();
+	for(i=0; i<(int)sizeof(content); i++)
+		content[i]=(char)(i*7+i/13);
+	fail_unless((ssb=sbuf_alloc_protocol(PROTO_2))!=NULL);
+	fail_unless((csb=sbuf_alloc_protocol(PROTO_2))!=NULL);
+	csb->protocol2->bfd.fd=-1;
+	alloc_counters_reset();
+}
+
+static void tear_down(void)
+{
+	sbuf_protocol2_free_content(ssb->protocol2);
+	sbuf_protocol2_free_content(csb->protocol2);
+	if(csb->protocol2->bfd.fd>=0)
+		fail_unless(!close(csb->protocol2->bfd.fd));
+	fail_unless(free_count==alloc_count);
+	sbuf_free(&ssb);
+	sbuf_free(&csb);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+}
+
+static void md5_of(uint8_t *md5sum, const char *buf, size_t len)
+{
+	MD5_CTX md5;
+	MD5_Init(&md5);
+	MD5_Update(&md5, buf, len);
+	MD5_Final(md5sum, &md5);
+}
+
+// The sigs of the file as it was in the last backup.
+static void keep_sigs(int n, struct blk **tail, int *count)
+{
+	int i;
+	struct blk blk;
+	memset(&blk, 0, sizeof(blk));
+	ssb->protocol2->prefix_size=OLD_SIZE;
+	for(i=0; i<n; i++)
+	{
+		blk.fingerprint=i;
+		md5_of(blk.md5sum, content+(i%BLKS)*BLK_LEN, BLK_LEN);
+		memset(blk.savepath, i, SAVE_PATH_LEN);
+		fail_unless(!append_keep_sig(ssb->protocol2, &blk,
+			tail, count));
+	}
+}
+
+static int count_prefix(struct blk *b)
+{
+	int n=0;
+	for(; b; b=b->next) n++;
+	return n;
+}
+
+// The file as the client sees it now, open as it would be for reading.
+static void write_file(size_t size)
+{
+	FILE *fp;
+	struct protocol2 *protocol2=csb->protocol2;
+	fail_unless((fp=fopen(FILE_PATH, "wb"))!=NULL);
+	fail_unless(fwrite(content, 1, size, fp)==size);
+	fail_unless(!fclose(fp));
+	fail_unless((protocol2->bfd.fd=open(FILE_PATH, O_RDONLY))>=0);
+	fail_unless(!fstat(protocol2->bfd.fd, &csb->statp));
+}
+
+// The server asks about the file, and the client checks it.
+static void ask(void)
+{
+	char msg[128];
+	struct iobuf rbuf;
+	fail_unless(!append_request(ssb->protocol2, BLK_LEN, BLK_LEN,
+		msg, sizeof(msg)));
+	fail_unless(ssb->protocol2->append_offset==OLD_SIZE-BLK_LEN);
+	iobuf_from_str(&rbuf, CMD_APPEND_FROM, msg);
+	fail_unless(!append_parse(csb->protocol2, &rbuf));
+	fail_unless(csb->protocol2->append_offset==OLD_SIZE-BLK_LEN);
+	fail_unless(csb->protocol2->append_length==BLK_LEN);
+	fail_unless(!memcmp(csb->protocol2->append_md5sum,
+		ssb->protocol2->append_md5sum, MD5_DIGEST_LENGTH));
+	fail_unless(csb->protocol2->append_first_length==BLK_LEN);
+	fail_unless(!memcmp(csb->protocol2->append_first_md5sum,
+		ssb->protocol2->append_first_md5sum, MD5_DIGEST_LENGTH));
+	fail_unless(!append_check(csb));
+}
+
+static int confirm(const char *offset)
+{
+	struct iobuf rbuf;
+	iobuf_from_str(&rbuf, CMD_APPEND_FROM, (char *)offset);
+	return append_confirm(ssb, &rbuf);
+}
+
+START_TEST(test_append_verified)
+{
+	int i;
+	int count=0;
+	char offset[32];
+	struct blk *b;
+	struct blk *tail=NULL;
+	setup();
+	keep_sigs(BLKS, &tail, &count);
+	write_file(OLD_SIZE+BLK_LEN/2);
+	ask();
+
+	// Carries on from the start of the last old block.
+	fail_unless(csb->flags & SBUF_APPENDED);
+	fail_unless(csb->protocol2->bfd.pos==OLD_SIZE-BLK_LEN);
+	fail_unless(lseek(csb->protocol2->bfd.fd, 0, SEEK_CUR)
+		==OLD_SIZE-BLK_LEN);
+
+	// Only the offset that was asked for will do.
+	fail_unless(confirm("0")==-1);
+	snprintf(offset, sizeof(offset), "%x", OLD_SIZE-BLK_LEN);
+	fail_unless(!confirm(offset));
+
+	// All but the last of the old sigs go in the new manifest.
+	b=append_prefix(ssb);
+	fail_unless(count_prefix(b)==BLKS-1);
+	for(i=0; b; b=b->next, i++)
+	{
+		uint8_t md5sum[MD5_DIGEST_LENGTH];
+		md5_of(md5sum, content+i*BLK_LEN, BLK_LEN);
+		fail_unless(!memcmp(b->md5sum, md5sum, MD5_DIGEST_LENGTH));
+		fail_unless(b->fingerprint==(uint64_t)i);
+		fail_unless(b->got==BLK_GOT);
+		fail_unless(b->got_save_path);
+	}
+	fail_unless(!(ssb->flags & SBUF_APPENDED));
+	tear_down();
+}
+END_TEST
+
+static void do_test_changed(size_t where)
+{
+	int count=0;
+	struct blk *tail=NULL;
+	setup();
+	keep_sigs(BLKS, &tail, &count);
+	content[where]^=0xff;
+	write_file(OLD_SIZE+BLK_LEN/2);
+	ask();
+
+	// Reads the whole file, and does not say otherwise.
+	fail_unless(!(csb->flags & SBUF_APPENDED));
+	fail_unless(!csb->protocol2->append_length);
+	fail_unless(lseek(csb->protocol2->bfd.fd, 0, SEEK_CUR)==0);
+
+	// So the kept sigs are dropped.
+	fail_unless(append_prefix(ssb)==NULL);
+	fail_unless(ssb->protocol2->prefix==NULL);
+	tear_down();
+}
+
+START_TEST(test_append_md5_mismatch)
+{
+	// Something in the last old block has changed.
+	do_test_changed(OLD_SIZE-1);
+}
+END_TEST
+
+START_TEST(test_append_first_changed)
+{
+	// Changed in place at the start, like a database header, as well as
+	// added to.
+	do_test_changed(10);
+}
+END_TEST
+
+START_TEST(test_append_shrunk)
+{
+	int count=0;
+	struct blk *tail=NULL;
+	setup();
+	keep_sigs(BLKS, &tail, &count);
+	write_file(OLD_SIZE-1);
+	ask();
+	fail_unless(!(csb->flags & SBUF_APPENDED));
+	fail_unless(!csb->protocol2->append_length);
+	fail_unless(lseek(csb->protocol2->bfd.fd, 0, SEEK_CUR)==0);
+	fail_unless(append_prefix(ssb)==NULL);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_append_one_blk)
+{
+	int count=0;
+	struct blk *tail=NULL;
+	setup();
+	keep_sigs(1, &tail, &count);
+	ssb->flags|=SBUF_APPENDED;
+	// The only old one is sent again.
+	fail_unless(append_prefix(ssb)==NULL);
+	fail_unless(ssb->protocol2->prefix==NULL);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_append_bad_length)
+{
+	int count=0;
+	char msg[128];
+	struct blk *tail=NULL;
+	setup();
+	// The data store did not have the last block, or it was too big.
+	keep_sigs(BLKS, &tail, &count);
+	fail_unless(append_request(ssb->protocol2, BLK_LEN, 0,
+		msg, sizeof(msg))==-1);
+	fail_unless(ssb->protocol2->prefix==NULL);
+	tail=NULL;
+	count=0;
+	keep_sigs(BLKS, &tail, &count);
+	fail_unless(append_request(ssb->protocol2, BLK_LEN, OLD_SIZE+1,
+		msg, sizeof(msg))==-1);
+	fail_unless(ssb->protocol2->prefix==NULL);
+	tail=NULL;
+	count=0;
+	keep_sigs(BLKS, &tail, &count);
+	fail_unless(append_request(ssb->protocol2, 0, BLK_LEN,
+		msg, sizeof(msg))==-1);
+	fail_unless(ssb->protocol2->prefix==NULL);
+	// The first block would run into the last one.
+	tail=NULL;
+	count=0;
+	keep_sigs(BLKS, &tail, &count);
+	fail_unless(append_request(ssb->protocol2, OLD_SIZE-BLK_LEN+1, BLK_LEN,
+		msg, sizeof(msg))==-1);
+	fail_unless(ssb->protocol2->prefix==NULL);
+	// Nothing kept, nothing to ask.
+	fail_unless(append_request(ssb->protocol2, BLK_LEN, BLK_LEN,
+		msg, sizeof(msg))==-1);
+	fail_unless(confirm("0")==-1);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_append_prefix_sigs_max)
+{
+	int count=0;
+	struct blk *tail=NULL;
+	setup();
+	keep_sigs(PREFIX_SIGS_MAX, &tail, &count);
+	fail_unless(count==PREFIX_SIGS_MAX);
+	fail_unless(count_prefix(ssb->protocol2->prefix)==PREFIX_SIGS_MAX);
+
+	// One more, and none are kept, nor any after that.
+	keep_sigs(10, &tail, &count);
+	fail_unless(count==-1);
+	fail_unless(tail==NULL);
+	fail_unless(ssb->protocol2->prefix==NULL);
+	fail_unless(free_count==alloc_count);
+	tear_down();
+}
+END_TEST
+
+static int parse(const char *str)
+{
+	struct iobuf rbuf;
+	iobuf_from_str(&rbuf, CMD_APPEND_FROM, (char *)str);
+	return append_parse(csb->protocol2, &rbuf);
+}
+
+START_TEST(test_append_parse)
+{
+	struct iobuf rbuf;
+	setup();
+#define MD5X	"0123456789abcdef0123456789abcdef"
+	fail_unless(!parse("a:3e8:0123456789abcdef0123456789ABCDEF:"
+		"64:fedcba9876543210fedcba9876543210"));
+	fail_unless(csb->protocol2->append_offset==10);
+	fail_unless(csb->protocol2->append_length==1000);
+	fail_unless(csb->protocol2->append_md5sum[0]==0x01);
+	fail_unless(csb->protocol2->append_md5sum[15]==0xef);
+	fail_unless(csb->protocol2->append_first_length==100);
+	fail_unless(csb->protocol2->append_first_md5sum[0]==0xfe);
+	fail_unless(csb->protocol2->append_first_md5sum[15]==0x10);
+
+	fail_unless(parse("")==-1);
+	fail_unless(parse("junk")==-1);
+	fail_unless(parse("a")==-1);
+	fail_unless(parse("a:3e8")==-1);
+	fail_unless(parse("a:3e8:")==-1);
+	// Without the first block.
+	fail_unless(parse("a:3e8:" MD5X)==-1);
+	fail_unless(parse("a:3e8:" MD5X ":")==-1);
+	fail_unless(parse("a:3e8:" MD5X ":64")==-1);
+	fail_unless(parse("a:3e8:" MD5X ":64:")==-1);
+	fail_unless(parse("x:3e8:" MD5X ":64:" MD5X)==-1);
+	fail_unless(parse("a:zz:" MD5X ":64:" MD5X)==-1);
+	fail_unless(parse("a:3e8:" MD5X ":zz:" MD5X)==-1);
+	// No length.
+	fail_unless(parse("a:0:" MD5X ":64:" MD5X)==-1);
+	fail_unless(parse("a:3e8:" MD5X ":0:" MD5X)==-1);
+	// Too short, too long, or not hex.
+	fail_unless(parse("a:3e8:0123456789abcdef0123456789abcde:64:" MD5X)
+		==-1);
+	fail_unless(parse("a:3e8:" MD5X "0:64:" MD5X)==-1);
+	fail_unless(parse("a:3e8:0123456789abcdef0123456789abcdeg:64:" MD5X)
+		==-1);
+	fail_unless(parse("a:3e8:" MD5X ":64:0123456789abcdef0123456789abcde")
+		==-1);
+	fail_unless(parse("a:3e8:" MD5X ":64:" MD5X "0")==-1);
+	fail_unless(parse("a:3e8:" MD5X ":64:0123456789abcdef0123456789abcdeg")
+		==-1);
+	fail_unless(parse("a:3e8:" MD5X ":64:" MD5X " x")==-1);
+	iobuf_init(&rbuf);
+	fail_unless(append_parse(csb->protocol2, &rbuf)==-1);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_protocol2_append(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("protocol2_append");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_append_verified);
+	tcase_add_test(tc_core, test_append_md5_mismatch);
+	tcase_add_test(tc_core, test_append_first_changed);
+	tcase_add_test(tc_core, test_append_shrunk);
+	tcase_add_test(tc_core, test_append_one_blk);
+	tcase_add_test(tc_core, test_append_bad_length);
+	tcase_add_test(tc_core, test_append_prefix_sigs_max);
+	tcase_add_test(tc_core, test_append_parse);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
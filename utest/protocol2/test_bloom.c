@@ -0,0 +1,143 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/md5.h>
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/protocol2/bloom.h"
+
+#define KEYS	10000
+
+static void make_md5sum(uint8_t *md5sum, int i)
+{
+	MD5_CTX md5;
+	MD5_Init(&md5);
+	MD5_Update(&md5, &i, sizeof(i));
+	MD5_Final(md5sum, &md5);
+}
+
+static void tear_down(struct bloom **bloom)
+{
+	bloom_free(bloom);
+	fail_unless(*bloom==NULL);
+	fail_unless(free_count==alloc_count);
+}
+
+START_TEST(test_bloom_no_false_negatives)
+{
+	struct bloom *bloom;
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	alloc_counters_reset();
+	fail_unless((bloom=bloom_alloc_for_keys(KEYS))!=NULL);
+	fail_unless(bloom->bytes==KEYS*BLOOM_BITS_PER_KEY/8);
+	for(int i=0; i<KEYS; i++)
+	{
+		make_md5sum(md5sum, i);
+		bloom_add(bloom, md5sum);
+	}
+	for(int i=0; i<KEYS; i++)
+	{
+		make_md5sum(md5sum, i);
+		fail_unless(bloom_test(bloom, md5sum)==1);
+	}
+	tear_down(&bloom);
+}
+END_TEST
+
+START_TEST(test_bloom_false_positives)
+{
+	int yes=0;
+	struct bloom *bloom;
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	alloc_counters_reset();
+	fail_unless((bloom=bloom_alloc_for_keys(KEYS))!=NULL);
+	for(int i=0; i<KEYS; i++)
+	{
+		make_md5sum(md5sum, i);
+		bloom_add(bloom, md5sum);
+	}
+	for(int i=KEYS; i<KEYS*2; i++)
+	{
+		make_md5sum(md5sum, i);
+		yes+=bloom_test(bloom, md5sum);
+	}
+	// Should be about one percent.
+	fail_unless(yes<KEYS*2/100);
+	tear_down(&bloom);
+}
+END_TEST
+
+START_TEST(test_bloom_empty)
+{
+	struct bloom *bloom;
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	alloc_counters_reset();
+	fail_unless((bloom=bloom_alloc_for_keys(0))!=NULL);
+	fail_unless(bloom->bytes==8);
+	make_md5sum(md5sum, 0);
+	fail_unless(!bloom_test(bloom, md5sum));
+	tear_down(&bloom);
+}
+END_TEST
+
+START_TEST(test_bloom_limits)
+{
+	struct bloom *bloom;
+	alloc_counters_reset();
+	fail_unless(bloom_alloc(0, BLOOM_HASHES)==NULL);
+	fail_unless(bloom_alloc(8, 0)==NULL);
+	fail_unless(bloom_alloc(8, BLOOM_HASHES_MAX+1)==NULL);
+	fail_unless((bloom=bloom_alloc(8, BLOOM_HASHES_MAX))!=NULL);
+	bloom_free(&bloom);
+	fail_unless((bloom=bloom_alloc_for_keys(0xFFFFFFFF))!=NULL);
+	fail_unless(bloom->bytes==BLOOM_BYTES_MAX);
+	tear_down(&bloom);
+}
+END_TEST
+
+START_TEST(test_bloom_copy)
+{
+	// What the client puts back together from what the server sent
+	// gives the same answers.
+	struct bloom *bloom;
+	struct bloom *copy;
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	alloc_counters_reset();
+	fail_unless((bloom=bloom_alloc_for_keys(KEYS))!=NULL);
+	for(int i=0; i<KEYS; i+=2)
+	{
+		make_md5sum(md5sum, i);
+		bloom_add(bloom, md5sum);
+	}
+	fail_unless((copy=bloom_alloc(bloom->bytes, bloom->hashes))!=NULL);
+	memcpy(copy->bits, bloom->bits, bloom->bytes);
+	for(int i=0; i<KEYS; i++)
+	{
+		make_md5sum(md5sum, i);
+		fail_unless(bloom_test(bloom, md5sum)
+			==bloom_test(copy, md5sum));
+	}
+	bloom_free(&copy);
+	tear_down(&bloom);
+}
+END_TEST
+
+Suite *suite_protocol2_bloom(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("protocol2_bloom");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_bloom_no_false_negatives);
+	tcase_add_test(tc_core, test_bloom_false_positives);
+	tcase_add_test(tc_core, test_bloom_empty);
+	tcase_add_test(tc_core, test_bloom_limits);
+	tcase_add_test(tc_core, test_bloom_copy);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,316 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include "../../test.h"
+#include "../../../src/server/protocol1/include.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/protocol1/rs_buf.h"
+
+#define BASE		"utest_phase4"
+#define CLIENT		BASE "/utestclient"
+#define REALCURRENT	"0000001 1970-01-01 00:00:00"
+#define CURRENTDATA	CLIENT "/" REALCURRENT "/data"
+#define FINISHING	CLIENT "/finishing"
+#define FILES		60
+
+// Stand-ins for librsync. A forward delta is just the whole of the new
+// file, and a delta that starts with "bad" cannot be applied.
+
+static size_t slurp(FILE *fp, gzFile zp, char *buf, size_t len)
+{
+	if(zp) return gzread(zp, buf, len);
+	return fread(buf, 1, len, fp);
+}
+
+rs_result rs_patch_gzfile(struct asfd *asfd,
+	rs_copy_cb *copy_cb, void *copy_arg, FILE *delta_file,
+	gzFile delta_zfile, FILE *new_file, gzFile new_zfile,
+	rs_stats_t *stats, struct cntr *cntr)
+{
+	size_t len;
+	char buf[256];
+	len=slurp(delta_file, delta_zfile, buf, sizeof(buf));
+	if(len>=3 && !strncmp(buf, "bad", 3))
+		return RS_IO_ERROR;
+	if(new_zfile)
+		return gzwrite(new_zfile, buf, len)==(int)len?RS_DONE:RS_IO_ERROR;
+	return fwrite(buf, 1, len, new_file)==len?RS_DONE:RS_IO_ERROR;
+}
+
+rs_result rs_sig_gzfile(struct asfd *asfd,
+	FILE *old_file, gzFile old_zfile, FILE *sig_file,
+	size_t new_block_len, size_t strong_len, rs_stats_t *stats,
+	struct cntr *cntr)
+{
+	fprintf(sig_file, "sig");
+	return RS_DONE;
+}
+
+rs_result rs_delta_gzfile(struct asfd *asfd,
+	rs_signature_t *sig, FILE *new_file,
+	gzFile new_zfile, FILE *delta_file, gzFile delta_zfile,
+	rs_stats_t *stats, struct cntr *cntr)
+{
+	size_t len;
+	char buf[256];
+	// The reverse delta is the old file.
+	len=slurp(new_file, new_zfile, buf, sizeof(buf));
+	if(delta_zfile)
+		gzwrite(delta_zfile, buf, len);
+	else
+		fwrite(buf, 1, len, delta_file);
+	return RS_DONE;
+}
+
+rs_result rs_loadsig_file(FILE *fp, rs_signature_t **sig, rs_stats_t *stats)
+	{ *sig=NULL; return RS_DONE; }
+rs_result rs_file_copy_cb(void *arg, rs_long_t pos, size_t *len, void **buf)
+	{ return RS_IO_ERROR; }
+size_t get_librsync_block_len(const char *endfile) { return 64; }
+
+enum file_kind
+{
+	KIND_PATCHED=0,
+	KIND_UNCHANGED,
+	KIND_NEW,
+	KIND_BAD_DELTA
+};
+
+static enum file_kind kind_of(int i)
+{
+	if(!(i%7)) return KIND_BAD_DELTA;
+	if(!(i%5)) return KIND_UNCHANGED;
+	if(!(i%3)) return KIND_NEW;
+	return KIND_PATCHED;
+}
+
+static void datapth_of(char *buf, size_t len, int i)
+{
+	snprintf(buf, len, "%04d/%04d", i/10, i);
+}
+
+static void write_file(const char *dir, const char *datapth,
+	const char *content)
+{
+	FILE *fp;
+	char path[256];
+	char *p;
+	snprintf(path, sizeof(path), "%s/%s", dir, datapth);
+	p=path;
+	fail_unless(!build_path_w(p));
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	fprintf(fp, "%s", content);
+	fail_unless(!fclose(fp));
+}
+
+static void assert_file(const char *dir, const char *datapth,
+	const char *content)
+{
+	FILE *fp;
+	char path[256];
+	char buf[256]="";
+	snprintf(path, sizeof(path), "%s/%s", dir, datapth);
+	fail_unless((fp=fopen(path, "rb"))!=NULL);
+	fail_unless(fread(buf, 1, sizeof(buf)-1, fp)==strlen(content));
+	ck_assert_str_eq(buf, content);
+	fclose(fp);
+}
+
+static int exists(const char *dir, const char *datapth)
+{
+	struct stat statp;
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", dir, datapth);
+	return !lstat(path, &statp);
+}
+
+static void gz_msg(gzFile zp, char cmd, const char *buf)
+{
+	gzprintf(zp, "%c%04X%s\n", cmd, (unsigned int)strlen(buf), buf);
+}
+
+static void make_backup_dirs(void)
+{
+	int i;
+	FILE *fp;
+	gzFile zp;
+	char buf[64];
+	char datapth[32];
+
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(!build_path_w(CURRENTDATA "/x"));
+	fail_unless(!symlink(REALCURRENT, CLIENT "/current"));
+	fail_unless(!build_path_w(FINISHING "/x"));
+	fail_unless((fp=fopen(FINISHING "/timestamp", "wb"))!=NULL);
+	fprintf(fp, "0000002 1970-01-02 00:00:00\n");
+	fail_unless(!fclose(fp));
+
+	fail_unless((zp=gzopen(FINISHING "/manifest.gz", "wb"))!=NULL);
+	for(i=0; i<FILES; i++)
+	{
+		datapth_of(datapth, sizeof(datapth), i);
+		snprintf(buf, sizeof(buf), "old %d", i);
+		if(kind_of(i)!=KIND_NEW)
+			write_file(CURRENTDATA, datapth, buf);
+		switch(kind_of(i))
+		{
+			case KIND_PATCHED:
+				snprintf(buf, sizeof(buf), "new %d", i);
+				write_file(FINISHING "/deltas.forward",
+					datapth, buf);
+				break;
+			case KIND_BAD_DELTA:
+				write_file(FINISHING "/deltas.forward",
+					datapth, "bad");
+				break;
+			case KIND_NEW:
+				snprintf(buf, sizeof(buf), "new %d", i);
+				write_file(FINISHING "/data.tmp",
+					datapth, buf);
+				break;
+			case KIND_UNCHANGED:
+				break;
+		}
+		gz_msg(zp, CMD_DATAPTH, datapth);
+		gz_msg(zp, CMD_ATTRIBS, "attribs");
+		snprintf(buf, sizeof(buf), "/some/file/%04d", i);
+		gz_msg(zp, CMD_FILE, buf);
+		gz_msg(zp, CMD_END_FILE, "5:md5");
+	}
+	fail_unless(!gzclose(zp));
+}
+
+static struct conf **setup_confs(int threads)
+{
+	struct conf **confs;
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	fail_unless(!conf_load_global_only_buf(MIN_SERVER_CONF, confs));
+	set_string(confs[OPT_DIRECTORY], BASE);
+	set_string(confs[OPT_CNAME], "utestclient");
+	set_e_protocol(confs[OPT_PROTOCOL], PROTO_1);
+	set_int(confs[OPT_COMPRESSION], 0);
+	set_int(confs[OPT_SHUFFLE_THREADS], threads);
+	return confs;
+}
+
+static void assert_manifest(void)
+{
+	int i;
+	gzFile zp;
+	char datapth[32];
+	char line[256];
+	char expected[64];
+	// The files that could not be patched are gone from the manifest,
+	// and the rest are still in order.
+	fail_unless((zp=gzopen(FINISHING "/manifest.gz", "rb"))!=NULL);
+	for(i=0; i<FILES; i++)
+	{
+		if(kind_of(i)==KIND_BAD_DELTA) continue;
+		datapth_of(datapth, sizeof(datapth), i);
+		snprintf(expected, sizeof(expected), "t%04X%s\n",
+			(unsigned int)strlen(datapth), datapth);
+		fail_unless(gzgets(zp, line, sizeof(line))!=NULL);
+		ck_assert_str_eq(line, expected);
+		// Attributes, path and end file.
+		for(int j=0; j<3; j++)
+			fail_unless(gzgets(zp, line, sizeof(line))!=NULL);
+	}
+	fail_unless(gzgets(zp, line, sizeof(line))==NULL);
+	gzclose(zp);
+}
+
+static void do_test_jiggle(int threads)
+{
+	int i;
+	char buf[64];
+	char datapth[32];
+	struct conf **confs;
+	struct sdirs *sdirs;
+
+	make_backup_dirs();
+	confs=setup_confs(threads);
+	fail_unless((sdirs=sdirs_alloc())!=NULL);
+	fail_unless(!sdirs_init(sdirs, confs));
+
+	fail_unless(!backup_phase4_server_protocol1(sdirs, confs));
+
+	for(i=0; i<FILES; i++)
+	{
+		datapth_of(datapth, sizeof(datapth), i);
+		switch(kind_of(i))
+		{
+			case KIND_PATCHED:
+				snprintf(buf, sizeof(buf), "new %d", i);
+				assert_file(FINISHING "/data", datapth, buf);
+				// The previous backup can get the old
+				// file back.
+				snprintf(buf, sizeof(buf), "old %d", i);
+				assert_file(CLIENT "/" REALCURRENT
+					"/deltas.reverse", datapth, buf);
+				fail_unless(!exists(CURRENTDATA, datapth));
+				break;
+			case KIND_NEW:
+				snprintf(buf, sizeof(buf), "new %d", i);
+				assert_file(FINISHING "/data", datapth, buf);
+				break;
+			case KIND_UNCHANGED:
+				snprintf(buf, sizeof(buf), "old %d", i);
+				assert_file(FINISHING "/data", datapth, buf);
+				break;
+			case KIND_BAD_DELTA:
+				fail_unless(!exists(FINISHING "/data", datapth));
+				// Still there for the previous backup.
+				snprintf(buf, sizeof(buf), "old %d", i);
+				assert_file(CURRENTDATA, datapth, buf);
+				break;
+		}
+		fail_unless(!exists(FINISHING "/deltas.forward", datapth)
+			|| kind_of(i)==KIND_BAD_DELTA);
+	}
+	assert_manifest();
+
+	sdirs_free(&sdirs);
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+}
+
+START_TEST(test_jiggle_in_main_process)
+{
+	do_test_jiggle(0);
+}
+END_TEST
+
+START_TEST(test_jiggle_with_threads)
+{
+	do_test_jiggle(4);
+}
+END_TEST
+
+START_TEST(test_jiggle_with_one_thread)
+{
+	do_test_jiggle(1);
+}
+END_TEST
+
+Suite *suite_server_protocol1_backup_phase4(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_backup_phase4");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_jiggle_in_main_process);
+	tcase_add_test(tc_core, test_jiggle_with_threads);
+	tcase_add_test(tc_core, test_jiggle_with_one_thread);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,208 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "../../test.h"
+#include "../../../src/server/protocol1/include.h"
+#include "../../../src/fsops.h"
+#include "../../../src/server/protocol1/bedup.h"
+
+#define BASE		"utest_bedup"
+#define CACHE		BASE ".cache"
+#define SIZE		5000
+
+static void setup(void)
+{
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	unlink(CACHE);
+	fail_unless(!mkdir(BASE, 0777));
+}
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	unlink(CACHE);
+}
+
+static void make_dir(const char *dir)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", BASE, dir);
+	fail_unless(!mkdir(path, 0777));
+}
+
+// Files of SIZE bytes, all the same except for 'c' at offset 'at'.
+static void make_file(const char *file, size_t at, char c)
+{
+	FILE *fp;
+	char buf[SIZE];
+	char path[256];
+	memset(buf, 'a', sizeof(buf));
+	buf[at]=c;
+	snprintf(path, sizeof(path), "%s/%s", BASE, file);
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	fail_unless(fwrite(buf, 1, sizeof(buf), fp)==sizeof(buf));
+	fail_unless(!fclose(fp));
+}
+
+static void make_small(const char *file, const char *content)
+{
+	FILE *fp;
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", BASE, file);
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	fprintf(fp, "%s", content);
+	fail_unless(!fclose(fp));
+}
+
+static ino_t ino_of(const char *file)
+{
+	struct stat statp;
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", BASE, file);
+	if(lstat(path, &statp)) return 0;
+	return statp.st_ino;
+}
+
+static void make_files(void)
+{
+	make_dir("a");
+	make_dir("b");
+	make_dir("c");
+	make_dir("c/d");
+	make_dir("c/d/e");
+	make_file("a/same1", 0, 'a');
+	make_file("b/same2", 0, 'a');
+	// A long way down, so that it is found by another thread.
+	make_file("c/d/e/same3", 0, 'a');
+	// The same first block, but not the rest.
+	make_file("a/end", SIZE-1, 'b');
+	// Not even the first block is the same.
+	make_file("b/start", 0, 'b');
+	// Small enough that the first block is all of it.
+	make_small("a/small1", "small");
+	make_small("c/small2", "small");
+	make_small("c/d/small3", "SMALL");
+	make_small("a/empty1", "");
+	make_small("b/empty2", "");
+}
+
+static int run(const char *opts, const char *threads, const char *cache)
+{
+	int argc=0;
+	char *argv[10];
+	argv[argc++]=(char *)"bedup";
+	argv[argc++]=(char *)"-n";
+	if(opts) argv[argc++]=(char *)opts;
+	argv[argc++]=(char *)"-j";
+	argv[argc++]=(char *)threads;
+	if(cache)
+	{
+		argv[argc++]=(char *)"-k";
+		argv[argc++]=(char *)cache;
+	}
+	argv[argc++]=(char *)BASE;
+	argv[argc]=NULL;
+	optind=1;
+	return run_bedup(argc, argv);
+}
+
+static void check_linked(void)
+{
+	fail_unless(ino_of("a/same1")==ino_of("b/same2"));
+	fail_unless(ino_of("a/same1")==ino_of("c/d/e/same3"));
+	fail_unless(ino_of("a/same1")!=ino_of("a/end"));
+	fail_unless(ino_of("a/same1")!=ino_of("b/start"));
+	fail_unless(ino_of("a/small1")==ino_of("c/small2"));
+	fail_unless(ino_of("a/small1")!=ino_of("c/d/small3"));
+	// Empty files are left alone.
+	fail_unless(ino_of("a/empty1")!=ino_of("b/empty2"));
+}
+
+static void do_test_link(const char *threads)
+{
+	setup();
+	make_files();
+	fail_unless(!run("-l", threads, NULL));
+	check_linked();
+	tear_down();
+}
+
+START_TEST(test_bedup_link)
+{
+	do_test_link("4");
+}
+END_TEST
+
+START_TEST(test_bedup_link_no_threads)
+{
+	do_test_link("0");
+}
+END_TEST
+
+START_TEST(test_bedup_delete)
+{
+	setup();
+	make_files();
+	fail_unless(!run("-d", "2", NULL));
+	fail_unless((ino_of("a/same1")!=0)
+		+(ino_of("b/same2")!=0)
+		+(ino_of("c/d/e/same3")!=0)==1);
+	fail_unless((ino_of("a/small1")!=0)+(ino_of("c/small2")!=0)==1);
+	fail_unless(ino_of("a/end")!=0);
+	fail_unless(ino_of("b/start")!=0);
+	fail_unless(ino_of("c/d/small3")!=0);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_bedup_cache)
+{
+	struct stat statp;
+	struct utimbuf times;
+	setup();
+	make_files();
+
+	// Only look, which fills in the cache.
+	fail_unless(!run(NULL, "2", CACHE));
+	fail_unless(!lstat(CACHE, &statp));
+	fail_unless(statp.st_size>0);
+	fail_unless(ino_of("a/same1")!=ino_of("b/same2"));
+
+	// Change one without it looking any different. The cached checksum
+	// is still the same as that of the others, but they get compared in
+	// full before being linked.
+	fail_unless(!lstat(BASE "/b/same2", &statp));
+	make_file("b/same2", 10, 'c');
+	times.actime=statp.st_atime;
+	times.modtime=statp.st_mtime;
+	fail_unless(!utime(BASE "/b/same2", &times));
+
+	fail_unless(!run("-l", "2", CACHE));
+	fail_unless(ino_of("a/same1")!=ino_of("b/same2"));
+	fail_unless(ino_of("a/same1")==ino_of("c/d/e/same3"));
+	fail_unless(ino_of("a/small1")==ino_of("c/small2"));
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol1_bedup(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_bedup");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_bedup_link);
+	tcase_add_test(tc_core, test_bedup_link_no_threads);
+	tcase_add_test(tc_core, test_bedup_delete);
+	tcase_add_test(tc_core, test_bedup_cache);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,296 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "../../test.h"
+#include "../../../src/server/protocol1/include.h"
+#include "../../../src/alloc.h"
+
+#define BASE		"utest_codecio"
+#define PATH		BASE "/data"
+// Enough for a few frames.
+#define DATA_LEN	(3*1024*1024+12345)
+
+static uint8_t *data;
+
+static void make_data(size_t len)
+{
+	uint32_t r=1;
+	fail_unless((data=(uint8_t *)malloc(len+1))!=NULL);
+	for(size_t i=0; i<len; i++)
+	{
+		r=r*1103515245+12345;
+		// Compressible, but not too much.
+		data[i]="burp backup "[(r>>16)%12];
+	}
+}
+
+static void setup(size_t len)
+{
+	alloc_counters_reset();
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(!build_path_w(PATH));
+	make_data(len);
+}
+
+static void tear_down(void)
+{
+	free(data);
+	data=NULL;
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(free_count==alloc_count);
+}
+
+START_TEST(test_codecio_gzip_and_plain)
+{
+	FILE *fp=NULL;
+	gzFile zp=NULL;
+	setup(100);
+	fail_unless((fp=open_file(PATH, "wb"))!=NULL);
+	fail_unless(!close_fp(&fp));
+	// Not compressed, so a plain file.
+	fail_unless(!open_data_file(PATH, 0, &fp, &zp));
+	fail_unless(fp && !zp);
+	close_fp(&fp);
+	// Gzipped files are left to zlib.
+	fail_unless(!open_data_file(PATH, 9, &fp, &zp));
+	fail_unless(!fp && zp);
+	gzclose_fp(&zp);
+	// Not there.
+	fail_unless(open_data_file(BASE "/no/such/file", 0, &fp, &zp)==-1);
+	fail_unless(!fp && !zp);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_codecio_not_for_gzip)
+{
+	alloc_counters_reset();
+	fail_unless(codec_fopen(PATH, "rb", 9)==NULL);
+	fail_unless(free_count==alloc_count);
+}
+END_TEST
+
+static int available(enum codec codec)
+{
+	if(codec_available(codec)) return 1;
+	// Without the library, it says so instead of going wrong later.
+	alloc_counters_reset();
+	fail_unless(codec_fopen(PATH, "wb",
+		codec_compression(codec, 1))==NULL);
+	fail_unless(free_count==alloc_count);
+	return 0;
+}
+
+static void write_data(int compression, size_t len)
+{
+	FILE *fp;
+	size_t n;
+	fail_unless((fp=codec_fopen(PATH, "wb", compression))!=NULL);
+	// In odd sized pieces, so that they do not line up with the frames.
+	for(size_t done=0; done<len; done+=n)
+	{
+		n=len-done<100003?len-done:100003;
+		fail_unless(fwrite(data+done, 1, n, fp)==n);
+	}
+	// Only says where it is when writing.
+	fail_unless(ftello(fp)==(off_t)len);
+	fail_unless(fseeko(fp, 0, SEEK_SET)==-1 || !len);
+	fail_unless(!fclose(fp));
+}
+
+static void assert_read(FILE *fp, off_t pos, size_t len)
+{
+	static uint8_t buf[200000];
+	fail_unless(len<=sizeof(buf));
+	fail_unless(!fseeko(fp, pos, SEEK_SET));
+	fail_unless(ftello(fp)==pos);
+	fail_unless(fread(buf, 1, len, fp)==len);
+	fail_unless(!memcmp(buf, data+pos, len));
+}
+
+static void do_test_round_trip(enum codec codec, int level)
+{
+	FILE *fp=NULL;
+	gzFile zp=NULL;
+	size_t got=0;
+	size_t n;
+	uint8_t *buf;
+	int compression=codec_compression(codec, level);
+	setup(DATA_LEN);
+	if(!available(codec))
+	{
+		tear_down();
+		return;
+	}
+	write_data(compression, DATA_LEN);
+	fail_unless(!open_data_file(PATH, compression, &fp, &zp));
+	fail_unless(fp && !zp);
+	fail_unless((buf=(uint8_t *)malloc(DATA_LEN+1))!=NULL);
+	while((n=fread(buf+got, 1, DATA_LEN+1-got, fp))>0)
+		got+=n;
+	fail_unless(!ferror(fp));
+	fail_unless(got==DATA_LEN);
+	fail_unless(!memcmp(buf, data, DATA_LEN));
+	free(buf);
+	fail_unless(!close_fp(&fp));
+	tear_down();
+}
+
+static void do_test_seek(enum codec codec)
+{
+	int i;
+	FILE *fp;
+	uint32_t r=3;
+	off_t pos;
+	size_t len;
+	int compression=codec_compression(codec, 1);
+	setup(DATA_LEN);
+	if(!available(codec))
+	{
+		tear_down();
+		return;
+	}
+	write_data(compression, DATA_LEN);
+	fail_unless((fp=codec_fopen(PATH, "rb", compression))!=NULL);
+	// Forwards past a few frames, then back to the start, and then all
+	// over the place, like librsync does with a basis file.
+	assert_read(fp, DATA_LEN-1000, 1000);
+	assert_read(fp, 0, 1000);
+	assert_read(fp, 1024*1024-10, 20);
+	for(i=0; i<100; i++)
+	{
+		r=r*1103515245+12345;
+		pos=(r>>4)%DATA_LEN;
+		r=r*1103515245+12345;
+		len=1+(r>>8)%150000;
+		if(pos+(off_t)len>DATA_LEN) len=DATA_LEN-pos;
+		assert_read(fp, pos, len);
+	}
+	// Past the end.
+	fail_unless(!fseeko(fp, DATA_LEN+10, SEEK_SET));
+	fail_unless(fgetc(fp)==EOF);
+	fail_unless(!fclose(fp));
+	tear_down();
+}
+
+static void do_test_empty(enum codec codec)
+{
+	FILE *fp;
+	struct stat statp;
+	int compression=codec_compression(codec, 1);
+	setup(0);
+	if(!available(codec))
+	{
+		tear_down();
+		return;
+	}
+	write_data(compression, 0);
+	// Still has a frame.
+	fail_unless(!lstat(PATH, &statp));
+	fail_unless(statp.st_size>0);
+	fail_unless((fp=codec_fopen(PATH, "rb", compression))!=NULL);
+	fail_unless(fgetc(fp)==EOF);
+	fail_unless(!ferror(fp));
+	fail_unless(!fclose(fp));
+	tear_down();
+}
+
+static void do_test_truncated(enum codec codec)
+{
+	FILE *fp;
+	struct stat statp;
+	uint8_t buf[65536];
+	int compression=codec_compression(codec, 1);
+	setup(DATA_LEN);
+	if(!available(codec))
+	{
+		tear_down();
+		return;
+	}
+	write_data(compression, DATA_LEN);
+	fail_unless(!lstat(PATH, &statp));
+	fail_unless(!truncate(PATH, statp.st_size-100));
+	fail_unless((fp=codec_fopen(PATH, "rb", compression))!=NULL);
+	while(fread(buf, 1, sizeof(buf), fp)==sizeof(buf)) { }
+	fail_unless(ferror(fp));
+	fclose(fp);
+	tear_down();
+}
+
+START_TEST(test_codecio_zstd_round_trip)
+{
+	do_test_round_trip(CODEC_ZSTD, 3);
+	do_test_round_trip(CODEC_ZSTD, 19);
+}
+END_TEST
+
+START_TEST(test_codecio_zstd_seek)
+{
+	do_test_seek(CODEC_ZSTD);
+}
+END_TEST
+
+START_TEST(test_codecio_zstd_empty)
+{
+	do_test_empty(CODEC_ZSTD);
+}
+END_TEST
+
+START_TEST(test_codecio_zstd_truncated)
+{
+	do_test_truncated(CODEC_ZSTD);
+}
+END_TEST
+
+START_TEST(test_codecio_lz4_round_trip)
+{
+	do_test_round_trip(CODEC_LZ4, 0);
+	do_test_round_trip(CODEC_LZ4, 9);
+}
+END_TEST
+
+START_TEST(test_codecio_lz4_seek)
+{
+	do_test_seek(CODEC_LZ4);
+}
+END_TEST
+
+START_TEST(test_codecio_lz4_empty)
+{
+	do_test_empty(CODEC_LZ4);
+}
+END_TEST
+
+START_TEST(test_codecio_lz4_truncated)
+{
+	do_test_truncated(CODEC_LZ4);
+}
+END_TEST
+
+Suite *suite_server_protocol1_codecio(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_codecio");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_codecio_gzip_and_plain);
+	tcase_add_test(tc_core, test_codecio_not_for_gzip);
+	tcase_add_test(tc_core, test_codecio_zstd_round_trip);
+	tcase_add_test(tc_core, test_codecio_zstd_seek);
+	tcase_add_test(tc_core, test_codecio_zstd_empty);
+	tcase_add_test(tc_core, test_codecio_zstd_truncated);
+	tcase_add_test(tc_core, test_codecio_lz4_round_trip);
+	tcase_add_test(tc_core, test_codecio_lz4_seek);
+	tcase_add_test(tc_core, test_codecio_lz4_empty);
+	tcase_add_test(tc_core, test_codecio_lz4_truncated);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
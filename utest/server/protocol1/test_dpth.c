@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include "../../test.h"
 #include "../../../src/alloc.h"
+#include "../../../src/codec.h"
 #include "../../../src/conf.h"
 #include "../../../src/conffile.h"
 #include "../../../src/fsops.h"
@@ -144,6 +145,15 @@ START_TEST(test_mk)
 	assert_mk(dpth, 5, CMD_FILE, "0009/0009/0009.gz");
 	assert_mk(dpth, 0, CMD_EFS_FILE, "0009/0009/0009");
 	assert_mk(dpth, 5, CMD_EFS_FILE, "0009/0009/0009");
+	assert_mk(dpth, 5, CMD_ENC_FILE, "0009/0009/0009.gz");
+	assert_mk(dpth, codec_compression(CODEC_ZSTD, 3), CMD_FILE,
+		"0009/0009/0009.zst");
+	assert_mk(dpth, codec_compression(CODEC_LZ4, 0), CMD_FILE,
+		"0009/0009/0009.lz4");
+	assert_mk(dpth, codec_compression(CODEC_ZSTD, 3), CMD_ENC_FILE,
+		"0009/0009/0009");
+	assert_mk(dpth, codec_compression(CODEC_ZSTD, 3), CMD_EFS_FILE,
+		"0009/0009/0009");
 	tear_down(&dpth);
 }
 END_TEST
@@ -0,0 +1,219 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../test.h"
+#include "../../../src/server/protocol1/include.h"
+#include "../../../src/alloc.h"
+#include "../../../src/fsops.h"
+#include "../../../src/server/sdirs.h"
+#include "../../../src/server/protocol1/hlindex.h"
+
+#define BASE		"utest_hlindex"
+#define FILES		BASE "/files"
+#define MD5A		"0123456789abcdef0123456789abcdef"
+#define MD5B		"fedcba9876543210fedcba9876543210"
+
+static struct conf **confs;
+static struct sdirs *sdirs;
+
+static void setup(int max_hardlinks)
+{
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(!mkdir(BASE, 0777));
+	fail_unless(!mkdir(FILES, 0777));
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	fail_unless(!conf_load_global_only_buf(MIN_SERVER_CONF, confs));
+	set_string(confs[OPT_DIRECTORY], BASE);
+	set_string(confs[OPT_CNAME], "utestclient");
+	set_e_protocol(confs[OPT_PROTOCOL], PROTO_1);
+	set_int(confs[OPT_MAX_HARDLINKS], max_hardlinks);
+	fail_unless((sdirs=sdirs_alloc())!=NULL);
+	fail_unless(!sdirs_init(sdirs, confs));
+	alloc_counters_reset();
+}
+
+static void tear_down(void)
+{
+	fail_unless(free_count==alloc_count);
+	sdirs_free(&sdirs);
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+}
+
+static void path_of(char *path, size_t len, int i)
+{
+	snprintf(path, len, "%s/%04d", FILES, i);
+}
+
+// A newly received data file.
+static int add(int i, const char *content, const char *endfile,
+	int compression)
+{
+	FILE *fp;
+	char path[64];
+	path_of(path, sizeof(path), i);
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	fprintf(fp, "%s", content);
+	fail_unless(!fclose(fp));
+	return hlindex_link(sdirs, path, endfile, compression, confs);
+}
+
+static void stat_file(int i, struct stat *statp)
+{
+	char path[64];
+	path_of(path, sizeof(path), i);
+	fail_unless(!lstat(path, statp));
+}
+
+// The index entry for some data.
+static int stat_entry(const char *md5, unsigned long long bytes,
+	int compression, struct stat *statp)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%.2s/%s.%llu.%d",
+		sdirs->hlindex, md5, md5, bytes, compression);
+	return lstat(path, statp);
+}
+
+START_TEST(test_hlindex_insert_and_link)
+{
+	int i;
+	struct stat first;
+	struct stat statp;
+	setup(10000);
+
+	// The first one goes in the index.
+	fail_unless(!add(0, "data", "4:" MD5A, 9));
+	stat_file(0, &first);
+	fail_unless(!stat_entry(MD5A, 4, 9, &statp));
+	fail_unless(statp.st_ino==first.st_ino);
+	fail_unless(statp.st_nlink==2);
+
+	// The ones after that are found, and linked to it.
+	for(i=1; i<5; i++)
+	{
+		fail_unless(add(i, "data", "4:" MD5A, 9)==1);
+		stat_file(i, &statp);
+		fail_unless(statp.st_ino==first.st_ino);
+	}
+	stat_file(0, &statp);
+	fail_unless(statp.st_nlink==6);
+
+	// Seeing the same file again does nothing.
+	{
+		char path[64];
+		path_of(path, sizeof(path), 0);
+		fail_unless(!hlindex_link(sdirs, path, "4:" MD5A, 9, confs));
+	}
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_hlindex_lookup_misses)
+{
+	struct stat first;
+	struct stat statp;
+	setup(10000);
+	fail_unless(!add(0, "data", "4:" MD5A, 9));
+	stat_file(0, &first);
+
+	// Stored with a different compression.
+	fail_unless(!add(1, "data", "4:" MD5A, 0));
+	stat_file(1, &statp);
+	fail_unless(statp.st_ino!=first.st_ino);
+	fail_unless(!stat_entry(MD5A, 4, 0, &statp));
+
+	// Different data.
+	fail_unless(!add(2, "diff", "4:" MD5B, 9));
+	stat_file(2, &statp);
+	fail_unless(statp.st_ino!=first.st_ino);
+
+	// Said to be the same, but is not.
+	fail_unless(!add(3, "DATA", "4:" MD5A, 9));
+	stat_file(3, &statp);
+	fail_unless(statp.st_ino!=first.st_ino);
+
+	// Not an end file that can be used.
+	fail_unless(!add(4, "data", "4", 9));
+	fail_unless(!add(5, "data", "4:" "0123", 9));
+	fail_unless(!add(6, "data", "4:" "0123456789ABCDEF0123456789ABCDEF",
+		9));
+	stat_file(4, &statp);
+	fail_unless(statp.st_nlink==1);
+
+	// Empty.
+	fail_unless(!add(7, "", "0:" MD5B, 9));
+	fail_unless(stat_entry(MD5B, 0, 9, &statp));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_hlindex_max_hardlinks)
+{
+	struct stat first;
+	struct stat statp;
+	setup(3);
+	fail_unless(!add(0, "data", "4:" MD5A, 9));
+	stat_file(0, &first);
+	fail_unless(add(1, "data", "4:" MD5A, 9)==1);
+	// Full up, so this one starts again, and later ones link to it.
+	fail_unless(!add(2, "data", "4:" MD5A, 9));
+	stat_file(2, &statp);
+	fail_unless(statp.st_ino!=first.st_ino);
+	first=statp;
+	fail_unless(!stat_entry(MD5A, 4, 9, &statp));
+	fail_unless(statp.st_ino==first.st_ino);
+	fail_unless(add(3, "data", "4:" MD5A, 9)==1);
+	stat_file(3, &statp);
+	fail_unless(statp.st_ino==first.st_ino);
+	stat_file(0, &statp);
+	fail_unless(statp.st_nlink==2);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_hlindex_prune)
+{
+	char path[64];
+	struct stat statp;
+	setup(10000);
+	fail_unless(!add(0, "data", "4:" MD5A, 9));
+	fail_unless(!add(1, "diff", "4:" MD5B, 9));
+
+	// Nothing refers to the first one any more.
+	path_of(path, sizeof(path), 0);
+	fail_unless(!unlink(path));
+	fail_unless(!hlindex_prune(sdirs));
+	fail_unless(stat_entry(MD5A, 4, 9, &statp));
+	fail_unless(!stat_entry(MD5B, 4, 9, &statp));
+
+	// A stale entry gets replaced by a new file.
+	path_of(path, sizeof(path), 1);
+	fail_unless(!unlink(path));
+	fail_unless(!add(2, "diff", "4:" MD5B, 9));
+	stat_file(2, &statp);
+	fail_unless(statp.st_nlink==2);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol1_hlindex(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_hlindex");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_hlindex_insert_and_link);
+	tcase_add_test(tc_core, test_hlindex_lookup_misses);
+	tcase_add_test(tc_core, test_hlindex_max_hardlinks);
+	tcase_add_test(tc_core, test_hlindex_prune);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
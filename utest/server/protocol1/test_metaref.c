@@ -0,0 +1,212 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../test.h"
+#include "../../../src/server/protocol1/include.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/server/protocol1/metaref.h"
+
+#define BASE		"utest_metaref"
+#define DATA		BASE "/data"
+#define ENDFILE		"4:0123456789abcdef0123456789abcdef"
+
+static struct conf **confs;
+static struct sbuf *rb;
+static struct metarefs metarefs;
+static char datapth[32];
+static char endfile[64];
+
+static void setup(int max_hardlinks)
+{
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(!mkdir(BASE, 0777));
+	fail_unless(!mkdir(DATA, 0777));
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	set_int(confs[OPT_META_REF], 1);
+	set_int(confs[OPT_MAX_HARDLINKS], max_hardlinks);
+	fail_unless((rb=sbuf_alloc_protocol(PROTO_1))!=NULL);
+	memset(&metarefs, 0, sizeof(metarefs));
+	alloc_counters_reset();
+}
+
+static void tear_down(void)
+{
+	metarefs_free(&metarefs);
+	fail_unless(!metarefs.count);
+	fail_unless(free_count==alloc_count);
+	// Not theirs to free.
+	iobuf_init(&rb->protocol1->datapth);
+	iobuf_init(&rb->protocol1->endfile);
+	sbuf_free(&rb);
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+}
+
+// What the server would have been given for the entry.
+static void set_entry(int i, enum cmd cmd, int compression)
+{
+	snprintf(datapth, sizeof(datapth), "%04d", i);
+	snprintf(endfile, sizeof(endfile), "%s", ENDFILE);
+	iobuf_from_str(&rb->protocol1->datapth, CMD_DATAPTH, datapth);
+	iobuf_from_str(&rb->protocol1->endfile, CMD_END_FILE, endfile);
+	rb->path.cmd=cmd;
+	rb->compression=compression;
+}
+
+static void write_data(int i, const char *content)
+{
+	FILE *fp;
+	char path[64];
+	snprintf(path, sizeof(path), "%s/%04d", DATA, i);
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	fprintf(fp, "%s", content);
+	fail_unless(!fclose(fp));
+}
+
+static void stat_data(int i, struct stat *statp)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "%s/%04d", DATA, i);
+	fail_unless(!lstat(path, statp));
+}
+
+// Sent whole.
+static void add(int i, enum cmd cmd, int compression)
+{
+	write_data(i, "meta");
+	set_entry(i, cmd, compression);
+	fail_unless(!metarefs_add(&metarefs, rb));
+}
+
+// Sent as a reference. The file for it has been started on, as with the
+// data that is sent whole.
+static int ref(int i, const char *refstr, enum cmd cmd, int compression)
+{
+	const char *e=NULL;
+	int ret;
+	write_data(i, "");
+	set_entry(i, cmd, compression);
+	ret=metarefs_link(NULL, &metarefs, refstr, rb, DATA, confs, &e);
+	if(!ret) ck_assert_str_eq(e, ENDFILE);
+	return ret;
+}
+
+START_TEST(test_metaref_link)
+{
+	int i;
+	struct stat first;
+	struct stat statp;
+	setup(10000);
+	add(0, CMD_METADATA, 9);
+	add(1, CMD_ENC_METADATA, 0);
+	fail_unless(metarefs.count==2);
+	stat_data(0, &first);
+	for(i=2; i<10; i++)
+	{
+		fail_unless(!ref(i, "0:4", CMD_METADATA, 9));
+		stat_data(i, &statp);
+		fail_unless(statp.st_ino==first.st_ino);
+	}
+	stat_data(0, &first);
+	fail_unless(first.st_nlink==9);
+	fail_unless(!ref(10, "1:4", CMD_ENC_METADATA, 0));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_metaref_link_limit)
+{
+	int i;
+	struct stat first;
+	struct stat statp;
+	setup(3);
+	add(0, CMD_METADATA, 9);
+	stat_data(0, &first);
+	// Links until the limit, then a copy, then links to the copy.
+	for(i=1; i<8; i++)
+	{
+		fail_unless(!ref(i, "0:4", CMD_METADATA, 9));
+		stat_data(i, &statp);
+		switch(i)
+		{
+			case 1:
+			case 2:
+				fail_unless(statp.st_ino==first.st_ino);
+				break;
+			case 3:
+			case 6:
+				// A copy, which later ones use.
+				fail_unless(statp.st_ino!=first.st_ino);
+				fail_unless(statp.st_size==4);
+				ck_assert_str_eq(metarefs.refs[0].datapth,
+					datapth);
+				first=statp;
+				break;
+			default:
+				fail_unless(statp.st_ino==first.st_ino);
+				break;
+		}
+	}
+	stat_data(0, &statp);
+	fail_unless(statp.st_nlink==3);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_metaref_bad)
+{
+	setup(10000);
+	add(0, CMD_METADATA, 9);
+	// Out of range, or not a reference at all.
+	fail_unless(ref(1, "1:4", CMD_METADATA, 9)==-1);
+	fail_unless(ref(1, "-1:4", CMD_METADATA, 9)==-1);
+	fail_unless(ref(1, "0", CMD_METADATA, 9)==-1);
+	// Not the same as what it refers to.
+	fail_unless(ref(1, "0:5", CMD_METADATA, 9)==-1);
+	fail_unless(ref(1, "0:4", CMD_ENC_METADATA, 9)==-1);
+	fail_unless(ref(1, "0:4", CMD_METADATA, 0)==-1);
+	// The client did not say that it would send them.
+	set_int(confs[OPT_META_REF], 0);
+	fail_unless(ref(1, "0:4", CMD_METADATA, 9)==-1);
+	set_int(confs[OPT_META_REF], 1);
+	fail_unless(!ref(1, "0:4", CMD_METADATA, 9));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_metaref_max)
+{
+	int i;
+	setup(10000);
+	write_data(0, "meta");
+	for(i=0; i<META_REF_MAX+10; i++)
+	{
+		set_entry(0, CMD_METADATA, 9);
+		fail_unless(!metarefs_add(&metarefs, rb));
+	}
+	fail_unless(metarefs.count==META_REF_MAX);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol1_metaref(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_metaref");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_metaref_link);
+	tcase_add_test(tc_core, test_metaref_link_limit);
+	tcase_add_test(tc_core, test_metaref_bad);
+	tcase_add_test(tc_core, test_metaref_max);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,269 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "../../test.h"
+#include "../../../src/server/protocol1/include.h"
+#include "../../../src/alloc.h"
+
+#define BASE		"utest_zlibio"
+#define PATH		BASE "/data.gz"
+#define DATA_LEN	(4*1024*1024)
+
+static uint8_t *data;
+
+// Made up of words, so that it compresses into lots of deflate blocks, but
+// is not so repetitive that it all ends up in the last one.
+static void make_data(size_t len)
+{
+	size_t i=0;
+	uint32_t r=1;
+	static const char *words[]={ "burp", "backup", "restore", "delta",
+		"zlib", "window", "block", "inflate", "basis", "librsync" };
+	fail_unless((data=(uint8_t *)malloc(len))!=NULL);
+	while(i<len)
+	{
+		const char *w;
+		r=r*1103515245+12345;
+		w=words[(r>>16)%10];
+		while(*w && i<len) data[i++]=*w++;
+		if(i<len) data[i++]='a'+(r>>8)%26;
+	}
+}
+
+static void write_gz(const char *mode, size_t from, size_t to)
+{
+	gzFile zp;
+	fail_unless((zp=gzopen(PATH, mode))!=NULL);
+	fail_unless(gzwrite(zp, data+from, to-from)==(int)(to-from));
+	fail_unless(gzclose(zp)==Z_OK);
+}
+
+// Lots of small deflate blocks, so lots of places to keep.
+static void write_gz_small_blocks(size_t len)
+{
+	FILE *fp;
+	z_stream strm;
+	static uint8_t out[65536];
+	memset(&strm, 0, sizeof(strm));
+	fail_unless(deflateInit2(&strm, 6, Z_DEFLATED, 15+16, 1,
+		Z_DEFAULT_STRATEGY)==Z_OK);
+	fail_unless((fp=fopen(PATH, "wb"))!=NULL);
+	strm.next_in=data;
+	strm.avail_in=len;
+	do {
+		strm.next_out=out;
+		strm.avail_out=sizeof(out);
+		fail_unless(deflate(&strm, Z_FINISH)!=Z_STREAM_ERROR);
+		fail_unless(fwrite(out, 1, sizeof(out)-strm.avail_out, fp)
+			==sizeof(out)-strm.avail_out);
+	} while(!strm.avail_out);
+	deflateEnd(&strm);
+	fail_unless(!fclose(fp));
+}
+
+static struct zbasis *setup(size_t len)
+{
+	struct zbasis *zb;
+	alloc_counters_reset();
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(!build_path_w(PATH));
+	make_data(len);
+	write_gz("wb", 0, len);
+	fail_unless((zb=zbasis_open(PATH))!=NULL);
+	return zb;
+}
+
+static void tear_down(struct zbasis **zb)
+{
+	zbasis_close(zb);
+	fail_unless(*zb==NULL);
+	free(data);
+	data=NULL;
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(free_count==alloc_count);
+}
+
+static void assert_read(struct zbasis *zb, off_t pos, size_t len)
+{
+	static uint8_t buf[100000];
+	size_t got=len;
+	void *b=buf;
+	fail_unless(len<=sizeof(buf));
+	fail_unless(zbasis_copy_cb(zb, pos, &got, &b)==RS_DONE);
+	fail_unless(got==len);
+	fail_unless(!memcmp(buf, data+pos, len));
+}
+
+START_TEST(test_zbasis_forwards)
+{
+	off_t pos;
+	struct zbasis *zb=setup(DATA_LEN);
+	for(pos=0; pos<DATA_LEN; pos+=7777)
+		assert_read(zb, pos, pos+7777>DATA_LEN?DATA_LEN-pos:7777);
+	// Kept some places to go back to.
+	fail_unless(zb->npoints>0);
+	tear_down(&zb);
+}
+END_TEST
+
+START_TEST(test_zbasis_backwards)
+{
+	off_t pos;
+	struct zbasis *zb=setup(DATA_LEN);
+	assert_read(zb, DATA_LEN-1000, 1000);
+	for(pos=DATA_LEN-50000; pos>0; pos-=123457)
+		assert_read(zb, pos, 50000);
+	assert_read(zb, 0, 10);
+	tear_down(&zb);
+}
+END_TEST
+
+START_TEST(test_zbasis_random)
+{
+	int i;
+	uint32_t r=7;
+	off_t pos;
+	size_t len;
+	struct zbasis *zb=setup(DATA_LEN);
+	for(i=0; i<200; i++)
+	{
+		r=r*1103515245+12345;
+		pos=(r>>4)%DATA_LEN;
+		r=r*1103515245+12345;
+		len=1+(r>>8)%70000;
+		if(pos+(off_t)len>DATA_LEN) len=DATA_LEN-pos;
+		assert_read(zb, pos, len);
+	}
+	tear_down(&zb);
+}
+END_TEST
+
+START_TEST(test_zbasis_points_thinned)
+{
+	off_t pos;
+	struct zbasis *zb=setup(DATA_LEN);
+	zbasis_close(&zb);
+	write_gz_small_blocks(DATA_LEN);
+	fail_unless((zb=zbasis_open(PATH))!=NULL);
+	// Make it want far more points than it is allowed, so that it has to
+	// keep every other one.
+	zb->span=1024;
+	for(pos=0; pos<DATA_LEN; pos+=50000)
+		assert_read(zb, pos, pos+50000>DATA_LEN?DATA_LEN-pos:50000);
+	fail_unless(zb->npoints<=ZBASIS_POINTS);
+	fail_unless(zb->span>1024);
+	for(pos=DATA_LEN-20000; pos>0; pos-=300001)
+		assert_read(zb, pos, 20000);
+	tear_down(&zb);
+}
+END_TEST
+
+START_TEST(test_zbasis_end)
+{
+	uint8_t buf[100];
+	size_t len=sizeof(buf);
+	void *b=buf;
+	struct zbasis *zb=setup(1000);
+	// A short read at the end.
+	fail_unless(zbasis_copy_cb(zb, 950, &len, &b)==RS_DONE);
+	fail_unless(len==50);
+	fail_unless(!memcmp(buf, data+950, 50));
+	len=sizeof(buf);
+	fail_unless(zbasis_copy_cb(zb, 1000, &len, &b)==RS_INPUT_ENDED);
+	tear_down(&zb);
+}
+END_TEST
+
+START_TEST(test_zbasis_members)
+{
+	struct zbasis *zb=setup(DATA_LEN);
+	zbasis_close(&zb);
+	// A file that was appended to has more than one gzip member.
+	write_gz("wb", 0, DATA_LEN/3);
+	write_gz("ab", DATA_LEN/3, DATA_LEN);
+	fail_unless((zb=zbasis_open(PATH))!=NULL);
+	assert_read(zb, DATA_LEN/3-500, 1000);
+	assert_read(zb, DATA_LEN-1000, 1000);
+	assert_read(zb, 100, 1000);
+	assert_read(zb, DATA_LEN/3+70000, 1000);
+	tear_down(&zb);
+}
+END_TEST
+
+START_TEST(test_zbasis_corrupt)
+{
+	FILE *fp;
+	off_t pos;
+	rs_result r=RS_DONE;
+	uint8_t buf[10000];
+	size_t len;
+	void *b=buf;
+	struct zbasis *zb=setup(DATA_LEN);
+	zbasis_close(&zb);
+	fail_unless((fp=fopen(PATH, "r+b"))!=NULL);
+	fail_unless(!fseek(fp, 5000, SEEK_SET));
+	fail_unless(fwrite("\xff\xff\xff\xff\xff\xff\xff\xff", 1, 8, fp)==8);
+	fail_unless(!fclose(fp));
+	fail_unless((zb=zbasis_open(PATH))!=NULL);
+	// Found out by the time it gets to the check at the end, if not
+	// before.
+	for(pos=0; pos<DATA_LEN && r==RS_DONE; pos+=len)
+	{
+		len=sizeof(buf);
+		r=zbasis_copy_cb(zb, pos, &len, &b);
+	}
+	fail_unless(r==RS_IO_ERROR);
+	tear_down(&zb);
+}
+END_TEST
+
+START_TEST(test_zbasis_truncated)
+{
+	struct stat statp;
+	uint8_t buf[1000];
+	size_t len=sizeof(buf);
+	void *b=buf;
+	struct zbasis *zb=setup(DATA_LEN);
+	zbasis_close(&zb);
+	fail_unless(!lstat(PATH, &statp));
+	fail_unless(!truncate(PATH, statp.st_size/2));
+	fail_unless((zb=zbasis_open(PATH))!=NULL);
+	fail_unless(zbasis_copy_cb(zb, DATA_LEN-1000, &len, &b)==RS_IO_ERROR);
+	tear_down(&zb);
+}
+END_TEST
+
+START_TEST(test_zbasis_no_file)
+{
+	alloc_counters_reset();
+	fail_unless(zbasis_open(BASE "/no/such/file")==NULL);
+	fail_unless(free_count==alloc_count);
+}
+END_TEST
+
+Suite *suite_server_protocol1_zlibio(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_zlibio");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_zbasis_forwards);
+	tcase_add_test(tc_core, test_zbasis_backwards);
+	tcase_add_test(tc_core, test_zbasis_random);
+	tcase_add_test(tc_core, test_zbasis_points_thinned);
+	tcase_add_test(tc_core, test_zbasis_end);
+	tcase_add_test(tc_core, test_zbasis_members);
+	tcase_add_test(tc_core, test_zbasis_corrupt);
+	tcase_add_test(tc_core, test_zbasis_truncated);
+	tcase_add_test(tc_core, test_zbasis_no_file);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -7,8 +7,8 @@
 #include "../../../src/fsops.h"
 #include "../../../src/hexmap.h"
 #include "../../../src/iobuf.h"
-#include "../../../src/lock.h"
 #include "../../../src/prepend.h"
+#include "../../../src/server/dpth.h"
 #include "../../../src/server/protocol2/dpth.h"
 #include "../../../src/protocol2/blk.h"
 
@@ -84,7 +84,16 @@ static void do_fork(void)
 	// Parent.
 }
 
-START_TEST(test_simple_lock)
+static void assert_data_file_exists(const char *savepath)
+{
+	char *path;
+	struct stat statp;
+	fail_unless((path=prepend_s(lockpath, savepath))!=NULL);
+	fail_unless(!lstat(path, &statp));
+	free_w(&path);
+}
+
+START_TEST(test_simple_range)
 {
 	int stat;
 	struct dpth *dpth;
@@ -94,7 +103,6 @@ START_TEST(test_simple_lock)
 		lockpath, MAX_STORAGE_SUBDIRS)==0);
 	savepath=dpth_protocol2_mk(dpth);
 	ck_assert_str_eq(savepath, "0000/0000/0000/0000");
-	fail_unless(dpth->head->lock->status==GET_LOCK_GOT);
 	// Fill up the data file, so that the next call to dpth_incr_sig will
 	// need to open a new one.
 	while(dpth->sig<DATA_FILE_SIG_MAX-1)
@@ -103,20 +111,206 @@ START_TEST(test_simple_lock)
 		fail_unless(dpth_protocol2_incr_sig(dpth)==0);
 	}
 
-	// Child will lock the next data file. So, the next call to dpth_mk
-	// will get the next one after that.
+	// Child will take the next range of data files from the counter. But
+	// the next call to dpth_mk will still be in the range that we took.
 	do_fork();
 	sleep(1);
 
 	fail_unless(dpth_protocol2_incr_sig(dpth)==0);
 	savepath=dpth_protocol2_mk(dpth);
-	ck_assert_str_eq(savepath, "0000/0000/0002/0000");
-	assert_components(dpth, 0, 0, 2, 0);
+	ck_assert_str_eq(savepath, "0000/0000/0001/0000");
+	assert_components(dpth, 0, 0, 1, 0);
 	fail_unless(dpth->head!=dpth->tail);
-	fail_unless(dpth->head->lock->status==GET_LOCK_GOT);
-	fail_unless(dpth->tail->lock->status==GET_LOCK_GOT);
-	tear_down(&dpth);
 	wait(&stat);
+	assert_data_file_exists("0000/0000/0010");
+	tear_down(&dpth);
+}
+END_TEST
+
+START_TEST(test_existing_data_file_skipped)
+{
+	FILE *fp;
+	char *path;
+	struct dpth *dpth;
+	dpth=setup();
+	fail_unless(dpth_protocol2_init(dpth,
+		lockpath, MAX_STORAGE_SUBDIRS)==0);
+	// Something that the counter does not know about.
+	path=prepend_s(lockpath, "0000/0000/0000");
+	fail_unless(build_path_w(path)==0);
+	fail_unless((fp=open_file(path, "wb"))!=NULL);
+	close_fp(&fp);
+	free_w(&path);
+
+	ck_assert_str_eq(dpth_protocol2_mk(dpth), "0000/0000/0001/0000");
+	tear_down(&dpth);
+}
+END_TEST
+
+START_TEST(test_data_file_content)
+{
+	int i;
+	FILE *fp;
+	char *path;
+	struct dpth *dpth;
+	const char *savepath;
+	char buf[64]="";
+	dpth=setup();
+	fail_unless(dpth_protocol2_init(dpth,
+		lockpath, MAX_STORAGE_SUBDIRS)==0);
+	dpth->sync=DATA_FILE_SYNC_RANGE;
+	savepath=dpth_protocol2_mk(dpth);
+	for(i=0; i<3; i++)
+	{
+		fail_unless(write_to_dpth(dpth, savepath)==0);
+		fail_unless(dpth_protocol2_incr_sig(dpth)==0);
+	}
+	// The writes are buffered until the data file is released.
+	fail_unless(dpth_release_all(dpth)==0);
+	fail_unless(dpth->fd==-1);
+
+	path=prepend_s(lockpath, "0000/0000/0000");
+	fail_unless((fp=open_file(path, "rb"))!=NULL);
+	fail_unless(fread(buf, 1, sizeof(buf), fp)==24);
+	ck_assert_str_eq(buf, "B0003abcB0003abcB0003abc");
+	close_fp(&fp);
+	free_w(&path);
+	tear_down(&dpth);
+}
+END_TEST
+
+START_TEST(test_range_after_lowered_subdirs)
+{
+	struct dpth *dpth;
+	dpth=setup();
+	fail_unless(dpth_protocol2_init(dpth,
+		lockpath, MAX_STORAGE_SUBDIRS)==0);
+	// The counter got part way into a seco directory that is now past
+	// max_storage_subdirs. The range has to start at the beginning of
+	// the next prim.
+	dpth->counter->next=((uint64_t)0x0000<<32)|((uint64_t)0x0020<<16)|5;
+	dpth->max_storage_subdirs=0x10;
+	ck_assert_str_eq(dpth_protocol2_mk(dpth), "0001/0000/0000/0000");
+	assert_components(dpth, 1, 0, 0, 0);
+	tear_down(&dpth);
+}
+END_TEST
+
+static char *reserved_path(void)
+{
+	char *reserved;
+	fail_unless((reserved=prepend_s(lockpath, DPTH_RESERVED))!=NULL);
+	return reserved;
+}
+
+static blkcnt_t blocks_of(const char *path)
+{
+	struct stat statp;
+	fail_unless(!lstat(path, &statp));
+	return statp.st_blocks;
+}
+
+START_TEST(test_reservation_given_back)
+{
+	char *path;
+	char *reserved;
+	struct dpth *dpth;
+	const char *savepath;
+	dpth=setup();
+	fail_unless(dpth_protocol2_init(dpth,
+		lockpath, MAX_STORAGE_SUBDIRS)==0);
+	reserved=reserved_path();
+	fail_unless(dpth_set_reserved(dpth, reserved)==0);
+	savepath=dpth_protocol2_mk(dpth);
+	fail_unless(write_to_dpth(dpth, savepath)==0);
+
+	// Until the data file is released, the marker says which one has
+	// space reserved.
+	path=prepend_s(lockpath, "0000/0000/0000");
+	fail_unless(!access(reserved, F_OK));
+	if(dpth->prealloc)
+		fail_unless(blocks_of(path)*512>=dpth->prealloc);
+
+	fail_unless(dpth_release_all(dpth)==0);
+	fail_unless(access(reserved, F_OK));
+	// Only the one block of data is left.
+	fail_unless(blocks_of(path)*512<=4096);
+
+	free_w(&path);
+	free_w(&reserved);
+	tear_down(&dpth);
+}
+END_TEST
+
+START_TEST(test_trim_reserved_after_crash)
+{
+	int fd;
+	FILE *fp;
+	char *path;
+	char *reserved;
+	struct dpth *dpth;
+	dpth=setup();
+	reserved=reserved_path();
+
+	// Nothing to do.
+	fail_unless(dpth_trim_reserved(reserved)==0);
+
+	// Left behind by a child that went away with the data file open.
+	path=prepend_s(lockpath, "0000/0000/0000");
+	fail_unless(build_path_w(path)==0);
+	fail_unless((fd=open(path, O_WRONLY|O_CREAT, 0666))>=0);
+	fail_unless(write(fd, "abc", 3)==3);
+#ifdef HAVE_LINUX_OS
+	if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, 1024*1024))
+		fail_unless(errno==EOPNOTSUPP);
+#endif
+	close(fd);
+	fail_unless((fp=open_file(reserved, "wb"))!=NULL);
+	fprintf(fp, "%s\n", path);
+	fail_unless(!close_fp(&fp));
+
+	fail_unless(dpth_trim_reserved(reserved)==0);
+	fail_unless(access(reserved, F_OK));
+	fail_unless(blocks_of(path)*512<=4096);
+
+	// A marker for a data file that never got created is just removed.
+	fail_unless((fp=open_file(reserved, "wb"))!=NULL);
+	fprintf(fp, "%s/0001\n", lockpath);
+	fail_unless(!close_fp(&fp));
+	fail_unless(dpth_trim_reserved(reserved)==0);
+	fail_unless(access(reserved, F_OK));
+
+	free_w(&path);
+	free_w(&reserved);
+	tear_down(&dpth);
+}
+END_TEST
+
+START_TEST(test_open_data_file_errors)
+{
+	char *path;
+	char *reserved;
+	struct dpth *dpth;
+	dpth=setup();
+
+	// Cannot open a directory for writing.
+	fail_unless(build_path_w(lockpath)==0);
+	fail_unless(mkdir(lockpath, 0777)==0);
+	fail_unless(dpth_open_data_file(dpth, lockpath, 0)==-1);
+	fail_unless(dpth->fd==-1);
+	fail_unless(dpth->fd_path==NULL);
+
+	// Cannot write the marker, because its directory is a file.
+	path=prepend_s(lockpath, "data");
+	reserved=prepend_s(path, DPTH_RESERVED);
+	fail_unless(dpth_set_reserved(dpth, reserved)==0);
+	fail_unless(dpth_open_data_file(dpth, path, 1024*1024)==-1);
+	fail_unless(dpth->fd==-1);
+	fail_unless(dpth->fd_path==NULL);
+
+	free_w(&path);
+	free_w(&reserved);
+	tear_down(&dpth);
 }
 END_TEST
 
@@ -258,7 +452,13 @@ Suite *suite_server_protocol2_dpth(void)
 
 	tc_core=tcase_create("Core");
 
-	tcase_add_test(tc_core, test_simple_lock);
+	tcase_add_test(tc_core, test_simple_range);
+	tcase_add_test(tc_core, test_existing_data_file_skipped);
+	tcase_add_test(tc_core, test_data_file_content);
+	tcase_add_test(tc_core, test_range_after_lowered_subdirs);
+	tcase_add_test(tc_core, test_reservation_given_back);
+	tcase_add_test(tc_core, test_trim_reserved_after_crash);
+	tcase_add_test(tc_core, test_open_data_file_errors);
 	tcase_add_test(tc_core, test_incr_sig);
 	tcase_add_test(tc_core, test_init);
 	suite_add_tcase(s, tc_core);
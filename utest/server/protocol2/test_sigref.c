@@ -0,0 +1,305 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../test.h"
+#include "../../../src/server/protocol2/include.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/fsops.h"
+#include "../../../src/hexmap.h"
+#include "../../../src/server/manio.h"
+#include "../../../src/protocol2/bloom.h"
+#include "../../../src/server/protocol2/sigref.h"
+
+#define BASE		"utest_sigref"
+#define MANIFEST	BASE "/manifest"
+#define PHASE1		BASE "/phase1"
+#define BLKS		10000
+
+static struct conf **confs;
+static struct sigref *sigref;
+
+static void setup(void)
+{
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	set_e_protocol(confs[OPT_PROTOCOL], PROTO_2);
+}
+
+// Reading the manifest frees some buffers with plain free(), which the
+// alloc counters do not see, so there is no check of them here.
+static void load_with(const char *phase1data)
+{
+	fail_unless((sigref=sigref_alloc())!=NULL);
+	fail_unless(!sigref_load(sigref, MANIFEST, phase1data, confs));
+}
+
+static void load(void)
+{
+	load_with(NULL);
+}
+
+static void tear_down(void)
+{
+	sigref_free(&sigref);
+	fail_unless(sigref==NULL);
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+}
+
+static void make_data(char *data, int i)
+{
+	snprintf(data, 32, "block %d", i);
+}
+
+static void make_blk(struct blk *blk, int i)
+{
+	MD5_CTX md5;
+	char data[32];
+	memset(blk, 0, sizeof(struct blk));
+	make_data(data, i);
+	MD5_Init(&md5);
+	MD5_Update(&md5, data, strlen(data));
+	MD5_Final(blk->md5sum, &md5);
+	blk->fingerprint=i+1;
+	blk->savepath[1]=i%0x100;
+	blk->savepath[3]=i/0x100;
+}
+
+// One file, with a sig for each block in 'blks'.
+static void write_manifest(struct blk *blks, int n)
+{
+	int i;
+	struct sbuf *sb;
+	struct manio *manio;
+	fail_unless((manio=manio_alloc())!=NULL);
+	fail_unless(!manio_init_write(manio, MANIFEST));
+	fail_unless((sb=sbuf_alloc_protocol(PROTO_2))!=NULL);
+	iobuf_from_str(&sb->path, CMD_FILE, (char *)"/a/file");
+	iobuf_from_str(&sb->attr, CMD_ATTRIBS, (char *)"0 attribs");
+	fail_unless(!manio_write_sbuf(manio, sb));
+	for(i=0; i<n; i++)
+		fail_unless(!manio_write_sig_and_path(manio, &blks[i]));
+	fail_unless(!manio_close(manio));
+	manio_free(&manio);
+	// Not its to free.
+	iobuf_init(&sb->path);
+	iobuf_init(&sb->attr);
+	sbuf_free(&sb);
+}
+
+// The phase1 scan, with the file from the manifest, and a new one.
+static void write_phase1(void)
+{
+	struct sbuf *sb;
+	struct manio *manio;
+	fail_unless((manio=manio_alloc())!=NULL);
+	fail_unless(!manio_init_write(manio, PHASE1));
+	manio_set_protocol(manio, PROTO_1);
+	fail_unless((sb=sbuf_alloc_protocol(PROTO_2))!=NULL);
+	iobuf_from_str(&sb->attr, CMD_ATTRIBS, (char *)"0 attribs");
+	iobuf_from_str(&sb->path, CMD_FILE, (char *)"/a/file");
+	fail_unless(!manio_write_sbuf(manio, sb));
+	iobuf_from_str(&sb->path, CMD_FILE, (char *)"/a/new");
+	fail_unless(!manio_write_sbuf(manio, sb));
+	fail_unless(!manio_close(manio));
+	manio_free(&manio);
+	// Not its to free.
+	iobuf_init(&sb->path);
+	iobuf_init(&sb->attr);
+	sbuf_free(&sb);
+}
+
+static int resolve(struct blk *want, struct blk *got)
+{
+	memset(got, 0, sizeof(struct blk));
+	return sigref_resolve(sigref, (const char *)want->md5sum, got);
+}
+
+START_TEST(test_sigref_resolve)
+{
+	int i;
+	struct blk got;
+	struct blk *blks;
+	setup();
+	fail_unless((blks=(struct blk *)calloc(BLKS, sizeof(struct blk)))
+		!=NULL);
+	for(i=0; i<BLKS; i++)
+		make_blk(&blks[i], i);
+	write_manifest(blks, BLKS);
+	load();
+
+	for(i=0; i<BLKS; i++)
+	{
+		fail_unless(resolve(&blks[i], &got)==1);
+		fail_unless(got.fingerprint==blks[i].fingerprint);
+		fail_unless(!memcmp(got.md5sum, blks[i].md5sum,
+			MD5_DIGEST_LENGTH));
+		fail_unless(!got.sig_unknown);
+	}
+
+	// Not one of them.
+	make_blk(&got, BLKS);
+	fail_unless(sigref_resolve(sigref, (const char *)got.md5sum, &got)==0);
+	fail_unless(got.sig_unknown);
+	free(blks);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sigref_drop_repeats)
+{
+	int i;
+	struct blk got;
+	struct blk blks[8];
+	setup();
+	for(i=0; i<5; i++)
+		make_blk(&blks[i], i);
+	// The same block again, which is fine.
+	make_blk(&blks[5], 1);
+	// Two different blocks that start the same way, which cannot be told
+	// apart by a reference.
+	make_blk(&blks[6], 3);
+	blks[6].md5sum[MD5_DIGEST_LENGTH-1]^=0xff;
+	blks[6].fingerprint=99;
+	make_blk(&blks[7], 3);
+	write_manifest(blks, 8);
+	load();
+
+	fail_unless(resolve(&blks[0], &got)==1);
+	fail_unless(resolve(&blks[1], &got)==1);
+	fail_unless(got.fingerprint==blks[1].fingerprint);
+	fail_unless(resolve(&blks[2], &got)==1);
+	fail_unless(resolve(&blks[3], &got)==0);
+	fail_unless(got.sig_unknown);
+	fail_unless(resolve(&blks[6], &got)==0);
+	fail_unless(got.sig_unknown);
+	fail_unless(resolve(&blks[4], &got)==1);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sigref_unknown_sig_from_data)
+{
+	char data[32];
+	struct blk want;
+	struct blk got;
+	setup();
+	make_blk(&want, 0);
+	write_manifest(&want, 1);
+	load();
+
+	// The filter was wrong about this one, so its data gets asked for,
+	// and its sig comes from that.
+	make_blk(&want, 1);
+	fail_unless(resolve(&want, &got)==0);
+	fail_unless(got.sig_unknown);
+	make_data(data, 1);
+	fail_unless(!blk_sig_from_data(&got, data, strlen(data)));
+	fail_unless(!got.sig_unknown);
+	fail_unless(!memcmp(got.md5sum, want.md5sum, MD5_DIGEST_LENGTH));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sigref_filter)
+{
+	int i;
+	uint32_t got=0;
+	unsigned int bytes=0;
+	unsigned int hashes=0;
+	struct iobuf wbuf;
+	struct blk blks[100];
+	setup();
+	for(i=0; i<100; i++)
+		make_blk(&blks[i], i);
+	write_manifest(blks, 100);
+	load();
+
+	// A header, then the filter in pieces.
+	iobuf_init(&wbuf);
+	sigref_get_wbuf(sigref, &wbuf);
+	fail_unless(wbuf.cmd==CMD_GEN);
+	fail_unless(sscanf(wbuf.buf, "sigfilter:%u:%u", &bytes, &hashes)==2);
+	fail_unless(bytes==100*BLOOM_BITS_PER_KEY/8);
+	fail_unless(hashes==BLOOM_HASHES);
+	while(1)
+	{
+		iobuf_init(&wbuf);
+		sigref_get_wbuf(sigref, &wbuf);
+		if(!wbuf.len) break;
+		fail_unless(wbuf.cmd==CMD_SIG_FILTER);
+		got+=wbuf.len;
+	}
+	fail_unless(got==bytes);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sigref_empty)
+{
+	struct iobuf wbuf;
+	struct blk want;
+	struct blk got;
+	setup();
+	// No current manifest.
+	load();
+	iobuf_init(&wbuf);
+	sigref_get_wbuf(sigref, &wbuf);
+	fail_unless(!wbuf.len);
+	make_blk(&want, 0);
+	fail_unless(resolve(&want, &got)==0);
+	fail_unless(got.sig_unknown);
+	memset(&got, 0, sizeof(got));
+	fail_unless(sigref_resolve(NULL, (const char *)want.md5sum, &got)==0);
+	fail_unless(got.sig_unknown);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sigref_filter_not_worth_it)
+{
+	int i;
+	struct iobuf wbuf;
+	struct blk got;
+	struct blk blks[100];
+	setup();
+	for(i=0; i<100; i++)
+		make_blk(&blks[i], i);
+	write_manifest(blks, 100);
+	// Nothing in the scan has any data that is new or changed, so the
+	// filter would cost more than it could save.
+	write_phase1();
+	load_with(PHASE1);
+	iobuf_init(&wbuf);
+	sigref_get_wbuf(sigref, &wbuf);
+	fail_unless(!wbuf.len);
+	fail_unless(resolve(&blks[0], &got)==0);
+	fail_unless(got.sig_unknown);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol2_sigref(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_sigref");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_sigref_resolve);
+	tcase_add_test(tc_core, test_sigref_drop_repeats);
+	tcase_add_test(tc_core, test_sigref_unknown_sig_from_data);
+	tcase_add_test(tc_core, test_sigref_filter);
+	tcase_add_test(tc_core, test_sigref_empty);
+	tcase_add_test(tc_core, test_sigref_filter_not_worth_it);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
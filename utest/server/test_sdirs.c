@@ -106,6 +106,7 @@ static void protocol1_tests(struct sdirs *sdirs, struct conf **confs)
 	ck_assert_str_eq(sdirs->datadirtmp, WORKING "/data.tmp");
 	ck_assert_str_eq(sdirs->cincexc, CURRENT "/incexc");
 	ck_assert_str_eq(sdirs->deltmppath, WORKING "/deltmppath");
+	ck_assert_str_eq(sdirs->hlindex, BASE "/" HLINDEX_DIR "/a_group");
 
 	check_dynamic_paths(sdirs, confs, "manifest.gz");
 }
@@ -146,6 +147,7 @@ static void protocol2_tests(struct sdirs *sdirs, struct conf **confs)
 	fail_unless(sdirs->datadirtmp==NULL);
 	fail_unless(sdirs->cincexc==NULL);
 	fail_unless(sdirs->deltmppath==NULL);
+	fail_unless(sdirs->hlindex==NULL);
 
 	check_dynamic_paths(sdirs, confs, "manifest");
 }
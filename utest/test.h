@@ -19,17 +19,54 @@
 
 extern int sub_ntests;
 
+// In bench.c.
+extern int bench_wanted(void);
+extern double bench_now(void);
+extern void bench_report(const char *name, long n, const char *what,
+	const char *old_name, double old_time,
+	const char *new_name, double new_time);
+
+// Counted by the stubs in mock.c.
+extern int attribs_set_calls;
+extern int attribs_set_quiet_calls;
+extern int set_extrameta_quiet_calls;
+extern int logw_calls;
+
 Suite *suite_alloc(void);
+Suite *suite_asfd(void);
 Suite *suite_base64(void);
+Suite *suite_bfile(void);
 Suite *suite_cmd(void);
 Suite *suite_conf(void);
 Suite *suite_conffile(void);
+Suite *suite_fsops(void);
 Suite *suite_hexmap(void);
+Suite *suite_linkhash(void);
 Suite *suite_lock(void);
 Suite *suite_pathcmp(void);
+Suite *suite_throttle(void);
+Suite *suite_workq(void);
+Suite *suite_client_journal(void);
+Suite *suite_client_matcher(void);
+Suite *suite_client_restore_writer(void);
+Suite *suite_client_walk(void);
+Suite *suite_client_protocol1_deltas(void);
+Suite *suite_client_protocol1_metacache(void);
+Suite *suite_client_protocol1_prefetch(void);
+Suite *suite_protocol1_enc(void);
+Suite *suite_protocol1_pgzip(void);
+Suite *suite_protocol2_append(void);
+Suite *suite_protocol2_bloom(void);
 Suite *suite_server_sdirs(void);
+Suite *suite_server_protocol1_backup_phase4(void);
+Suite *suite_server_protocol1_bedup(void);
+Suite *suite_server_protocol1_codecio(void);
 Suite *suite_server_protocol1_dpth(void);
 Suite *suite_server_protocol1_fdirs(void);
+Suite *suite_server_protocol1_hlindex(void);
+Suite *suite_server_protocol1_metaref(void);
+Suite *suite_server_protocol1_zlibio(void);
 Suite *suite_server_protocol2_dpth(void);
+Suite *suite_server_protocol2_sigref(void);
 
 #endif
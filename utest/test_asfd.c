@@ -0,0 +1,175 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "test.h"
+#include "../src/burp.h"
+#include "../src/alloc.h"
+#include "../src/asfd.h"
+#include "../src/async.h"
+#include "../src/cmd.h"
+#include "../src/conf.h"
+#include "../src/fsops.h"
+
+#define DATA_PATH	"utest_asfd"
+#define DATA_LEN	0xFFFF
+
+static struct conf **confs;
+static struct async *as;
+static int peer=-1;
+static char data[DATA_LEN];
+
+static int open_data(void)
+{
+	int fd;
+	FILE *fp;
+	for(int i=0; i<DATA_LEN; i++) data[i]='a'+i%26;
+	fail_unless((fp=open_file(DATA_PATH, "wb"))!=NULL);
+	fail_unless(fwrite(data, 1, DATA_LEN, fp)==DATA_LEN);
+	fail_unless(!close_fp(&fp));
+	fail_unless((fd=open(DATA_PATH, O_RDONLY))>=0);
+	return fd;
+}
+
+static struct asfd *setup(void)
+{
+	int sv[2];
+	struct asfd *asfd;
+	alloc_counters_reset();
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	set_int(confs[OPT_NETWORK_TIMEOUT], 1);
+	fail_unless(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	fail_unless((as=async_alloc())!=NULL);
+	fail_unless(!as->init(as, 0));
+	fail_unless((asfd=setup_asfd(as, "test", &sv[0], NULL,
+		ASFD_STREAM_STANDARD, ASFD_FD_CHILD_MAIN,
+		-1, confs))!=NULL);
+	peer=sv[1];
+	return asfd;
+}
+
+static void tear_down(struct asfd *asfd, int *fd)
+{
+	// iobuf_free() leaves the rbuf alone.
+	free_v((void **)&asfd->rbuf);
+	close_fd(fd);
+	close_fd(&peer);
+	async_asfd_free_all(&as);
+	confs_free(&confs);
+	unlink(DATA_PATH);
+	fail_unless(free_count==alloc_count);
+}
+
+static void read_all(int fd, char *buf, size_t len)
+{
+	ssize_t r;
+	while(len)
+	{
+		fail_unless((r=read(fd, buf, len))>0);
+		buf+=r;
+		len-=r;
+	}
+}
+
+START_TEST(test_write_from_fd)
+{
+	int fd;
+	char buf[32]="";
+	struct asfd *asfd=setup();
+	fd=open_data();
+	fail_unless(!asfd->write_str(asfd, CMD_GEN, "before"));
+	fail_unless(!asfd->write_from_fd(asfd, CMD_DATA, fd, 3, 10));
+	fail_unless(!asfd->write_str(asfd, CMD_GEN, "after"));
+	fail_unless(!asfd->writebuflen);
+	fail_unless(!asfd->sendlen);
+	read_all(peer, buf, 11+15+10);
+	fail_unless(!memcmp(buf, "c0006beforeB000Adefghijklmc0005after", 36));
+	tear_down(asfd, &fd);
+}
+END_TEST
+
+static void *drain(void *arg)
+{
+	char *buf=(char *)arg;
+	read_all(peer, buf, 5+DATA_LEN);
+	return NULL;
+}
+
+START_TEST(test_write_from_fd_more_than_socket_takes)
+{
+	int fd;
+	int sndbuf=4096;
+	pthread_t thread;
+	char *buf;
+	struct asfd *asfd=setup();
+	fd=open_data();
+	// Make sure that it has to wait for the socket to be writable.
+	fail_unless(!setsockopt(asfd->fd, SOL_SOCKET, SO_SNDBUF,
+		&sndbuf, sizeof(sndbuf)));
+	fail_unless((buf=(char *)malloc(5+DATA_LEN))!=NULL);
+	fail_unless(!pthread_create(&thread, NULL, drain, buf));
+	fail_unless(!asfd->write_from_fd(asfd, CMD_DATA, fd, 0, DATA_LEN));
+	fail_unless(!pthread_join(thread, NULL));
+	fail_unless(!memcmp(buf, "BFFFF", 5));
+	fail_unless(!memcmp(buf+5, data, DATA_LEN));
+	free(buf);
+	tear_down(asfd, &fd);
+}
+END_TEST
+
+START_TEST(test_write_from_fd_times_out)
+{
+	int i;
+	int fd;
+	int sndbuf=4096;
+	struct asfd *asfd=setup();
+	fd=open_data();
+	// Nobody is reading, so the wait has to give up after the network
+	// timeout, instead of hanging.
+	fail_unless(!setsockopt(asfd->fd, SOL_SOCKET, SO_SNDBUF,
+		&sndbuf, sizeof(sndbuf)));
+	for(i=0; i<100; i++)
+		if(asfd->write_from_fd(asfd, CMD_DATA, fd, 0, DATA_LEN))
+			break;
+	fail_unless(i<100);
+	fail_unless(!asfd->sendlen);
+	tear_down(asfd, &fd);
+}
+END_TEST
+
+START_TEST(test_write_from_fd_ratelimited)
+{
+	int fd;
+	struct asfd *asfd=setup();
+	fd=open_data();
+	// Has to go the copying way.
+	asfd->ratelimit=1;
+	fail_unless(asfd->write_from_fd(asfd, CMD_DATA, fd, 0, 10)==1);
+	fail_unless(!asfd->writebuflen);
+	tear_down(asfd, &fd);
+}
+END_TEST
+
+Suite *suite_asfd(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("asfd");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 10);
+
+	tcase_add_test(tc_core, test_write_from_fd);
+	tcase_add_test(tc_core, test_write_from_fd_more_than_socket_takes);
+	tcase_add_test(tc_core, test_write_from_fd_times_out);
+	tcase_add_test(tc_core, test_write_from_fd_ratelimited);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
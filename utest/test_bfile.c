@@ -0,0 +1,187 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "test.h"
+#include "../src/burp.h"
+#include "../src/alloc.h"
+#include "../src/bfile.h"
+#include "../src/fsops.h"
+
+static const char *path="utest_bfile";
+
+static void tear_down(void)
+{
+	unlink(path);
+	fail_unless(free_count==alloc_count);
+}
+
+// Leaves holes where there are blocks of zeros, for the reads to skip.
+static void write_file(const char *buf, size_t len)
+{
+	int fd;
+	size_t n;
+	size_t done;
+	fail_unless((fd=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600))>=0);
+	for(done=0; done<len; done+=n)
+	{
+		n=len-done<4096?len-done:4096;
+		if(buf[done] || memcmp(buf+done, buf+done+1, n-1))
+			fail_unless(pwrite(fd, buf+done, n, done)==(ssize_t)n);
+	}
+	fail_unless(!ftruncate(fd, len));
+	fail_unless(!close(fd));
+}
+
+static void read_back(const char *buf, size_t len)
+{
+	ssize_t got;
+	size_t total=0;
+	char rbuf[5000];
+	BFILE bfd;
+	struct stat statp;
+
+	fail_unless(!lstat(path, &statp));
+	fail_unless((size_t)statp.st_size==len);
+	bfile_init(&bfd, 0, NULL);
+	fail_unless(!bfd.open(&bfd, NULL, path, O_RDONLY, 0));
+	while((got=bfd.read(&bfd, rbuf, sizeof(rbuf)))>0)
+	{
+		fail_unless(total+got<=len);
+		fail_unless(!memcmp(rbuf, buf+total, got));
+		total+=got;
+	}
+	fail_unless(!got);
+	fail_unless(total==len);
+	fail_unless(!bfd.close(&bfd, NULL));
+}
+
+static void do_test(const char *buf, size_t len)
+{
+	write_file(buf, len);
+	read_back(buf, len);
+	tear_down();
+}
+
+START_TEST(test_sparse_no_zeros)
+{
+	char buf[20000];
+	memset(buf, 'a', sizeof(buf));
+	do_test(buf, sizeof(buf));
+}
+END_TEST
+
+START_TEST(test_sparse_hole_in_middle)
+{
+	char buf[20000];
+	memset(buf, 0, sizeof(buf));
+	memset(buf, 'a', 4096);
+	memset(buf+16384, 'b', sizeof(buf)-16384);
+	do_test(buf, sizeof(buf));
+}
+END_TEST
+
+START_TEST(test_sparse_hole_at_end)
+{
+	char buf[20000];
+	memset(buf, 0, sizeof(buf));
+	memset(buf, 'a', 100);
+	do_test(buf, sizeof(buf));
+}
+END_TEST
+
+START_TEST(test_sparse_all_hole)
+{
+	char buf[20000];
+	memset(buf, 0, sizeof(buf));
+	do_test(buf, sizeof(buf));
+}
+END_TEST
+
+#ifdef SEEK_DATA
+static int open_for_read(BFILE *bfd)
+{
+	bfile_init(bfd, 0, NULL);
+	fail_unless(!bfd->open(bfd, NULL, path, O_RDONLY, 0));
+	return bfd->sparse;
+}
+
+START_TEST(test_sparse_read_asks_filesystem)
+{
+	int fd;
+	off_t hole;
+	BFILE bfd;
+	char buf[8192];
+	alloc_counters_reset();
+
+	// Zeros that were written are not a hole.
+	memset(buf, 0, sizeof(buf));
+	fail_unless((fd=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600))>=0);
+	fail_unless(write(fd, buf, sizeof(buf))==(ssize_t)sizeof(buf));
+	fail_unless(!fsync(fd));
+	fail_unless(!close(fd));
+	fail_unless(!open_for_read(&bfd));
+	fail_unless(!bfd.close(&bfd, NULL));
+
+	// A real hole.
+	fail_unless((fd=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600))>=0);
+	fail_unless(write(fd, "a", 1)==1);
+	fail_unless(!ftruncate(fd, 1024*1024));
+	hole=lseek(fd, 0, SEEK_HOLE);
+	fail_unless(!close(fd));
+	// Only if the filesystem can say so.
+	fail_unless(open_for_read(&bfd)==(hole>=0 && hole<1024*1024));
+	fail_unless(bfd.read(&bfd, buf, 1)==1);
+	fail_unless(buf[0]=='a');
+	fail_unless(!bfd.close(&bfd, NULL));
+	tear_down();
+}
+END_TEST
+#endif
+
+START_TEST(test_open_mem)
+{
+	BFILE bfd;
+	char rbuf[4];
+	char *mem;
+	alloc_counters_reset();
+	fail_unless((mem=strdup_w("abcdefghij", __func__))!=NULL);
+	bfile_init(&bfd, 0, NULL);
+	fail_unless(!bfile_open_mem(&bfd, NULL, path, mem, 10, NULL));
+	fail_unless(bfd.mode==BF_READ);
+	fail_unless(bfd.read(&bfd, rbuf, sizeof(rbuf))==4);
+	fail_unless(!memcmp(rbuf, "abcd", 4));
+	fail_unless(bfd.read(&bfd, rbuf, sizeof(rbuf))==4);
+	fail_unless(!memcmp(rbuf, "efgh", 4));
+	fail_unless(bfd.read(&bfd, rbuf, sizeof(rbuf))==2);
+	fail_unless(!memcmp(rbuf, "ij", 2));
+	fail_unless(bfd.read(&bfd, rbuf, sizeof(rbuf))==0);
+	fail_unless(!bfd.close(&bfd, NULL));
+	fail_unless(bfd.mode==BF_CLOSED);
+	fail_unless(free_count==alloc_count);
+}
+END_TEST
+
+Suite *suite_bfile(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("bfile");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_sparse_no_zeros);
+	tcase_add_test(tc_core, test_sparse_hole_in_middle);
+	tcase_add_test(tc_core, test_sparse_hole_at_end);
+	tcase_add_test(tc_core, test_sparse_all_hole);
+#ifdef SEEK_DATA
+	tcase_add_test(tc_core, test_sparse_read_asks_filesystem);
+#endif
+	tcase_add_test(tc_core, test_open_mem);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
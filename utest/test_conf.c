@@ -3,10 +3,7 @@
 #include <stdlib.h>
 #include "../src/alloc.h"
 #include "../src/conf.h"
-
-// Stuff pulled in from strlist.c:
-#include "../src/regexp.h"
-int compile_regex(regex_t **regex, const char *str) { return 0; }
+#include "../src/protocol1/enc.h"
 
 static void check_default(struct conf **c, enum conf_opt o)
 {
@@ -74,6 +71,7 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_VSS_DRIVES:
 		case OPT_REGEX:
 		case OPT_RESTORE_CLIENT:
+		case OPT_JOURNAL_DIR:
 			fail_unless(get_string(c[o])==NULL);
 			break;
 		case OPT_RATELIMIT:
@@ -84,6 +82,10 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_B_SCRIPT_POST_RUN_ON_FAIL:
 		case OPT_R_SCRIPT_POST_RUN_ON_FAIL:
 		case OPT_SEND_CLIENT_CNTR:
+		case OPT_META_REF:
+		case OPT_APPEND_FROM:
+		case OPT_SIG_FILTER:
+		case OPT_PRESSURE_LIMIT:
 		case OPT_BREAKPOINT:
 		case OPT_SYSLOG:
 		case OPT_PROGRESS_COUNTER:
@@ -93,6 +95,7 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_S_SCRIPT_POST_NOTIFY:
 		case OPT_S_SCRIPT_NOTIFY:
 		case OPT_HARDLINKED_ARCHIVE:
+		case OPT_INLINE_DEDUP:
         	case OPT_N_SUCCESS_WARNINGS_ONLY:
         	case OPT_N_SUCCESS_CHANGES_ONLY:
 		case OPT_CROSS_ALL_FILESYSTEMS:
@@ -123,8 +126,22 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_SERVER_CAN_RESTORE:
 		case OPT_B_SCRIPT_RESERVED_ARGS:
 		case OPT_R_SCRIPT_RESERVED_ARGS:
+		case OPT_DATA_FILE_SYNC:
 			fail_unless(get_int(c[o])==1);
 			break;
+		case OPT_ENCRYPTION_CIPHER:
+			fail_unless(get_int(c[o])==ENC_CIPHER_AES_256_GCM);
+			break;
+		case OPT_RESTORE_SPOOL_THREADS:
+			fail_unless(get_int(c[o])==2);
+			break;
+		case OPT_RESTORE_THREADS:
+		case OPT_SHUFFLE_THREADS:
+		case OPT_COMPRESSION_THREADS:
+		case OPT_DELTA_THREADS:
+		case OPT_SCAN_THREADS:
+			fail_unless(get_int(c[o])==4);
+			break;
 		case OPT_NETWORK_TIMEOUT:
 			fail_unless(get_int(c[o])==60*60*2);
 			break;
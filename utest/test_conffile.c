@@ -3,8 +3,10 @@
 #include <stdlib.h>
 #include "test.h"
 #include "../src/alloc.h"
+#include "../src/codec.h"
 #include "../src/conf.h"
 #include "../src/conffile.h"
+#include "../src/protocol1/enc.h"
 
 static struct conf **setup_conf(void)
 {
@@ -105,6 +107,30 @@ START_TEST(test_client_conf)
 }
 END_TEST
 
+START_TEST(test_client_encryption_cipher)
+{
+	struct conf **confs=NULL;
+	setup(&confs, NULL);
+	fail_unless(!conf_load_global_only_buf(MIN_CLIENT_CONF
+		"encryption_cipher=blowfish\n", confs));
+	fail_unless(get_int(confs[OPT_ENCRYPTION_CIPHER])
+		==ENC_CIPHER_BLOWFISH);
+	tear_down(NULL, &confs);
+
+	setup(&confs, NULL);
+	fail_unless(!conf_load_global_only_buf(MIN_CLIENT_CONF
+		"encryption_cipher=aes-256-gcm\n", confs));
+	fail_unless(get_int(confs[OPT_ENCRYPTION_CIPHER])
+		==ENC_CIPHER_AES_256_GCM);
+	tear_down(NULL, &confs);
+
+	setup(&confs, NULL);
+	fail_unless(conf_load_global_only_buf(MIN_CLIENT_CONF
+		"encryption_cipher=des\n", confs)==-1);
+	tear_down(NULL, &confs);
+}
+END_TEST
+
 static void assert_strlist(struct strlist **s, const char *path, int flag)
 {
 	if(!path)
@@ -209,6 +235,92 @@ START_TEST(test_server_conf)
 }
 END_TEST
 
+struct cdata
+{
+	const char *value;
+	enum codec codec;
+	int level;
+};
+
+static struct cdata compressions[] = {
+	{ "0", CODEC_GZIP, 0 },
+	{ "5", CODEC_GZIP, 5 },
+	{ "gzip9", CODEC_GZIP, 9 },
+	{ "zlib1", CODEC_GZIP, 1 },
+	{ "zstd", CODEC_ZSTD, 3 },
+	{ "zstd0", CODEC_ZSTD, 3 },
+	{ "zstd19", CODEC_ZSTD, 19 },
+	{ "lz4", CODEC_LZ4, 0 },
+	{ "lz49", CODEC_LZ4, 9 },
+};
+
+static const char *compression_failures[] = {
+	"gzip10",
+	"gzip",
+	"zstd20",
+	"zstdx",
+	"lz413",
+	"bzip2",
+};
+
+START_TEST(test_server_compression)
+{
+	char buf[4096];
+	struct conf **confs=NULL;
+	FOREACH(compressions)
+	{
+		int r;
+		struct cdata *d=&compressions[i];
+		setup(&confs, NULL);
+		snprintf(buf, sizeof(buf), "%scompression=%s\n",
+			MIN_SERVER_CONF, d->value);
+		r=conf_load_global_only_buf(buf, confs);
+		if(!codec_available(d->codec))
+			fail_unless(r==-1);
+		else
+		{
+			int compression=get_int(confs[OPT_COMPRESSION]);
+			fail_unless(!r);
+			fail_unless(codec_get(compression)==d->codec);
+			fail_unless(codec_level(compression)==d->level);
+			fail_unless(codec_client_level(compression)
+				==(d->codec==CODEC_GZIP?d->level:0));
+		}
+		tear_down(NULL, &confs);
+	}
+	FOREACH(compression_failures)
+	{
+		setup(&confs, NULL);
+		snprintf(buf, sizeof(buf), "%scompression=%s\n",
+			MIN_SERVER_CONF, compression_failures[i]);
+		fail_unless(conf_load_global_only_buf(buf, confs)==-1);
+		tear_down(NULL, &confs);
+	}
+}
+END_TEST
+
+START_TEST(test_server_data_file_sync)
+{
+	int i;
+	char buf[4096];
+	struct conf **confs=NULL;
+	for(i=-2; i<=3; i++)
+	{
+		setup(&confs, NULL);
+		snprintf(buf, sizeof(buf), "%sdata_file_sync=%d\n",
+			MIN_SERVER_CONF, i);
+		if(i>=0 && i<=2)
+		{
+			fail_unless(!conf_load_global_only_buf(buf, confs));
+			fail_unless(get_int(confs[OPT_DATA_FILE_SYNC])==i);
+		}
+		else
+			fail_unless(conf_load_global_only_buf(buf, confs)==-1);
+		tear_down(NULL, &confs);
+	}
+}
+END_TEST
+
 static void pre_post_assertions(struct conf **confs, const char *pre_path,
 	const char *post_path, const char *pre_arg1, const char *pre_arg2,
 	const char *post_arg1, const char *post_arg2,
@@ -467,6 +579,7 @@ START_TEST(test_clientconfdir_conf)
 		"restore_client=123\n"
 		"restore_client=456\n"
 		"dedup_group=dd_group\n"
+		"append_from=1\n"
 	;
 
 	clientconfdir_setup(&globalcs, &cconfs, gbuf, buf);
@@ -503,6 +616,7 @@ START_TEST(test_clientconfdir_conf)
 	assert_strlist(&s, "/timer/arg2", 0);
 	assert_include(&s, NULL);
 	ck_assert_str_eq(get_string(cconfs[OPT_DEDUP_GROUP]), "dd_group");
+	fail_unless(get_int(cconfs[OPT_APPEND_FROM])==1);
 	notify_assertions(cconfs);
 	tear_down(&globalcs, &cconfs);
 }
@@ -587,9 +701,12 @@ Suite *suite_conffile(void)
 
 	tcase_add_test(tc_core, test_conf_get_pair);
 	tcase_add_test(tc_core, test_client_conf);
+	tcase_add_test(tc_core, test_client_encryption_cipher);
 	tcase_add_test(tc_core, test_client_includes_excludes);
 	tcase_add_test(tc_core, test_client_include_failures);
 	tcase_add_test(tc_core, test_server_conf);
+	tcase_add_test(tc_core, test_server_compression);
+	tcase_add_test(tc_core, test_server_data_file_sync);
 	tcase_add_test(tc_core, test_server_script_pre_post);
 	tcase_add_test(tc_core, test_server_script);
 	tcase_add_test(tc_core, test_backup_script_pre_post);
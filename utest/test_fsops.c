@@ -0,0 +1,105 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "test.h"
+#include "../src/burp.h"
+#include "../src/alloc.h"
+#include "../src/fsops.h"
+
+#define BASE	"utest_fsops"
+#define SRC	BASE "/src"
+#define DST	BASE "/dst"
+
+static void write_data(const char *path, size_t len)
+{
+	size_t i;
+	FILE *fp;
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	for(i=0; i<len; i++)
+		fail_unless(fputc((int)(i*7%251), fp)!=EOF);
+	fail_unless(!fclose(fp));
+}
+
+static void assert_same(const char *a, const char *b)
+{
+	int ca;
+	int cb;
+	FILE *fa;
+	FILE *fb;
+	fail_unless((fa=fopen(a, "rb"))!=NULL);
+	fail_unless((fb=fopen(b, "rb"))!=NULL);
+	do
+	{
+		ca=fgetc(fa);
+		cb=fgetc(fb);
+		fail_unless(ca==cb);
+	} while(ca!=EOF);
+	fclose(fa);
+	fclose(fb);
+}
+
+static void run_clone(size_t len)
+{
+	struct stat sa;
+	struct stat sb;
+	fail_unless(!mkdir(BASE, 0777));
+	write_data(SRC, len);
+	// Something already there gets replaced.
+	write_data(DST, len+100);
+	fail_unless(!clone_file(SRC, DST));
+	assert_same(SRC, DST);
+	fail_unless(!stat(SRC, &sa));
+	fail_unless(!stat(DST, &sb));
+	fail_unless(sa.st_ino!=sb.st_ino);
+	fail_unless(sb.st_size==(off_t)len);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(free_count==alloc_count);
+}
+
+START_TEST(test_clone_file_empty)
+{
+	run_clone(0);
+}
+END_TEST
+
+START_TEST(test_clone_file_small)
+{
+	run_clone(1000);
+}
+END_TEST
+
+START_TEST(test_clone_file_large)
+{
+	run_clone(1024*1024+3);
+}
+END_TEST
+
+START_TEST(test_clone_file_no_source)
+{
+	fail_unless(!mkdir(BASE, 0777));
+	fail_unless(clone_file(SRC, DST)==-1);
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+}
+END_TEST
+
+Suite *suite_fsops(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("fsops");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_clone_file_empty);
+	tcase_add_test(tc_core, test_clone_file_small);
+	tcase_add_test(tc_core, test_clone_file_large);
+	tcase_add_test(tc_core, test_clone_file_no_source);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,247 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "test.h"
+#include "../src/burp.h"
+#include "../src/alloc.h"
+#include "../src/linkhash.h"
+
+static void setup(void)
+{
+	alloc_counters_reset();
+	fail_unless(!linkhash_init());
+}
+
+static void tear_down(void)
+{
+	linkhash_free();
+	fail_unless(free_count==alloc_count);
+}
+
+static void set_stat(struct stat *statp, dev_t dev, ino_t ino)
+{
+	memset(statp, 0, sizeof(struct stat));
+	statp->st_dev=dev;
+	statp->st_ino=ino;
+}
+
+START_TEST(test_linkhash_empty)
+{
+	struct stat statp;
+	setup();
+	set_stat(&statp, 1, 2);
+	fail_unless(linkhash_search(&statp)==NULL);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_linkhash_many)
+{
+	int i;
+	char buf[64];
+	char *first;
+	struct stat statp;
+	struct f_link *lp;
+	int n=200000;
+
+	setup();
+	for(i=0; i<n; i++)
+	{
+		// The same inode numbers on a few different devices.
+		set_stat(&statp, i%3, i/3);
+		snprintf(buf, sizeof(buf), "/some/path/%d", i);
+		fail_unless(linkhash_search(&statp)==NULL);
+		fail_unless(!linkhash_add(buf, &statp));
+	}
+	set_stat(&statp, 0, 0);
+	fail_unless((lp=linkhash_search(&statp))!=NULL);
+	first=lp->name;
+
+	for(i=0; i<n; i++)
+	{
+		set_stat(&statp, i%3, i/3);
+		snprintf(buf, sizeof(buf), "/some/path/%d", i);
+		fail_unless((lp=linkhash_search(&statp))!=NULL);
+		fail_unless(lp->dev==(dev_t)(i%3));
+		fail_unless(lp->ino==(ino_t)(i/3));
+		fail_unless(!strcmp(lp->name, buf));
+	}
+	set_stat(&statp, 3, 0);
+	fail_unless(linkhash_search(&statp)==NULL);
+	set_stat(&statp, 0, n);
+	fail_unless(linkhash_search(&statp)==NULL);
+
+	// The names do not move when the table grows.
+	for(i=0; i<n; i++)
+	{
+		set_stat(&statp, 7, i);
+		fail_unless(!linkhash_add((char *)"x", &statp));
+	}
+	set_stat(&statp, 0, 0);
+	fail_unless((lp=linkhash_search(&statp))!=NULL);
+	fail_unless(lp->name==first);
+	fail_unless(!strcmp(first, "/some/path/0"));
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_linkhash_long_name)
+{
+	char *buf;
+	struct stat statp;
+	struct f_link *lp;
+	size_t len=1024*1024;
+
+	setup();
+	fail_unless((buf=(char *)malloc(len+1))!=NULL);
+	memset(buf, 'a', len);
+	buf[len]='\0';
+	set_stat(&statp, 1, 1);
+	fail_unless(!linkhash_add((char *)"/short", &statp));
+	set_stat(&statp, 1, 2);
+	fail_unless(!linkhash_add(buf, &statp));
+	set_stat(&statp, 1, 3);
+	fail_unless(!linkhash_add((char *)"/after", &statp));
+	fail_unless((lp=linkhash_search(&statp))!=NULL);
+	fail_unless(!strcmp(lp->name, "/after"));
+	set_stat(&statp, 1, 2);
+	fail_unless((lp=linkhash_search(&statp))!=NULL);
+	fail_unless(!strcmp(lp->name, buf));
+	free(buf);
+	tear_down();
+}
+END_TEST
+
+// What linkhash.c used to be - a fixed table of 65536 chains, with an
+// allocation for each entry and its name. Kept here to compare against.
+struct old_link
+{
+	struct old_link *next;
+	dev_t dev;
+	ino_t ino;
+	char *name;
+};
+
+#define OLD_SIZE	(1<<16)
+
+static int old_hash(struct stat *statp)
+{
+	int hash=statp->st_dev;
+	unsigned long long i=statp->st_ino;
+	hash ^= i;
+	i >>= 16;
+	hash ^= i;
+	i >>= 16;
+	hash ^= i;
+	i >>= 16;
+	hash ^= i;
+	return hash & (OLD_SIZE-1);
+}
+
+static struct old_link *old_search(struct old_link **table,
+	struct stat *statp, struct old_link ***bucket)
+{
+	struct old_link *lp;
+	*bucket=&table[old_hash(statp)];
+	for(lp=**bucket; lp; lp=lp->next)
+		if(lp->ino==statp->st_ino && lp->dev==statp->st_dev)
+			return lp;
+	return NULL;
+}
+
+// Adds a lot of hard links, then looks them all up again, both ways.
+START_TEST(test_linkhash_benchmark)
+{
+	int i;
+	char buf[64];
+	double old_time;
+	double new_time;
+	struct stat statp;
+	struct old_link **table;
+	struct old_link **bucket;
+	int n=2000000;
+
+	fail_unless((table=(struct old_link **)
+		calloc(OLD_SIZE, sizeof(struct old_link *)))!=NULL);
+	old_time=bench_now();
+	for(i=0; i<n; i++)
+	{
+		struct old_link *lp;
+		set_stat(&statp, 2049, 1000000+i*7);
+		snprintf(buf, sizeof(buf), "/var/mail/user/cur/%d", i);
+		if(old_search(table, &statp, &bucket)) continue;
+		fail_unless((lp=(struct old_link *)
+			malloc(sizeof(struct old_link)))!=NULL);
+		fail_unless((lp->name=strdup(buf))!=NULL);
+		lp->dev=statp.st_dev;
+		lp->ino=statp.st_ino;
+		lp->next=*bucket;
+		*bucket=lp;
+	}
+	for(i=0; i<n; i++)
+	{
+		set_stat(&statp, 2049, 1000000+i*7);
+		fail_unless(old_search(table, &statp, &bucket)!=NULL);
+	}
+	old_time=bench_now()-old_time;
+	for(i=0; i<OLD_SIZE; i++)
+	{
+		struct old_link *lp;
+		while((lp=table[i]))
+		{
+			table[i]=lp->next;
+			free(lp->name);
+			free(lp);
+		}
+	}
+	free(table);
+
+	setup();
+	new_time=bench_now();
+	for(i=0; i<n; i++)
+	{
+		set_stat(&statp, 2049, 1000000+i*7);
+		snprintf(buf, sizeof(buf), "/var/mail/user/cur/%d", i);
+		if(linkhash_search(&statp)) continue;
+		fail_unless(!linkhash_add(buf, &statp));
+	}
+	for(i=0; i<n; i++)
+	{
+		set_stat(&statp, 2049, 1000000+i*7);
+		fail_unless(linkhash_search(&statp)!=NULL);
+	}
+	new_time=bench_now()-new_time;
+	tear_down();
+
+	bench_report("linkhash", n, "links",
+		"chained", old_time, "open addressing", new_time);
+}
+END_TEST
+
+Suite *suite_linkhash(void)
+{
+	Suite *s;
+	TCase *tc_core;
+	TCase *tc_bench;
+
+	s=suite_create("linkhash");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_linkhash_empty);
+	tcase_add_test(tc_core, test_linkhash_many);
+	tcase_add_test(tc_core, test_linkhash_long_name);
+	suite_add_tcase(s, tc_core);
+
+	if(bench_wanted())
+	{
+		tc_bench=tcase_create("Benchmark");
+		tcase_set_timeout(tc_bench, 600);
+		tcase_add_test(tc_bench, test_linkhash_benchmark);
+		suite_add_tcase(s, tc_bench);
+	}
+
+	return s;
+}
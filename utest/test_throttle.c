@@ -0,0 +1,155 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "test.h"
+#include "../src/burp.h"
+#include "../src/alloc.h"
+#include "../src/cntr.h"
+#include "../src/fsops.h"
+#include "../src/throttle.h"
+
+#define BASE	"utest_throttle"
+
+static void set_pressure(const char *resource, float avg10)
+{
+	FILE *fp;
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", BASE, resource);
+	fail_unless((fp=fopen(path, "w"))!=NULL);
+	fprintf(fp, "some avg10=%.2f avg60=0.00 avg300=0.00 total=0\n",
+		avg10);
+	fprintf(fp, "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+	fail_unless(!fclose(fp));
+}
+
+static struct cntr *setup(void)
+{
+	struct cntr *cntr;
+	fail_unless(!mkdir(BASE, 0777));
+	set_pressure("cpu", 0);
+	set_pressure("io", 0);
+	set_pressure("memory", 0);
+	fail_unless((cntr=cntr_alloc())!=NULL);
+	fail_unless(!cntr_init(cntr, "utestclient"));
+	// The counters do not free everything that they allocate.
+	alloc_counters_reset();
+	return cntr;
+}
+
+static void tear_down(struct cntr **cntr)
+{
+	throttle_free();
+	fail_unless(!recursive_delete(BASE, NULL, 1));
+	fail_unless(free_count==alloc_count);
+	cntr_free(cntr);
+}
+
+START_TEST(test_throttle_off)
+{
+	struct cntr *cntr=setup();
+	set_pressure("io", 90);
+	fail_unless(!throttle_init(cntr, 0, BASE));
+	throttle_check();
+	throttle_wait();
+	fail_unless(throttle_level()==100);
+	fail_unless(throttle_threads(8)==8);
+	fail_unless(throttle_ratelimit(1000)==1000);
+	// No pressure stall information.
+	fail_unless(!throttle_init(cntr, 10, BASE "/nothing"));
+	throttle_check();
+	fail_unless(throttle_level()==100);
+	tear_down(&cntr);
+}
+END_TEST
+
+START_TEST(test_throttle_levels)
+{
+	int i;
+	struct cntr *cntr=setup();
+	fail_unless(!throttle_init(cntr, 10, BASE));
+	throttle_check();
+	fail_unless(throttle_level()==100);
+
+	// The worst of them counts.
+	set_pressure("memory", 30);
+	throttle_check();
+	fail_unless(throttle_level()==50);
+	fail_unless(throttle_threads(8)==4);
+	fail_unless(throttle_ratelimit(1000)==500);
+	throttle_check();
+	fail_unless(throttle_level()==25);
+	fail_unless(throttle_threads(2)==1);
+	for(i=0; i<10; i++) throttle_check();
+	fail_unless(throttle_level()==5);
+
+	// Not comfortably below the limit, so it stays the same.
+	set_pressure("memory", 9);
+	throttle_check();
+	fail_unless(throttle_level()==5);
+
+	set_pressure("memory", 1);
+	throttle_check();
+	fail_unless(throttle_level()==15);
+	for(i=0; i<20; i++) throttle_check();
+	fail_unless(throttle_level()==100);
+	tear_down(&cntr);
+}
+END_TEST
+
+static void busy(long usecs)
+{
+	struct timeval start;
+	struct timeval now;
+	gettimeofday(&start, NULL);
+	do
+	{
+		gettimeofday(&now, NULL);
+	} while((now.tv_sec-start.tv_sec)*1000000
+		+(now.tv_usec-start.tv_usec)<usecs);
+}
+
+START_TEST(test_throttle_wait)
+{
+	int i;
+	struct cntr *cntr=setup();
+	fail_unless(!throttle_init(cntr, 10, BASE));
+	set_pressure("cpu", 50);
+	// Down to a quarter of full speed.
+	throttle_check();
+	throttle_check();
+	fail_unless(throttle_level()==25);
+	set_pressure("cpu", 9);
+	for(i=0; i<5; i++)
+	{
+		// Works for 100ms, so has to sleep for 300ms.
+		busy(100000);
+		throttle_wait();
+	}
+	fail_unless(throttle_level()==25);
+	fail_unless(cntr->ent[(uint8_t)CMD_THROTTLED]->count==1);
+	tear_down(&cntr);
+}
+END_TEST
+
+Suite *suite_throttle(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("throttle");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 20);
+
+	tcase_add_test(tc_core, test_throttle_off);
+	tcase_add_test(tc_core, test_throttle_levels);
+	tcase_add_test(tc_core, test_throttle_wait);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,157 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "test.h"
+#include "../src/alloc.h"
+#include "../src/workq.h"
+
+#define JOBS	20
+
+struct job
+{
+	int num;
+	int ran;
+};
+
+static void run_job(void *data)
+{
+	struct job *job=(struct job *)data;
+	// Make the earlier jobs finish last.
+	usleep((JOBS-job->num)*100);
+	job->ran++;
+}
+
+static void run_jobs(int threads, int max)
+{
+	int i;
+	int got=0;
+	struct job *job;
+	struct job jobs[JOBS];
+	struct workq *workq;
+
+	fail_unless((workq=workq_alloc(threads, max))!=NULL);
+	fail_unless(workq_empty(workq));
+	fail_unless(workq_get(workq, 1)==NULL);
+	for(i=0; i<JOBS; i++)
+	{
+		jobs[i].num=i;
+		jobs[i].ran=0;
+		while(workq_full(workq))
+		{
+			fail_unless((job=(struct job *)
+				workq_get(workq, 1))!=NULL);
+			fail_unless(job==&jobs[got++]);
+			fail_unless(job->ran==1);
+		}
+		fail_unless(!workq_add(workq, run_job, &jobs[i]));
+	}
+	while((job=(struct job *)workq_get(workq, 1)))
+	{
+		fail_unless(job==&jobs[got++]);
+		fail_unless(job->ran==1);
+	}
+	fail_unless(got==JOBS);
+	fail_unless(workq_empty(workq));
+	workq_free(&workq);
+	fail_unless(workq==NULL);
+	fail_unless(free_count==alloc_count);
+}
+
+START_TEST(test_workq_no_threads)
+{
+	run_jobs(0, 4);
+}
+END_TEST
+
+START_TEST(test_workq_threads)
+{
+	run_jobs(3, 6);
+}
+END_TEST
+
+START_TEST(test_workq_one_slot)
+{
+	run_jobs(2, 1);
+}
+END_TEST
+
+START_TEST(test_workq_add_when_full)
+{
+	int i=0;
+	struct workq *workq;
+	fail_unless((workq=workq_alloc(0, 1))!=NULL);
+	fail_unless(!workq_add(workq, run_job, &i));
+	fail_unless(workq_full(workq));
+	fail_unless(workq_add(workq, run_job, &i)==-1);
+	fail_unless(workq_get(workq, 0)==&i);
+	workq_free(&workq);
+	fail_unless(free_count==alloc_count);
+}
+END_TEST
+
+static pthread_mutex_t active_lock=PTHREAD_MUTEX_INITIALIZER;
+static int running=0;
+static int most_running=0;
+
+static void active_job(void *data)
+{
+	pthread_mutex_lock(&active_lock);
+	if(++running>most_running) most_running=running;
+	pthread_mutex_unlock(&active_lock);
+	usleep(2000);
+	pthread_mutex_lock(&active_lock);
+	running--;
+	pthread_mutex_unlock(&active_lock);
+}
+
+static int run_active(struct workq *workq, int active)
+{
+	int i;
+	int data[JOBS];
+	most_running=0;
+	workq_set_active(workq, active);
+	for(i=0; i<JOBS; i++)
+	{
+		while(workq_full(workq))
+			fail_unless(workq_get(workq, 1)!=NULL);
+		fail_unless(!workq_add(workq, active_job, &data[i]));
+	}
+	while(workq_get(workq, 1)) { }
+	return most_running;
+}
+
+START_TEST(test_workq_set_active)
+{
+	struct workq *workq;
+	fail_unless((workq=workq_alloc(4, 8))!=NULL);
+	fail_unless(run_active(workq, 1)==1);
+	fail_unless(run_active(workq, 2)<=2);
+	// Always at least one.
+	fail_unless(run_active(workq, 0)==1);
+	fail_unless(run_active(workq, 10)<=4);
+	workq_free(&workq);
+	fail_unless(free_count==alloc_count);
+}
+END_TEST
+
+Suite *suite_workq(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("workq");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_workq_no_threads);
+	tcase_add_test(tc_core, test_workq_threads);
+	tcase_add_test(tc_core, test_workq_one_slot);
+	tcase_add_test(tc_core, test_workq_add_when_full);
+	tcase_add_test(tc_core, test_workq_set_active);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}